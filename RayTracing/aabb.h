@@ -1,12 +1,18 @@
 #pragma once
 
-class AABB
+template<typename T>
+class AABBT
 {
+    using Interval = IntervalT<T>;
+    using Point3 = Vec3T<T>;
+    using Vec3 = Vec3T<T>;
+    using Ray = RayT<T>;
+
 public:
 
-    AABB() {} // The default AABB is empty, since Intervals are empty by default.
+    AABBT() {} // The default AABB is empty, since Intervals are empty by default.
 
-    AABB(const Interval& x, const Interval& y, const Interval& z)
+    AABBT(const Interval& x, const Interval& y, const Interval& z)
         : x(x)
         , y(y)
         , z(z)
@@ -14,7 +20,7 @@ public:
         PadToMinimums();
     }
 
-    AABB(const Point3& a, const Point3& b)
+    AABBT(const Point3& a, const Point3& b)
     {
         // Treat the two points a and b as extrema for the bounding box, so we don't require a
         // particular minimum/maximum coordinate order.
@@ -25,7 +31,7 @@ public:
         PadToMinimums();
     }
 
-    AABB(const AABB& box0, const AABB& box1)
+    AABBT(const AABBT& box0, const AABBT& box1)
     {
         x = Interval(box0.x, box1.x);
         y = Interval(box0.y, box1.y);
@@ -41,16 +47,24 @@ public:
 
     bool Hit(const Ray& r, Interval ray_t) const
     {
+        return Clip(r, ray_t);
+    }
+
+    bool Clip(const Ray& r, Interval& ray_t) const
+    {
+        // Shrinks the ray interval to the part of the ray inside the box. Returns false if the ray
+        // misses the box within the interval.
+
         const Point3& ray_orig = r.origin();
         const Vec3& ray_dir = r.direction();
 
         for (int axis = 0; axis < 3; axis++)
         {
             const Interval& ax = AxisInterval(axis);
-            const double adinv = 1.0 / ray_dir[axis];
+            const T adinv = T(1) / ray_dir[axis];
 
-            const double t0 = (ax.min - ray_orig[axis]) * adinv;
-            const double t1 = (ax.max - ray_orig[axis]) * adinv;
+            const T t0 = (ax.min - ray_orig[axis]) * adinv;
+            const T t1 = (ax.max - ray_orig[axis]) * adinv;
 
             if (t0 < t1)
             {
@@ -69,6 +83,11 @@ public:
         return true;
     }
 
+    bool IsEmpty() const
+    {
+        return x.Size() < 0 || y.Size() < 0 || z.Size() < 0;
+    }
+
     int LongestAxis() const
     {
         // Returns the index of the longest axis of the bounding box.
@@ -79,14 +98,56 @@ public:
             return y.Size() > z.Size() ? 1 : 2;
     }
 
-    static const AABB empty, universe;
+    T SurfaceArea() const
+    {
+        // Returns the surface area of the box, or zero if the box is empty.
+
+        if (IsEmpty())
+            return 0;
+
+        const T dx = x.Size();
+        const T dy = y.Size();
+        const T dz = z.Size();
+
+        return 2 * (dx * dy + dy * dz + dz * dx);
+    }
+
+    Point3 Center() const
+    {
+        return Point3(0.5 * (x.min + x.max), 0.5 * (y.min + y.max), 0.5 * (z.min + z.max));
+    }
+
+    static AABBT Overlap(const AABBT& a, const AABBT& b)
+    {
+        // Returns the intersection of the two boxes, which is empty if they don't overlap.
+
+        AABBT box;
+        box.x = Interval(std::fmax(a.x.min, b.x.min), std::fmin(a.x.max, b.x.max));
+        box.y = Interval(std::fmax(a.y.min, b.y.min), std::fmin(a.y.max, b.y.max));
+        box.z = Interval(std::fmax(a.z.min, b.z.min), std::fmin(a.z.max, b.z.max));
+        return box;
+    }
+
+    static AABBT Lerp(const AABBT& a, const AABBT& b, T t)
+    {
+        // Linearly interpolates between two boxes. If both boxes bound an object moving linearly
+        // between them, the result bounds that object at time t.
+
+        AABBT box;
+        box.x = Interval(a.x.min + t * (b.x.min - a.x.min), a.x.max + t * (b.x.max - a.x.max));
+        box.y = Interval(a.y.min + t * (b.y.min - a.y.min), a.y.max + t * (b.y.max - a.y.max));
+        box.z = Interval(a.z.min + t * (b.z.min - a.z.min), a.z.max + t * (b.z.max - a.z.max));
+        return box;
+    }
+
+    static const AABBT empty, universe;
 
 private:
 
     void PadToMinimums()
     {
         // Adjust the AABB so that no side is narrower than some delta, padding if necessary.
-        constexpr double delta = 0.0001;
+        constexpr T delta = T(0.0001);
         if (x.Size() < delta) x = x.Expand(delta);
         if (y.Size() < delta) y = y.Expand(delta);
         if (z.Size() < delta) z = z.Expand(delta);
@@ -94,16 +155,22 @@ private:
 
 public:
     Interval x, y, z;
+
+    friend AABBT operator+(const AABBT& bbox, const Vec3& offset)
+    {
+        return AABBT(bbox.x + offset.x(), bbox.y + offset.y(), bbox.z + offset.z());
+    }
+
+    friend AABBT operator+(const Vec3& offset, const AABBT& bbox)
+    {
+        return bbox + offset;
+    }
 };
 
-const AABB AABB::empty = AABB(Interval::empty, Interval::empty, Interval::empty);
-const AABB AABB::universe = AABB(Interval::universe, Interval::universe, Interval::universe);
+template<typename T>
+const AABBT<T> AABBT<T>::empty = AABBT<T>(IntervalT<T>::empty, IntervalT<T>::empty, IntervalT<T>::empty);
 
-AABB operator+(const AABB& bbox, const Vec3& offset)
-{
-    return AABB(bbox.x + offset.x(), bbox.y + offset.y(), bbox.z + offset.z());
-}
+template<typename T>
+const AABBT<T> AABBT<T>::universe = AABBT<T>(IntervalT<T>::universe, IntervalT<T>::universe, IntervalT<T>::universe);
 
-AABB operator+(const Vec3& offset, const AABB& bbox) {
-    return bbox + offset;
-}
\ No newline at end of file
+using AABB = AABBT<Real>;
\ No newline at end of file
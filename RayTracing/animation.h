@@ -0,0 +1,271 @@
+#pragma once
+
+#include "bvh.h"
+#include "camera.h"
+#include "color.h"
+#include "hittableList.h"
+#include "instance.h"
+#include "matrix.h"
+#include "sceneCompiler.h"
+#include "threadPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+template<typename T>
+class Track
+{
+public:
+    // Values at keyframes, linearly interpolated between them and held before the first key and
+    // after the last. Frames are fractional, so a track can be sampled between frames.
+
+    void Add(double frame, const T& value)
+    {
+        const auto at = std::upper_bound(keys.begin(), keys.end(), frame,
+            [](double f, const std::pair<double, T>& key) { return f < key.first; });
+        keys.insert(at, { frame, value });
+    }
+
+    bool IsEmpty() const { return keys.empty(); }
+
+    T At(double frame, const T& fallback) const
+    {
+        if (keys.empty())
+            return fallback;
+
+        if (frame <= keys.front().first)
+            return keys.front().second;
+
+        if (frame >= keys.back().first)
+            return keys.back().second;
+
+        const auto next = std::upper_bound(keys.begin(), keys.end(), frame,
+            [](double f, const std::pair<double, T>& key) { return f < key.first; });
+        const auto previous = next - 1;
+
+        const double t = (frame - previous->first) / (next->first - previous->first);
+        return previous->second + t * (next->second - previous->second);
+    }
+
+private:
+    std::vector<std::pair<double, T>> keys;  // Sorted by frame
+};
+
+struct CameraAnimation
+{
+    // Camera settings over the frames of a sequence. Settings without keys keep the camera's value.
+
+    Track<Point3> lookFrom;
+    Track<Point3> lookAt;
+    Track<double> vfov;
+    Track<double> focusDist;
+
+    void Apply(double frame, Camera& cam) const
+    {
+        cam.lookFrom = lookFrom.At(frame, cam.lookFrom);
+        cam.lookAt = lookAt.At(frame, cam.lookAt);
+        cam.vfov = vfov.At(frame, cam.vfov);
+        cam.focusDist = focusDist.At(frame, cam.focusDist);
+    }
+};
+
+struct ObjectAnimation
+{
+    // An object moved over the frames of a sequence: scaled, then turned about the y axis by
+    // degrees, then translated, all about the origin of the object.
+
+    shared_ptr<Hittable> object;
+    Track<Vec3> translation;
+    Track<double> rotationY;
+    Track<Vec3> scale;
+
+    Matrix34 TransformAt(double frame) const
+    {
+        return Matrix34::Translation(translation.At(frame, Vec3(0, 0, 0)))
+            * Matrix34::RotationY(rotationY.At(frame, 0.0))
+            * Matrix34::Scale(scale.At(frame, Vec3(1, 1, 1)));
+    }
+};
+
+class Sequence
+{
+public:
+    // Renders the frames of an animation in one run. The still part of the world is compiled
+    // once, and every animated object is compiled once into an instance, so a frame only moves
+    // the instances and refits the small BVH above them. Frames are rendered on one pool of
+    // threads kept for the whole sequence, and each finished frame is handed to a writer thread
+    // that encodes and writes it while the next frame renders.
+
+    HittableList world;                       // Objects that don't move
+    std::vector<ObjectAnimation> objects;     // Objects that do
+    CameraAnimation camera;
+
+    ObjectAnimation& Animate(shared_ptr<Hittable> object)
+    {
+        objects.push_back(ObjectAnimation());
+        objects.back().object = object;
+        return objects.back();
+    }
+
+    bool Render(Camera& cam, int frameCount, const std::string& prefix)
+    {
+        // Writes frames 0 to frameCount - 1 to binary PPM files named with prefix and the frame
+        // number. Returns false if a frame couldn't be written.
+
+        const auto start = std::chrono::steady_clock::now();
+
+        if (cam.denoise || !cam.featurePrefix.empty() || !cam.previewName.empty() || !cam.streamFilename.empty())
+            std::clog << "Sequences are written without denoising, features, previews or streaming.\n";
+
+        SceneCompiler compiler;
+        shared_ptr<Hittable> still = cam.compileScene ? compiler.Compile(world) : nullptr;
+        if (still)
+            compiler.LogStats(std::clog);
+        else
+            still = MakeObject<HittableList>(world);
+
+        // Each animated object is compiled alone, and placed by an instance moved every frame.
+        std::vector<shared_ptr<Instance>> instances;
+        for (const ObjectAnimation& animation : objects)
+        {
+            shared_ptr<Hittable> compiled = cam.compileScene ? compiler.Compile(HittableList(animation.object)) : nullptr;
+            instances.push_back(MakeObject<Instance>(compiled ? compiled : animation.object, animation.TransformAt(0)));
+        }
+
+        shared_ptr<BVH_Node> moving;
+        HittableList scene(still);
+        if (!instances.empty())
+        {
+            HittableList movingList;
+            for (const shared_ptr<Instance>& instance : instances)
+                movingList.Add(instance);
+
+            moving = MakeObject<BVH_Node>(movingList);
+            scene.Add(moving);
+        }
+
+        FrameWriter writer(cam.imageWidth, prefix);
+        ThreadPool pool;
+        std::vector<Color> pixels;
+
+        for (int frame = 0; frame < frameCount; frame++)
+        {
+            const auto frameStart = std::chrono::steady_clock::now();
+
+            camera.Apply(frame, cam);
+            for (size_t k = 0; k < instances.size(); k++)
+                instances[k]->SetTransform(objects[k].TransformAt(frame));
+
+            if (moving)
+                moving->Refit();
+
+            cam.RenderFrame(scene, pool, pixels);
+            writer.Write(frame, pixels);
+
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - frameStart;
+            std::clog << "\rFrame " << (frame + 1) << " of " << frameCount << ": " << elapsed.count() << "s          " << std::flush;
+        }
+
+        const bool written = writer.Finish();
+
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::clog << "\rDone. Total time: " << elapsed.count() << "s                  \n";
+        return written;
+    }
+
+    static std::string FrameFilename(const std::string& prefix, int frame)
+    {
+        std::string number = std::to_string(frame);
+        if (number.size() < 4)
+            number.insert(0, 4 - number.size(), '0');
+
+        return prefix + number + ".ppm";
+    }
+
+private:
+    class FrameWriter
+    {
+    public:
+        // A thread writing one frame at a time. Handing it a frame swaps the frame's pixels for
+        // the ones it last wrote, so no pixels are copied, and only waits if it is still busy.
+
+        FrameWriter(int width, const std::string& prefix)
+            : width(width)
+            , prefix(prefix)
+            , thread([this]() { WriteLoop(); })
+        {}
+
+        ~FrameWriter() { Finish(); }
+
+        void Write(int frame, std::vector<Color>& pixels)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [this]() { return !pending; });
+                pixels.swap(framePixels);
+                frameNumber = frame;
+                pending = true;
+            }
+
+            changed.notify_all();
+        }
+
+        bool Finish()
+        {
+            // Waits for the last frame to be written, and returns false if any wasn't.
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [this]() { return !pending; });
+                finished = true;
+            }
+
+            changed.notify_all();
+            if (thread.joinable())
+                thread.join();
+
+            return !failed;
+        }
+
+    private:
+        int width;
+        std::string prefix;
+
+        std::mutex mutex;  // Guards everything below but the thread
+        std::condition_variable changed;
+        std::vector<Color> framePixels;
+        int frameNumber = 0;
+        bool pending = false;   // A frame waits to be written
+        bool finished = false;
+        bool failed = false;
+
+        std::thread thread;
+
+        void WriteLoop()
+        {
+            while (true)
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [this]() { return pending || finished; });
+                if (!pending)
+                    return;
+
+                // The frame isn't touched by the renderer until pending is cleared.
+                lock.unlock();
+                const bool written = WriteImage(FrameFilename(prefix, frameNumber), framePixels, width);
+
+                lock.lock();
+                failed = failed || !written;
+                pending = false;
+                lock.unlock();
+                changed.notify_all();
+            }
+        }
+    };
+};
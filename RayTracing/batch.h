@@ -0,0 +1,226 @@
+#pragma once
+
+#include "camera.h"
+#include "color.h"
+#include "hittableList.h"
+#include "sceneCompiler.h"
+#include "threadPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct BatchJob
+{
+    // One image of a batch: the scene it shows, the camera settings it changes, and where it goes.
+
+    std::string scene;
+    std::string output;
+    std::vector<std::pair<std::string, std::string>> settings;  // Applied over the scene's camera, in order
+};
+
+class BatchRenderer
+{
+public:
+    // Renders a list of jobs on one pool of threads kept for the whole batch. Every job's rows
+    // go into a single run over the pool, in job order, so threads finishing one job move on to
+    // the next, and jobs too small to use every thread render side by side. Each scene is built
+    // and compiled once, and shared by all the jobs showing it. A job's image is written by the
+    // thread finishing its last row, and its pixels are only held while it renders.
+    //
+    // Job files hold one job per line, as key=value pairs: scene and out are required, the
+    // others set the camera. Vectors are written x,y,z, and # starts a comment.
+    //
+    //   scene=7 out=cornell.ppm width=200 spp=64
+    //   scene=1 out=spheres.ppm width=160 spp=16 lookFrom=13,2,3 vfov=25
+
+    using SceneBuilder = std::function<bool(const std::string& scene, HittableList& world, Camera& cam)>;
+
+    std::vector<BatchJob> jobs;
+
+    explicit BatchRenderer(SceneBuilder builder)
+        : builder(builder)
+    {}
+
+    bool Load(const std::string& filename)
+    {
+        // Adds the jobs of a job file, or returns false on the first line that isn't a job.
+
+        std::ifstream in(filename);
+        if (!in)
+        {
+            std::cerr << "ERROR: Could not open job file '" << filename << "'.\n";
+            return false;
+        }
+
+        std::string line;
+        for (int lineNumber = 1; std::getline(in, line); lineNumber++)
+        {
+            line = line.substr(0, line.find('#'));
+
+            BatchJob job;
+            Camera check;
+            std::istringstream words(line);
+            std::string word;
+            while (words >> word)
+            {
+                const size_t equals = word.find('=');
+                const std::string key = word.substr(0, equals);
+                const std::string value = equals == std::string::npos ? "" : word.substr(equals + 1);
+
+                if (key == "scene")
+                    job.scene = value;
+                else if (key == "out")
+                    job.output = value;
+                else if (!check.Set(key, value))
+                {
+                    std::cerr << "ERROR: Bad setting '" << word << "' on line " << lineNumber << " of '" << filename << "'.\n";
+                    return false;
+                }
+                else
+                    job.settings.emplace_back(key, value);
+            }
+
+            if (job.scene.empty() && job.output.empty() && job.settings.empty())
+                continue;
+
+            if (job.scene.empty() || job.output.empty())
+            {
+                std::cerr << "ERROR: Job on line " << lineNumber << " of '" << filename << "' needs a scene and an out file.\n";
+                return false;
+            }
+
+            jobs.push_back(job);
+        }
+
+        return true;
+    }
+
+    bool Run()
+    {
+        // Renders every job, and returns false if any scene couldn't be built or image written.
+
+        const auto start = std::chrono::steady_clock::now();
+        bool succeeded = true;
+
+        // Scenes are built in job order on this thread, since building may draw random numbers.
+        std::vector<std::unique_ptr<JobState>> states;
+        std::vector<int> firstRows;  // Of each job, in the rows of all jobs
+        int rowCount = 0;
+
+        for (const BatchJob& job : jobs)
+        {
+            const Scene* scene = GetScene(job.scene);
+            if (scene == nullptr)
+            {
+                succeeded = false;
+                continue;
+            }
+
+            auto state = std::make_unique<JobState>();
+            state->job = &job;
+            state->scene = scene->compiled ? scene->compiled.get() : &scene->world;
+            state->cam = scene->cam;
+            for (const auto& setting : job.settings)
+                state->cam.Set(setting.first, setting.second);
+
+            state->height = state->cam.PrepareRows();
+            state->rowsLeft = state->height;
+
+            firstRows.push_back(rowCount);
+            rowCount += state->height;
+            states.push_back(std::move(state));
+        }
+
+        std::atomic<int> jobsDone{ 0 };
+        std::atomic<bool> allWritten{ true };
+        std::mutex logMutex;
+
+        pool.ParallelFor(rowCount, [&](int row)
+        {
+            const size_t index = std::upper_bound(firstRows.begin(), firstRows.end(), row) - firstRows.begin() - 1;
+            JobState& state = *states[index];
+            const int width = state.cam.imageWidth;
+
+            std::call_once(state.allocated, [&]() { state.pixels.resize(size_t(width) * state.height); });
+            const int j = row - firstRows[index];
+            state.cam.RenderRow(*state.scene, j, &state.pixels[size_t(j) * width]);
+
+            if (--state.rowsLeft > 0)
+                return;
+
+            if (!WriteImage(state.job->output, state.pixels, width))
+                allWritten = false;
+
+            std::vector<Color>().swap(state.pixels);
+
+            const std::lock_guard<std::mutex> lock(logMutex);
+            std::clog << "\rJobs done: " << ++jobsDone << " of " << states.size() << "          " << std::flush;
+        });
+
+        const size_t sceneCount = std::count_if(scenes.begin(), scenes.end(), [](const auto& scene) { return scene.second != nullptr; });
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::clog << "\rDone. " << states.size() << " jobs on " << sceneCount << " scenes and "
+            << pool.ThreadCount() << " threads. Total time: " << elapsed.count() << "s                  \n";
+
+        return succeeded && allWritten;
+    }
+
+private:
+    struct Scene
+    {
+        HittableList world;
+        Camera cam;
+        shared_ptr<Hittable> compiled;  // Null when the world is traced as it is
+    };
+
+    struct JobState
+    {
+        const BatchJob* job = nullptr;
+        const Hittable* scene = nullptr;
+        Camera cam;
+        int height = 0;
+        std::atomic<int> rowsLeft{ 0 };
+        std::once_flag allocated;
+        std::vector<Color> pixels;
+    };
+
+    SceneBuilder builder;
+    ThreadPool pool;
+    std::map<std::string, std::unique_ptr<Scene>> scenes;  // By the name jobs give them
+
+    const Scene* GetScene(const std::string& name)
+    {
+        auto found = scenes.find(name);
+        if (found != scenes.end())
+            return found->second.get();
+
+        // Scenes that fail are kept as null, so they are only tried once.
+        auto scene = std::make_unique<Scene>();
+        if (!builder(name, scene->world, scene->cam))
+        {
+            std::cerr << "ERROR: Could not build scene '" << name << "'.\n";
+            scenes.emplace(name, nullptr);
+            return nullptr;
+        }
+
+        if (scene->cam.compileScene)
+        {
+            SceneCompiler compiler;
+            scene->compiled = compiler.Compile(scene->world);
+            if (scene->compiled)
+                compiler.LogStats(std::clog);
+        }
+
+        return scenes.emplace(name, std::move(scene)).first->second.get();
+    }
+};
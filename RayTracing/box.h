@@ -0,0 +1,157 @@
+#pragma once
+
+#include "hittable.h"
+
+class Box final : public Hittable
+{
+public:
+    // Axis aligned box given by two opposite corners, hit with a single slab test. Each face gets
+    // the UVs of the quad it used to be made of, so textures map the same way.
+
+    Box(const Point3& a, const Point3& b, shared_ptr<Material> mat)
+        : Hittable(HittableKind::Box)
+        , min(std::fmin(a.x(), b.x()), std::fmin(a.y(), b.y()), std::fmin(a.z(), b.z()))
+        , max(std::fmax(a.x(), b.x()), std::fmax(a.y(), b.y()), std::fmax(a.z(), b.z()))
+        , mat(mat)
+        , bbox(min, max)
+    {}
+
+    bool Intersect(const Ray& r, const Interval& ray_t, Intersection& hit) const override
+    {
+        double t;
+        int face;
+        if (!IntersectBox(min, max, r, ray_t, t, face))
+            return false;
+
+        hit.Set(t, this, uint32_t(face));
+        return true;
+    }
+
+    void ComputeSurface(const Ray& r, const Intersection& hit, int depth, HitRecord& rec) const override
+    {
+        BoxSurface(min, max, r, hit.t, int(hit.primitive), rec);
+        rec.mat = mat.get();
+    }
+
+    bool Span(const Ray& r, Interval& span) const override
+    {
+        int enterFace, exitFace;
+        return Slabs(min, max, r, span, enterFace, exitFace);
+    }
+
+    AABB BoundingBox() const override { return bbox; }
+
+    const Point3& Min() const { return min; }
+    const Point3& Max() const { return max; }
+    const shared_ptr<Material>& GetMaterial() const { return mat; }
+
+    // Faces are numbered 2 * axis for the side at the minimum coordinate, plus one for the side at
+    // the maximum.
+
+    static bool Slabs(const Point3& min, const Point3& max, const Ray& r, Interval& span, int& enterFace, int& exitFace)
+    {
+        // Finds where the line of the ray enters and leaves the box, and through which faces.
+        // Returns false if it misses the box.
+
+        span = Interval::universe;
+        enterFace = exitFace = 0;
+
+        for (int axis = 0; axis < 3; axis++)
+        {
+            // A zero direction gives infinite distances, or NaN when the origin is on the face
+            // plane, which the comparisons below skip.
+            const double invD = 1.0 / r.direction()[axis];
+            double t0 = (min[axis] - r.origin()[axis]) * invD;
+            double t1 = (max[axis] - r.origin()[axis]) * invD;
+            int face0 = 2 * axis;
+            int face1 = 2 * axis + 1;
+
+            if (invD < 0)
+            {
+                std::swap(t0, t1);
+                std::swap(face0, face1);
+            }
+
+            if (t0 > span.min)
+            {
+                span.min = t0;
+                enterFace = face0;
+            }
+
+            if (t1 < span.max)
+            {
+                span.max = t1;
+                exitFace = face1;
+            }
+        }
+
+        return span.min <= span.max;
+    }
+
+    static bool IntersectBox(const Point3& min, const Point3& max, const Ray& r, const Interval& ray_t, double& t, int& face)
+    {
+        // Returns the nearest face crossing in the interval, which is the exit when the ray
+        // starts inside the box.
+
+        Interval span;
+        int enterFace, exitFace;
+        if (!Slabs(min, max, r, span, enterFace, exitFace))
+            return false;
+
+        if (ray_t.Contains(span.min))
+        {
+            t = span.min;
+            face = enterFace;
+            return true;
+        }
+
+        if (ray_t.Contains(span.max))
+        {
+            t = span.max;
+            face = exitFace;
+            return true;
+        }
+
+        return false;
+    }
+
+    static void BoxSurface(const Point3& min, const Point3& max, const Ray& r, double t, int face, HitRecord& rec)
+    {
+        // Fills everything in the hit record but the material, for a hit at t on the given face.
+
+        const int axis = face / 2;
+        const bool maxSide = face % 2 == 1;
+
+        rec.t = t;
+        rec.p = r.at(t);
+        rec.p[axis] = maxSide ? max[axis] : min[axis];  // Exactly on the face
+
+        Vec3 outwardNormal(0, 0, 0);
+        outwardNormal[axis] = maxSide ? 1 : -1;
+        rec.SetFaceNormal(r, outwardNormal);
+
+        // Position on the face, from 0 to 1 along each axis. Flat boxes have no extent along
+        // some axis, and take 0 along it rather than dividing by zero.
+        const Vec3 size = max - min;
+        const double x = size.x() > 0 ? (rec.p.x() - min.x()) / size.x() : 0;
+        const double y = size.y() > 0 ? (rec.p.y() - min.y()) / size.y() : 0;
+        const double z = size.z() > 0 ? (rec.p.z() - min.z()) / size.z() : 0;
+
+        const Vec3 dx(size.x(), 0, 0), dy(0, size.y(), 0), dz(0, 0, size.z());
+
+        switch (face)
+        {
+            case 0: rec.u = z;     rec.v = y;     rec.dpdu = dz;  rec.dpdv = dy;  break;  // left
+            case 1: rec.u = 1 - z; rec.v = y;     rec.dpdu = -dz; rec.dpdv = dy;  break;  // right
+            case 2: rec.u = x;     rec.v = z;     rec.dpdu = dx;  rec.dpdv = dz;  break;  // bottom
+            case 3: rec.u = x;     rec.v = 1 - z; rec.dpdu = dx;  rec.dpdv = -dz; break;  // top
+            case 4: rec.u = 1 - x; rec.v = y;     rec.dpdu = -dx; rec.dpdv = dy;  break;  // back
+            default: rec.u = x;    rec.v = y;     rec.dpdu = dx;  rec.dpdv = dy;  break;  // front
+        }
+    }
+
+private:
+    Point3 min, max;
+    shared_ptr<Material> mat;
+    AABB bbox;
+};
@@ -6,7 +6,7 @@
 
 #include <algorithm>
 
-class BVH_Node : public Hittable
+class BVH_Node final : public Hittable
 {
 public:
     BVH_Node(HittableList list)
@@ -20,6 +20,7 @@ public:
     }
 
     BVH_Node(std::vector<shared_ptr<Hittable>>& objects, size_t start, size_t end)
+        : Hittable(HittableKind::BVHNode)
     {
         // Build the bounding box of the span of source objects.
         bbox = AABB::empty;
@@ -50,25 +51,41 @@ public:
             std::sort(std::begin(objects) + start, std::begin(objects) + end, comparator);
 
             const size_t mid = start + objectSpan / 2;
-            left = make_shared<BVH_Node>(objects, start, mid);
-            right = make_shared<BVH_Node>(objects, mid, end);
+            left = MakeObject<BVH_Node>(objects, start, mid);
+            right = MakeObject<BVH_Node>(objects, mid, end);
         }
 
         bbox = AABB(left->BoundingBox(), right->BoundingBox());
     }
 
-    bool Hit(const Ray& r, const Interval& ray_t, HitRecord& rec) const override
+    bool Intersect(const Ray& r, const Interval& ray_t, Intersection& hit) const override
     {
         if (!bbox.Hit(r, ray_t))
             return false;
 
-        const bool hitLeft = left->Hit(r, ray_t, rec);
-        const bool hitRight = right->Hit(r, Interval(ray_t.min, hitLeft ? rec.t : ray_t.max), rec);
+        const bool hitLeft = IntersectObject(*left, r, ray_t, hit);
+        const bool hitRight = IntersectObject(*right, r, Interval(ray_t.min, hitLeft ? hit.t : ray_t.max), hit);
 
         return hitLeft || hitRight;
     }
 
+    void Refit()
+    {
+        // Recomputes the boxes of this node and the nodes below it after their objects moved,
+        // keeping the tree as it was built. That is much cheaper than a rebuild, though the tree
+        // gets looser the further objects move from where they were.
+        for (const shared_ptr<Hittable>& child : { left, right })
+            if (child->Kind() == HittableKind::BVHNode)
+                static_cast<BVH_Node&>(*child).Refit();
+
+        bbox = AABB(left->BoundingBox(), right->BoundingBox());
+    }
+
     AABB BoundingBox() const override { return bbox; }
+    AABB BoundingBoxAt(double time) const override { return AABB(left->BoundingBoxAt(time), right->BoundingBoxAt(time)); }
+
+    const shared_ptr<Hittable>& Left() const { return left; }
+    const shared_ptr<Hittable>& Right() const { return right; }
 
 private:
 
@@ -1,7 +1,16 @@
 #pragma once
 
+#include "denoiser.h"
+#include "dispatch.h"
 #include "hittable.h"
 #include "material.h"
+#include "previewBuffer.h"
+#include "sceneCompiler.h"
+#include "threadPool.h"
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <sstream>
 #include <thread>
 
 class Camera
@@ -22,6 +31,48 @@ public:
     double defocusAngle = 0;  // Variation angle of rays through each pixel
     double focusDist = 10;    // Distance from camera lookfrom point to plane of perfect focus
 
+    bool   compileScene = true;   // Flatten the world and build acceleration before rendering
+
+    bool        denoise = false;  // Filter the image guided by the first hit of each pixel
+    Denoiser    denoiser;         // Settings of the filter
+    std::string featurePrefix;    // When set, also write the first hit features to images named with it
+
+    std::string previewName;      // When set, render in passes of doubling samples, shown through this shared memory preview
+    std::string streamFilename;   // When set, write the image to this binary PPM file while rendering
+    int         streamTileSize = 32;  // Side of the tiles of a streamed image, in pixels
+
+    bool Set(const std::string& key, const std::string& value)
+    {
+        // Sets a setting from its text, as in job and scene files, or returns false if the key
+        // or value is unknown. Vectors are written x,y,z.
+
+        std::istringstream in(value);
+        char comma1 = 0, comma2 = 0;
+        double x, y, z;
+
+        if (key == "width")          in >> imageWidth;
+        else if (key == "aspect")    in >> aspectRatio;
+        else if (key == "spp")       in >> samplesPerPixel;
+        else if (key == "depth")     in >> maxDepth;
+        else if (key == "vfov")      in >> vfov;
+        else if (key == "focus")     in >> focusDist;
+        else if (key == "defocus")   in >> defocusAngle;
+        else if (key == "lookFrom" || key == "lookAt" || key == "up" || key == "background")
+        {
+            in >> x >> comma1 >> y >> comma2 >> z;
+            if (comma1 != ',' || comma2 != ',')
+                return false;
+
+            Vec3& target = key == "lookFrom" ? lookFrom : key == "lookAt" ? lookAt : key == "up" ? up : background;
+            target = Vec3(x, y, z);
+        }
+        else
+            return false;
+
+        return !in.fail() && in.peek() == std::char_traits<char>::eof()
+            && imageWidth > 0 && aspectRatio > 0 && samplesPerPixel > 0;
+    }
+
     void Render(const Hittable& world)
     {
         const auto processorCount = std::thread::hardware_concurrency();
@@ -29,28 +80,39 @@ public:
 
         Initialize();
 
+        // Trace a compiled copy of the world, so worlds left as plain lists still get a BVH.
+        SceneCompiler compiler;
+        const shared_ptr<Hittable> compiled = compileScene ? compiler.Compile(world) : nullptr;
+        if (compiled)
+            compiler.LogStats(std::clog);
+
+        const Hittable& scene = compiled ? *compiled : world;
+
+        if (!streamFilename.empty())
+        {
+            if (RenderStream(scene))
+                std::clog << "\rDone. Total time: " << double(clock() - start) / CLOCKS_PER_SEC << "s                  \n";
+            return;
+        }
+
         std::cout << "P3\n" << imageWidth << ' ' << imageHeight << "\n255\n";
 
         std::vector<Color> pixels(imageWidth * imageHeight);
+        const bool gatherFeatures = denoise || !featurePrefix.empty();
+        std::vector<PixelFeatures> features(gatherFeatures ? pixels.size() : 0);
         constexpr bool useAsync = true;
 
-        if (!useAsync)
+        if (!previewName.empty())
+        {
+            RenderProgressive(scene, pixels, features);
+        }
+        else if (!useAsync)
         {
             for (int j = 0; j < imageHeight; j++)
             {
                 std::clog << "\rScanlines remaining: " << (imageHeight - j) << ' ' << std::flush;
                 for (int i = 0; i < imageWidth; i++)
-                {
-                    Color pixelColor(0, 0, 0);
-
-                    for (int sample = 0; sample < samplesPerPixel; sample++)
-                    {
-                        const Ray r = GetRay(i, j);
-                        pixelColor += RayColor(r, maxDepth, world);
-                    }
-
-                    pixels[j * imageHeight + i] = pixelColor * pixelSamplesScale;
-                }
+                    pixels[j * imageWidth + i] = RenderPixel(i, j, scene, samplesPerPixel, gatherFeatures ? &features[j * imageWidth + i] : nullptr);
             }
         }
         else
@@ -66,23 +128,13 @@ public:
                 const int start = linesPerProcessor * p;
                 const int end = p == processorCount - 1 ? imageHeight : linesPerProcessor * (p + 1);
 
-                threads[p] = std::thread([this, &pixels, &world, &processed, start, end]
+                threads[p] = std::thread([this, &pixels, &features, gatherFeatures, &scene, &processed, start, end]
                 {
                     for (int j = start; j < end; j++)
                     {
                         std::clog << "\rScanlines remaining: " << (imageHeight - processed) << "          " << std::flush;
                         for (int i = 0; i < imageWidth; i++)
-                        {
-                            Color pixelColor(0, 0, 0);
-
-                            for (int sample = 0; sample < samplesPerPixel; sample++)
-                            {
-                                const Ray r = GetRay(i, j);
-                                pixelColor += RayColor(r, maxDepth, world);
-                            }
-
-                            pixels[j * imageHeight + i] = pixelColor * pixelSamplesScale;
-                        }
+                            pixels[j * imageWidth + i] = RenderPixel(i, j, scene, samplesPerPixel, gatherFeatures ? &features[j * imageWidth + i] : nullptr);
                         ++processed;
                     }
                 });
@@ -94,6 +146,12 @@ public:
             }
         }
 
+        if (!featurePrefix.empty())
+            Denoiser::WriteFeatures(featurePrefix, features, imageWidth, imageHeight);
+
+        if (denoise)
+            denoiser.Denoise(pixels, features, imageWidth, imageHeight);
+
         for (const Color& color : pixels)
         {
             WriteColor(std::cout, color);
@@ -103,10 +161,210 @@ public:
         std::clog << "\rDone. Total time: " << elapsed << "s                  \n";
     }
 
+    void RenderProgressive(const Hittable& scene, std::vector<Color>& pixels, std::vector<PixelFeatures>& features) const
+    {
+        // Renders passes of 1, 2, 4... samples per pixel, keeping the running mean of each pixel,
+        // and publishes the image to the preview after every pass. Features are taken in the
+        // last pass, which has about half the samples. Viewers read the preview without locks,
+        // so publishing never waits on them.
+
+        PreviewBuffer preview;
+        if (!preview.Create(previewName, imageWidth, imageHeight))
+            std::cerr << "ERROR: Could not create preview '" << previewName << "'.\n";
+
+        std::vector<unsigned char> frame(pixels.size() * 3);
+        int samplesDone = 0;
+
+        for (int passSamples = 1; samplesDone < samplesPerPixel; passSamples *= 2)
+        {
+            const int samples = std::min(passSamples, samplesPerPixel - samplesDone);
+            const bool lastPass = samplesDone + samples == samplesPerPixel;
+            const double weight = double(samples) / (samplesDone + samples);
+
+            std::atomic<int> nextRow{ 0 };
+            std::vector<std::thread> threads(std::max(1u, std::thread::hardware_concurrency()));
+            for (std::thread& thread : threads)
+            {
+                thread = std::thread([&]()
+                {
+                    for (int j = nextRow++; j < imageHeight; j = nextRow++)
+                        for (int i = 0; i < imageWidth; i++)
+                        {
+                            const size_t k = size_t(j) * imageWidth + i;
+                            PixelFeatures* pixelFeatures = lastPass && !features.empty() ? &features[k] : nullptr;
+                            pixels[k] += weight * (RenderPixel(i, j, scene, samples, pixelFeatures) - pixels[k]);
+                            ColorToBytes(pixels[k], &frame[k * 3]);
+
+                            // The image averages every pass, not only the last.
+                            if (pixelFeatures)
+                                pixelFeatures->variance *= weight;
+                        }
+                });
+            }
+
+            for (std::thread& thread : threads)
+                thread.join();
+
+            samplesDone += samples;
+            if (preview.IsOpen())
+                preview.Publish(frame.data(), samplesDone);
+
+            std::clog << "\rSamples per pixel: " << samplesDone << " of " << samplesPerPixel << "          " << std::flush;
+        }
+    }
+
+    bool RenderStream(const Hittable& scene) const
+    {
+        // Renders the image in tiles, taken by the threads in scanline order. Finished tiles
+        // are turned into bytes in a band of tile rows, and each band is written to the file
+        // as soon as it and the bands above it are done. Only a few bands are held at once,
+        // so memory doesn't grow with the image height, and threads wait rather than start a
+        // band that doesn't fit. The whole image is never held, so it can't be denoised.
+
+        std::ofstream out(streamFilename, std::ios::binary | std::ios::trunc);
+        if (!out)
+        {
+            std::cerr << "ERROR: Could not open image file '" << streamFilename << "' for writing.\n";
+            return false;
+        }
+
+        if (denoise || !featurePrefix.empty())
+            std::clog << "Streamed images are written without denoising or features.\n";
+
+        out << "P6\n" << imageWidth << ' ' << imageHeight << "\n255\n";
+
+        const int tileSize = std::max(1, streamTileSize);
+        const int tilesX = (imageWidth + tileSize - 1) / tileSize;
+        const int bandCount = (imageHeight + tileSize - 1) / tileSize;
+        const int tileCount = tilesX * bandCount;
+        const int threadCount = int(std::max(1u, std::thread::hardware_concurrency()));
+
+        // Enough bands for every thread to have a tile while the oldest band finishes.
+        const int window = std::min(bandCount, (threadCount + tilesX - 1) / tilesX + 1);
+        const size_t bandBytes = size_t(imageWidth) * tileSize * 3;
+        std::vector<unsigned char> bands(size_t(window) * bandBytes);
+        std::vector<int> tilesDone(window, 0);
+
+        std::mutex mutex;  // Guards the counters below and the file
+        std::condition_variable bandWritten;
+        int nextTile = 0;
+        int writtenBands = 0;
+
+        std::vector<std::thread> threads(std::min(threadCount, tileCount));
+        for (std::thread& thread : threads)
+        {
+            thread = std::thread([&]()
+            {
+                while (true)
+                {
+                    int tile;
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        bandWritten.wait(lock, [&]() { return nextTile >= tileCount || nextTile / tilesX < writtenBands + window; });
+                        if (nextTile >= tileCount)
+                            return;
+
+                        tile = nextTile++;
+                    }
+
+                    // Bands of a tile row share the slot of the band written a window earlier.
+                    const int band = tile / tilesX;
+                    unsigned char* bandData = bands.data() + size_t(band % window) * bandBytes;
+                    const int x0 = (tile % tilesX) * tileSize;
+                    const int y0 = band * tileSize;
+                    const int x1 = std::min(x0 + tileSize, imageWidth);
+                    const int y1 = std::min(y0 + tileSize, imageHeight);
+
+                    for (int j = y0; j < y1; j++)
+                        for (int i = x0; i < x1; i++)
+                            ColorToBytes(RenderPixel(i, j, scene, samplesPerPixel, nullptr), bandData + (size_t(j - y0) * imageWidth + i) * 3);
+
+                    const std::lock_guard<std::mutex> lock(mutex);
+                    if (++tilesDone[band % window] < tilesX || band != writtenBands)
+                        continue;
+
+                    // Write every finished band in order, starting with this one.
+                    while (writtenBands < bandCount && tilesDone[writtenBands % window] == tilesX)
+                    {
+                        const int rows = std::min(tileSize, imageHeight - writtenBands * tileSize);
+                        out.write(reinterpret_cast<const char*>(bands.data() + size_t(writtenBands % window) * bandBytes),
+                            std::streamsize(size_t(rows) * imageWidth * 3));
+
+                        tilesDone[writtenBands % window] = 0;
+                        writtenBands++;
+                    }
+
+                    std::clog << "\rBands remaining: " << (bandCount - writtenBands) << "          " << std::flush;
+                    bandWritten.notify_all();
+                }
+            });
+        }
+
+        for (std::thread& thread : threads)
+            thread.join();
+
+        out.flush();
+        if (!out)
+        {
+            std::cerr << "ERROR: Could not write image file '" << streamFilename << "'.\n";
+            return false;
+        }
+
+        return true;
+    }
+
+    void RenderFrame(const Hittable& scene, ThreadPool& pool, std::vector<Color>& pixels)
+    {
+        // Renders the image into pixels on the threads of the pool, for frames of a sequence
+        // that share one compiled scene and one set of threads. The camera may have moved since
+        // the last frame.
+
+        pixels.resize(size_t(imageWidth) * PrepareRows());
+        pool.ParallelFor(imageHeight, [&](int j) { RenderRow(scene, j, &pixels[size_t(j) * imageWidth]); });
+    }
+
+    int PrepareRows()
+    {
+        // Sets the camera up for RenderRow, after its settings changed, and returns the image height.
+        Initialize();
+        return imageHeight;
+    }
+
+    void RenderRow(const Hittable& scene, int j, Color* row) const
+    {
+        for (int i = 0; i < imageWidth; i++)
+            row[i] = RenderPixel(i, j, scene, samplesPerPixel, nullptr);
+    }
+
+    double MeasurePaths(const Hittable& world, int pathCount)
+    {
+        // Traces paths through random pixels without writing an image, and returns the millions
+        // of paths traced per second. The world is traced as given, so pass a compiled one.
+
+        Initialize();
+
+        Color sum(0, 0, 0);
+        const auto start = clock();
+        for (int path = 0; path < pathCount; path++)
+        {
+            const int i = Random::Int(0, imageWidth - 1);
+            const int j = Random::Int(0, imageHeight - 1);
+            RayDifferential differential;
+            const Ray r = GetRay(i, j, differential);
+            sum += RayColor(r, maxDepth, world, &differential);
+        }
+        const double elapsed = double(clock() - start) / CLOCKS_PER_SEC;
+
+        // Keep the paths from being optimized away.
+        if (sum.x() < 0)
+            std::clog << sum << '\n';
+
+        return elapsed > 0 ? pathCount / elapsed * 1e-6 : 0;
+    }
+
 private:
 
     int    imageHeight;        // Rendered image height
-    double pixelSamplesScale;  // Color scale factor for a sum of pixel samples
     Point3 center;             // Camera center
     Point3 pixel00Loc;         // Location of pixel 0, 0
     Vec3   pixelDelta_u;       // Offset to pixel to the right
@@ -114,6 +372,7 @@ private:
     Vec3   u, v, w;            // Camera frame basis vectors
     Vec3   defocusDisk_u;      // Defocus disk horizontal radius
     Vec3   defocusDisk_v;      // Defocus disk vertical radius
+    double differentialScale;  // Spacing of the samples of a pixel, in pixels
 
     void Initialize()
     {
@@ -121,7 +380,8 @@ private:
         imageHeight = int(imageWidth / aspectRatio);
         imageHeight = (imageHeight < 1) ? 1 : imageHeight;
 
-        pixelSamplesScale = 1.0 / samplesPerPixel;
+        // Samples of a pixel are spread over it, so each covers less than a pixel.
+        differentialScale = std::fmax(0.125, 1.0 / std::sqrt(double(samplesPerPixel)));
 
         center = lookFrom;
 
@@ -171,6 +431,15 @@ private:
         return Ray(rayOrigin, rayDirection, rayTime);
     }
 
+    Ray GetRay(int i, int j, RayDifferential& differential) const
+    {
+        // Also returns the change of direction to the rays of the neighbouring samples.
+
+        differential.dDdx = differentialScale * pixelDelta_u;
+        differential.dDdy = differentialScale * pixelDelta_v;
+        return GetRay(i, j);
+    }
+
     static Vec3 SampleSquare()
     {
         // Returns the vector to a random point in the [-.5,-.5]-[+.5,+.5] unit square.
@@ -184,7 +453,85 @@ private:
         return center + (p[0] * defocusDisk_u) + (p[1] * defocusDisk_v);
     }
 
-    Color RayColor(const Ray& r, int depth, const Hittable& world) const
+    Color RenderPixel(int i, int j, const Hittable& scene, int samples, PixelFeatures* features) const
+    {
+        // Averages samples of a pixel, and their first hit features when asked for them.
+
+        const double sampleScale = 1.0 / samples;
+        Color pixelColor(0, 0, 0);
+        double luminanceSum = 0, luminanceSquares = 0;
+
+        for (int sample = 0; sample < samples; sample++)
+        {
+            RayDifferential differential;
+            const Ray r = GetRay(i, j, differential);
+
+            if (!features)
+            {
+                pixelColor += RayColor(r, maxDepth, scene, &differential);
+                continue;
+            }
+
+            PixelFeatures sampleFeatures;
+            const Color sampleColor = RayColor(r, maxDepth, scene, &differential, &sampleFeatures);
+            pixelColor += sampleColor;
+
+            features->albedo += sampleFeatures.albedo;
+            features->normal += sampleFeatures.normal;
+            features->depth += sampleFeatures.depth;
+
+            const double luminance = 0.2126 * sampleColor.x() + 0.7152 * sampleColor.y() + 0.0722 * sampleColor.z();
+            luminanceSum += luminance;
+            luminanceSquares += luminance * luminance;
+        }
+
+        if (features)
+        {
+            features->albedo *= sampleScale;
+            features->depth *= sampleScale;
+            if (features->normal.LengthSquared() > 0)
+                features->normal = UnitVector(features->normal);
+
+            // Variance of the mean of the samples.
+            const double mean = luminanceSum * sampleScale;
+            features->variance = std::fmax(0.0, luminanceSquares * sampleScale - mean * mean) * sampleScale;
+        }
+
+        return pixelColor * sampleScale;
+    }
+
+    static void SetFootprint(const Ray& r, const RayDifferential& differential, HitRecord& rec)
+    {
+        // Finds where the neighbouring rays cross the plane tangent at the hit, and how far
+        // apart that puts their texture coordinates, by least squares on dpdu and dpdv.
+
+        const double uu = Dot(rec.dpdu, rec.dpdu), uv = Dot(rec.dpdu, rec.dpdv), vv = Dot(rec.dpdv, rec.dpdv);
+        const double determinant = uu * vv - uv * uv;
+        if (determinant <= 1e-20 * uu * vv)
+            return;
+
+        double footprint = 0;
+        for (const Vec3& dD : { differential.dDdx, differential.dDdy })
+        {
+            const Vec3 direction = r.direction() + dD;
+            const double cosine = Dot(direction, rec.normal);
+            if (std::fabs(cosine) < 1e-12)
+                return;
+
+            const double t = Dot(rec.p - r.origin(), rec.normal) / cosine;
+            const Vec3 dp = r.origin() + t * direction - rec.p;
+
+            const double pu = Dot(dp, rec.dpdu), pv = Dot(dp, rec.dpdv);
+            const double du = (vv * pu - uv * pv) / determinant;
+            const double dv = (uu * pv - uv * pu) / determinant;
+            footprint = std::fmax(footprint, std::fmax(std::fabs(du), std::fabs(dv)));
+        }
+
+        rec.footprint = footprint;
+    }
+
+    Color RayColor(const Ray& r, int depth, const Hittable& world, const RayDifferential* differential = nullptr,
+        PixelFeatures* features = nullptr) const
     {
         // If we've exceeded the ray bounce limit, no more light is gathered.
         if (depth <= 0)
@@ -195,13 +542,30 @@ private:
 
         // If the ray hits nothing, return the background color.
         if (!world.Hit(r, Interval(0.001, infinity), rec))
+        {
+            if (features)
+                features->albedo = Color(1, 1, 1);
             return background;
+        }
+
+        // Only camera rays have differentials, later bounces look up unfiltered textures.
+        if (differential)
+            SetFootprint(r, *differential, rec);
 
         Ray scattered;
         Color attenuation;
-        const Color colorFromEmission = rec.mat->Emitted(rec.u, rec.v, rec.p);
+        const Color colorFromEmission = EmittedMaterial(*rec.mat, rec.u, rec.v, rec.p);
+
+        const bool scatters = ScatterMaterial(*rec.mat, r, rec, attenuation, scattered);
+
+        if (features)
+        {
+            features->albedo = scatters ? attenuation : Color(1, 1, 1);
+            features->normal = rec.normal;
+            features->depth = rec.t * r.direction().Length();
+        }
 
-        if (!rec.mat->Scatter(r, rec, attenuation, scattered))
+        if (!scatters)
             return colorFromEmission;
 
         const Color colorFromScatter = attenuation * RayColor(scattered, depth - 1, world);
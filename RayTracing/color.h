@@ -3,6 +3,10 @@
 #include "interval.h"
 #include "vec3.h"
 
+#include <fstream>
+#include <string>
+#include <vector>
+
 using Color = Vec3;
 
 inline double LinearToGamma(double linearComponent)
@@ -13,7 +17,7 @@ inline double LinearToGamma(double linearComponent)
     return 0;
 }
 
-void WriteColor(std::ostream& out, const Color& pixelColor)
+inline void ColorToBytes(const Color& pixelColor, unsigned char bytes[3])
 {
     // Apply a linear to gamma transform for gamma 2
     const double r = LinearToGamma(pixelColor.x());
@@ -22,10 +26,38 @@ void WriteColor(std::ostream& out, const Color& pixelColor)
 
     // Translate the [0,1] component values to the byte range [0,255].
     static const Interval intensity(0.000, 0.999);
-    const int rbyte = int(256 * intensity.Clamp(r));
-    const int gbyte = int(256 * intensity.Clamp(g));
-    const int bbyte = int(256 * intensity.Clamp(b));
+    bytes[0] = (unsigned char)(256 * intensity.Clamp(r));
+    bytes[1] = (unsigned char)(256 * intensity.Clamp(g));
+    bytes[2] = (unsigned char)(256 * intensity.Clamp(b));
+}
+
+void WriteColor(std::ostream& out, const Color& pixelColor)
+{
+    unsigned char bytes[3];
+    ColorToBytes(pixelColor, bytes);
 
     // Write out the pixel color components.
-    out << rbyte << ' ' << gbyte << ' ' << bbyte << '\n';
-}
\ No newline at end of file
+    out << int(bytes[0]) << ' ' << int(bytes[1]) << ' ' << int(bytes[2]) << '\n';
+}
+
+inline bool WriteImage(const std::string& filename, const std::vector<Color>& pixels, int width)
+{
+    // Writes rows of width pixels to a binary PPM file.
+
+    std::vector<unsigned char> bytes(pixels.size() * 3);
+    for (size_t k = 0; k < pixels.size(); k++)
+        ColorToBytes(pixels[k], &bytes[k * 3]);
+
+    std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+    out << "P6\n" << width << ' ' << pixels.size() / width << "\n255\n";
+    out.write(reinterpret_cast<const char*>(bytes.data()), std::streamsize(bytes.size()));
+    out.flush();
+
+    if (!out)
+    {
+        std::cerr << "ERROR: Could not write image file '" << filename << "'.\n";
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,560 @@
+#pragma once
+
+#include "hittable.h"
+#include "triangleMesh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <ostream>
+#include <type_traits>
+#include <vector>
+
+template<typename Quantized>
+class CompressedMesh : public Hittable
+{
+public:
+    // Compact copy of a triangle mesh, for scenes that would not fit in memory or cache otherwise.
+    // Each BVH node stores the boxes of both children as 8 or 16-bit offsets from its own corner,
+    // rounded outward so they still enclose the children. Positions can be stored as 16-bit
+    // offsets within the mesh bounds, and normals as two 16-bit octahedral coordinates. The node
+    // bounds are computed from the quantized positions, so every quantized triangle is bounded.
+
+    static_assert(std::is_same<Quantized, uint8_t>::value || std::is_same<Quantized, uint16_t>::value,
+        "Node bounds are quantized to 8 or 16 bits");
+
+    struct Options
+    {
+        bool quantizePositions = true;
+        bool encodeNormals = true;
+    };
+
+    struct Node
+    {
+        float origin[3];                // Minimum corner of the node
+        uint32_t child[2];              // Interior child: node index. Leaf child: first triangle
+        int8_t exponent[3];             // Child bounds are in units of 2^exponent from the origin
+        uint8_t leafCount[2];           // Triangles in each leaf child, zero for interior children
+        Quantized childMin[2][3];
+        Quantized childMax[2][3];
+    };
+
+    struct MemoryStats
+    {
+        size_t nodes = 0;
+        size_t positions = 0;
+        size_t normals = 0;
+        size_t uvs = 0;
+        size_t indices = 0;
+
+        size_t Total() const { return nodes + positions + normals + uvs + indices; }
+    };
+
+    CompressedMesh(const TriangleMesh& source, const Options& options = Options())
+        : mat(source.GetMaterial())
+    {
+        const MeshView& view = source.View();
+        const size_t vertexCount = view.vertexCount;
+
+        originalStats.nodes = source.NodeCount() * sizeof(TriangleMesh::Node);
+        originalStats.positions = 3 * vertexCount * sizeof(float);
+        originalStats.normals = view.HasNormals() ? 3 * vertexCount * sizeof(float) : 0;
+        originalStats.uvs = view.HasUVs() ? 2 * vertexCount * sizeof(float) : 0;
+        originalStats.indices = 3 * view.triangleCount * sizeof(uint32_t);
+
+        if (source.NodeCount() == 0)
+            return;
+
+        indices.assign(view.indices, view.indices + 3 * view.triangleCount);
+        if (view.HasUVs())
+        {
+            u.assign(view.u, view.u + vertexCount);
+            v.assign(view.v, view.v + vertexCount);
+        }
+
+        StorePositions(view, options.quantizePositions);
+        StoreNormals(view, options.encodeNormals);
+        BuildNodes(source);
+    }
+
+    bool Intersect(const Ray& r, const Interval& ray_t, Intersection& hit) const override
+    {
+        if (nodes.empty())
+            return false;
+
+        const TriangleMesh::RayData ray(r);
+
+        double closest = ray_t.max;
+        uint32_t hitTriangle = noChild;
+        double hitB1 = 0, hitB2 = 0;
+
+        // Nodes and leaves still to visit, with the distance where the ray enters them.
+        struct StackEntry
+        {
+            uint32_t index;
+            uint32_t leafCount;
+            double tEnter;
+        } stack[64];
+
+        int stackSize = 0;
+        StackEntry current = { 0, 0, 0 };
+
+        while (true)
+        {
+            if (current.leafCount > 0)
+            {
+                for (uint32_t i = current.index; i < current.index + current.leafCount; i++)
+                {
+                    const uint32_t* tri = &indices[3 * i];
+                    double t, b1, b2;
+                    if (TriangleMesh::IntersectTriangle(ray, Position(tri[0]), Position(tri[1]), Position(tri[2]),
+                        ray_t.min, closest, t, b1, b2))
+                    {
+                        closest = t;
+                        hitTriangle = i;
+                        hitB1 = b1;
+                        hitB2 = b2;
+                    }
+                }
+            }
+            else
+            {
+                const Node& node = nodes[current.index];
+
+                double scale[3];
+                for (int axis = 0; axis < 3; axis++)
+                    scale[axis] = PowerOfTwo(node.exponent[axis]);
+
+                StackEntry children[2];
+                for (int c = 0; c < 2; c++)
+                {
+                    children[c] = { node.child[c], node.leafCount[c], infinity };
+                    if (node.child[c] == noChild)
+                        continue;
+
+                    double min[3], max[3];
+                    for (int axis = 0; axis < 3; axis++)
+                    {
+                        min[axis] = node.origin[axis] + node.childMin[c][axis] * scale[axis];
+                        max[axis] = node.origin[axis] + node.childMax[c][axis] * scale[axis];
+                    }
+                    children[c].tEnter = TriangleMesh::SlabEntry(ray, min, max, ray_t.min, closest);
+                }
+
+                // Visit the nearest child first, and skip the children the ray misses.
+                if (children[1].tEnter < children[0].tEnter)
+                    std::swap(children[0], children[1]);
+
+                if (children[0].tEnter < infinity)
+                {
+                    if (children[1].tEnter < infinity)
+                        stack[stackSize++] = children[1];
+                    current = children[0];
+                    continue;
+                }
+            }
+
+            // Skip the entries that start beyond the closest hit found since they were pushed.
+            while (stackSize > 0 && stack[stackSize - 1].tEnter > closest)
+                stackSize--;
+
+            if (stackSize == 0)
+                break;
+            current = stack[--stackSize];
+        }
+
+        if (hitTriangle == noChild)
+            return false;
+
+        hit.Set(closest, this, hitTriangle, hitB1, hitB2);
+        return true;
+    }
+
+    void ComputeSurface(const Ray& r, const Intersection& hit, int depth, HitRecord& rec) const override
+    {
+        FillHitRecord(r, hit.primitive, hit.t, hit.b1, hit.b2, rec);
+    }
+
+    AABB BoundingBox() const override { return bbox; }
+
+    const shared_ptr<Material>& GetMaterial() const { return mat; }
+
+    MemoryStats GetMemoryStats() const
+    {
+        MemoryStats stats;
+        stats.nodes = nodes.size() * sizeof(Node);
+        stats.positions = quantizedPositions.size() * sizeof(uint16_t) + positions.size() * sizeof(float);
+        stats.normals = octNormals.size() * sizeof(int16_t) + normals.size() * sizeof(float);
+        stats.uvs = (u.size() + v.size()) * sizeof(float);
+        stats.indices = indices.size() * sizeof(uint32_t);
+        return stats;
+    }
+
+    void LogStats(std::ostream& out) const
+    {
+        // Memory used by each part of the mesh, next to the uncompressed mesh it was made from.
+
+        const MemoryStats stats = GetMemoryStats();
+        auto line = [&](const char* name, size_t compressed, size_t original)
+        {
+            out << "  " << name << ": " << compressed / 1024.0 << " KiB (uncompressed " << original / 1024.0 << " KiB)\n";
+        };
+
+        out << "Compressed mesh, " << 8 * sizeof(Quantized) << "-bit nodes:\n";
+        line("nodes", stats.nodes, originalStats.nodes);
+        line("positions", stats.positions, originalStats.positions);
+        line("normals", stats.normals, originalStats.normals);
+        line("uvs", stats.uvs, originalStats.uvs);
+        line("indices", stats.indices, originalStats.indices);
+        line("total", stats.Total(), originalStats.Total());
+    }
+
+private:
+    static constexpr uint32_t noChild = 0xffffffff;
+    static constexpr double maxQuantized = double(Quantized(~Quantized(0)));
+
+    std::vector<Node> nodes;
+    std::vector<uint32_t> indices;
+
+    // Positions are either quantized, relative to the mesh bounds, or stored as floats
+    std::vector<uint16_t> quantizedPositions;
+    std::vector<float> positions;
+    double positionOrigin[3] = {};
+    double positionScale[3] = {};
+
+    // Normals are either octahedral coordinates or floats, and may be missing
+    std::vector<int16_t> octNormals;
+    std::vector<float> normals;
+
+    std::vector<float> u, v;
+
+    shared_ptr<Material> mat;
+    AABB bbox;
+    MemoryStats originalStats;
+
+    static double PowerOfTwo(int exponent)
+    {
+        // Builds the float directly from its exponent bits, which is faster than ldexp.
+        const uint32_t bits = uint32_t(exponent + 127) << 23;
+        float value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    Point3 Position(uint32_t vertex) const
+    {
+        if (!quantizedPositions.empty())
+        {
+            const uint16_t* q = &quantizedPositions[3 * size_t(vertex)];
+            return Point3(
+                positionOrigin[0] + q[0] * positionScale[0],
+                positionOrigin[1] + q[1] * positionScale[1],
+                positionOrigin[2] + q[2] * positionScale[2]);
+        }
+
+        const float* p = &positions[3 * size_t(vertex)];
+        return Point3(p[0], p[1], p[2]);
+    }
+
+    Vec3 Normal(uint32_t vertex) const
+    {
+        if (!octNormals.empty())
+            return OctDecode(octNormals[2 * size_t(vertex)], octNormals[2 * size_t(vertex) + 1]);
+
+        const float* n = &normals[3 * size_t(vertex)];
+        return Vec3(n[0], n[1], n[2]);
+    }
+
+    void StorePositions(const MeshView& view, bool quantize)
+    {
+        const size_t vertexCount = view.vertexCount;
+        const float* source[3] = { view.x, view.y, view.z };
+
+        if (!quantize)
+        {
+            positions.resize(3 * vertexCount);
+            for (size_t i = 0; i < vertexCount; i++)
+                for (int axis = 0; axis < 3; axis++)
+                    positions[3 * i + axis] = source[axis][i];
+            return;
+        }
+
+        // Spread the mesh bounds over the 16-bit range of every axis.
+        for (int axis = 0; axis < 3; axis++)
+        {
+            double min = infinity, max = -infinity;
+            for (size_t i = 0; i < vertexCount; i++)
+            {
+                min = std::fmin(min, source[axis][i]);
+                max = std::fmax(max, source[axis][i]);
+            }
+            positionOrigin[axis] = min;
+            positionScale[axis] = max > min ? (max - min) / 65535.0 : 1.0;
+        }
+
+        quantizedPositions.resize(3 * vertexCount);
+        for (size_t i = 0; i < vertexCount; i++)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                const double q = std::round((source[axis][i] - positionOrigin[axis]) / positionScale[axis]);
+                quantizedPositions[3 * i + axis] = uint16_t(Interval(0, 65535).Clamp(q));
+            }
+        }
+    }
+
+    void StoreNormals(const MeshView& view, bool encode)
+    {
+        if (!view.HasNormals())
+            return;
+
+        const size_t vertexCount = view.vertexCount;
+
+        if (!encode)
+        {
+            normals.resize(3 * vertexCount);
+            for (size_t i = 0; i < vertexCount; i++)
+            {
+                normals[3 * i + 0] = view.nx[i];
+                normals[3 * i + 1] = view.ny[i];
+                normals[3 * i + 2] = view.nz[i];
+            }
+            return;
+        }
+
+        octNormals.resize(2 * vertexCount);
+        for (size_t i = 0; i < vertexCount; i++)
+            OctEncode(Vec3(view.nx[i], view.ny[i], view.nz[i]), octNormals[2 * i], octNormals[2 * i + 1]);
+    }
+
+    static void OctEncode(const Vec3& n, int16_t& a, int16_t& b)
+    {
+        // Projects the unit vector onto the octahedron |x| + |y| + |z| = 1, and unfolds the lower
+        // half over the corners of the upper half, mapping the sphere to a square.
+
+        const double length = std::fabs(n.x()) + std::fabs(n.y()) + std::fabs(n.z());
+        double x = length > 0 ? n.x() / length : 0;
+        double y = length > 0 ? n.y() / length : 0;
+
+        if (n.z() < 0)
+        {
+            const double foldedX = (1 - std::fabs(y)) * (x >= 0 ? 1 : -1);
+            const double foldedY = (1 - std::fabs(x)) * (y >= 0 ? 1 : -1);
+            x = foldedX;
+            y = foldedY;
+        }
+
+        a = int16_t(std::round(Interval(-1, 1).Clamp(x) * 32767));
+        b = int16_t(std::round(Interval(-1, 1).Clamp(y) * 32767));
+    }
+
+    static Vec3 OctDecode(int16_t a, int16_t b)
+    {
+        double x = a / 32767.0;
+        double y = b / 32767.0;
+        const double z = 1 - std::fabs(x) - std::fabs(y);
+
+        if (z < 0)
+        {
+            const double unfoldedX = (1 - std::fabs(y)) * (x >= 0 ? 1 : -1);
+            const double unfoldedY = (1 - std::fabs(x)) * (y >= 0 ? 1 : -1);
+            x = unfoldedX;
+            y = unfoldedY;
+        }
+
+        return UnitVector(Vec3(x, y, z));
+    }
+
+    struct Box
+    {
+        double min[3] = { infinity, infinity, infinity };
+        double max[3] = { -infinity, -infinity, -infinity };
+
+        void Extend(const Point3& p)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                min[axis] = std::fmin(min[axis], p[axis]);
+                max[axis] = std::fmax(max[axis], p[axis]);
+            }
+        }
+
+        void Extend(const Box& box)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                min[axis] = std::fmin(min[axis], box.min[axis]);
+                max[axis] = std::fmax(max[axis], box.max[axis]);
+            }
+        }
+    };
+
+    void BuildNodes(const TriangleMesh& source)
+    {
+        // Keeps the topology of the source BVH, with bounds recomputed from the stored positions.
+
+        const TriangleMesh::Node* sourceNodes = source.GetNodes();
+        Box bounds;
+
+        nodes.emplace_back();
+        if (sourceNodes[0].count > 0)
+        {
+            // A single leaf hangs from a root with one child.
+            const Box leaf = LeafBox(sourceNodes[0].offset, sourceNodes[0].count);
+            Box children[2] = { leaf, Box() };
+            SetChildren(0, children);
+            nodes[0].child[0] = sourceNodes[0].offset;
+            nodes[0].leafCount[0] = uint8_t(sourceNodes[0].count);
+            nodes[0].child[1] = noChild;
+            nodes[0].leafCount[1] = 0;
+            bounds = leaf;
+        }
+        else
+        {
+            bounds = BuildNode(sourceNodes, 0, 0);
+        }
+
+        bbox = AABB(Point3(bounds.min[0], bounds.min[1], bounds.min[2]), Point3(bounds.max[0], bounds.max[1], bounds.max[2]));
+    }
+
+    Box LeafBox(uint32_t first, uint32_t count) const
+    {
+        Box box;
+        for (uint32_t i = first; i < first + count; i++)
+            for (int k = 0; k < 3; k++)
+                box.Extend(Position(indices[3 * i + k]));
+        return box;
+    }
+
+    Box BuildNode(const TriangleMesh::Node* sourceNodes, uint32_t sourceIdx, uint32_t nodeIdx)
+    {
+        // Fills the node made for the interior source node, creating the nodes of its children,
+        // and returns its bounds.
+
+        const TriangleMesh::Node& sourceNode = sourceNodes[sourceIdx];
+        Box children[2];
+
+        for (int c = 0; c < 2; c++)
+        {
+            const uint32_t sourceChild = sourceNode.offset + c;
+            const TriangleMesh::Node& child = sourceNodes[sourceChild];
+
+            if (child.count > 0)
+            {
+                children[c] = LeafBox(child.offset, child.count);
+                nodes[nodeIdx].child[c] = child.offset;
+                nodes[nodeIdx].leafCount[c] = uint8_t(child.count);
+            }
+            else
+            {
+                const uint32_t childIdx = uint32_t(nodes.size());
+                nodes.emplace_back();
+                children[c] = BuildNode(sourceNodes, sourceChild, childIdx);
+                nodes[nodeIdx].child[c] = childIdx;
+                nodes[nodeIdx].leafCount[c] = 0;
+            }
+        }
+
+        SetChildren(nodeIdx, children);
+
+        Box bounds = children[0];
+        bounds.Extend(children[1]);
+        return bounds;
+    }
+
+    void SetChildren(uint32_t nodeIdx, const Box children[2])
+    {
+        // Quantizes the child boxes relative to the node, rounding outward.
+
+        Node& node = nodes[nodeIdx];
+        Box bounds = children[0];
+        bounds.Extend(children[1]);
+
+        for (int axis = 0; axis < 3; axis++)
+        {
+            // The origin is rounded down to a float, and the unit is the smallest power of two
+            // that spans the node in the quantized range.
+            float origin = float(bounds.min[axis]);
+            if (origin > bounds.min[axis])
+                origin = std::nextafter(origin, -std::numeric_limits<float>::infinity());
+
+            const double extent = bounds.max[axis] - origin;
+            int exponent = extent > 0 ? int(std::ceil(std::log2(extent / maxQuantized))) : -126;
+            exponent = std::max(exponent, -126);
+            while (origin + maxQuantized * PowerOfTwo(exponent) < bounds.max[axis])
+                exponent++;
+
+            node.origin[axis] = origin;
+            node.exponent[axis] = int8_t(exponent);
+
+            const double scale = PowerOfTwo(exponent);
+            for (int c = 0; c < 2; c++)
+            {
+                if (children[c].min[axis] > children[c].max[axis])
+                {
+                    node.childMin[c][axis] = 0;
+                    node.childMax[c][axis] = 0;
+                    continue;
+                }
+
+                double qMin = std::floor((children[c].min[axis] - origin) / scale);
+                double qMax = std::ceil((children[c].max[axis] - origin) / scale);
+                qMin = Interval(0, maxQuantized).Clamp(qMin);
+                qMax = Interval(0, maxQuantized).Clamp(qMax);
+
+                // Fix any rounding of the divisions above, so the decoded box always contains
+                // the child.
+                while (qMin > 0 && origin + qMin * scale > children[c].min[axis])
+                    qMin--;
+                while (qMax < maxQuantized && origin + qMax * scale < children[c].max[axis])
+                    qMax++;
+
+                node.childMin[c][axis] = Quantized(qMin);
+                node.childMax[c][axis] = Quantized(qMax);
+            }
+        }
+    }
+
+    void FillHitRecord(const Ray& r, uint32_t triangle, double t, double b1, double b2, HitRecord& rec) const
+    {
+        const uint32_t* tri = &indices[3 * triangle];
+        const double b0 = 1 - b1 - b2;
+
+        const Point3 p0 = Position(tri[0]);
+        const Vec3 geometricNormal = UnitVector(Cross(Position(tri[1]) - p0, Position(tri[2]) - p0));
+
+        rec.t = t;
+        rec.p = r.at(t);
+        rec.mat = mat.get();
+
+        if (!octNormals.empty() || !normals.empty())
+        {
+            // Faces are decided by the geometric normal, the vertex normals only shade.
+            const Vec3 shadingNormal = UnitVector(b0 * Normal(tri[0]) + b1 * Normal(tri[1]) + b2 * Normal(tri[2]));
+
+            rec.frontFace = Dot(r.direction(), geometricNormal) < 0;
+            rec.normal = rec.frontFace ? shadingNormal : -shadingNormal;
+        }
+        else
+        {
+            rec.SetFaceNormal(r, geometricNormal);
+        }
+
+        if (!u.empty())
+        {
+            rec.u = b0 * u[tri[0]] + b1 * u[tri[1]] + b2 * u[tri[2]];
+            rec.v = b0 * v[tri[0]] + b1 * v[tri[1]] + b2 * v[tri[2]];
+            rec.SetTriangleDerivatives({ p0, Position(tri[1]), Position(tri[2]) },
+                { u[tri[0]], u[tri[1]], u[tri[2]] }, { v[tri[0]], v[tri[1]], v[tri[2]] });
+        }
+        else
+        {
+            rec.u = b1;
+            rec.v = b2;
+            rec.dpdu = Position(tri[1]) - p0;
+            rec.dpdv = Position(tri[2]) - p0;
+        }
+    }
+};
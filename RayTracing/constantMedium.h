@@ -10,52 +10,68 @@ public:
     ConstantMedium(shared_ptr<Hittable> boundary, double density, shared_ptr<Texture> tex)
         : boundary(boundary)
         , negInvDensity(-1 / density)
-        , phaseFunction(make_shared<Isotropic>(tex))
+        , phaseFunction(MakeObject<Isotropic>(tex))
     {}
 
     ConstantMedium(shared_ptr<Hittable> boundary, double density, const Color& albedo)
         : boundary(boundary)
         , negInvDensity(-1 / density)
-        , phaseFunction(make_shared<Isotropic>(albedo))
+        , phaseFunction(MakeObject<Isotropic>(albedo))
     {}
 
-    bool Hit(const Ray& r, const Interval& ray_t, HitRecord& rec) const override
-    {
-        HitRecord rec1, rec2;
+    ConstantMedium(shared_ptr<Hittable> boundary, double density, shared_ptr<Material> phaseFunction)
+        : boundary(boundary)
+        , negInvDensity(-1 / density)
+        , phaseFunction(phaseFunction)
+    {}
 
-        if (!boundary->Hit(r, Interval::universe, rec1))
+    bool Intersect(const Ray& r, const Interval& ray_t, Intersection& hit) const override
+    {
+        Interval span;
+        if (!boundary->Span(r, span))
             return false;
 
-        if (!boundary->Hit(r, Interval(rec1.t + 0.0001, infinity), rec2))
-            return false;
+        double t1 = span.min;
+        double t2 = span.max;
 
-        if (rec1.t < ray_t.min) rec1.t = ray_t.min;
-        if (rec2.t > ray_t.max) rec2.t = ray_t.max;
+        if (t1 < ray_t.min) t1 = ray_t.min;
+        if (t2 > ray_t.max) t2 = ray_t.max;
 
-        if (rec1.t >= rec2.t)
+        if (t1 >= t2)
             return false;
 
-        if (rec1.t < 0)
-            rec1.t = 0;
+        if (t1 < 0)
+            t1 = 0;
 
         const double rayLength = r.direction().Length();
-        const double distance_inside_boundary = (rec2.t - rec1.t) * rayLength;
+        const double distance_inside_boundary = (t2 - t1) * rayLength;
         const double hit_distance = negInvDensity * std::log(Random::Double());
 
         if (hit_distance > distance_inside_boundary)
             return false;
 
-        rec.t = rec1.t + hit_distance / rayLength;
+        hit.Set(t1 + hit_distance / rayLength, this);
+        return true;
+    }
+
+    void ComputeSurface(const Ray& r, const Intersection& hit, int depth, HitRecord& rec) const override
+    {
+        rec.t = hit.t;
         rec.p = r.at(rec.t);
 
         rec.normal = Vec3(1, 0, 0);  // arbitrary
         rec.frontFace = true;        // also arbitrary
-        rec.mat = phaseFunction;
-
-        return true;
+        rec.u = 0;                   // so are the texture coordinates
+        rec.v = 0;
+        rec.mat = phaseFunction.get();
     }
 
     AABB BoundingBox() const override { return boundary->BoundingBox(); }
+    AABB BoundingBoxAt(double time) const override { return boundary->BoundingBoxAt(time); }
+
+    const shared_ptr<Hittable>& Boundary() const { return boundary; }
+    double Density() const { return -1 / negInvDensity; }
+    const shared_ptr<Material>& PhaseFunction() const { return phaseFunction; }
 
 private:
     shared_ptr<Hittable> boundary;
@@ -0,0 +1,256 @@
+#pragma once
+
+#include "color.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct PixelFeatures
+{
+    // What the camera rays of a pixel saw at their first hit, averaged over its samples, and
+    // how much the samples of the pixel disagreed.
+
+    Color albedo;          // Reflectance of the surface, one for lights and the background
+    Vec3 normal;           // Shading normal, zero for the background
+    double depth = 0;      // Distance to the hit, zero for the background
+    double variance = 0;   // Of the pixel's mean luminance
+};
+
+class Denoiser
+{
+public:
+    // Edge-avoiding a-trous wavelet filter guided by the first hit features. Colors are divided
+    // by their albedo, so texture detail is put back after filtering instead of being blurred,
+    // and the rest is filtered by a widening 5x5 kernel over several passes. Each neighbour is
+    // weighted down by how much its normal and depth differ, and by how much its luminance
+    // differs relative to the noise left in the pixel, which is tracked through the passes.
+    // Each pass runs over tiles of the image on all the hardware threads.
+
+    int passes = 5;                 // The kernel reaches 2^passes * 2 pixels
+    double colorSigma = 4;          // Luminance differences allowed, in standard deviations
+    double normalPower = 64;        // Sharpness of the normal weight
+    double depthSigma = 0.05;       // Relative depth differences allowed per pixel of distance
+
+    void Denoise(std::vector<Color>& pixels, const std::vector<PixelFeatures>& features, int width, int height) const
+    {
+        const size_t pixelCount = size_t(width) * height;
+        std::vector<Color> color(pixelCount), filtered(pixelCount);
+        std::vector<double> variance(pixelCount), filteredVariance(pixelCount);
+
+        for (size_t p = 0; p < pixelCount; p++)
+            color[p] = Demodulate(pixels[p], features[p].albedo);
+
+        // Pixels whose few samples happened to agree would keep all their noise, so the noise
+        // is also estimated from how much the pixels around them differ.
+        ForEachTile(width, height, [&](int x0, int y0, int x1, int y1)
+        {
+            for (int y = y0; y < y1; y++)
+                for (int x = x0; x < x1; x++)
+                {
+                    const size_t center = size_t(y) * width + x;
+                    const double albedo = std::fmax(1e-2, Luminance(features[center].albedo));
+                    variance[center] = std::fmax(features[center].variance / (albedo * albedo),
+                        SpatialVariance(x, y, width, height, color, features));
+                }
+        });
+
+        for (int pass = 0; pass < passes; pass++)
+        {
+            const int step = 1 << pass;
+            ForEachTile(width, height, [&](int x0, int y0, int x1, int y1)
+            {
+                for (int y = y0; y < y1; y++)
+                    for (int x = x0; x < x1; x++)
+                        FilterPixel(x, y, step, width, height, color, variance, features, filtered, filteredVariance);
+            });
+
+            color.swap(filtered);
+            variance.swap(filteredVariance);
+        }
+
+        for (size_t p = 0; p < pixelCount; p++)
+            pixels[p] = color[p] * Albedo(features[p].albedo);
+    }
+
+    static void WriteFeatures(const std::string& prefix, const std::vector<PixelFeatures>& features, int width, int height)
+    {
+        // Writes the albedo, normal and depth images, with normals mapped from [-1,1] and
+        // depths from the nearest to the farthest hit.
+
+        double nearest = infinity, farthest = 0;
+        for (const PixelFeatures& f : features)
+            if (f.depth > 0)
+            {
+                nearest = std::fmin(nearest, f.depth);
+                farthest = std::fmax(farthest, f.depth);
+            }
+
+        std::ofstream albedo(prefix + "albedo.ppm"), normal(prefix + "normal.ppm"), depth(prefix + "depth.ppm");
+        for (std::ofstream* out : { &albedo, &normal, &depth })
+            *out << "P3\n" << width << ' ' << height << "\n255\n";
+
+        for (const PixelFeatures& f : features)
+        {
+            WriteColor(albedo, f.albedo);
+
+            const Color mapped = 0.5 * (f.normal + Vec3(1, 1, 1));
+            normal << Byte(mapped.x()) << ' ' << Byte(mapped.y()) << ' ' << Byte(mapped.z()) << '\n';
+
+            const int level = f.depth > 0 ? Byte(1 - (f.depth - nearest) / std::fmax(farthest - nearest, 1e-12)) : 0;
+            depth << level << ' ' << level << ' ' << level << '\n';
+        }
+    }
+
+private:
+    static constexpr double kernel[3] = { 3.0 / 8.0, 1.0 / 4.0, 1.0 / 16.0 };  // By distance
+    static constexpr int tileSize = 32;
+
+    static double Luminance(const Color& c) { return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z(); }
+    static int Byte(double value) { return int(255.99 * Interval(0, 1).Clamp(value)); }
+
+    static Color Albedo(const Color& albedo)
+    {
+        // Dark albedos would blow up the noise they divide, so they are kept from getting small.
+        const double minimum = 0.01;
+        return Color(std::fmax(albedo.x(), minimum), std::fmax(albedo.y(), minimum), std::fmax(albedo.z(), minimum));
+    }
+
+    static Color Demodulate(const Color& color, const Color& albedo)
+    {
+        const Color a = Albedo(albedo);
+        return Color(color.x() / a.x(), color.y() / a.y(), color.z() / a.z());
+    }
+
+    void FilterPixel(int x, int y, int step, int width, int height, const std::vector<Color>& color,
+        const std::vector<double>& variance, const std::vector<PixelFeatures>& features,
+        std::vector<Color>& filtered, std::vector<double>& filteredVariance) const
+    {
+        const size_t center = size_t(y) * width + x;
+        const PixelFeatures& f = features[center];
+        const double luminance = Luminance(color[center]);
+        const double colorScale = 1 / (colorSigma * std::sqrt(BlurredVariance(x, y, width, height, variance)) + 1e-6);
+        const bool background = f.depth <= 0;
+
+        Color sum(0, 0, 0);
+        double weightSum = 0, varianceSum = 0;
+
+        for (int dy = -2; dy <= 2; dy++)
+        {
+            const int qy = y + dy * step;
+            if (qy < 0 || qy >= height)
+                continue;
+
+            for (int dx = -2; dx <= 2; dx++)
+            {
+                const int qx = x + dx * step;
+                if (qx < 0 || qx >= width)
+                    continue;
+
+                const size_t q = size_t(qy) * width + qx;
+                const PixelFeatures& g = features[q];
+
+                // The background only mixes with itself.
+                if (background != (g.depth <= 0))
+                    continue;
+
+                double weight = kernel[std::abs(dx)] * kernel[std::abs(dy)];
+                if (!background)
+                {
+                    const double cosine = std::fmax(0.0, Dot(f.normal, g.normal));
+                    const double depthScale = depthSigma * step * std::max(std::abs(dx), std::abs(dy)) * f.depth;
+                    weight *= std::pow(cosine, normalPower) * std::exp(-std::fabs(f.depth - g.depth) / (depthScale + 1e-12));
+                }
+
+                weight *= std::exp(-std::fabs(luminance - Luminance(color[q])) * colorScale);
+
+                sum += weight * color[q];
+                weightSum += weight;
+                varianceSum += weight * weight * variance[q];
+            }
+        }
+
+        // The center always has weight, so the sums are never zero.
+        filtered[center] = sum / weightSum;
+        filteredVariance[center] = varianceSum / (weightSum * weightSum);
+    }
+
+    static double SpatialVariance(int x, int y, int width, int height, const std::vector<Color>& color,
+        const std::vector<PixelFeatures>& features)
+    {
+        // Variance of the luminance of the 5x5 pixels around, among those on the same kind of
+        // surface: background or not.
+
+        const bool background = features[size_t(y) * width + x].depth <= 0;
+        double sum = 0, squares = 0;
+        int count = 0;
+
+        for (int qy = std::max(0, y - 2); qy <= std::min(height - 1, y + 2); qy++)
+            for (int qx = std::max(0, x - 2); qx <= std::min(width - 1, x + 2); qx++)
+            {
+                const size_t q = size_t(qy) * width + qx;
+                if (background != (features[q].depth <= 0))
+                    continue;
+
+                const double luminance = Luminance(color[q]);
+                sum += luminance;
+                squares += luminance * luminance;
+                count++;
+            }
+
+        const double mean = sum / count;
+        return std::fmax(0.0, squares / count - mean * mean);
+    }
+
+    static double BlurredVariance(int x, int y, int width, int height, const std::vector<double>& variance)
+    {
+        // 3x3 Gaussian of the variance, which steadies the luminance weights.
+
+        double sum = 0, weightSum = 0;
+        for (int dy = -1; dy <= 1; dy++)
+            for (int dx = -1; dx <= 1; dx++)
+            {
+                const int qx = x + dx, qy = y + dy;
+                if (qx < 0 || qx >= width || qy < 0 || qy >= height)
+                    continue;
+
+                const double weight = (dx == 0 ? 0.5 : 0.25) * (dy == 0 ? 0.5 : 0.25);
+                sum += weight * variance[size_t(qy) * width + qx];
+                weightSum += weight;
+            }
+
+        return sum / weightSum;
+    }
+
+    template<typename F>
+    static void ForEachTile(int width, int height, F fn)
+    {
+        // Runs fn for every tile of the image, spreading the tiles over the hardware threads.
+
+        const int tilesX = (width + tileSize - 1) / tileSize;
+        const int tileCount = tilesX * ((height + tileSize - 1) / tileSize);
+
+        std::atomic<int> nextTile{ 0 };
+        std::vector<std::thread> threads(std::min<size_t>(tileCount, std::max(1u, std::thread::hardware_concurrency())));
+
+        for (std::thread& thread : threads)
+        {
+            thread = std::thread([&]()
+            {
+                for (int tile = nextTile++; tile < tileCount; tile = nextTile++)
+                {
+                    const int x0 = (tile % tilesX) * tileSize;
+                    const int y0 = (tile / tilesX) * tileSize;
+                    fn(x0, y0, std::min(x0 + tileSize, width), std::min(y0 + tileSize, height));
+                }
+            });
+        }
+
+        for (std::thread& thread : threads)
+            thread.join();
+    }
+};
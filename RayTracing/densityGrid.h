@@ -0,0 +1,362 @@
+#pragma once
+
+#include "aabb.h"
+#include "sourceFiles.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+class DensityGrid
+{
+public:
+    // Voxel densities over a box, kept sparse in bricks of brickSize^3 voxels: bricks where every
+    // voxel is zero take no memory. Every brick is also a cell of a coarse majorant grid, holding
+    // the largest density found anywhere in its region, which bounds the density when tracking
+    // rays through the volume.
+
+    static constexpr int brickSize = 8;
+
+    DensityGrid(const AABB& bounds, int nx, int ny, int nz, const float* densities)
+        : bounds(bounds)
+    {
+        // densities holds nx * ny * nz values with x varying fastest. Negative values are zero.
+
+        resolution[0] = std::max(nx, 1);
+        resolution[1] = std::max(ny, 1);
+        resolution[2] = std::max(nz, 1);
+        Resize();
+
+        for (int bz = 0; bz < brickCount[2]; bz++)
+            for (int by = 0; by < brickCount[1]; by++)
+                for (int bx = 0; bx < brickCount[0]; bx++)
+                {
+                    // Copy the brick, with the voxels past the edge of the grid left at zero.
+                    float brick[brickVoxels] = {};
+                    bool empty = true;
+
+                    for (int z = 0; z < brickSize; z++)
+                        for (int y = 0; y < brickSize; y++)
+                            for (int x = 0; x < brickSize; x++)
+                            {
+                                const int i = bx * brickSize + x;
+                                const int j = by * brickSize + y;
+                                const int k = bz * brickSize + z;
+                                if (i >= nx || j >= ny || k >= nz)
+                                    continue;
+
+                                const float density = std::max(densities[(size_t(k) * ny + j) * nx + i], 0.0f);
+                                brick[(z * brickSize + y) * brickSize + x] = density;
+                                empty = empty && density == 0;
+                            }
+
+                    if (empty)
+                        continue;
+
+                    brickIndex[CellIndex(bx, by, bz)] = uint32_t(brickData.size() / brickVoxels);
+                    brickData.insert(brickData.end(), brick, brick + brickVoxels);
+                }
+
+        ComputeMajorants();
+    }
+
+    template<typename F>
+    static shared_ptr<DensityGrid> Sample(const AABB& bounds, int nx, int ny, int nz, F density)
+    {
+        // Builds a grid from a function of the position, sampled at the voxel centers.
+
+        std::vector<float> densities(size_t(nx) * ny * nz);
+        const Point3 origin(bounds.x.min, bounds.y.min, bounds.z.min);
+        const Vec3 voxel(bounds.x.Size() / nx, bounds.y.Size() / ny, bounds.z.Size() / nz);
+
+        for (int k = 0; k < nz; k++)
+            for (int j = 0; j < ny; j++)
+                for (int i = 0; i < nx; i++)
+                {
+                    const Point3 p = origin + Vec3((i + 0.5) * voxel.x(), (j + 0.5) * voxel.y(), (k + 0.5) * voxel.z());
+                    densities[(size_t(k) * ny + j) * nx + i] = float(density(p));
+                }
+
+        return make_shared<DensityGrid>(bounds, nx, ny, nz, densities.data());
+    }
+
+    double Density(const Point3& p) const
+    {
+        // Trilinear interpolation between voxel centers. The density is zero outside the bounds.
+
+        double x[3];
+        int cell[3];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const Interval& extent = bounds.AxisInterval(axis);
+            if (!extent.Contains(p[axis]))
+                return 0;
+
+            x[axis] = (p[axis] - extent.min) * voxelsPerUnit[axis] - 0.5;
+            cell[axis] = int(std::floor(x[axis]));
+            x[axis] -= cell[axis];
+        }
+
+        double density = 0;
+        for (int corner = 0; corner < 8; corner++)
+        {
+            const int dx = corner & 1, dy = (corner >> 1) & 1, dz = corner >> 2;
+            const double weight = (dx ? x[0] : 1 - x[0]) * (dy ? x[1] : 1 - x[1]) * (dz ? x[2] : 1 - x[2]);
+            density += weight * Voxel(cell[0] + dx, cell[1] + dy, cell[2] + dz);
+        }
+
+        return density;
+    }
+
+    template<typename F>
+    bool Traverse(const Ray& r, Interval ray_t, F visit) const
+    {
+        // Walks the majorant cells the ray crosses in the interval, front to back, calling
+        // visit(segment, majorant) for the part of the ray in each. Stops and returns true as
+        // soon as visit does.
+
+        if (!bounds.Clip(r, ray_t))
+            return false;
+
+        const Point3 start = r.at(ray_t.min);
+        int cell[3], step[3];
+        double next[3], delta[3];
+
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const Interval& extent = bounds.AxisInterval(axis);
+            const double cellSize = brickSize / voxelsPerUnit[axis];
+            const double direction = r.direction()[axis];
+
+            cell[axis] = std::clamp(int((start[axis] - extent.min) / cellSize), 0, brickCount[axis] - 1);
+
+            if (direction == 0)
+            {
+                step[axis] = 0;
+                next[axis] = delta[axis] = infinity;
+                continue;
+            }
+
+            // Ray parameter of the next cell boundary, and between boundaries along the axis.
+            step[axis] = direction > 0 ? 1 : -1;
+            const double boundary = extent.min + (cell[axis] + (direction > 0 ? 1 : 0)) * cellSize;
+            next[axis] = (boundary - r.origin()[axis]) / direction;
+            delta[axis] = cellSize / std::fabs(direction);
+        }
+
+        double t0 = ray_t.min;
+        while (true)
+        {
+            const int axis = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+            const double t1 = std::fmin(next[axis], ray_t.max);
+
+            const float majorant = majorants[CellIndex(cell[0], cell[1], cell[2])];
+            if (t1 > t0 && majorant > 0 && visit(Interval(t0, t1), double(majorant)))
+                return true;
+
+            if (next[axis] >= ray_t.max)
+                return false;
+
+            cell[axis] += step[axis];
+            if (cell[axis] < 0 || cell[axis] >= brickCount[axis])
+                return false;
+
+            t0 = t1;
+            next[axis] += delta[axis];
+        }
+    }
+
+    bool Contains(const Point3& p) const
+    {
+        return bounds.x.Contains(p.x()) && bounds.y.Contains(p.y()) && bounds.z.Contains(p.z());
+    }
+
+    const AABB& Bounds() const { return bounds; }
+    size_t BrickCount() const { return brickData.size() / brickVoxels; }
+    size_t CellCount() const { return majorants.size(); }
+
+    size_t BytesUsed() const
+    {
+        return brickIndex.size() * sizeof(uint32_t) + (brickData.size() + majorants.size()) * sizeof(float);
+    }
+
+    float MaxDensity() const
+    {
+        return majorants.empty() ? 0.0f : *std::max_element(majorants.begin(), majorants.end());
+    }
+
+    static bool Write(const std::string& filename, const DensityGrid& grid)
+    {
+        Header header = {};
+        std::memcpy(header.magic, fileMagic, sizeof(header.magic));
+        header.formatVersion = formatVersion;
+        header.byteOrder = byteOrderMark;
+        header.brickCount = uint32_t(grid.BrickCount());
+        for (int axis = 0; axis < 3; axis++)
+        {
+            header.resolution[axis] = uint32_t(grid.resolution[axis]);
+            header.boundsMin[axis] = grid.bounds.AxisInterval(axis).min;
+            header.boundsMax[axis] = grid.bounds.AxisInterval(axis).max;
+        }
+
+        const std::string tempFilename = filename + ".tmp";
+        {
+            std::ofstream out(tempFilename, std::ios::binary | std::ios::trunc);
+            out.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+            out.write(reinterpret_cast<const char*>(grid.brickIndex.data()), std::streamsize(grid.brickIndex.size() * sizeof(uint32_t)));
+            out.write(reinterpret_cast<const char*>(grid.brickData.data()), std::streamsize(grid.brickData.size() * sizeof(float)));
+            if (!out)
+                return false;
+        }
+
+        std::remove(filename.c_str());
+        return std::rename(tempFilename.c_str(), filename.c_str()) == 0;
+    }
+
+    static shared_ptr<DensityGrid> Load(const std::string& filename)
+    {
+        // Loads a sparse grid written by Write. Returns nullptr if the file is missing or invalid.
+
+        SourceFiles::Record(filename);
+
+        std::ifstream in(filename, std::ios::binary);
+        Header header;
+        if (!in.read(reinterpret_cast<char*>(&header), sizeof(Header))
+            || std::memcmp(header.magic, fileMagic, sizeof(header.magic)) != 0
+            || header.formatVersion != formatVersion
+            || header.byteOrder != byteOrderMark)
+            return nullptr;
+
+        for (int axis = 0; axis < 3; axis++)
+            if (header.resolution[axis] == 0 || header.resolution[axis] > maxResolution)
+                return nullptr;
+
+        const AABB bounds(Point3(header.boundsMin[0], header.boundsMin[1], header.boundsMin[2]),
+            Point3(header.boundsMax[0], header.boundsMax[1], header.boundsMax[2]));
+
+        auto grid = shared_ptr<DensityGrid>(new DensityGrid(bounds));
+        for (int axis = 0; axis < 3; axis++)
+            grid->resolution[axis] = int(header.resolution[axis]);
+        grid->Resize();
+
+        if (header.brickCount > grid->brickIndex.size())
+            return nullptr;
+
+        grid->brickData.resize(size_t(header.brickCount) * brickVoxels);
+        if (!in.read(reinterpret_cast<char*>(grid->brickIndex.data()), std::streamsize(grid->brickIndex.size() * sizeof(uint32_t)))
+            || !in.read(reinterpret_cast<char*>(grid->brickData.data()), std::streamsize(grid->brickData.size() * sizeof(float))))
+            return nullptr;
+
+        for (uint32_t brick : grid->brickIndex)
+            if (brick != noBrick && brick >= header.brickCount)
+                return nullptr;
+
+        grid->ComputeMajorants();
+        return grid;
+    }
+
+    static shared_ptr<DensityGrid> LoadRaw(const std::string& filename, const AABB& bounds, int nx, int ny, int nz)
+    {
+        // Loads a dense grid of 32-bit floats with x varying fastest, the layout most volume
+        // datasets come in. Returns nullptr if the file is missing or too short.
+
+        SourceFiles::Record(filename);
+
+        if (nx <= 0 || ny <= 0 || nz <= 0 || nx > maxResolution || ny > maxResolution || nz > maxResolution)
+            return nullptr;
+
+        std::vector<float> densities(size_t(nx) * ny * nz);
+        std::ifstream in(filename, std::ios::binary);
+        if (!in.read(reinterpret_cast<char*>(densities.data()), std::streamsize(densities.size() * sizeof(float))))
+            return nullptr;
+
+        return make_shared<DensityGrid>(bounds, nx, ny, nz, densities.data());
+    }
+
+private:
+    static constexpr int brickVoxels = brickSize * brickSize * brickSize;
+    static constexpr uint32_t noBrick = 0xffffffff;
+    static constexpr int maxResolution = 1 << 16;
+
+    static constexpr char fileMagic[8] = { 'R', 'T', 'V', 'O', 'L', 0, 0, 0 };
+    static constexpr uint32_t formatVersion = 1;
+    static constexpr uint32_t byteOrderMark = 0x01020304;  // Reads differently on the other byte order
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t formatVersion;
+        uint32_t byteOrder;
+        uint32_t resolution[3];
+        uint32_t brickCount;
+        double boundsMin[3];
+        double boundsMax[3];
+    };
+
+    AABB bounds;
+    int resolution[3];
+    int brickCount[3];
+    double voxelsPerUnit[3];
+    std::vector<uint32_t> brickIndex;  // Per cell, noBrick for cells with no stored voxels
+    std::vector<float> brickData;
+    std::vector<float> majorants;      // Per cell
+
+    DensityGrid(const AABB& bounds) : bounds(bounds) {}
+
+    void Resize()
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            brickCount[axis] = (resolution[axis] + brickSize - 1) / brickSize;
+            voxelsPerUnit[axis] = resolution[axis] / bounds.AxisInterval(axis).Size();
+        }
+
+        brickIndex.assign(size_t(brickCount[0]) * brickCount[1] * brickCount[2], noBrick);
+        brickData.clear();
+    }
+
+    size_t CellIndex(int bx, int by, int bz) const
+    {
+        return (size_t(bz) * brickCount[1] + by) * brickCount[0] + bx;
+    }
+
+    float Voxel(int i, int j, int k) const
+    {
+        // Clamps to the edge of the grid, so the density doesn't fade out inside the bounds.
+        i = std::clamp(i, 0, resolution[0] - 1);
+        j = std::clamp(j, 0, resolution[1] - 1);
+        k = std::clamp(k, 0, resolution[2] - 1);
+
+        const uint32_t brick = brickIndex[CellIndex(i / brickSize, j / brickSize, k / brickSize)];
+        if (brick == noBrick)
+            return 0;
+
+        const int x = i % brickSize, y = j % brickSize, z = k % brickSize;
+        return brickData[size_t(brick) * brickVoxels + (z * brickSize + y) * brickSize + x];
+    }
+
+    void ComputeMajorants()
+    {
+        // Interpolation inside a cell reaches one voxel past it on every side, so the majorant
+        // takes those voxels into account too.
+
+        majorants.assign(brickIndex.size(), 0.0f);
+
+        for (int bz = 0; bz < brickCount[2]; bz++)
+            for (int by = 0; by < brickCount[1]; by++)
+                for (int bx = 0; bx < brickCount[0]; bx++)
+                {
+                    float majorant = 0;
+                    for (int k = bz * brickSize - 1; k <= (bz + 1) * brickSize; k++)
+                        for (int j = by * brickSize - 1; j <= (by + 1) * brickSize; j++)
+                            for (int i = bx * brickSize - 1; i <= (bx + 1) * brickSize; i++)
+                                majorant = std::max(majorant, Voxel(i, j, k));
+
+                    majorants[CellIndex(bx, by, bz)] = majorant;
+                }
+    }
+};
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "box.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "instance.h"
+#include "primitiveBatch.h"
+#include "quad.h"
+#include "sphere.h"
+#include "triangleMesh.h"
+
+// The built-in objects are final, so a cast to their class calls them directly, and the compiler
+// can inline them into the traversal loops. The virtual functions stay as the path for any other
+// object, and for all of them when closedDispatch is off.
+
+inline bool IntersectObject(const Hittable& object, const Ray& r, const Interval& ray_t, Intersection& hit)
+{
+    switch (closedDispatch ? object.Kind() : HittableKind::Custom)
+    {
+        case HittableKind::Sphere:         return static_cast<const Sphere&>(object).Intersect(r, ray_t, hit);
+        case HittableKind::Quad:           return static_cast<const Quad&>(object).Intersect(r, ray_t, hit);
+        case HittableKind::Box:            return static_cast<const Box&>(object).Intersect(r, ray_t, hit);
+        case HittableKind::Translate:      return static_cast<const Translate&>(object).Intersect(r, ray_t, hit);
+        case HittableKind::RotateY:        return static_cast<const Rotate_Y&>(object).Intersect(r, ray_t, hit);
+        case HittableKind::Instance:       return static_cast<const Instance&>(object).Intersect(r, ray_t, hit);
+        case HittableKind::BVHNode:        return static_cast<const BVH_Node&>(object).Intersect(r, ray_t, hit);
+        case HittableKind::PrimitiveBatch: return static_cast<const PrimitiveBatch&>(object).Intersect(r, ray_t, hit);
+        case HittableKind::TriangleMesh:   return static_cast<const TriangleMesh&>(object).Intersect(r, ray_t, hit);
+        default:                           return object.Intersect(r, ray_t, hit);
+    }
+}
+
+inline void ComputeObjectSurface(const Hittable& object, const Ray& r, const Intersection& hit, int depth, HitRecord& rec)
+{
+    // Lists and BVH nodes never own a hit, so they aren't listed.
+    switch (closedDispatch ? object.Kind() : HittableKind::Custom)
+    {
+        case HittableKind::Sphere:         static_cast<const Sphere&>(object).ComputeSurface(r, hit, depth, rec); break;
+        case HittableKind::Quad:           static_cast<const Quad&>(object).ComputeSurface(r, hit, depth, rec); break;
+        case HittableKind::Box:            static_cast<const Box&>(object).ComputeSurface(r, hit, depth, rec); break;
+        case HittableKind::Translate:      static_cast<const Translate&>(object).ComputeSurface(r, hit, depth, rec); break;
+        case HittableKind::RotateY:        static_cast<const Rotate_Y&>(object).ComputeSurface(r, hit, depth, rec); break;
+        case HittableKind::Instance:       static_cast<const Instance&>(object).ComputeSurface(r, hit, depth, rec); break;
+        case HittableKind::PrimitiveBatch: static_cast<const PrimitiveBatch&>(object).ComputeSurface(r, hit, depth, rec); break;
+        case HittableKind::TriangleMesh:   static_cast<const TriangleMesh&>(object).ComputeSurface(r, hit, depth, rec); break;
+        default:                           object.ComputeSurface(r, hit, depth, rec); break;
+    }
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "densityGrid.h"
+#include "hittable.h"
+#include "material.h"
+#include "texture.h"
+
+class HeterogeneousMedium : public Hittable
+{
+public:
+    // Participating medium whose density varies through a voxel grid, scaled by densityScale,
+    // inside a closed boundary. Scattering points are found with delta tracking: distances are
+    // sampled against the majorant of each grid cell the ray crosses, and tentative collisions
+    // are kept with probability density / majorant, which is unbiased for any density. Cells
+    // with no density are skipped without sampling.
+
+    HeterogeneousMedium(shared_ptr<Hittable> boundary, shared_ptr<const DensityGrid> grid, double densityScale, shared_ptr<Texture> tex)
+        : boundary(boundary)
+        , grid(grid)
+        , densityScale(densityScale)
+        , phaseFunction(MakeObject<Isotropic>(tex))
+    {}
+
+    HeterogeneousMedium(shared_ptr<Hittable> boundary, shared_ptr<const DensityGrid> grid, double densityScale, const Color& albedo)
+        : boundary(boundary)
+        , grid(grid)
+        , densityScale(densityScale)
+        , phaseFunction(MakeObject<Isotropic>(albedo))
+    {}
+
+    HeterogeneousMedium(shared_ptr<Hittable> boundary, shared_ptr<const DensityGrid> grid, double densityScale, shared_ptr<Material> phaseFunction)
+        : boundary(boundary)
+        , grid(grid)
+        , densityScale(densityScale)
+        , phaseFunction(phaseFunction)
+    {}
+
+    bool Intersect(const Ray& r, const Interval& ray_t, Intersection& hit) const override
+    {
+        Interval span;
+        if (!boundary->Span(r, span))
+            return false;
+
+        double t1 = std::fmax(span.min, std::fmax(ray_t.min, 0.0));
+        double t2 = std::fmin(span.max, ray_t.max);
+        if (t1 >= t2)
+            return false;
+
+        // Sampled distances are in world units, the ray parameter is in direction lengths.
+        const double rayLength = r.direction().Length();
+        double collision = 0;
+
+        const bool scattered = grid->Traverse(r, Interval(t1, t2), [&](const Interval& segment, double majorant)
+        {
+            // Free flight restarts at each cell, since exponential distances have no memory.
+            const double sigmaMax = majorant * densityScale;
+            double t = segment.min;
+
+            while (true)
+            {
+                t -= std::log(1 - Random::Double()) / (sigmaMax * rayLength);
+                if (t >= segment.max)
+                    return false;
+
+                if (Random::Double() * majorant < grid->Density(r.at(t)))
+                {
+                    collision = t;
+                    return true;
+                }
+            }
+        });
+
+        if (!scattered)
+            return false;
+
+        hit.Set(collision, this);
+        return true;
+    }
+
+    void ComputeSurface(const Ray& r, const Intersection& hit, int depth, HitRecord& rec) const override
+    {
+        rec.t = hit.t;
+        rec.p = r.at(rec.t);
+
+        rec.normal = Vec3(1, 0, 0);  // arbitrary
+        rec.frontFace = true;        // also arbitrary
+        rec.u = 0;                   // so are the texture coordinates
+        rec.v = 0;
+        rec.mat = phaseFunction.get();
+    }
+
+    AABB BoundingBox() const override { return boundary->BoundingBox(); }
+    AABB BoundingBoxAt(double time) const override { return boundary->BoundingBoxAt(time); }
+
+    const shared_ptr<Hittable>& Boundary() const { return boundary; }
+    const shared_ptr<const DensityGrid>& Grid() const { return grid; }
+    double DensityScale() const { return densityScale; }
+    const shared_ptr<Material>& PhaseFunction() const { return phaseFunction; }
+
+private:
+    shared_ptr<Hittable> boundary;
+    shared_ptr<const DensityGrid> grid;  // In the space of the boundary
+    double densityScale;
+    shared_ptr<Material> phaseFunction;
+};
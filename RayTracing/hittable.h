@@ -2,16 +2,31 @@
 
 #include "aabb.h"
 
+#include <cmath>
+#include <cstdint>
+#include <type_traits>
+
+class Hittable;
 class Material;
+struct HitRecord;
+struct Intersection;
+
+// Hit an object or fill its hit record, calling the built-in kinds of objects without a virtual
+// call. Defined in dispatch.h, after every built-in object.
+inline bool IntersectObject(const Hittable& object, const Ray& r, const Interval& ray_t, Intersection& hit);
+inline void ComputeObjectSurface(const Hittable& object, const Ray& r, const Intersection& hit, int depth, HitRecord& rec);
 
 struct HitRecord
 {
     Point3 p;
     Vec3 normal;
-    shared_ptr<Material> mat;
+    const Material* mat = nullptr;  // Owned by the scene, which outlives every hit
     double t;
     double u;
     double v;
+    Vec3 dpdu;              // Change of p along u and v, zero where the surface doesn't say
+    Vec3 dpdv;
+    double footprint = 0;   // Width of the area seen by the ray around u, v, in UV units
     bool frontFace;
 
     void SetFaceNormal(const Ray& r, const Vec3& outwardNormal)
@@ -22,6 +37,89 @@ struct HitRecord
         frontFace = Dot(r.direction(), outwardNormal) < 0;
         normal = frontFace ? outwardNormal : -outwardNormal;
     }
+
+    void SetTriangleDerivatives(const Point3 (&p)[3], const double (&tu)[3], const double (&tv)[3])
+    {
+        // Sets dpdu and dpdv from the corners of a triangle and their UV coordinates, leaving
+        // them zero for UVs that don't span an area.
+
+        const double du02 = tu[0] - tu[2], du12 = tu[1] - tu[2];
+        const double dv02 = tv[0] - tv[2], dv12 = tv[1] - tv[2];
+        const double determinant = du02 * dv12 - dv02 * du12;
+        if (std::fabs(determinant) < 1e-12)
+            return;
+
+        const Vec3 dp02 = p[0] - p[2], dp12 = p[1] - p[2];
+        const double inverse = 1 / determinant;
+        dpdu = (dv12 * dp02 - dv02 * dp12) * inverse;
+        dpdv = (du02 * dp12 - du12 * dp02) * inverse;
+    }
+
+    Ray SpawnRay(const Vec3& direction, double time) const
+    {
+        // Returns a ray leaving the hit point. In float builds the rounding error of the hit
+        // point can put it on the wrong side of the surface, and the minimum ray distance alone
+        // doesn't cover it far from the origin, so the origin is pushed off the surface, to the
+        // side the ray leaves on, by a margin that grows with the size of its coordinates.
+
+        if constexpr (std::is_same<Real, double>::value)
+            return Ray(p, direction, time);
+
+        const Real magnitude = std::fmax(std::fabs(p.x()), std::fmax(std::fabs(p.y()), std::fabs(p.z())));
+        const Real offset = 32 * std::numeric_limits<Real>::epsilon() * (magnitude + 1);
+        const Vec3 side = Dot(direction, normal) < 0 ? -normal : normal;
+        return Ray(p + offset * side, direction, time);
+    }
+};
+
+struct Intersection
+{
+    // The closest hit found while tracing, with just what is needed to compute its surface
+    // afterwards. Candidate hits only write these few values, and the full hit record is
+    // computed once, for the final hit.
+
+    static constexpr int maxInstanceDepth = 8;
+
+    double t = 0;
+    const Hittable* object = nullptr;   // Object that computes the surface
+    uint32_t primitive = 0;             // Triangle, lane or record within the object
+    double b1 = 0, b2 = 0;              // Barycentric or surface coordinates of the hit
+    const Hittable* instances[maxInstanceDepth];  // Outermost transforms placing the object, by depth modulo the size
+    int instanceCount = 0;                        // Transforms placing the object, kept or not
+
+    void Set(double hitT, const Hittable* hitObject, uint32_t hitPrimitive = 0, double hitB1 = 0, double hitB2 = 0)
+    {
+        t = hitT;
+        object = hitObject;
+        primitive = hitPrimitive;
+        b1 = hitB1;
+        b2 = hitB2;
+        instanceCount = 0;
+    }
+
+    void PushInstance(const Hittable* instance)
+    {
+        // Transforms are pushed innermost first. Past the size of the array the innermost are
+        // overwritten, and their surface is found again when it is needed, see ComputeSurface.
+        instances[instanceCount % maxInstanceDepth] = instance;
+        instanceCount++;
+    }
+
+    void ComputeSurface(const Ray& r, HitRecord& rec) const { ComputeSurface(r, instanceCount, rec); }
+
+    // Computes the surface for a ray in the space of the object inside a transform, with the
+    // given number of transforms left inside that.
+    inline void ComputeSurface(const Hittable& object, const Ray& r, int depth, HitRecord& rec) const;
+
+private:
+    inline void ComputeSurface(const Ray& r, int depth, HitRecord& rec) const;
+};
+
+enum class HittableKind : uint8_t
+{
+    // Built-in objects, which IntersectObject and ComputeObjectSurface call directly. Any other
+    // object is Custom and goes through its virtual functions.
+    Custom, Sphere, Quad, Box, Translate, RotateY, Instance, BVHNode, PrimitiveBatch, TriangleMesh
 };
 
 class Hittable
@@ -29,36 +127,137 @@ class Hittable
 public:
     virtual ~Hittable() = default;
 
-    virtual bool Hit(const Ray& r, const Interval& ray_t, HitRecord& rec) const = 0;
+    // Finds the closest hit in the interval. On a hit the intersection is overwritten, otherwise
+    // it is left untouched, so a closer hit found earlier stays.
+    virtual bool Intersect(const Ray& r, const Interval& ray_t, Intersection& hit) const = 0;
+
+    // Fills the hit record for an intersection found by this object. depth is the number of
+    // instances inside this one, which transforms pass on.
+    virtual void ComputeSurface(const Ray& r, const Intersection& hit, int depth, HitRecord& rec) const {}
+
+    bool Hit(const Ray& r, const Interval& ray_t, HitRecord& rec) const
+    {
+        Intersection hit;
+        if (!IntersectObject(*this, r, ray_t, hit))
+            return false;
+
+        hit.ComputeSurface(r, rec);
+        return true;
+    }
+
+    // Finds the part of the ray line inside a closed object, which may start or end behind the
+    // origin, or the single point where it crosses an open surface. Returns false if the line
+    // misses the object.
+    virtual bool Span(const Ray& r, Interval& span) const
+    {
+        // Two closest hit queries, the first from anywhere on the line and the second past the
+        // first hit. Objects that find both crossings at once should override it.
+        Intersection enter, exit;
+        if (!IntersectObject(*this, r, Interval::universe, enter))
+            return false;
+
+        if (!IntersectObject(*this, r, Interval(enter.t + 0.0001, infinity), exit))
+            return false;
+
+        span = Interval(enter.t, exit.t);
+        return true;
+    }
+
     virtual AABB BoundingBox() const = 0;
+
+    virtual AABB BoundingBoxAt(double time) const
+    {
+        // Bounds of the object at the given time. Static objects can rely on the default, moving
+        // objects should override it so motion-aware structures can tighten their bounds.
+        return BoundingBox();
+    }
+
+    virtual AABB ClippedBoundingBox(const AABB& clip) const
+    {
+        // Bounds of the part of the object inside the clip box, used by spatial splits. Objects
+        // that can bound their clipped surface more tightly than the box overlap should override it.
+        return AABB::Overlap(BoundingBox(), clip);
+    }
+
+    HittableKind Kind() const { return kind; }
+
+protected:
+    Hittable() {}
+    explicit Hittable(HittableKind kind) : kind(kind) {}
+
+private:
+    HittableKind kind = HittableKind::Custom;
 };
 
-class Translate : public Hittable
+inline void Intersection::ComputeSurface(const Ray& r, int depth, HitRecord& rec) const
+{
+    if (depth > 0)
+        ComputeObjectSurface(*instances[(depth - 1) % maxInstanceDepth], r, *this, depth - 1, rec);
+    else
+        ComputeObjectSurface(*object, r, *this, 0, rec);
+}
+
+inline void Intersection::ComputeSurface(const Hittable& inside, const Ray& r, int depth, HitRecord& rec) const
+{
+    if (depth > 0 && depth <= instanceCount - maxInstanceDepth)
+    {
+        // The transforms inside this one were overwritten. Tracing the same ray through the
+        // object again, just around the hit, finds the hit with the transforms inside.
+        Intersection inner;
+        const Interval around(std::nextafter(Real(t), -Real(infinity)), std::nextafter(Real(t), Real(infinity)));
+        if (IntersectObject(inside, r, around, inner))
+        {
+            inner.ComputeSurface(r, rec);
+            return;
+        }
+    }
+
+    ComputeSurface(r, depth, rec);
+}
+
+class Translate final : public Hittable
 {
 public:
     Translate(shared_ptr<Hittable> object, const Vec3& offset)
-        : object(object)
+        : Hittable(HittableKind::Translate)
+        , object(object)
         , offset(offset)
     {
         bbox = object->BoundingBox() + offset;
     }
 
-    bool Hit(const Ray& r, const Interval& ray_t, HitRecord& rec) const override
+    bool Intersect(const Ray& r, const Interval& ray_t, Intersection& hit) const override
     {
         // Move the ray backwards by the offset
         const Ray offset_r(r.origin() - offset, r.direction(), r.time());
 
         // Determine whether an intersection exists along the offset ray (and if so, where)
-        if (!object->Hit(offset_r, ray_t, rec))
+        if (!IntersectObject(*object, offset_r, ray_t, hit))
             return false;
 
+        hit.PushInstance(this);
+        return true;
+    }
+
+    void ComputeSurface(const Ray& r, const Intersection& hit, int depth, HitRecord& rec) const override
+    {
+        const Ray offset_r(r.origin() - offset, r.direction(), r.time());
+        hit.ComputeSurface(*object, offset_r, depth, rec);
+
         // Move the intersection point forwards by the offset
         rec.p += offset;
+    }
 
-        return true;
+    bool Span(const Ray& r, Interval& span) const override
+    {
+        return object->Span(Ray(r.origin() - offset, r.direction(), r.time()), span);
     }
 
     AABB BoundingBox() const override { return bbox; }
+    AABB BoundingBoxAt(double time) const override { return object->BoundingBoxAt(time) + offset; }
+
+    const shared_ptr<Hittable>& GetObject() const { return object; }
+    const Vec3& Offset() const { return offset; }
 
 private:
     shared_ptr<Hittable> object;
@@ -66,48 +265,68 @@ private:
     AABB bbox;
 };
 
-class Rotate_Y : public Hittable
+class Rotate_Y final : public Hittable
 {
 public:
 
     Rotate_Y(shared_ptr<Hittable> object, double angle)
-        : object(object)
+        : Hittable(HittableKind::RotateY)
+        , object(object)
     {
         const double radians = DegToRad(angle);
         sinTheta = std::sin(radians);
         cosTheta = std::cos(radians);
-        bbox = object->BoundingBox();
+        bbox = RotateBox(object->BoundingBox());
+    }
 
-        Point3 min(infinity, infinity, infinity);
-        Point3 max(-infinity, -infinity, -infinity);
+    bool Intersect(const Ray& r, const Interval& ray_t, Intersection& hit) const override
+    {
+        // Determine whether an intersection exists in object space (and if so, where).
+        if (!IntersectObject(*object, RotateRay(r), ray_t, hit))
+            return false;
 
-        for (int i = 0; i < 2; i++)
-        {
-            for (int j = 0; j < 2; j++)
-            {
-                for (int k = 0; k < 2; k++)
-                {
-                    const double x = i * bbox.x.max + (1 - i) * bbox.x.min;
-                    const double y = j * bbox.y.max + (1 - j) * bbox.y.min;
-                    const double z = k * bbox.z.max + (1 - k) * bbox.z.min;
+        hit.PushInstance(this);
+        return true;
+    }
 
-                    const double newx = cosTheta * x + sinTheta * z;
-                    const double newz = -sinTheta * x + cosTheta * z;
+    void ComputeSurface(const Ray& r, const Intersection& hit, int depth, HitRecord& rec) const override
+    {
+        hit.ComputeSurface(*object, RotateRay(r), depth, rec);
 
-                    const Vec3 tester(newx, y, newz);
+        // Transform the intersection from object space back to world space.
+        rec.p = Point3(
+            (cosTheta * rec.p.x()) + (sinTheta * rec.p.z()),
+            rec.p.y(),
+            (-sinTheta * rec.p.x()) + (cosTheta * rec.p.z())
+        );
 
-                    for (int c = 0; c < 3; c++) {
-                        min[c] = std::fmin(min[c], tester[c]);
-                        max[c] = std::fmax(max[c], tester[c]);
-                    }
-                }
-            }
-        }
+        rec.normal = RotateBack(rec.normal);
+        rec.dpdu = RotateBack(rec.dpdu);
+        rec.dpdv = RotateBack(rec.dpdv);
+    }
+
+    bool Span(const Ray& r, Interval& span) const override { return object->Span(RotateRay(r), span); }
+
+    AABB BoundingBox() const override { return bbox; }
+    AABB BoundingBoxAt(double time) const override { return RotateBox(object->BoundingBoxAt(time)); }
 
-        bbox = AABB(min, max);
+    const shared_ptr<Hittable>& GetObject() const { return object; }
+    double SinTheta() const { return sinTheta; }
+    double CosTheta() const { return cosTheta; }
+
+private:
+    shared_ptr<Hittable> object;
+    double sinTheta;
+    double cosTheta;
+    AABB bbox;
+
+    Vec3 RotateBack(const Vec3& v) const
+    {
+        // Transform a direction from object space back to world space.
+        return Vec3((cosTheta * v.x()) + (sinTheta * v.z()), v.y(), (-sinTheta * v.x()) + (cosTheta * v.z()));
     }
 
-    bool Hit(const Ray& r, const Interval& ray_t, HitRecord& rec) const override
+    Ray RotateRay(const Ray& r) const
     {
         // Transform the ray from world space to object space.
 
@@ -123,33 +342,39 @@ public:
             (sinTheta * r.direction().x()) + (cosTheta * r.direction().z())
         );
 
-        const Ray rotated_r(origin, direction, r.time());
+        return Ray(origin, direction, r.time());
+    }
+
+    AABB RotateBox(const AABB& box) const
+    {
+        // Returns the world space bounds of the given object space box.
 
-        // Determine whether an intersection exists in object space (and if so, where).
-        if (!object->Hit(rotated_r, ray_t, rec))
-            return false;
+        Point3 min(infinity, infinity, infinity);
+        Point3 max(-infinity, -infinity, -infinity);
 
-        // Transform the intersection from object space back to world space.
-        rec.p = Point3(
-            (cosTheta * rec.p.x()) + (sinTheta * rec.p.z()),
-            rec.p.y(),
-            (-sinTheta * rec.p.x()) + (cosTheta * rec.p.z())
-        );
+        for (int i = 0; i < 2; i++)
+        {
+            for (int j = 0; j < 2; j++)
+            {
+                for (int k = 0; k < 2; k++)
+                {
+                    const double x = i * box.x.max + (1 - i) * box.x.min;
+                    const double y = j * box.y.max + (1 - j) * box.y.min;
+                    const double z = k * box.z.max + (1 - k) * box.z.min;
 
-        rec.normal = Vec3(
-            (cosTheta * rec.normal.x()) + (sinTheta * rec.normal.z()),
-            rec.normal.y(),
-            (-sinTheta * rec.normal.x()) + (cosTheta * rec.normal.z())
-        );
+                    const double newx = cosTheta * x + sinTheta * z;
+                    const double newz = -sinTheta * x + cosTheta * z;
 
-        return true;
-    }
+                    const Vec3 tester(newx, y, newz);
 
-    AABB BoundingBox() const override { return bbox; }
+                    for (int c = 0; c < 3; c++) {
+                        min[c] = std::fmin(min[c], tester[c]);
+                        max[c] = std::fmax(max[c], tester[c]);
+                    }
+                }
+            }
+        }
 
-private:
-    shared_ptr<Hittable> object;
-    double sinTheta;
-    double cosTheta;
-    AABB bbox;
+        return AABB(min, max);
+    }
 };
\ No newline at end of file
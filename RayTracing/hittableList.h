@@ -21,19 +21,37 @@ public:
         bbox = AABB(bbox, object->BoundingBox());
     }
 
-    bool Hit(const Ray& r, const Interval& ray_t, HitRecord& rec) const override
+    bool Intersect(const Ray& r, const Interval& ray_t, Intersection& hit) const override
     {
-        HitRecord temp_rec;
         bool hitAnything = false;
         double closestSoFar = ray_t.max;
 
         for (const shared_ptr<Hittable>& object : objects)
         {
-            if (object->Hit(r, Interval(ray_t.min, closestSoFar), temp_rec))
+            if (IntersectObject(*object, r, Interval(ray_t.min, closestSoFar), hit))
             {
                 hitAnything = true;
-                closestSoFar = temp_rec.t;
-                rec = temp_rec;
+                closestSoFar = hit.t;
+            }
+        }
+
+        return hitAnything;
+    }
+
+    bool Span(const Ray& r, Interval& span) const override
+    {
+        // One pass over the objects, joining their spans. That is exact for convex boundaries,
+        // such as the six quads of a box, and covers the gaps between separate objects.
+        bool hitAnything = false;
+        span = Interval::empty;
+
+        for (const shared_ptr<Hittable>& object : objects)
+        {
+            Interval objectSpan;
+            if (object->Span(r, objectSpan))
+            {
+                hitAnything = true;
+                span = Interval(span, objectSpan);
             }
         }
 
@@ -42,6 +60,15 @@ public:
 
     AABB BoundingBox() const override { return bbox; }
 
+    AABB BoundingBoxAt(double time) const override
+    {
+        AABB box;
+        for (const shared_ptr<Hittable>& object : objects)
+            box = AABB(box, object->BoundingBoxAt(time));
+
+        return box;
+    }
+
 private:
     AABB bbox;
 };
\ No newline at end of file
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "hittable.h"
+#include "matrix.h"
+
+class Instance final : public Hittable
+{
+public:
+    // Places a shared object, usually a BVH, in the world through an affine transform. The ray is
+    // transformed into object space once when entering the instance, so any number of instances
+    // can reference one copy of the object and its acceleration structure. Put instances in a BVH
+    // to get a two-level hierarchy.
+
+    Instance(shared_ptr<Hittable> object, const Matrix34& objectToWorld)
+        : Hittable(HittableKind::Instance)
+        , object(object)
+        , objectToWorld(objectToWorld)
+        , worldToObject(objectToWorld.Inverse())
+        , bbox(objectToWorld.TransformBox(object->BoundingBox()))
+    {}
+
+    static shared_ptr<Instance> Collapse(shared_ptr<Hittable> object)
+    {
+        // Folds a chain of Translate, Rotate_Y and Instance wrappers into a single instance of the
+        // innermost object, so hits only pay for one transform.
+
+        Matrix34 objectToWorld;
+
+        while (true)
+        {
+            if (auto translate = dynamic_cast<const Translate*>(object.get()))
+            {
+                objectToWorld = objectToWorld * Matrix34::Translation(translate->Offset());
+                object = translate->GetObject();
+            }
+            else if (auto rotate = dynamic_cast<const Rotate_Y*>(object.get()))
+            {
+                objectToWorld = objectToWorld * Matrix34::RotationY(rotate->SinTheta(), rotate->CosTheta());
+                object = rotate->GetObject();
+            }
+            else if (auto instance = dynamic_cast<const Instance*>(object.get()))
+            {
+                objectToWorld = objectToWorld * instance->ObjectToWorld();
+                object = instance->GetObject();
+            }
+            else
+            {
+                break;
+            }
+        }
+
+        return MakeObject<Instance>(object, objectToWorld);
+    }
+
+    bool Intersect(const Ray& r, const Interval& ray_t, Intersection& hit) const override
+    {
+        if (!IntersectObject(*object, LocalRay(r), ray_t, hit))
+            return false;
+
+        hit.PushInstance(this);
+        return true;
+    }
+
+    void ComputeSurface(const Ray& r, const Intersection& hit, int depth, HitRecord& rec) const override
+    {
+        hit.ComputeSurface(*object, LocalRay(r), depth, rec);
+
+        // Affine transforms keep the sign of Dot(direction, normal), so the face orientation set
+        // in object space still holds.
+        rec.p = r.at(rec.t);
+        rec.normal = UnitVector(worldToObject.TransformTransposed(rec.normal));
+        rec.dpdu = objectToWorld.TransformVector(rec.dpdu);
+        rec.dpdv = objectToWorld.TransformVector(rec.dpdv);
+    }
+
+    bool Span(const Ray& r, Interval& span) const override { return object->Span(LocalRay(r), span); }
+
+    AABB BoundingBox() const override { return bbox; }
+
+    AABB BoundingBoxAt(double time) const override
+    {
+        return objectToWorld.TransformBox(object->BoundingBoxAt(time));
+    }
+
+    const shared_ptr<Hittable>& GetObject() const { return object; }
+    const Matrix34& ObjectToWorld() const { return objectToWorld; }
+
+    void SetTransform(const Matrix34& transform)
+    {
+        // Moves the instance between frames of an animation. Whatever holds it has to refit its
+        // bounding box afterwards.
+        objectToWorld = transform;
+        worldToObject = transform.Inverse();
+        bbox = objectToWorld.TransformBox(object->BoundingBox());
+    }
+
+private:
+    shared_ptr<Hittable> object;
+    Matrix34 objectToWorld;
+    Matrix34 worldToObject;
+    AABB bbox;
+
+    Ray LocalRay(const Ray& r) const
+    {
+        // The object space direction isn't normalized, so the ray parameter t means the same in
+        // both spaces.
+        return Ray(worldToObject.TransformPoint(r.origin()), worldToObject.TransformVector(r.direction()), r.time());
+    }
+};
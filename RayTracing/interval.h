@@ -1,61 +1,67 @@
 #pragma once
 
-class Interval
+template<typename T>
+class IntervalT
 {
 public:
-    double min, max;
+    T min, max;
 
-    Interval() : min(+infinity), max(-infinity) {} // Default interval is empty
+    IntervalT() : min(+infinity), max(-infinity) {} // Default interval is empty
 
-    Interval(double min, double max) : min(min), max(max) {}
+    IntervalT(T min, T max) : min(min), max(max) {}
 
-    Interval(const Interval& a, const Interval& b)
+    IntervalT(const IntervalT& a, const IntervalT& b)
     {
         // Create the interval tightly enclosing the two input intervals.
         min = a.min <= b.min ? a.min : b.min;
         max = a.max >= b.max ? a.max : b.max;
     }
 
-    double Size() const
+    T Size() const
     {
         return max - min;
     }
 
-    bool Contains(double x) const
+    bool Contains(T x) const
     {
         return min <= x && x <= max;
     }
 
-    bool Surrounds(double x) const
+    bool Surrounds(T x) const
     {
         return min < x && x < max;
     }
 
-    double Clamp(double x) const
+    T Clamp(T x) const
     {
         if (x < min) return min;
         if (x > max) return max;
         return x;
     }
 
-    Interval Expand(double delta) const
+    IntervalT Expand(T delta) const
     {
-        const double padding = delta / 2;
-        return Interval(min - padding, max + padding);
+        const T padding = delta / 2;
+        return IntervalT(min - padding, max + padding);
     }
 
-    static const Interval empty, universe;
+    static const IntervalT empty, universe;
+
+    friend IntervalT operator+(const IntervalT& ival, T displacement)
+    {
+        return IntervalT(ival.min + displacement, ival.max + displacement);
+    }
+
+    friend IntervalT operator+(T displacement, const IntervalT& ival)
+    {
+        return ival + displacement;
+    }
 };
 
-const Interval Interval::empty = Interval(+infinity, -infinity);
-const Interval Interval::universe = Interval(-infinity, +infinity);
+template<typename T>
+const IntervalT<T> IntervalT<T>::empty = IntervalT<T>(+infinity, -infinity);
 
-Interval operator+(const Interval& ival, double displacement)
-{
-    return Interval(ival.min + displacement, ival.max + displacement);
-}
+template<typename T>
+const IntervalT<T> IntervalT<T>::universe = IntervalT<T>(-infinity, +infinity);
 
-Interval operator+(double displacement, const Interval& ival)
-{
-    return ival + displacement;
-}
\ No newline at end of file
+using Interval = IntervalT<Real>;
@@ -1,43 +1,101 @@
 #include "raytracing.h"
 
+#include "animation.h"
+#include "batch.h"
+#include "box.h"
 #include "bvh.h"
 #include "camera.h"
+#include "compressedMesh.h"
 #include "constantMedium.h"
+#include "densityGrid.h"
+#include "heterogeneousMedium.h"
 #include "hittable.h"
 #include "hittableList.h"
+#include "instance.h"
 #include "material.h"
+#include "meshFile.h"
+#include "meshLoader.h"
+#include "motionBvh.h"
+#include "perlin.h"
 #include "quad.h"
+#include "sbvh.h"
+#include "sceneFile.h"
+#include "sceneSnapshot.h"
+#include "sourceFiles.h"
 #include "sphere.h"
 #include "texture.h"
+#include "triangleMesh.h"
 
-void CornellSmoke()
+#include <deque>
+
+void CornellSmoke(HittableList& world, Camera& cam)
 {
-    HittableList world;
+    auto red   = MakeObject<Lambertian>(Color(.65, .05, .05));
+    auto white = MakeObject<Lambertian>(Color(.73, .73, .73));
+    auto green = MakeObject<Lambertian>(Color(.12, .45, .15));
+    auto light = MakeObject<DiffuseLight>(Color(15, 15, 15));
 
-    auto red   = make_shared<Lambertian>(Color(.65, .05, .05));
-    auto white = make_shared<Lambertian>(Color(.73, .73, .73));
-    auto green = make_shared<Lambertian>(Color(.12, .45, .15));
-    auto light = make_shared<DiffuseLight>(Color(15, 15, 15));
+    world.Add(MakeObject<Quad>(Point3(555, 0, 0),     Vec3(0, 555, 0),  Vec3(0, 0, 555),  green));
+    world.Add(MakeObject<Quad>(Point3(0, 0, 0),       Vec3(0, 555, 0),  Vec3(0, 0, 555),  red));
+    world.Add(MakeObject<Quad>(Point3(343, 554, 332), Vec3(-130, 0, 0), Vec3(0, 0, -105), light));
+    world.Add(MakeObject<Quad>(Point3(0, 0, 0),       Vec3(555, 0, 0),  Vec3(0, 0, 555),  white));
+    world.Add(MakeObject<Quad>(Point3(555, 555, 555), Vec3(-555, 0, 0), Vec3(0, 0, -555), white));
+    world.Add(MakeObject<Quad>(Point3(0, 0, 555),     Vec3(555, 0, 0),  Vec3(0, 555, 0),  white));
 
-    world.Add(make_shared<Quad>(Point3(555, 0, 0),     Vec3(0, 555, 0),  Vec3(0, 0, 555),  green));
-    world.Add(make_shared<Quad>(Point3(0, 0, 0),       Vec3(0, 555, 0),  Vec3(0, 0, 555),  red));
-    world.Add(make_shared<Quad>(Point3(343, 554, 332), Vec3(-130, 0, 0), Vec3(0, 0, -105), light));
-    world.Add(make_shared<Quad>(Point3(0, 0, 0),       Vec3(555, 0, 0),  Vec3(0, 0, 555),  white));
-    world.Add(make_shared<Quad>(Point3(555, 555, 555), Vec3(-555, 0, 0), Vec3(0, 0, -555), white));
-    world.Add(make_shared<Quad>(Point3(0, 0, 555),     Vec3(555, 0, 0),  Vec3(0, 555, 0),  white));
+    shared_ptr<Hittable> box1 = MakeObject<Box>(Point3(0, 0, 0), Point3(165, 330, 165), white);
+    box1 = MakeObject<Rotate_Y>(box1, 15);
+    box1 = MakeObject<Translate>(box1, Vec3(265, 0, 295));
 
-    shared_ptr<Hittable> box1 = Box(Point3(0, 0, 0), Point3(165, 330, 165), white);
-    box1 = make_shared<Rotate_Y>(box1, 15);
-    box1 = make_shared<Translate>(box1, Vec3(265, 0, 295));
+    shared_ptr<Hittable> box2 = MakeObject<Box>(Point3(0, 0, 0), Point3(165, 165, 165), white);
+    box2 = MakeObject<Rotate_Y>(box2, -18);
+    box2 = MakeObject<Translate>(box2, Vec3(130, 0, 65));
 
-    shared_ptr<Hittable> box2 = Box(Point3(0, 0, 0), Point3(165, 165, 165), white);
-    box2 = make_shared<Rotate_Y>(box2, -18);
-    box2 = make_shared<Translate>(box2, Vec3(130, 0, 65));
+    world.Add(MakeObject<ConstantMedium>(Instance::Collapse(box1), 0.01, Color(0, 0, 0)));
+    world.Add(MakeObject<ConstantMedium>(Instance::Collapse(box2), 0.01, Color(1, 1, 1)));
 
-    world.Add(make_shared<ConstantMedium>(box1, 0.01, Color(0, 0, 0)));
-    world.Add(make_shared<ConstantMedium>(box2, 0.01, Color(1, 1, 1)));
+    cam.aspectRatio = 1.0;
+    cam.imageWidth = 600;
+    cam.samplesPerPixel = 50;
+    cam.maxDepth = 50;
+    cam.background = Color(0, 0, 0);
 
-    Camera cam;
+    cam.vfov = 40;
+    cam.lookFrom = Point3(278, 278, -800);
+    cam.lookAt = Point3(278, 278, 0);
+    cam.up = Vec3(0, 1, 0);
+
+    cam.defocusAngle = 0;
+}
+
+void CornellCloud(HittableList& world, Camera& cam)
+{
+    auto red   = MakeObject<Lambertian>(Color(.65, .05, .05));
+    auto white = MakeObject<Lambertian>(Color(.73, .73, .73));
+    auto green = MakeObject<Lambertian>(Color(.12, .45, .15));
+    auto light = MakeObject<DiffuseLight>(Color(15, 15, 15));
+
+    world.Add(MakeObject<Quad>(Point3(555, 0, 0),     Vec3(0, 555, 0),  Vec3(0, 0, 555),  green));
+    world.Add(MakeObject<Quad>(Point3(0, 0, 0),       Vec3(0, 555, 0),  Vec3(0, 0, 555),  red));
+    world.Add(MakeObject<Quad>(Point3(343, 554, 332), Vec3(-130, 0, 0), Vec3(0, 0, -105), light));
+    world.Add(MakeObject<Quad>(Point3(0, 0, 0),       Vec3(555, 0, 0),  Vec3(0, 0, 555),  white));
+    world.Add(MakeObject<Quad>(Point3(555, 555, 555), Vec3(-555, 0, 0), Vec3(0, 0, -555), white));
+    world.Add(MakeObject<Quad>(Point3(0, 0, 555),     Vec3(555, 0, 0),  Vec3(0, 555, 0),  white));
+
+    // A ball of turbulence that thins out towards its edge. A grid converted with
+    // --convert-volume can be loaded instead with DensityGrid::Load.
+    const Point3 center(278, 240, 278);
+    const double radius = 190;
+    const AABB bounds(center - Vec3(radius, radius, radius), center + Vec3(radius, radius, radius));
+    const Perlin noise;
+
+    auto grid = DensityGrid::Sample(bounds, 96, 96, 96, [&](const Point3& p)
+    {
+        const double falloff = 1 - (p - center).LengthSquared() / (radius * radius);
+        return 2 * falloff + 2 * noise.Turb(0.012 * p, 6) - 1.2;
+    });
+
+    auto boundary = MakeObject<Box>(Point3(bounds.x.min, bounds.y.min, bounds.z.min), Point3(bounds.x.max, bounds.y.max, bounds.z.max), white);
+    world.Add(MakeObject<HeterogeneousMedium>(boundary, grid, 0.03, Color(.9, .9, .9)));
 
     cam.aspectRatio = 1.0;
     cam.imageWidth = 600;
@@ -51,41 +109,90 @@ void CornellSmoke()
     cam.up = Vec3(0, 1, 0);
 
     cam.defocusAngle = 0;
-
-    cam.Render(world);
 }
 
-void CornellBox()
+void CornellMesh(HittableList& world, Camera& cam)
 {
-    HittableList world;
+    auto red   = MakeObject<Lambertian>(Color(.65, .05, .05));
+    auto white = MakeObject<Lambertian>(Color(.73, .73, .73));
+    auto green = MakeObject<Lambertian>(Color(.12, .45, .15));
+    auto light = MakeObject<DiffuseLight>(Color(15, 15, 15));
+
+    world.Add(MakeObject<Quad>(Point3(555, 0, 0),     Vec3(0, 555, 0),  Vec3(0, 0, 555),  green));
+    world.Add(MakeObject<Quad>(Point3(0, 0, 0),       Vec3(0, 555, 0),  Vec3(0, 0, 555),  red));
+    world.Add(MakeObject<Quad>(Point3(343, 554, 332), Vec3(-130, 0, 0), Vec3(0, 0, -105), light));
+    world.Add(MakeObject<Quad>(Point3(0, 0, 0),       Vec3(555, 0, 0),  Vec3(0, 0, 555),  white));
+    world.Add(MakeObject<Quad>(Point3(555, 555, 555), Vec3(-555, 0, 0), Vec3(0, 0, -555), white));
+    world.Add(MakeObject<Quad>(Point3(0, 0, 555),     Vec3(555, 0, 0),  Vec3(0, 555, 0),  white));
+
+    // The model is converted to a mesh file on first use, later runs map it directly.
+    shared_ptr<TriangleMesh> mesh = MeshFile::Load("bunny.rtmesh", white);
+    if (!mesh)
+    {
+        MeshData meshData;
+        if (MeshLoader::Load("bunny.ply", meshData))
+        {
+            mesh = MakeObject<TriangleMesh>(std::move(meshData), white);
+            MeshFile::Write("bunny.rtmesh", *mesh);
+        }
+    }
 
-    auto red   = make_shared<Lambertian>(Color(.65, .05, .05));
-    auto white = make_shared<Lambertian>(Color(.73, .73, .73));
-    auto green = make_shared<Lambertian>(Color(.12, .45, .15));
-    auto light = make_shared<DiffuseLight>(Color(15, 15, 15));
-
-    world.Add(make_shared<Quad>(Point3(555, 0, 0),     Vec3(0, 555, 0),  Vec3(0, 0, 555),  green));
-    world.Add(make_shared<Quad>(Point3(0, 0, 0),       Vec3(0, 555, 0),  Vec3(0, 0, 555),  red));
-    world.Add(make_shared<Quad>(Point3(343, 554, 332), Vec3(-130, 0, 0), Vec3(0, 0, -105), light));
-    world.Add(make_shared<Quad>(Point3(0, 0, 0),       Vec3(555, 0, 0),  Vec3(0, 0, 555),  white));
-    world.Add(make_shared<Quad>(Point3(555, 555, 555), Vec3(-555, 0, 0), Vec3(0, 0, -555), white));
-    world.Add(make_shared<Quad>(Point3(0, 0, 555),     Vec3(555, 0, 0),  Vec3(0, 555, 0),  white));
-
-    shared_ptr<Hittable> box1 = Box(Point3(0, 0, 0), Point3(165, 330, 165), white);
-    box1 = make_shared<Rotate_Y>(box1, 15);
-    box1 = make_shared<Translate>(box1, Vec3(265, 0, 295));
-    world.Add(box1);
-
-    /*shared_ptr<Hittable> box2 = Box(Point3(0, 0, 0), Point3(165, 165, 165), white);
-    box2 = make_shared<Rotate_Y>(box2, -18);
-    box2 = make_shared<Translate>(box2, Vec3(130, 0, 65));
+    if (mesh)
+    {
+        // Scale the model to fit a 300 unit cube and stand it on the floor, in the middle.
+        const AABB bounds = mesh->BoundingBox();
+        const double size = std::fmax(bounds.x.Size(), std::fmax(bounds.y.Size(), bounds.z.Size()));
+        const double scale = 300 / size;
+        const Point3 center = bounds.Center();
+
+        const Matrix34 objectToWorld = Matrix34::Translation(Vec3(278, 0, 278))
+            * Matrix34::RotationY(180)
+            * Matrix34::Scale(Vec3(scale, scale, scale))
+            * Matrix34::Translation(Vec3(-center.x(), -bounds.y.min, -center.z()));
+        world.Add(MakeObject<Instance>(mesh, objectToWorld));
+    }
+
+    cam.aspectRatio = 1.0;
+    cam.imageWidth = 400;
+    cam.samplesPerPixel = 200;
+    cam.maxDepth = 50;
+    cam.background = Color(0, 0, 0);
+
+    cam.vfov = 40;
+    cam.lookFrom = Point3(278, 278, -800);
+    cam.lookAt = Point3(278, 278, 0);
+    cam.up = Vec3(0, 1, 0);
+
+    cam.defocusAngle = 0;
+}
+
+void CornellBox(HittableList& world, Camera& cam)
+{
+    auto red   = MakeObject<Lambertian>(Color(.65, .05, .05));
+    auto white = MakeObject<Lambertian>(Color(.73, .73, .73));
+    auto green = MakeObject<Lambertian>(Color(.12, .45, .15));
+    auto light = MakeObject<DiffuseLight>(Color(15, 15, 15));
+
+    world.Add(MakeObject<Quad>(Point3(555, 0, 0),     Vec3(0, 555, 0),  Vec3(0, 0, 555),  green));
+    world.Add(MakeObject<Quad>(Point3(0, 0, 0),       Vec3(0, 555, 0),  Vec3(0, 0, 555),  red));
+    world.Add(MakeObject<Quad>(Point3(343, 554, 332), Vec3(-130, 0, 0), Vec3(0, 0, -105), light));
+    world.Add(MakeObject<Quad>(Point3(0, 0, 0),       Vec3(555, 0, 0),  Vec3(0, 0, 555),  white));
+    world.Add(MakeObject<Quad>(Point3(555, 555, 555), Vec3(-555, 0, 0), Vec3(0, 0, -555), white));
+    world.Add(MakeObject<Quad>(Point3(0, 0, 555),     Vec3(555, 0, 0),  Vec3(0, 555, 0),  white));
+
+    shared_ptr<Hittable> box1 = MakeObject<Box>(Point3(0, 0, 0), Point3(165, 330, 165), white);
+    box1 = MakeObject<Rotate_Y>(box1, 15);
+    box1 = MakeObject<Translate>(box1, Vec3(265, 0, 295));
+    world.Add(Instance::Collapse(box1));
+
+    /*shared_ptr<Hittable> box2 = MakeObject<Box>(Point3(0, 0, 0), Point3(165, 165, 165), white);
+    box2 = MakeObject<Rotate_Y>(box2, -18);
+    box2 = MakeObject<Translate>(box2, Vec3(130, 0, 65));
     world.Add(box2);*/
 
     // Glass Sphere
-    auto glass = make_shared<Dielectric>(1.5);
-    world.Add(make_shared<Sphere>(Point3(190, 90, 190), 90, glass));
-
-    Camera cam;
+    auto glass = MakeObject<Dielectric>(1.5);
+    world.Add(MakeObject<Sphere>(Point3(190, 90, 190), 90, glass));
 
     cam.aspectRatio = 1.0;
     cam.imageWidth = 100;
@@ -99,23 +206,32 @@ void CornellBox()
     cam.up = Vec3(0, 1, 0);
 
     cam.defocusAngle = 0;
-
-    cam.Render(world);
 }
 
-void SimpleLight()
+// Voxels along the longest side of the baked noise of the Perlin scenes, or zero to evaluate the
+// noise exactly at every hit.
+constexpr int noiseBakeResolution = 0;
+
+void BakeNoise(NoiseTexture& texture, const AABB& bounds)
 {
-    HittableList world;
+    if (noiseBakeResolution <= 0)
+        return;
 
-    auto pertext = make_shared<NoiseTexture>(4);
-    world.Add(make_shared<Sphere>(Point3(0, -1000, 0), 1000, make_shared<Lambertian>(pertext)));
-    world.Add(make_shared<Sphere>(Point3(0, 2, 0), 2, make_shared<Lambertian>(pertext)));
+    const NoiseTexture::BakeStats stats = texture.Bake(bounds, noiseBakeResolution);
+    std::clog << "Baked noise: " << stats.bytes / (1024 * 1024) << " MB, turbulence error "
+        << stats.rmsError << " RMS, " << stats.maxError << " max\n";
+}
 
-    auto difflight = make_shared<DiffuseLight>(Color(4, 4, 4));
-    world.Add(make_shared<Sphere>(Point3(0, 7, 0), 2, difflight));
-    world.Add(make_shared<Quad>(Point3(3, 1, -2), Vec3(2, 0, 0), Vec3(0, 2, 0), difflight));
+void SimpleLight(HittableList& world, Camera& cam)
+{
+    auto pertext = MakeObject<NoiseTexture>(4);
+    BakeNoise(*pertext, AABB(Point3(-4, -0.1, -4), Point3(4, 4.1, 4)));  // The sphere and the ground around it
+    world.Add(MakeObject<Sphere>(Point3(0, -1000, 0), 1000, MakeObject<Lambertian>(pertext)));
+    world.Add(MakeObject<Sphere>(Point3(0, 2, 0), 2, MakeObject<Lambertian>(pertext)));
 
-    Camera cam;
+    auto difflight = MakeObject<DiffuseLight>(Color(4, 4, 4));
+    world.Add(MakeObject<Sphere>(Point3(0, 7, 0), 2, difflight));
+    world.Add(MakeObject<Quad>(Point3(3, 1, -2), Vec3(2, 0, 0), Vec3(0, 2, 0), difflight));
 
     cam.aspectRatio = 16.0 / 9.0;
     cam.imageWidth = 400;
@@ -129,29 +245,23 @@ void SimpleLight()
     cam.up = Vec3(0, 1, 0);
 
     cam.defocusAngle = 0;
-
-    cam.Render(world);
 }
 
-void Quads()
+void Quads(HittableList& world, Camera& cam)
 {
-    HittableList world;
-
     // Materials
-    auto leftRed     = make_shared<Lambertian>(Color(1.0, 0.2, 0.2));
-    auto backGreen   = make_shared<Lambertian>(Color(0.2, 1.0, 0.2));
-    auto rightBlue   = make_shared<Lambertian>(Color(0.2, 0.2, 1.0));
-    auto upperOrange = make_shared<Lambertian>(Color(1.0, 0.5, 0.0));
-    auto lowerTeal   = make_shared<Lambertian>(Color(0.2, 0.8, 0.8));
+    auto leftRed     = MakeObject<Lambertian>(Color(1.0, 0.2, 0.2));
+    auto backGreen   = MakeObject<Lambertian>(Color(0.2, 1.0, 0.2));
+    auto rightBlue   = MakeObject<Lambertian>(Color(0.2, 0.2, 1.0));
+    auto upperOrange = MakeObject<Lambertian>(Color(1.0, 0.5, 0.0));
+    auto lowerTeal   = MakeObject<Lambertian>(Color(0.2, 0.8, 0.8));
 
     // Quads
-    world.Add(make_shared<Quad>(Point3(-3, -2, 5), Vec3(0, 0,-4), Vec3(0, 4, 0), leftRed));
-    world.Add(make_shared<Quad>(Point3(-2, -2, 0), Vec3(4, 0, 0), Vec3(0, 4, 0), backGreen));
-    world.Add(make_shared<Quad>(Point3( 3, -2, 1), Vec3(0, 0, 4), Vec3(0, 4, 0), rightBlue));
-    world.Add(make_shared<Quad>(Point3(-2,  3, 1), Vec3(4, 0, 0), Vec3(0, 0, 4), upperOrange));
-    world.Add(make_shared<Quad>(Point3(-2, -3, 5), Vec3(4, 0, 0), Vec3(0, 0,-4), lowerTeal));
-
-    Camera cam;
+    world.Add(MakeObject<Quad>(Point3(-3, -2, 5), Vec3(0, 0,-4), Vec3(0, 4, 0), leftRed));
+    world.Add(MakeObject<Quad>(Point3(-2, -2, 0), Vec3(4, 0, 0), Vec3(0, 4, 0), backGreen));
+    world.Add(MakeObject<Quad>(Point3( 3, -2, 1), Vec3(0, 0, 4), Vec3(0, 4, 0), rightBlue));
+    world.Add(MakeObject<Quad>(Point3(-2,  3, 1), Vec3(4, 0, 0), Vec3(0, 0, 4), upperOrange));
+    world.Add(MakeObject<Quad>(Point3(-2, -3, 5), Vec3(4, 0, 0), Vec3(0, 0,-4), lowerTeal));
 
     cam.aspectRatio = 1.0;
     cam.imageWidth = 400;
@@ -165,19 +275,14 @@ void Quads()
     cam.up = Vec3(0, 1, 0);
 
     cam.defocusAngle = 0;
-
-    cam.Render(world);
 }
 
-void PerlinSpheres()
+void PerlinSpheres(HittableList& world, Camera& cam)
 {
-    HittableList world;
-
-    auto pertext = make_shared<NoiseTexture>(4);
-    world.Add(make_shared<Sphere>(Point3(0, -1000, 0), 1000, make_shared<Lambertian>(pertext)));
-    world.Add(make_shared<Sphere>(Point3(0, 2, 0), 2, make_shared<Lambertian>(pertext)));
-
-    Camera cam;
+    auto pertext = MakeObject<NoiseTexture>(4);
+    BakeNoise(*pertext, AABB(Point3(-4, -0.1, -4), Point3(4, 4.1, 4)));  // The sphere and the ground around it
+    world.Add(MakeObject<Sphere>(Point3(0, -1000, 0), 1000, MakeObject<Lambertian>(pertext)));
+    world.Add(MakeObject<Sphere>(Point3(0, 2, 0), 2, MakeObject<Lambertian>(pertext)));
 
     cam.aspectRatio = 16.0 / 9.0;
     cam.imageWidth = 400;
@@ -191,17 +296,14 @@ void PerlinSpheres()
     cam.up = Vec3(0, 1, 0);
 
     cam.defocusAngle = 0;
-
-    cam.Render(world);
 }
 
-void Earth()
+void Earth(HittableList& world, Camera& cam)
 {
-    auto earthTexture = make_shared<ImageTexture>("earthmap.jpg");
-    auto earthSurface = make_shared<Lambertian>(earthTexture);
-    auto globe = make_shared<Sphere>(Point3(0, 0, 0), 2, earthSurface);
-
-    Camera cam;
+    auto earthTexture = MakeObject<ImageTexture>("earthmap.jpg");
+    auto earthSurface = MakeObject<Lambertian>(earthTexture);
+    auto globe = MakeObject<Sphere>(Point3(0, 0, 0), 2, earthSurface);
+    world.Add(globe);
 
     cam.aspectRatio = 16.0 / 9.0;
     cam.imageWidth = 400;
@@ -215,18 +317,14 @@ void Earth()
     cam.up = Vec3(0, 1, 0);
 
     cam.defocusAngle = 0;
-
-    cam.Render(HittableList(globe));
 }
 
-void BouncingSpheres()
+void BouncingSpheres(HittableList& world, Camera& cam)
 {
-    HittableList world;
+    shared_ptr<Texture> checker = MakeObject<CheckerTexture>(0.32, Color(.2, .3, .1), Color(.9, .9, .9));
+    shared_ptr<Material> ground_material = MakeObject<Lambertian>(checker);
 
-    shared_ptr<Texture> checker = make_shared<CheckerTexture>(0.32, Color(.2, .3, .1), Color(.9, .9, .9));
-    shared_ptr<Material> ground_material = make_shared<Lambertian>(checker);
-
-    world.Add(make_shared<Sphere>(Point3(0, -1000, 0), 1000, ground_material));
+    world.Add(MakeObject<Sphere>(Point3(0, -1000, 0), 1000, ground_material));
 
     for (int a = -11; a < 11; a++) {
         for (int b = -11; b < 11; b++) {
@@ -239,38 +337,36 @@ void BouncingSpheres()
                 if (choose_mat < 0.8) {
                     // diffuse
                     const Color albedo = Color::Random() * Color::Random();
-                    Sphere_material = make_shared<Lambertian>(albedo);
+                    Sphere_material = MakeObject<Lambertian>(albedo);
                     const Vec3 center2 = center + Vec3(0, Random::Double(0, .5), 0);
-                    world.Add(make_shared<Sphere>(center, center2, 0.2, Sphere_material));
+                    world.Add(MakeObject<Sphere>(center, center2, 0.2, Sphere_material));
                 }
                 else if (choose_mat < 0.95) {
                     // metal
                     const Color albedo = Color::Random(0.5, 1);
                     const double fuzz = Random::Double(0, 0.5);
-                    Sphere_material = make_shared<Metal>(albedo, fuzz);
-                    world.Add(make_shared<Sphere>(center, 0.2, Sphere_material));
+                    Sphere_material = MakeObject<Metal>(albedo, fuzz);
+                    world.Add(MakeObject<Sphere>(center, 0.2, Sphere_material));
                 }
                 else {
                     // glass
-                    Sphere_material = make_shared<Dielectric>(1.5);
-                    world.Add(make_shared<Sphere>(center, 0.2, Sphere_material));
+                    Sphere_material = MakeObject<Dielectric>(1.5);
+                    world.Add(MakeObject<Sphere>(center, 0.2, Sphere_material));
                 }
             }
         }
     }
 
-    auto material1 = make_shared<Dielectric>(1.5);
-    world.Add(make_shared<Sphere>(Point3(0, 1, 0), 1.0, material1));
+    auto material1 = MakeObject<Dielectric>(1.5);
+    world.Add(MakeObject<Sphere>(Point3(0, 1, 0), 1.0, material1));
 
-    auto material2 = make_shared<Lambertian>(Color(0.4, 0.2, 0.1));
-    world.Add(make_shared<Sphere>(Point3(-4, 1, 0), 1.0, material2));
+    auto material2 = MakeObject<Lambertian>(Color(0.4, 0.2, 0.1));
+    world.Add(MakeObject<Sphere>(Point3(-4, 1, 0), 1.0, material2));
 
-    auto material3 = make_shared<Metal>(Color(0.7, 0.6, 0.5), 0.0);
-    world.Add(make_shared<Sphere>(Point3(4, 1, 0), 1.0, material3));
+    auto material3 = MakeObject<Metal>(Color(0.7, 0.6, 0.5), 0.0);
+    world.Add(MakeObject<Sphere>(Point3(4, 1, 0), 1.0, material3));
 
-    world = HittableList(make_shared<BVH_Node>(world));
-
-    Camera cam;
+    world = HittableList(MakeObject<MotionBVH>(world));
 
     cam.aspectRatio = 16.0 / 9.0;
     cam.imageWidth = 400;
@@ -285,20 +381,14 @@ void BouncingSpheres()
 
     cam.defocusAngle = 0.6;
     cam.focusDist = 10.0;
-
-    cam.Render(world);
 }
 
-void CheckeredSpheres()
+void CheckeredSpheres(HittableList& world, Camera& cam)
 {
-    HittableList world;
-
-    auto checker = make_shared<CheckerTexture>(0.32, Color(.2, .3, .1), Color(.9, .9, .9));
+    auto checker = MakeObject<CheckerTexture>(0.32, Color(.2, .3, .1), Color(.9, .9, .9));
 
-    world.Add(make_shared<Sphere>(Point3(0, -10, 0), 10, make_shared<Lambertian>(checker)));
-    world.Add(make_shared<Sphere>(Point3(0, 10, 0), 10, make_shared<Lambertian>(checker)));
-
-    Camera cam;
+    world.Add(MakeObject<Sphere>(Point3(0, -10, 0), 10, MakeObject<Lambertian>(checker)));
+    world.Add(MakeObject<Sphere>(Point3(0, 10, 0), 10, MakeObject<Lambertian>(checker)));
 
     cam.aspectRatio = 16.0 / 9.0;
     cam.imageWidth = 400;
@@ -312,21 +402,459 @@ void CheckeredSpheres()
     cam.up = Vec3(0, 1, 0);
 
     cam.defocusAngle = 0;
+}
 
-    cam.Render(world);
+bool BuildScene(int scene, SceneArena& arena, HittableList& world, Camera& cam)
+{
+    // Every object of the scene is made in the arena, which has to outlive the world. Returns
+    // false, building nothing, if there is no scene with that number.
+    const SceneArena::Scope arenaScope(arena);
+
+    switch (scene)
+    {
+        case 1: BouncingSpheres(world, cam);  break;
+        case 2: CheckeredSpheres(world, cam); break;
+        case 3: Earth(world, cam);            break;
+        case 4: PerlinSpheres(world, cam);    break;
+        case 5: Quads(world, cam);            break;
+        case 6: SimpleLight(world, cam);      break;
+        case 7: CornellBox(world, cam);       break;
+        case 8: CornellSmoke(world, cam);     break;
+        case 9: CornellMesh(world, cam);      break;
+        case 10: CornellCloud(world, cam);    break;
+        default: return false;
+    }
+
+    return true;
 }
 
-int main()
+int ConvertMesh(const char* source, const char* destination)
 {
-    switch (7)
+    // Converts an OBJ or PLY model to a mesh file, including its BVH.
+
+    MeshData meshData;
+    if (!MeshLoader::Load(source, meshData))
+        return 1;
+
+    const TriangleMesh mesh(std::move(meshData), nullptr);
+    if (!MeshFile::Write(destination, mesh))
     {
-        case 1: BouncingSpheres();  break;
-        case 2: CheckeredSpheres(); break;
-        case 3: Earth();            break;
-        case 4: PerlinSpheres();    break;
-        case 5: Quads();            break;
-        case 6: SimpleLight();      break;
-        case 7: CornellBox();       break;
-        case 8: CornellSmoke();     break;
+        std::cerr << "ERROR: Could not write mesh file '" << destination << "'.\n";
+        return 1;
     }
+
+    std::clog << "Converted " << mesh.View().triangleCount << " triangles, " << mesh.View().vertexCount
+        << " vertices and " << mesh.NodeCount() << " BVH nodes to '" << destination << "'.\n";
+    return 0;
+}
+
+int ConvertVolume(const char* source, int nx, int ny, int nz, const char* destination)
+{
+    // Converts a dense grid of 32-bit floats to a sparse volume file, over the unit cube.
+
+    auto grid = DensityGrid::LoadRaw(source, AABB(Point3(0, 0, 0), Point3(1, 1, 1)), nx, ny, nz);
+    if (!grid)
+    {
+        std::cerr << "ERROR: Could not load volume '" << source << "'.\n";
+        return 1;
+    }
+
+    if (!DensityGrid::Write(destination, *grid))
+    {
+        std::cerr << "ERROR: Could not write volume file '" << destination << "'.\n";
+        return 1;
+    }
+
+    std::clog << "Converted " << nx << "x" << ny << "x" << nz << " voxels to " << grid->BrickCount() << " of "
+        << grid->CellCount() << " bricks in '" << destination << "'.\n";
+    return 0;
+}
+
+int ConvertTexture(const char* source, const char* destination)
+{
+    // Converts an image to a tile file, which scenes can name in place of the image.
+
+    const std::string path = rtw_image::find(source);
+    uint64_t sourceStamp;
+    if (path.empty() || !TiledImage::SourceStamp(path, sourceStamp))
+    {
+        std::cerr << "ERROR: Could not find image '" << source << "'.\n";
+        return 1;
+    }
+
+    auto image = TiledImage::Decode(path);
+    if (!image)
+        return 1;
+
+    if (!image->Write(destination, sourceStamp))
+    {
+        std::cerr << "ERROR: Could not write tile file '" << destination << "'.\n";
+        return 1;
+    }
+
+    std::clog << "Converted " << image->Width() << "x" << image->Height() << " pixels to " << image->LevelCount()
+        << " levels of " << image->TileCount() << " tiles in '" << destination << "'.\n";
+    return 0;
+}
+
+int DumpPreview(const char* name, const char* destination)
+{
+    // Writes the current frame of a progressive render's preview to a binary PPM file.
+
+    PreviewBuffer preview;
+    if (!preview.Attach(name))
+    {
+        std::cerr << "ERROR: Could not attach to preview '" << name << "'.\n";
+        return 1;
+    }
+
+    // A read only fails if the renderer published twice during it, so it soon succeeds.
+    std::vector<unsigned char> pixels;
+    int samples;
+    uint64_t sequence;
+    while (!preview.Read(pixels, samples, sequence)) {}
+
+    std::ofstream out(destination, std::ios::binary);
+    out << "P6\n" << preview.Width() << ' ' << preview.Height() << "\n255\n";
+    out.write(reinterpret_cast<const char*>(pixels.data()), std::streamsize(pixels.size()));
+    if (!out)
+    {
+        std::cerr << "ERROR: Could not write image file '" << destination << "'.\n";
+        return 1;
+    }
+
+    std::clog << "Wrote frame " << sequence << " at " << samples << " samples per pixel to '" << destination << "'.\n";
+    return 0;
+}
+
+int RenderTurntable(int scene, int frameCount, const char* prefix)
+{
+    // Renders a scene from a camera circling its look at point once over the frames.
+
+    SceneArena arena;
+    Sequence sequence;
+    Camera cam;
+    if (!BuildScene(scene, arena, sequence.world, cam))
+    {
+        std::cerr << "ERROR: Unknown scene " << scene << ".\n";
+        return 1;
+    }
+
+    // Keys on a circle are joined by straight lines, so there are enough to look round.
+    const Vec3 offset = cam.lookFrom - cam.lookAt;
+    const int keyCount = 64;
+    for (int key = 0; key <= keyCount; key++)
+    {
+        const Matrix34 turn = Matrix34::RotationY(360.0 * key / keyCount);
+        sequence.camera.lookFrom.Add(double(frameCount) * key / keyCount, cam.lookAt + turn.TransformVector(offset));
+    }
+
+    return sequence.Render(cam, frameCount, prefix) ? 0 : 1;
+}
+
+int RenderSceneFile(const char* filename)
+{
+    // Renders a scene file to standard output, timing its parse, build and BVH apart.
+
+    SceneArena arena;
+    SceneFile file;
+    HittableList world;
+    Camera cam;
+    {
+        const SceneArena::Scope arenaScope(arena);
+        if (!file.Parse(filename))
+            return 1;
+
+        file.Build(world, cam);
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    SceneCompiler compiler;
+    const shared_ptr<Hittable> compiled = compiler.Compile(world);
+    file.timings.bvh = SceneFile::SecondsSince(start);
+
+    compiler.LogStats(std::clog);
+    std::clog << file.ObjectCount() << " objects. ";
+    file.timings.Log(std::clog);
+
+    cam.compileScene = false;
+    cam.Render(compiled ? *compiled : world);
+    return 0;
+}
+
+int ConvertScene(const char* source, const char* destination)
+{
+    // Converts a text scene file to the binary format, which loads without parsing numbers.
+
+    SceneFile file;
+    if (!file.Parse(source))
+        return 1;
+
+    if (!file.WriteBinary(destination))
+    {
+        std::cerr << "ERROR: Could not write scene file '" << destination << "'.\n";
+        return 1;
+    }
+
+    std::clog << "Converted " << file.ObjectCount() << " objects to '" << destination << "' in " << file.timings.parse << "s.\n";
+    return 0;
+}
+
+int RenderBatch(const char* filename)
+{
+    // Renders the jobs of a job file, naming the scenes of main by number, or scene files.
+
+    std::deque<SceneArena> arenas;  // One per scene, outliving the renderer
+    BatchRenderer batch([&arenas](const std::string& name, HittableList& world, Camera& cam)
+    {
+        char* end;
+        const long scene = std::strtol(name.c_str(), &end, 10);
+        arenas.emplace_back();
+
+        if (*end != 0)
+        {
+            SceneFile file;
+            const SceneArena::Scope arenaScope(arenas.back());
+            if (!file.Parse(name))
+                return false;
+
+            file.Build(world, cam);
+            return true;
+        }
+
+        if (scene < 1 || scene > 10)
+            return false;
+
+        return BuildScene(int(scene), arenas.back(), world, cam);
+    });
+
+    if (!batch.Load(filename))
+        return 1;
+
+    return batch.Run() ? 0 : 1;
+}
+
+double MeasureRays(const Hittable& object, const std::vector<Ray>& rays, size_t& hits)
+{
+    // Returns the millions of rays traced per second.
+    hits = 0;
+    const auto start = clock();
+    for (const Ray& r : rays)
+    {
+        HitRecord rec;
+        if (object.Hit(r, Interval(0.001, infinity), rec))
+            hits++;
+    }
+    const double elapsed = double(clock() - start) / CLOCKS_PER_SEC;
+    return elapsed > 0 ? rays.size() / elapsed * 1e-6 : 0;
+}
+
+int MeshStats(const char* filename)
+{
+    // Compares the memory and tracing speed of a mesh with its compressed versions.
+
+    shared_ptr<TriangleMesh> mesh = MeshFile::Load(filename, nullptr);
+    if (!mesh)
+    {
+        MeshData meshData;
+        if (!MeshLoader::Load(filename, meshData))
+            return 1;
+        mesh = make_shared<TriangleMesh>(std::move(meshData), nullptr);
+    }
+
+    const CompressedMesh<uint8_t> mesh8(*mesh);
+    const CompressedMesh<uint16_t> mesh16(*mesh);
+    mesh8.LogStats(std::clog);
+    mesh16.LogStats(std::clog);
+
+    // Rays from a sphere around the mesh towards random points inside its bounds.
+    const AABB bounds = mesh->BoundingBox();
+    const Vec3 size(bounds.x.Size(), bounds.y.Size(), bounds.z.Size());
+    const Point3 center = bounds.Center();
+
+    std::vector<Ray> rays(1000000);
+    for (Ray& r : rays)
+    {
+        const Point3 origin = center + size.Length() * Random::UnitVector();
+        const Point3 target = Point3(bounds.x.min, bounds.y.min, bounds.z.min)
+            + Vec3(Random::Double() * size.x(), Random::Double() * size.y(), Random::Double() * size.z());
+        r = Ray(origin, target - origin);
+    }
+
+    size_t hits;
+    double speed = MeasureRays(*mesh, rays, hits);
+    std::clog << "Uncompressed: " << speed << " Mrays/s, " << hits << " hits\n";
+    speed = MeasureRays(mesh8, rays, hits);
+    std::clog << "8-bit nodes:  " << speed << " Mrays/s, " << hits << " hits\n";
+    speed = MeasureRays(mesh16, rays, hits);
+    std::clog << "16-bit nodes: " << speed << " Mrays/s, " << hits << " hits\n";
+    return 0;
+}
+
+int TestNesting()
+{
+    // Checks hits on a sphere nested in more transforms than an intersection keeps, some of
+    // them behind lists, against the same sphere placed by one instance of the whole transform.
+
+    auto mat = make_shared<Lambertian>(Color(0.5, 0.5, 0.5));
+    shared_ptr<Hittable> nested = make_shared<Sphere>(Point3(0.2, 0.1, -0.3), 1, mat);
+    Matrix34 objectToWorld;
+
+    constexpr int depth = 3 * Intersection::maxInstanceDepth;
+    for (int level = 0; level < depth; level++)
+    {
+        Matrix34 transform;
+        switch (level % 3)
+        {
+            case 0:
+            {
+                const Vec3 offset(0.1 * level, -0.05 * level, 0.02);
+                nested = make_shared<Translate>(nested, offset);
+                transform = Matrix34::Translation(offset);
+                break;
+            }
+            case 1:
+            {
+                nested = make_shared<Rotate_Y>(nested, 15.0 * level);
+                transform = Matrix34::RotationY(15.0 * level);
+                break;
+            }
+            case 2:
+            {
+                transform = Matrix34::Scale(Vec3(1.1, 0.95, 1.0));
+                nested = make_shared<Instance>(nested, transform);
+                break;
+            }
+        }
+
+        objectToWorld = transform * objectToWorld;
+        if (level % 4 == 0)
+            nested = make_shared<HittableList>(nested);
+    }
+
+    const Instance direct(make_shared<Sphere>(Point3(0.2, 0.1, -0.3), 1, mat), objectToWorld);
+    const Point3 center = direct.BoundingBox().Center();
+
+    // Float transforms round at every level, so their hits only agree roughly.
+    const double tolerance = std::is_same<Real, double>::value ? 1e-6 : 1e-2;
+
+    int failures = 0;
+    for (int i = 0; i < 10000; i++)
+    {
+        const Point3 origin = center + 10 * Random::UnitVector();
+        const Ray r(origin, center + 1.5 * Random::UnitVector() - origin);
+        HitRecord nestedRec, directRec;
+        const bool nestedHit = nested->Hit(r, Interval(0.001, infinity), nestedRec);
+        const bool directHit = direct.Hit(r, Interval(0.001, infinity), directRec);
+
+        if (nestedHit != directHit
+            || (nestedHit && ((nestedRec.p - directRec.p).Length() > tolerance || (nestedRec.normal - directRec.normal).Length() > tolerance)))
+            failures++;
+    }
+
+    std::clog << "Nested " << depth << " transforms deep: " << failures << " of 10000 rays differ.\n";
+    return failures == 0 ? 0 : 1;
+}
+
+int DispatchBench(int scene)
+{
+    // Measures path tracing speed, to compare builds with and without RT_VIRTUAL_DISPATCH, which
+    // call the built-in objects, materials and textures through the switch on their kind or
+    // through their virtual functions.
+
+    SceneArena arena;
+    HittableList world;
+    Camera cam;
+    if (!BuildScene(scene, arena, world, cam))
+    {
+        std::cerr << "ERROR: Unknown scene " << scene << ".\n";
+        return 1;
+    }
+
+    // Scenes the compiler can't handle are traced as they are.
+    SceneCompiler compiler;
+    const shared_ptr<Hittable> compiled = compiler.Compile(world);
+    const Hittable& target = compiled ? *compiled : world;
+
+    // Keep the best of a few runs, to even out warm up and noise.
+    constexpr int pathCount = 100000;
+    double speed = 0;
+    for (int run = 0; run < 3; run++)
+        speed = std::fmax(speed, cam.MeasurePaths(target, pathCount));
+
+    std::clog << (closedDispatch ? "Closed kinds:  " : "Virtual calls: ") << speed << " Mpaths/s\n";
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc == 4 && std::string(argv[1]) == "--convert-mesh")
+        return ConvertMesh(argv[2], argv[3]);
+
+    if (argc == 7 && std::string(argv[1]) == "--convert-volume")
+        return ConvertVolume(argv[2], std::atoi(argv[3]), std::atoi(argv[4]), std::atoi(argv[5]), argv[6]);
+
+    if (argc == 4 && std::string(argv[1]) == "--convert-texture")
+        return ConvertTexture(argv[2], argv[3]);
+
+    if (argc == 4 && std::string(argv[1]) == "--dump-preview")
+        return DumpPreview(argv[2], argv[3]);
+
+    if (argc == 5 && std::string(argv[1]) == "--turntable")
+        return RenderTurntable(std::atoi(argv[2]), std::atoi(argv[3]), argv[4]);
+
+    if (argc == 3 && std::string(argv[1]) == "--scene")
+        return RenderSceneFile(argv[2]);
+
+    if (argc == 4 && std::string(argv[1]) == "--convert-scene")
+        return ConvertScene(argv[2], argv[3]);
+
+    if (argc == 3 && std::string(argv[1]) == "--batch")
+        return RenderBatch(argv[2]);
+
+    if (argc == 3 && std::string(argv[1]) == "--mesh-stats")
+        return MeshStats(argv[2]);
+
+    if (argc == 2 && std::string(argv[1]) == "--test-nesting")
+        return TestNesting();
+
+    if (argc == 3 && std::string(argv[1]) == "--dispatch-bench")
+        return DispatchBench(std::atoi(argv[2]));
+
+    const int scene = 7;
+
+    // If RTW_SNAPSHOT_CACHE names a directory, compiled scenes are cached there in snapshot
+    // files, keyed by the scene, by the build of the renderer and its precision, and by the
+    // files the scene reads, so repeated runs skip building the scene and its BVH until any
+    // of them changes.
+    const std::string snapshotDirectory = SceneSnapshot::CacheDirectory();
+    const bool useSnapshots = !snapshotDirectory.empty();
+    const std::string snapshotFilename = snapshotDirectory + "/scene" + std::to_string(scene) + ".rtsnap";
+    const uint64_t sourceHash = SceneSnapshot::Hash(std::to_string(scene) + " " + std::to_string(sizeof(Real)) + " " __DATE__ " " __TIME__);
+
+    SceneSnapshot snapshot;
+    if (useSnapshots && snapshot.Load(snapshotFilename, sourceHash))
+    {
+        Camera cam = snapshot.GetCamera();
+        cam.Render(snapshot);
+        return 0;
+    }
+
+    SceneArena arena;
+    HittableList world;
+    Camera cam;
+    SourceFiles sources;
+    {
+        SourceFiles::Scope recording(sources);
+        BuildScene(scene, arena, world, cam);
+    }
+
+    // Render the freshly written snapshot, so the first run matches later ones.
+    if (useSnapshots && SceneSnapshot::Write(snapshotFilename, world, cam, sourceHash, sources) && snapshot.Load(snapshotFilename, sourceHash))
+    {
+        cam.Render(snapshot);
+        return 0;
+    }
+
+    cam.Render(world);
 }
\ No newline at end of file
@@ -2,6 +2,14 @@
 
 #include "hittable.h"
 #include "texture.h"
+#include "textureProgram.h"
+
+enum class MaterialKind : uint8_t
+{
+    // Built-in materials, which ScatterMaterial and EmittedMaterial call directly. Any other
+    // material is Custom.
+    Custom, Lambertian, Metal, Dielectric, DiffuseLight, Isotropic
+};
 
 class Material
 {
@@ -17,17 +25,34 @@ public:
     {
         return Color(0, 0, 0);
     }
+
+    // Replaces constant textures with their color, so shading skips the texture lookup. Returns
+    // whether the material ended up constant.
+    virtual bool FoldConstants() { return false; }
+
+    MaterialKind Kind() const { return kind; }
+
+protected:
+    Material() {}
+    explicit Material(MaterialKind kind) : kind(kind) {}
+
+private:
+    MaterialKind kind = MaterialKind::Custom;
 };
 
-class Lambertian : public Material
+class Lambertian final : public Material
 {
 public:
     Lambertian(const Color& albedo)
-        : tex(make_shared<SolidColor>(albedo))
+        : Material(MaterialKind::Lambertian)
+        , tex(MakeObject<SolidColor>(albedo))
+        , program(*tex)
     {}
 
     Lambertian(shared_ptr<Texture> tex)
-        : tex(tex)
+        : Material(MaterialKind::Lambertian)
+        , tex(tex)
+        , program(*tex)
     {}
 
     bool Scatter(const Ray& r_in, const HitRecord& rec, Color& attenuation, Ray& scattered) const override
@@ -38,20 +63,28 @@ public:
         if (scatterDirection.isNearZero())
             scatterDirection = rec.normal;
 
-        scattered = Ray(rec.p, scatterDirection, r_in.time());
-        attenuation = tex->Value(rec.u, rec.v, rec.p);;
+        scattered = rec.SpawnRay(scatterDirection, r_in.time());
+        attenuation = isConstant ? constant : program.Evaluate(rec.u, rec.v, rec.p, rec.footprint);
         return true;
     }
 
+    bool FoldConstants() override { return isConstant = program.IsConstant(constant); }
+
+    const shared_ptr<Texture>& GetTexture() const { return tex; }
+
 private:
     shared_ptr<Texture> tex;
+    TextureProgram program;  // Compiled from tex
+    Color constant;
+    bool isConstant = false;
 };
 
-class Metal : public Material
+class Metal final : public Material
 {
 public:
     Metal(const Color& albedo, double fuzz)
-        : albedo(albedo)
+        : Material(MaterialKind::Metal)
+        , albedo(albedo)
         , fuzz(fuzz < 1 ? fuzz : 1)
     {}
 
@@ -59,20 +92,26 @@ public:
     {
         Vec3 reflected = Reflect(r_in.direction(), rec.normal);
         reflected = UnitVector(reflected) + (fuzz * Random::UnitVector());
-        scattered = Ray(rec.p, reflected, r_in.time());
+        scattered = rec.SpawnRay(reflected, r_in.time());
         attenuation = albedo;
         return (Dot(scattered.direction(), rec.normal) > 0);
     }
 
+    const Color& Albedo() const { return albedo; }
+    double Fuzz() const { return fuzz; }
+
 private:
     Color albedo;
     double fuzz;
 };
 
-class Dielectric : public Material
+class Dielectric final : public Material
 {
 public:
-    Dielectric(double refractionIndex) : refractionIndex(refractionIndex) {}
+    Dielectric(double refractionIndex)
+        : Material(MaterialKind::Dielectric)
+        , refractionIndex(refractionIndex)
+    {}
 
     bool Scatter(const Ray& r_in, const HitRecord& rec, Color& attenuation, Ray& scattered) const override
     {
@@ -93,7 +132,7 @@ public:
         else
             direction = Refract(unit_direction, rec.normal, ri);
 
-        scattered = Ray(rec.p, direction, r_in.time());
+        scattered = rec.SpawnRay(direction, r_in.time());
         return true;
     }
 
@@ -105,6 +144,8 @@ public:
         return r0 + (1 - r0) * std::pow((1 - cosine), 5);
     }
 
+    double RefractionIndex() const { return refractionIndex; }
+
 
 private:
     // Refractive index in vacuum or air, or the ratio of the material's refractive index over
@@ -112,34 +153,73 @@ private:
     double refractionIndex;
 };
 
-class DiffuseLight : public Material
+class DiffuseLight final : public Material
 {
 public:
-    DiffuseLight(shared_ptr<Texture> tex) : tex(tex) {}
-    DiffuseLight(const Color& emit) : tex(make_shared<SolidColor>(emit)) {}
+    DiffuseLight(shared_ptr<Texture> tex) : Material(MaterialKind::DiffuseLight), tex(tex), program(*tex) {}
+    DiffuseLight(const Color& emit) : Material(MaterialKind::DiffuseLight), tex(MakeObject<SolidColor>(emit)), program(*tex) {}
 
     Color Emitted(double u, double v, const Point3& p) const override
     {
-        return tex->Value(u, v, p);
+        return isConstant ? constant : program.Evaluate(u, v, p, 0);
     }
 
+    bool FoldConstants() override { return isConstant = program.IsConstant(constant); }
+
+    const shared_ptr<Texture>& GetTexture() const { return tex; }
+
 private:
     shared_ptr<Texture> tex;
+    TextureProgram program;  // Compiled from tex
+    Color constant;
+    bool isConstant = false;
 };
 
-class Isotropic : public Material
+class Isotropic final : public Material
 {
 public:
-    Isotropic(const Color& albedo) : tex(make_shared<SolidColor>(albedo)) {}
-    Isotropic(shared_ptr<Texture> tex) : tex(tex) {}
+    Isotropic(const Color& albedo) : Material(MaterialKind::Isotropic), tex(MakeObject<SolidColor>(albedo)), program(*tex) {}
+    Isotropic(shared_ptr<Texture> tex) : Material(MaterialKind::Isotropic), tex(tex), program(*tex) {}
 
     bool Scatter(const Ray& r_in, const HitRecord& rec, Color& attenuation, Ray& scattered) const override
     {
-        scattered = Ray(rec.p, Random::UnitVector(), r_in.time());
-        attenuation = tex->Value(rec.u, rec.v, rec.p);
+        scattered = rec.SpawnRay(Random::UnitVector(), r_in.time());
+        attenuation = isConstant ? constant : program.Evaluate(rec.u, rec.v, rec.p, rec.footprint);
         return true;
     }
 
+    bool FoldConstants() override { return isConstant = program.IsConstant(constant); }
+
+    const shared_ptr<Texture>& GetTexture() const { return tex; }
+
 private:
     shared_ptr<Texture> tex;
-};
\ No newline at end of file
+    TextureProgram program;  // Compiled from tex
+    Color constant;
+    bool isConstant = false;
+};
+
+inline bool ScatterMaterial(const Material& mat, const Ray& r_in, const HitRecord& rec, Color& attenuation, Ray& scattered)
+{
+    // Built-in materials are final, so the casts call them directly.
+    switch (closedDispatch ? mat.Kind() : MaterialKind::Custom)
+    {
+        case MaterialKind::Lambertian:   return static_cast<const Lambertian&>(mat).Scatter(r_in, rec, attenuation, scattered);
+        case MaterialKind::Metal:        return static_cast<const Metal&>(mat).Scatter(r_in, rec, attenuation, scattered);
+        case MaterialKind::Dielectric:   return static_cast<const Dielectric&>(mat).Scatter(r_in, rec, attenuation, scattered);
+        case MaterialKind::DiffuseLight: return false;
+        case MaterialKind::Isotropic:    return static_cast<const Isotropic&>(mat).Scatter(r_in, rec, attenuation, scattered);
+        default:                         return mat.Scatter(r_in, rec, attenuation, scattered);
+    }
+}
+
+inline Color EmittedMaterial(const Material& mat, double u, double v, const Point3& p)
+{
+    // Only lights emit among the built-in materials.
+    switch (closedDispatch ? mat.Kind() : MaterialKind::Custom)
+    {
+        case MaterialKind::DiffuseLight: return static_cast<const DiffuseLight&>(mat).Emitted(u, v, p);
+        case MaterialKind::Custom:       return mat.Emitted(u, v, p);
+        default:                         return Color(0, 0, 0);
+    }
+}
\ No newline at end of file
@@ -0,0 +1,157 @@
+#pragma once
+
+#include "aabb.h"
+#include "vec3.h"
+
+class Matrix34
+{
+public:
+    // Affine transform stored as the top three rows of a 4x4 matrix: a 3x3 linear part followed
+    // by a translation column. Points are transformed as column vectors, so A * B applies B first.
+
+    double m[3][4];
+
+    Matrix34()
+        : m{ { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 } }
+    {}
+
+    static Matrix34 Translation(const Vec3& offset)
+    {
+        Matrix34 result;
+        result.m[0][3] = offset.x();
+        result.m[1][3] = offset.y();
+        result.m[2][3] = offset.z();
+        return result;
+    }
+
+    static Matrix34 RotationY(double sinTheta, double cosTheta)
+    {
+        // Same rotation as Rotate_Y, taking object space to world space.
+        Matrix34 result;
+        result.m[0][0] = cosTheta;  result.m[0][2] = sinTheta;
+        result.m[2][0] = -sinTheta; result.m[2][2] = cosTheta;
+        return result;
+    }
+
+    static Matrix34 RotationY(double angle)
+    {
+        const double radians = DegToRad(angle);
+        return RotationY(std::sin(radians), std::cos(radians));
+    }
+
+    static Matrix34 Scale(const Vec3& scale)
+    {
+        Matrix34 result;
+        result.m[0][0] = scale.x();
+        result.m[1][1] = scale.y();
+        result.m[2][2] = scale.z();
+        return result;
+    }
+
+    Point3 TransformPoint(const Point3& p) const
+    {
+        return Point3(
+            m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3],
+            m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3],
+            m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3]);
+    }
+
+    Vec3 TransformVector(const Vec3& v) const
+    {
+        return Vec3(
+            m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+            m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+            m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z());
+    }
+
+    Vec3 TransformTransposed(const Vec3& v) const
+    {
+        // Multiplies by the transpose of the linear part. Given the inverse of a transform, this
+        // carries normals through the transform itself.
+        return Vec3(
+            m[0][0] * v.x() + m[1][0] * v.y() + m[2][0] * v.z(),
+            m[0][1] * v.x() + m[1][1] * v.y() + m[2][1] * v.z(),
+            m[0][2] * v.x() + m[1][2] * v.y() + m[2][2] * v.z());
+    }
+
+    AABB TransformBox(const AABB& box) const
+    {
+        // Returns the bounds of the transformed corners of the box.
+
+        Point3 min(infinity, infinity, infinity);
+        Point3 max(-infinity, -infinity, -infinity);
+
+        for (int i = 0; i < 2; i++)
+            for (int j = 0; j < 2; j++)
+                for (int k = 0; k < 2; k++)
+                {
+                    const Point3 corner = TransformPoint(Point3(
+                        i ? box.x.max : box.x.min,
+                        j ? box.y.max : box.y.min,
+                        k ? box.z.max : box.z.min));
+
+                    for (int c = 0; c < 3; c++)
+                    {
+                        min[c] = std::fmin(min[c], corner[c]);
+                        max[c] = std::fmax(max[c], corner[c]);
+                    }
+                }
+
+        return AABB(min, max);
+    }
+
+    bool IsTranslation() const
+    {
+        // Whether the linear part is the identity.
+        return m[0][0] == 1 && m[0][1] == 0 && m[0][2] == 0
+            && m[1][0] == 0 && m[1][1] == 1 && m[1][2] == 0
+            && m[2][0] == 0 && m[2][1] == 0 && m[2][2] == 1;
+    }
+
+    bool IsIdentity() const
+    {
+        return IsTranslation() && m[0][3] == 0 && m[1][3] == 0 && m[2][3] == 0;
+    }
+
+    Matrix34 Inverse() const
+    {
+        // Inverts the linear part through its adjugate, then moves the translation across.
+
+        const double a00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+        const double a01 = m[0][2] * m[2][1] - m[0][1] * m[2][2];
+        const double a02 = m[0][1] * m[1][2] - m[0][2] * m[1][1];
+        const double a10 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+        const double a11 = m[0][0] * m[2][2] - m[0][2] * m[2][0];
+        const double a12 = m[0][2] * m[1][0] - m[0][0] * m[1][2];
+        const double a20 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+        const double a21 = m[0][1] * m[2][0] - m[0][0] * m[2][1];
+        const double a22 = m[0][0] * m[1][1] - m[0][1] * m[1][0];
+
+        const double invDet = 1.0 / (m[0][0] * a00 + m[0][1] * a10 + m[0][2] * a20);
+
+        Matrix34 result;
+        result.m[0][0] = a00 * invDet; result.m[0][1] = a01 * invDet; result.m[0][2] = a02 * invDet;
+        result.m[1][0] = a10 * invDet; result.m[1][1] = a11 * invDet; result.m[1][2] = a12 * invDet;
+        result.m[2][0] = a20 * invDet; result.m[2][1] = a21 * invDet; result.m[2][2] = a22 * invDet;
+
+        const Vec3 offset = -result.TransformVector(Vec3(m[0][3], m[1][3], m[2][3]));
+        result.m[0][3] = offset.x();
+        result.m[1][3] = offset.y();
+        result.m[2][3] = offset.z();
+        return result;
+    }
+};
+
+inline Matrix34 operator*(const Matrix34& a, const Matrix34& b)
+{
+    Matrix34 result;
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 4; j++)
+        {
+            result.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j];
+        }
+        result.m[i][3] += a.m[i][3];
+    }
+    return result;
+}
@@ -0,0 +1,193 @@
+#pragma once
+
+#include "mappedFile.h"
+#include "sourceFiles.h"
+#include "triangleMesh.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+class MeshFile
+{
+public:
+    // Binary mesh container made to be memory mapped: a header with counts and bounds, followed
+    // by aligned vertex, index and BVH arrays in exactly the layout TriangleMesh traces. Loading
+    // maps the file and points the mesh at it, so no data is parsed or copied, pages are read on
+    // first touch, and every process mapping the file shares the same pages.
+
+    static bool Write(const std::string& filename, const TriangleMesh& mesh)
+    {
+        static_assert(std::is_trivially_copyable<TriangleMesh::Node>::value, "Mesh nodes are stored as raw bytes");
+
+        const MeshView& view = mesh.View();
+
+        Header header = {};
+        std::memcpy(header.magic, fileMagic, sizeof(header.magic));
+        header.formatVersion = formatVersion;
+        header.byteOrder = byteOrderMark;
+        header.headerSize = sizeof(Header);
+        header.vertexCount = view.vertexCount;
+        header.triangleCount = view.triangleCount;
+        header.nodeCount = mesh.NodeCount();
+
+        const AABB bounds = mesh.BoundingBox();
+        for (int axis = 0; axis < 3; axis++)
+        {
+            header.boundsMin[axis] = float(bounds.AxisInterval(axis).min);
+            header.boundsMax[axis] = float(bounds.AxisInterval(axis).max);
+        }
+
+        std::vector<unsigned char> payload;
+        const size_t floatSize = view.vertexCount * sizeof(float);
+
+        AppendSection(header, payload, XSection, view.x, floatSize);
+        AppendSection(header, payload, YSection, view.y, floatSize);
+        AppendSection(header, payload, ZSection, view.z, floatSize);
+        if (view.HasNormals())
+        {
+            AppendSection(header, payload, NXSection, view.nx, floatSize);
+            AppendSection(header, payload, NYSection, view.ny, floatSize);
+            AppendSection(header, payload, NZSection, view.nz, floatSize);
+        }
+        if (view.HasUVs())
+        {
+            AppendSection(header, payload, USection, view.u, floatSize);
+            AppendSection(header, payload, VSection, view.v, floatSize);
+        }
+        AppendSection(header, payload, IndicesSection, view.indices, 3 * view.triangleCount * sizeof(uint32_t));
+        AppendSection(header, payload, NodesSection, mesh.GetNodes(), mesh.NodeCount() * sizeof(TriangleMesh::Node));
+
+        // Replace the file instead of rewriting it, since other processes may have it mapped.
+        const std::string tempFilename = filename + ".tmp";
+        {
+            std::ofstream out(tempFilename, std::ios::binary | std::ios::trunc);
+            out.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+            out.write(reinterpret_cast<const char*>(payload.data()), std::streamsize(payload.size()));
+            if (!out)
+                return false;
+        }
+
+        std::remove(filename.c_str());
+        return std::rename(tempFilename.c_str(), filename.c_str()) == 0;
+    }
+
+    static shared_ptr<TriangleMesh> Load(const std::string& filename, shared_ptr<Material> mat)
+    {
+        // Returns nullptr if the file is missing or not a valid mesh file. Only the header and
+        // section table are checked, since touching the arrays would read the whole file.
+
+        SourceFiles::Record(filename);
+
+        auto file = make_shared<MappedFile>();
+        if (!file->Open(filename) || file->Size() < sizeof(Header))
+            return nullptr;
+
+        Header header;
+        std::memcpy(&header, file->Data(), sizeof(Header));
+
+        if (std::memcmp(header.magic, fileMagic, sizeof(header.magic)) != 0
+            || header.formatVersion != formatVersion
+            || header.byteOrder != byteOrderMark
+            || header.headerSize != sizeof(Header)
+            || header.vertexCount > 0xffffffffull
+            || header.triangleCount > 0xffffffffull)
+            return nullptr;
+
+        const size_t floatSize = size_t(header.vertexCount) * sizeof(float);
+        const bool hasNormals = header.sections[NXSection].size > 0;
+        const bool hasUVs = header.sections[USection].size > 0;
+
+        for (int section = 0; section < SectionCount; section++)
+        {
+            size_t expected = floatSize;
+            if (section == IndicesSection) expected = size_t(header.triangleCount) * 3 * sizeof(uint32_t);
+            if (section == NodesSection) expected = size_t(header.nodeCount) * sizeof(TriangleMesh::Node);
+            if (section >= NXSection && section <= NZSection && !hasNormals) expected = 0;
+            if (section >= USection && section <= VSection && !hasUVs) expected = 0;
+
+            const SectionRecord& record = header.sections[section];
+            if (record.size != expected || record.offset % sectionAlignment != 0
+                || record.offset > file->Size() || record.size > file->Size() - record.offset)
+                return nullptr;
+        }
+
+        const unsigned char* base = file->Data();
+        auto floats = [&](int section) { return reinterpret_cast<const float*>(base + header.sections[section].offset); };
+
+        MeshView view;
+        view.x = floats(XSection);
+        view.y = floats(YSection);
+        view.z = floats(ZSection);
+        view.nx = hasNormals ? floats(NXSection) : nullptr;
+        view.ny = hasNormals ? floats(NYSection) : nullptr;
+        view.nz = hasNormals ? floats(NZSection) : nullptr;
+        view.u = hasUVs ? floats(USection) : nullptr;
+        view.v = hasUVs ? floats(VSection) : nullptr;
+        view.indices = reinterpret_cast<const uint32_t*>(base + header.sections[IndicesSection].offset);
+        view.vertexCount = size_t(header.vertexCount);
+        view.triangleCount = size_t(header.triangleCount);
+
+        const TriangleMesh::Node* nodes = header.nodeCount > 0
+            ? reinterpret_cast<const TriangleMesh::Node*>(base + header.sections[NodesSection].offset)
+            : nullptr;
+
+        return make_shared<TriangleMesh>(view, nodes, size_t(header.nodeCount), file, mat);
+    }
+
+private:
+    static constexpr char fileMagic[8] = { 'R', 'T', 'M', 'E', 'S', 'H', 0, 0 };
+    static constexpr uint32_t formatVersion = 1;
+    static constexpr uint32_t byteOrderMark = 0x01020304;  // Reads differently on the other byte order
+    static constexpr size_t sectionAlignment = 64;        // Cache line aligned arrays
+
+    enum SectionId
+    {
+        XSection, YSection, ZSection,
+        NXSection, NYSection, NZSection,
+        USection, VSection,
+        IndicesSection,
+        NodesSection,
+        SectionCount
+    };
+
+    struct SectionRecord
+    {
+        uint64_t offset;  // From the start of the file
+        uint64_t size;    // In bytes, zero for missing sections
+    };
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t formatVersion;
+        uint32_t byteOrder;
+        uint64_t headerSize;
+        uint64_t vertexCount;
+        uint64_t triangleCount;
+        uint64_t nodeCount;   // Zero if the file has no BVH
+        float boundsMin[3];
+        float boundsMax[3];
+        SectionRecord sections[SectionCount];
+    };
+
+    static void AppendSection(Header& header, std::vector<unsigned char>& payload, SectionId id, const void* data, size_t size)
+    {
+        // Sections start aligned relative to the file, which the mapping keeps page aligned.
+        const size_t fileOffset = sizeof(Header) + payload.size();
+        const size_t padding = (sectionAlignment - fileOffset % sectionAlignment) % sectionAlignment;
+        payload.resize(payload.size() + padding, 0);
+
+        header.sections[id].offset = sizeof(Header) + payload.size();
+        header.sections[id].size = size;
+
+        const size_t start = payload.size();
+        payload.resize(start + size);
+        if (size > 0)
+            std::memcpy(payload.data() + start, data, size);
+    }
+};
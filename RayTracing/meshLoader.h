@@ -0,0 +1,911 @@
+#pragma once
+
+#include "mappedFile.h"
+#include "sourceFiles.h"
+#include "triangleMesh.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+class MeshLoader
+{
+public:
+    // Loads triangle meshes from Wavefront OBJ and binary PLY files. Files are memory mapped and
+    // parsed by all hardware threads at once, each working on its own range of the file.
+
+    static bool Load(const std::string& filename, MeshData& mesh)
+    {
+        SourceFiles::Record(filename);
+
+        const size_t dot = filename.find_last_of('.');
+        const std::string extension = dot == std::string::npos ? "" : filename.substr(dot + 1);
+
+        if (extension == "obj" || extension == "OBJ")
+            return LoadOBJ(filename, mesh);
+        if (extension == "ply" || extension == "PLY")
+            return LoadPLY(filename, mesh);
+
+        std::cerr << "ERROR: Unknown mesh format '" << filename << "'.\n";
+        return false;
+    }
+
+    static bool LoadOBJ(const std::string& filename, MeshData& mesh)
+    {
+        MappedFile file;
+        if (!file.Open(filename))
+        {
+            std::cerr << "ERROR: Could not load mesh file '" << filename << "'.\n";
+            return false;
+        }
+
+        const char* text = reinterpret_cast<const char*>(file.Data());
+        const size_t size = file.Size();
+
+        // Split the file into chunks of whole lines, one or more per thread.
+        const size_t chunkCount = std::max<size_t>(1, std::min<size_t>(ThreadCount() * 4, size / (1 << 16)));
+        std::vector<size_t> chunkStart(chunkCount + 1, size);
+        chunkStart[0] = 0;
+        for (size_t c = 1; c < chunkCount; c++)
+        {
+            size_t pos = std::max(chunkStart[c - 1], size * c / chunkCount);
+            while (pos < size && text[pos - 1] != '\n')
+                pos++;
+            chunkStart[c] = pos;
+        }
+
+        // First pass counts the vertex attributes in every chunk, so the second pass knows where
+        // its vertices go and can resolve relative face indices.
+        std::vector<ObjCounts> counts(chunkCount);
+        ForEachChunk(chunkCount, [&](size_t c)
+        {
+            counts[c] = CountObjLines(text + chunkStart[c], text + chunkStart[c + 1]);
+        });
+
+        ObjCounts total;
+        std::vector<ObjCounts> bases(chunkCount);
+        for (size_t c = 0; c < chunkCount; c++)
+        {
+            bases[c] = total;
+            total.positions += counts[c].positions;
+            total.normals += counts[c].normals;
+            total.uvs += counts[c].uvs;
+        }
+
+        ObjAttributes attributes;
+        attributes.x.resize(total.positions);
+        attributes.y.resize(total.positions);
+        attributes.z.resize(total.positions);
+        attributes.nx.resize(total.normals);
+        attributes.ny.resize(total.normals);
+        attributes.nz.resize(total.normals);
+        attributes.u.resize(total.uvs);
+        attributes.v.resize(total.uvs);
+
+        std::vector<std::vector<ObjCorner>> corners(chunkCount);
+        std::vector<char> valid(chunkCount, 1);
+        ForEachChunk(chunkCount, [&](size_t c)
+        {
+            valid[c] = ParseObjLines(text + chunkStart[c], text + chunkStart[c + 1], bases[c], total, attributes, corners[c]);
+        });
+
+        if (std::find(valid.begin(), valid.end(), 0) != valid.end())
+        {
+            std::cerr << "ERROR: Invalid face in mesh file '" << filename << "'.\n";
+            return false;
+        }
+
+        BuildObjMesh(attributes, corners, mesh);
+        return true;
+    }
+
+    static bool LoadPLY(const std::string& filename, MeshData& mesh)
+    {
+        MappedFile file;
+        if (!file.Open(filename))
+        {
+            std::cerr << "ERROR: Could not load mesh file '" << filename << "'.\n";
+            return false;
+        }
+
+        PlyHeader header;
+        if (!ParsePlyHeader(file.Data(), file.Size(), header))
+        {
+            std::cerr << "ERROR: Unsupported PLY file '" << filename << "', only binary PLY is supported.\n";
+            return false;
+        }
+
+        const unsigned char* pos = file.Data() + header.dataOffset;
+        const unsigned char* end = file.Data() + file.Size();
+
+        // Faces may come before the vertices, so their indices are checked against the header.
+        size_t vertexCount = 0;
+        for (const PlyElement& element : header.elements)
+            if (element.name == "vertex")
+                vertexCount = element.count;
+
+        for (const PlyElement& element : header.elements)
+        {
+            const unsigned char* next = nullptr;
+
+            if (element.name == "vertex")
+                next = ReadPlyVertices(element, header.swapBytes, pos, end, mesh);
+            else if (element.name == "face")
+                next = ReadPlyFaces(element, header.swapBytes, pos, end, vertexCount, mesh);
+            else
+                next = SkipPlyElement(element, header.swapBytes, pos, end);
+
+            if (next == nullptr)
+            {
+                std::cerr << "ERROR: Truncated or invalid PLY file '" << filename << "'.\n";
+                return false;
+            }
+            pos = next;
+        }
+
+        return true;
+    }
+
+private:
+
+    static size_t ThreadCount()
+    {
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    template<typename F>
+    static void ForEachChunk(size_t chunkCount, F fn)
+    {
+        // Runs fn for every chunk index, spreading the chunks over the hardware threads.
+
+        std::atomic<size_t> nextChunk{ 0 };
+        std::vector<std::thread> threads(std::min(chunkCount, ThreadCount()));
+
+        for (std::thread& thread : threads)
+        {
+            thread = std::thread([&]()
+            {
+                for (size_t c = nextChunk++; c < chunkCount; c = nextChunk++)
+                    fn(c);
+            });
+        }
+
+        for (std::thread& thread : threads)
+            thread.join();
+    }
+
+    // OBJ
+
+    struct ObjCounts
+    {
+        size_t positions = 0;
+        size_t normals = 0;
+        size_t uvs = 0;
+    };
+
+    struct ObjAttributes
+    {
+        std::vector<float> x, y, z;
+        std::vector<float> nx, ny, nz;
+        std::vector<float> u, v;
+    };
+
+    struct ObjCorner
+    {
+        // Zero based attribute indices of a face corner, noIndex for missing ones.
+        uint32_t position, uv, normal;
+    };
+
+    static constexpr uint32_t noIndex = 0xffffffff;
+
+    static bool IsBlank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+    static const char* SkipBlanks(const char* p, const char* end)
+    {
+        while (p < end && IsBlank(*p))
+            p++;
+        return p;
+    }
+
+    static const char* NextLine(const char* p, const char* end)
+    {
+        const char* newline = static_cast<const char*>(std::memchr(p, '\n', size_t(end - p)));
+        return newline ? newline + 1 : end;
+    }
+
+    static ObjCounts CountObjLines(const char* p, const char* end)
+    {
+        ObjCounts counts;
+        while (p < end)
+        {
+            // The same tests as ParseObjLines, so both agree on every line.
+            p = SkipBlanks(p, end);
+            if (end - p > 1 && p[0] == 'v' && IsBlank(p[1])) counts.positions++;
+            else if (end - p > 2 && p[0] == 'v' && p[1] == 'n') counts.normals++;
+            else if (end - p > 2 && p[0] == 'v' && p[1] == 't') counts.uvs++;
+            p = NextLine(p, end);
+        }
+        return counts;
+    }
+
+    static float ParseFloat(const char*& p, const char* end)
+    {
+        // Parses plain decimal numbers with an optional exponent, falling back to strtod for
+        // anything else (like "nan" or hexadecimal floats).
+
+        p = SkipBlanks(p, end);
+        const char* start = p;
+
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+'))
+            negative = *p++ == '-';
+
+        double value = 0;
+        bool digits = false;
+        while (p < end && *p >= '0' && *p <= '9')
+        {
+            value = value * 10 + (*p++ - '0');
+            digits = true;
+        }
+
+        if (p < end && *p == '.')
+        {
+            p++;
+            double scale = 0.1;
+            while (p < end && *p >= '0' && *p <= '9')
+            {
+                value += (*p++ - '0') * scale;
+                scale *= 0.1;
+                digits = true;
+            }
+        }
+
+        if (digits && p < end && (*p == 'e' || *p == 'E'))
+        {
+            const char* exponentStart = p++;
+            bool negativeExponent = false;
+            if (p < end && (*p == '-' || *p == '+'))
+                negativeExponent = *p++ == '-';
+
+            int exponent = 0;
+            bool exponentDigits = false;
+            while (p < end && *p >= '0' && *p <= '9')
+            {
+                exponent = std::min(exponent * 10 + (*p++ - '0'), 400);
+                exponentDigits = true;
+            }
+
+            if (exponentDigits)
+                value *= std::pow(10.0, negativeExponent ? -exponent : exponent);
+            else
+                p = exponentStart;
+        }
+
+        if (!digits || (p < end && !IsBlank(*p) && *p != '\n' && *p != '/'))
+        {
+            // The number ends at the line, so strtod can't run past the end of the file.
+            const std::string token(start, NextLine(start, end));
+            char* tokenEnd = nullptr;
+            const double fallback = std::strtod(token.c_str(), &tokenEnd);
+            p = start + (tokenEnd - token.c_str());
+            return float(fallback);
+        }
+
+        return float(negative ? -value : value);
+    }
+
+    static bool ParseIndex(const char*& p, const char* end, size_t base, size_t count, uint32_t& index)
+    {
+        // Parses a one based or negative (relative) OBJ index into a zero based index.
+
+        bool negative = false;
+        if (p < end && *p == '-')
+        {
+            negative = true;
+            p++;
+        }
+
+        long long value = 0;
+        bool digits = false;
+        while (p < end && *p >= '0' && *p <= '9')
+        {
+            value = value * 10 + (*p++ - '0');
+            digits = true;
+        }
+
+        if (!digits || value == 0)
+            return false;
+
+        const long long resolved = negative ? (long long)(base) - value : value - 1;
+        if (resolved < 0 || resolved >= (long long)(count))
+            return false;
+
+        index = uint32_t(resolved);
+        return true;
+    }
+
+    static bool ParseObjLines(const char* p, const char* end, const ObjCounts& base, const ObjCounts& total,
+        ObjAttributes& attributes, std::vector<ObjCorner>& corners)
+    {
+        // Writes the vertex attributes of the lines to their place in the attribute arrays, and
+        // the corners of every face, fan triangulated, to corners.
+
+        ObjCounts seen = base;
+        std::vector<ObjCorner> polygon;
+
+        while (p < end)
+        {
+            p = SkipBlanks(p, end);
+            const char* lineEnd = NextLine(p, end);
+
+            if (end - p > 1 && p[0] == 'v' && IsBlank(p[1]))
+            {
+                p += 2;
+                attributes.x[seen.positions] = ParseFloat(p, lineEnd);
+                attributes.y[seen.positions] = ParseFloat(p, lineEnd);
+                attributes.z[seen.positions] = ParseFloat(p, lineEnd);
+                seen.positions++;
+            }
+            else if (end - p > 2 && p[0] == 'v' && p[1] == 'n')
+            {
+                p += 2;
+                attributes.nx[seen.normals] = ParseFloat(p, lineEnd);
+                attributes.ny[seen.normals] = ParseFloat(p, lineEnd);
+                attributes.nz[seen.normals] = ParseFloat(p, lineEnd);
+                seen.normals++;
+            }
+            else if (end - p > 2 && p[0] == 'v' && p[1] == 't')
+            {
+                p += 2;
+                attributes.u[seen.uvs] = ParseFloat(p, lineEnd);
+                attributes.v[seen.uvs] = ParseFloat(p, lineEnd);
+                seen.uvs++;
+            }
+            else if (end - p > 1 && p[0] == 'f' && IsBlank(p[1]))
+            {
+                p += 2;
+                polygon.clear();
+
+                while (true)
+                {
+                    p = SkipBlanks(p, lineEnd);
+                    if (p >= lineEnd || *p == '\n' || *p == '#')
+                        break;
+
+                    // Corners are written as v, v/vt, v//vn or v/vt/vn.
+                    ObjCorner corner = { noIndex, noIndex, noIndex };
+                    if (!ParseIndex(p, lineEnd, seen.positions, total.positions, corner.position))
+                        return false;
+
+                    if (p < lineEnd && *p == '/')
+                    {
+                        p++;
+                        if (p < lineEnd && *p != '/' && !ParseIndex(p, lineEnd, seen.uvs, total.uvs, corner.uv))
+                            return false;
+
+                        if (p < lineEnd && *p == '/')
+                        {
+                            p++;
+                            if (!ParseIndex(p, lineEnd, seen.normals, total.normals, corner.normal))
+                                return false;
+                        }
+                    }
+
+                    polygon.push_back(corner);
+                }
+
+                for (size_t i = 2; i < polygon.size(); i++)
+                {
+                    corners.push_back(polygon[0]);
+                    corners.push_back(polygon[i - 1]);
+                    corners.push_back(polygon[i]);
+                }
+            }
+
+            p = lineEnd;
+        }
+
+        return true;
+    }
+
+    static void BuildObjMesh(ObjAttributes& attributes, const std::vector<std::vector<ObjCorner>>& chunkCorners, MeshData& mesh)
+    {
+        // OBJ indexes every attribute on its own, while the mesh has one index per vertex. Most
+        // exporters use the same index for all of them, so the attribute arrays are used as they
+        // are, otherwise every distinct combination becomes a vertex.
+
+        bool hasNormals = !attributes.nx.empty();
+        bool hasUVs = !attributes.u.empty();
+        bool sharedIndices = true;
+        size_t cornerCount = 0;
+
+        for (const std::vector<ObjCorner>& corners : chunkCorners)
+        {
+            cornerCount += corners.size();
+            for (const ObjCorner& corner : corners)
+            {
+                hasNormals = hasNormals && corner.normal != noIndex;
+                hasUVs = hasUVs && corner.uv != noIndex;
+                sharedIndices = sharedIndices
+                    && (corner.normal == noIndex || corner.normal == corner.position)
+                    && (corner.uv == noIndex || corner.uv == corner.position);
+            }
+        }
+
+        const size_t positionCount = attributes.x.size();
+        sharedIndices = sharedIndices
+            && (!hasNormals || attributes.nx.size() == positionCount)
+            && (!hasUVs || attributes.u.size() == positionCount);
+
+        mesh = MeshData();
+        mesh.indices.reserve(cornerCount);
+
+        if (sharedIndices)
+        {
+            for (const std::vector<ObjCorner>& corners : chunkCorners)
+                for (const ObjCorner& corner : corners)
+                    mesh.indices.push_back(corner.position);
+
+            mesh.x.swap(attributes.x);
+            mesh.y.swap(attributes.y);
+            mesh.z.swap(attributes.z);
+            if (hasNormals)
+            {
+                mesh.nx.swap(attributes.nx);
+                mesh.ny.swap(attributes.ny);
+                mesh.nz.swap(attributes.nz);
+            }
+            if (hasUVs)
+            {
+                mesh.u.swap(attributes.u);
+                mesh.v.swap(attributes.v);
+            }
+            return;
+        }
+
+        struct CornerHash
+        {
+            size_t operator()(const ObjCorner& c) const
+            {
+                return std::hash<uint64_t>()((uint64_t(c.position) << 32) ^ (uint64_t(c.uv) << 16) ^ c.normal);
+            }
+        };
+        struct CornerEqual
+        {
+            bool operator()(const ObjCorner& a, const ObjCorner& b) const
+            {
+                return a.position == b.position && a.uv == b.uv && a.normal == b.normal;
+            }
+        };
+
+        std::unordered_map<ObjCorner, uint32_t, CornerHash, CornerEqual> vertices;
+        vertices.reserve(positionCount);
+
+        for (const std::vector<ObjCorner>& corners : chunkCorners)
+        {
+            for (ObjCorner corner : corners)
+            {
+                if (!hasNormals) corner.normal = noIndex;
+                if (!hasUVs) corner.uv = noIndex;
+
+                auto inserted = vertices.emplace(corner, uint32_t(mesh.x.size()));
+                if (inserted.second)
+                {
+                    mesh.x.push_back(attributes.x[corner.position]);
+                    mesh.y.push_back(attributes.y[corner.position]);
+                    mesh.z.push_back(attributes.z[corner.position]);
+                    if (hasNormals)
+                    {
+                        mesh.nx.push_back(attributes.nx[corner.normal]);
+                        mesh.ny.push_back(attributes.ny[corner.normal]);
+                        mesh.nz.push_back(attributes.nz[corner.normal]);
+                    }
+                    if (hasUVs)
+                    {
+                        mesh.u.push_back(attributes.u[corner.uv]);
+                        mesh.v.push_back(attributes.v[corner.uv]);
+                    }
+                }
+                mesh.indices.push_back(inserted.first->second);
+            }
+        }
+    }
+
+    // PLY
+
+    enum class PlyType { Invalid, Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64 };
+
+    struct PlyProperty
+    {
+        std::string name;
+        PlyType type = PlyType::Invalid;       // Item type for lists
+        PlyType countType = PlyType::Invalid;  // Set for lists only
+    };
+
+    struct PlyElement
+    {
+        std::string name;
+        size_t count = 0;
+        std::vector<PlyProperty> properties;
+    };
+
+    struct PlyHeader
+    {
+        bool swapBytes = false;
+        size_t dataOffset = 0;
+        std::vector<PlyElement> elements;
+    };
+
+    static PlyType ParsePlyType(const std::string& name)
+    {
+        if (name == "char" || name == "int8") return PlyType::Int8;
+        if (name == "uchar" || name == "uint8") return PlyType::UInt8;
+        if (name == "short" || name == "int16") return PlyType::Int16;
+        if (name == "ushort" || name == "uint16") return PlyType::UInt16;
+        if (name == "int" || name == "int32") return PlyType::Int32;
+        if (name == "uint" || name == "uint32") return PlyType::UInt32;
+        if (name == "float" || name == "float32") return PlyType::Float32;
+        if (name == "double" || name == "float64") return PlyType::Float64;
+        return PlyType::Invalid;
+    }
+
+    static size_t PlyTypeSize(PlyType type)
+    {
+        switch (type)
+        {
+            case PlyType::Int8: case PlyType::UInt8: return 1;
+            case PlyType::Int16: case PlyType::UInt16: return 2;
+            case PlyType::Int32: case PlyType::UInt32: case PlyType::Float32: return 4;
+            case PlyType::Float64: return 8;
+            default: return 0;
+        }
+    }
+
+    static double ReadPlyValue(const unsigned char* p, PlyType type, bool swapBytes)
+    {
+        unsigned char bytes[8] = {};
+        const size_t size = PlyTypeSize(type);
+        for (size_t i = 0; i < size; i++)
+            bytes[i] = swapBytes ? p[size - 1 - i] : p[i];
+
+        switch (type)
+        {
+            case PlyType::Int8: { int8_t value; std::memcpy(&value, bytes, 1); return value; }
+            case PlyType::UInt8: return bytes[0];
+            case PlyType::Int16: { int16_t value; std::memcpy(&value, bytes, 2); return value; }
+            case PlyType::UInt16: { uint16_t value; std::memcpy(&value, bytes, 2); return value; }
+            case PlyType::Int32: { int32_t value; std::memcpy(&value, bytes, 4); return value; }
+            case PlyType::UInt32: { uint32_t value; std::memcpy(&value, bytes, 4); return value; }
+            case PlyType::Float32: { float value; std::memcpy(&value, bytes, 4); return value; }
+            case PlyType::Float64: { double value; std::memcpy(&value, bytes, 8); return value; }
+            default: return 0;
+        }
+    }
+
+    static bool ParsePlyHeader(const unsigned char* data, size_t size, PlyHeader& header)
+    {
+        const char* text = reinterpret_cast<const char*>(data);
+        const char* end = text + size;
+
+        if (size < 4 || std::memcmp(text, "ply", 3) != 0)
+            return false;
+
+        const char* p = NextLine(text, end);
+        bool hasFormat = false;
+
+        while (p < end)
+        {
+            const char* lineEnd = NextLine(p, end);
+            std::string line(p, lineEnd);
+            while (!line.empty() && (line.back() == '\n' || line.back() == '\r'))
+                line.pop_back();
+            p = lineEnd;
+
+            std::vector<std::string> words;
+            size_t start = 0;
+            while (start < line.size())
+            {
+                const size_t stop = line.find(' ', start);
+                const size_t wordEnd = stop == std::string::npos ? line.size() : stop;
+                if (wordEnd > start)
+                    words.push_back(line.substr(start, wordEnd - start));
+                start = wordEnd + 1;
+            }
+
+            if (words.empty() || words[0] == "comment" || words[0] == "obj_info")
+                continue;
+
+            if (words[0] == "end_header")
+            {
+                header.dataOffset = size_t(p - text);
+                return hasFormat;
+            }
+
+            if (words[0] == "format" && words.size() >= 2)
+            {
+                // Multi-byte values are stored in the machine order after swapping if needed.
+                const uint16_t one = 1;
+                const bool littleEndianMachine = *reinterpret_cast<const unsigned char*>(&one) == 1;
+
+                if (words[1] == "binary_little_endian")
+                    header.swapBytes = !littleEndianMachine;
+                else if (words[1] == "binary_big_endian")
+                    header.swapBytes = littleEndianMachine;
+                else
+                    return false;
+                hasFormat = true;
+            }
+            else if (words[0] == "element" && words.size() == 3)
+            {
+                PlyElement element;
+                element.name = words[1];
+                element.count = size_t(std::strtoull(words[2].c_str(), nullptr, 10));
+                header.elements.push_back(element);
+            }
+            else if (words[0] == "property" && !header.elements.empty())
+            {
+                PlyProperty property;
+                if (words.size() == 5 && words[1] == "list")
+                {
+                    property.countType = ParsePlyType(words[2]);
+                    property.type = ParsePlyType(words[3]);
+                    property.name = words[4];
+                    if (property.countType == PlyType::Invalid)
+                        return false;
+                }
+                else if (words.size() == 3)
+                {
+                    property.type = ParsePlyType(words[1]);
+                    property.name = words[2];
+                }
+
+                if (property.type == PlyType::Invalid)
+                    return false;
+                header.elements.back().properties.push_back(property);
+            }
+        }
+
+        return false;
+    }
+
+    static const unsigned char* SkipPlyRecord(const PlyElement& element, bool swapBytes, const unsigned char* p, const unsigned char* end)
+    {
+        // Returns the end of the record starting at p, or nullptr if it runs past the end.
+
+        for (const PlyProperty& property : element.properties)
+        {
+            size_t size = PlyTypeSize(property.type);
+            if (property.countType != PlyType::Invalid)
+            {
+                const size_t countSize = PlyTypeSize(property.countType);
+                if (size_t(end - p) < countSize)
+                    return nullptr;
+                const double count = ReadPlyValue(p, property.countType, swapBytes);
+                if (count < 0)
+                    return nullptr;
+                p += countSize;
+                size *= size_t(count);
+            }
+
+            if (size_t(end - p) < size)
+                return nullptr;
+            p += size;
+        }
+        return p;
+    }
+
+    static const unsigned char* SkipPlyElement(const PlyElement& element, bool swapBytes, const unsigned char* p, const unsigned char* end)
+    {
+        for (size_t i = 0; i < element.count && p != nullptr; i++)
+            p = SkipPlyRecord(element, swapBytes, p, end);
+        return p;
+    }
+
+    static const unsigned char* ReadPlyVertices(const PlyElement& element, bool swapBytes, const unsigned char* p, const unsigned char* end, MeshData& mesh)
+    {
+        // Vertex records have a fixed size, so every thread can decode its own range directly.
+
+        struct Attribute
+        {
+            std::vector<float>* target;
+            size_t offset;
+            PlyType type;
+        };
+
+        std::vector<Attribute> attributes;
+        size_t stride = 0;
+        int normalCount = 0, uvCount = 0;
+        bool hasPosition[3] = {};
+
+        for (const PlyProperty& property : element.properties)
+        {
+            if (property.countType != PlyType::Invalid)
+                return nullptr;
+
+            const std::string& name = property.name;
+            std::vector<float>* target = nullptr;
+
+            if (name == "x") { target = &mesh.x; hasPosition[0] = true; }
+            else if (name == "y") { target = &mesh.y; hasPosition[1] = true; }
+            else if (name == "z") { target = &mesh.z; hasPosition[2] = true; }
+            else if (name == "nx") { target = &mesh.nx; normalCount++; }
+            else if (name == "ny") { target = &mesh.ny; normalCount++; }
+            else if (name == "nz") { target = &mesh.nz; normalCount++; }
+            else if (name == "u" || name == "s" || name == "texture_u") { target = &mesh.u; uvCount++; }
+            else if (name == "v" || name == "t" || name == "texture_v") { target = &mesh.v; uvCount++; }
+
+            if (target != nullptr)
+                attributes.push_back({ target, stride, property.type });
+            stride += PlyTypeSize(property.type);
+        }
+
+        if (!hasPosition[0] || !hasPosition[1] || !hasPosition[2] || size_t(end - p) / std::max<size_t>(stride, 1) < element.count)
+            return nullptr;
+
+        for (Attribute& attribute : attributes)
+        {
+            // Drop partial normals or UVs.
+            const bool isNormal = attribute.target == &mesh.nx || attribute.target == &mesh.ny || attribute.target == &mesh.nz;
+            const bool isUV = attribute.target == &mesh.u || attribute.target == &mesh.v;
+            if ((isNormal && normalCount != 3) || (isUV && uvCount != 2))
+                attribute.target = nullptr;
+            else
+                attribute.target->resize(element.count);
+        }
+
+        const size_t chunkSize = 1 << 16;
+        const size_t chunkCount = (element.count + chunkSize - 1) / chunkSize;
+
+        ForEachChunk(chunkCount, [&](size_t c)
+        {
+            const size_t first = c * chunkSize;
+            const size_t last = std::min(element.count, first + chunkSize);
+
+            for (const Attribute& attribute : attributes)
+            {
+                if (attribute.target == nullptr)
+                    continue;
+
+                float* target = attribute.target->data();
+                const unsigned char* record = p + first * stride + attribute.offset;
+                for (size_t i = first; i < last; i++, record += stride)
+                    target[i] = float(ReadPlyValue(record, attribute.type, swapBytes));
+            }
+        });
+
+        return p + element.count * stride;
+    }
+
+    static bool ReadPlyIndex(const unsigned char* p, PlyType type, bool swapBytes, size_t vertexCount, uint32_t& index)
+    {
+        // Indices may be stored in any type, so they are checked before being converted.
+        const double value = ReadPlyValue(p, type, swapBytes);
+        if (!(value >= 0 && value < double(std::min<size_t>(vertexCount, noIndex))))
+            return false;
+
+        index = uint32_t(value);
+        return true;
+    }
+
+    static const unsigned char* ReadPlyFaces(const PlyElement& element, bool swapBytes, const unsigned char* p, const unsigned char* end,
+        size_t vertexCount, MeshData& mesh)
+    {
+        // Face records have variable length. A quick serial pass finds where every chunk of faces
+        // starts and how many triangles it makes, then the chunks are decoded in parallel.
+        // Returns nullptr if a record is truncated or a face refers to a missing vertex.
+
+        const PlyProperty* indexProperty = nullptr;
+        for (const PlyProperty& property : element.properties)
+            if (property.countType != PlyType::Invalid && (property.name == "vertex_indices" || property.name == "vertex_index"))
+                indexProperty = &property;
+
+        if (indexProperty == nullptr)
+            return nullptr;
+
+        const size_t chunkSize = 1 << 16;
+        const size_t chunkCount = (element.count + chunkSize - 1) / chunkSize;
+        std::vector<const unsigned char*> chunkStart(chunkCount + 1);
+        std::vector<size_t> chunkTriangles(chunkCount + 1, 0);
+
+        const size_t countSize = PlyTypeSize(indexProperty->countType);
+        const bool onlyIndices = element.properties.size() == 1;
+
+        for (size_t i = 0; i < element.count; i++)
+        {
+            if (i % chunkSize == 0)
+            {
+                chunkStart[i / chunkSize] = p;
+                chunkTriangles[i / chunkSize + 1] = chunkTriangles[i / chunkSize];
+            }
+
+            const unsigned char* recordStart = p;
+            if (!onlyIndices)
+            {
+                // Find the index list among the other properties.
+                for (const PlyProperty& property : element.properties)
+                {
+                    if (&property == indexProperty)
+                        break;
+
+                    PlyElement single;
+                    single.properties.push_back(property);
+                    p = SkipPlyRecord(single, swapBytes, p, end);
+                    if (p == nullptr)
+                        return nullptr;
+                }
+            }
+
+            // Skipping the record checks the count isn't negative, before it is converted.
+            if (size_t(end - p) < countSize)
+                return nullptr;
+            const double count = ReadPlyValue(p, indexProperty->countType, swapBytes);
+
+            p = SkipPlyRecord(element, swapBytes, recordStart, end);
+            if (p == nullptr)
+                return nullptr;
+
+            if (count >= 3)
+                chunkTriangles[i / chunkSize + 1] += size_t(count) - 2;
+        }
+        chunkStart[chunkCount] = p;
+
+        const size_t firstIndex = mesh.indices.size();
+        mesh.indices.resize(firstIndex + 3 * chunkTriangles[chunkCount]);
+
+        std::atomic<bool> valid{ true };
+        ForEachChunk(chunkCount, [&](size_t c)
+        {
+            const unsigned char* record = chunkStart[c];
+            uint32_t* out = mesh.indices.data() + firstIndex + 3 * chunkTriangles[c];
+            const size_t itemSize = PlyTypeSize(indexProperty->type);
+
+            for (size_t i = c * chunkSize; i < std::min(element.count, (c + 1) * chunkSize); i++)
+            {
+                const unsigned char* next = SkipPlyRecord(element, swapBytes, record, end);
+
+                const unsigned char* list = record;
+                for (const PlyProperty& property : element.properties)
+                {
+                    if (&property == indexProperty)
+                        break;
+                    PlyElement single;
+                    single.properties.push_back(property);
+                    list = SkipPlyRecord(single, swapBytes, list, end);
+                }
+
+                const size_t count = size_t(ReadPlyValue(list, indexProperty->countType, swapBytes));
+                const unsigned char* items = list + countSize;
+
+                // Fan triangulate polygons.
+                uint32_t first;
+                if (count >= 3 && !ReadPlyIndex(items, indexProperty->type, swapBytes, vertexCount, first))
+                {
+                    valid = false;
+                    return;
+                }
+
+                for (size_t k = 2; k < count; k++)
+                {
+                    *out++ = first;
+                    if (!ReadPlyIndex(items + (k - 1) * itemSize, indexProperty->type, swapBytes, vertexCount, *out++)
+                        || !ReadPlyIndex(items + k * itemSize, indexProperty->type, swapBytes, vertexCount, *out++))
+                    {
+                        valid = false;
+                        return;
+                    }
+                }
+
+                record = next;
+            }
+        });
+
+        return valid ? p : nullptr;
+    }
+};
@@ -0,0 +1,330 @@
+#pragma once
+
+#include "aabb.h"
+#include "hittable.h"
+#include "hittableList.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+class MotionBVH : public Hittable
+{
+public:
+    // Bounding volume hierarchy for scenes with moving objects. Every node stores its bounds at the
+    // start and at the end of its time range, and interpolates them at the ray time during
+    // traversal, so a ray only pays for where the objects are at that instant instead of for their
+    // whole swept volume. Nodes whose interpolated bounds turn out loose (objects moving in
+    // different directions) are split in time instead of in space.
+
+    MotionBVH(const HittableList& list, int maxTimeSplits = 4)
+        : objects(list.objects)
+        , maxTimeSplits(maxTimeSplits)
+    {
+        std::vector<uint32_t> refs(objects.size());
+        std::iota(refs.begin(), refs.end(), 0);
+
+        nodes.reserve(2 * objects.size() + 1);
+        leafRefs.reserve(objects.size());
+
+        if (!refs.empty())
+            Build(refs, 0, refs.size(), 0.0, 1.0, 0);
+
+        bbox = list.BoundingBox();
+    }
+
+    bool Intersect(const Ray& r, const Interval& ray_t, Intersection& hit) const override
+    {
+        if (nodes.empty())
+            return false;
+
+        const double time = r.time();
+        const bool dirIsNeg[3] = { r.direction().x() < 0, r.direction().y() < 0, r.direction().z() < 0 };
+
+        uint32_t stack[64];
+        int stackSize = 0;
+        uint32_t nodeIdx = 0;
+
+        bool hitAnything = false;
+        double closestSoFar = ray_t.max;
+
+        while (true)
+        {
+            const Node& node = nodes[nodeIdx];
+
+            if (node.Bounds(time).Hit(r, Interval(ray_t.min, closestSoFar)))
+            {
+                if (node.count > 0)
+                {
+                    for (uint32_t i = 0; i < node.count; i++)
+                    {
+                        const Hittable& object = *objects[leafRefs[node.offset + i]];
+                        if (IntersectObject(object, r, Interval(ray_t.min, closestSoFar), hit))
+                        {
+                            hitAnything = true;
+                            closestSoFar = hit.t;
+                        }
+                    }
+                }
+                else if (node.timeSplit)
+                {
+                    // Only the child whose time range contains the ray time can be hit.
+                    nodeIdx = (time < nodes[node.offset].time0) ? nodeIdx + 1 : node.offset;
+                    continue;
+                }
+                else
+                {
+                    // Visit the child nearest to the ray origin first.
+                    if (dirIsNeg[node.axis])
+                    {
+                        stack[stackSize++] = nodeIdx + 1;
+                        nodeIdx = node.offset;
+                    }
+                    else
+                    {
+                        stack[stackSize++] = node.offset;
+                        nodeIdx = nodeIdx + 1;
+                    }
+                    continue;
+                }
+            }
+
+            if (stackSize == 0)
+                break;
+
+            nodeIdx = stack[--stackSize];
+        }
+
+        return hitAnything;
+    }
+
+    AABB BoundingBox() const override { return bbox; }
+
+    AABB BoundingBoxAt(double time) const override
+    {
+        return nodes.empty() ? AABB::empty : nodes[0].Bounds(time);
+    }
+
+    const std::vector<shared_ptr<Hittable>>& Objects() const { return objects; }
+
+private:
+
+    struct Node
+    {
+        AABB bounds0;          // Bounds at the start of the node time range
+        AABB bounds1;          // Bounds at the end of the node time range
+        double time0;          // Start of the node time range
+        double invDuration;    // One over the length of the node time range
+        uint32_t offset;       // Leaf: first entry in leafRefs. Interior: index of the second child
+        uint16_t count;        // Number of objects in a leaf, zero for interior nodes
+        uint8_t axis;          // Split axis, used to visit the nearest child first
+        uint8_t timeSplit;     // Whether the children split the time range instead of space
+
+        AABB Bounds(double time) const
+        {
+            const double t = Interval(0, 1).Clamp((time - time0) * invDuration);
+            return AABB::Lerp(bounds0, bounds1, t);
+        }
+    };
+
+    static constexpr int binCount = 16;
+    static constexpr uint32_t maxLeafSize = 4;
+    static constexpr double traversalCost = 1.0;
+    static constexpr double intersectionCost = 1.0;
+
+    // Above this ratio between the interpolated and the actual mid-time bounds, the node is split
+    // in time instead of in space.
+    static constexpr double timeSplitLooseness = 1.5;
+
+    void Build(std::vector<uint32_t>& refs, size_t start, size_t end, double time0, double time1, int timeSplits)
+    {
+        const size_t nodeIdx = nodes.size();
+        nodes.emplace_back();
+
+        const double timeMid = 0.5 * (time0 + time1);
+
+        // Node bounds at both ends of its time range, plus the exact bounds at the middle, which
+        // tell how much the linear interpolation overestimates the motion.
+        AABB bounds0, bounds1, boundsMid, centroidBounds;
+        for (size_t i = start; i < end; i++)
+        {
+            const Hittable& object = *objects[refs[i]];
+            const AABB box0 = object.BoundingBoxAt(time0);
+            const AABB box1 = object.BoundingBoxAt(time1);
+            const Point3 centroid = AABB::Lerp(box0, box1, 0.5).Center();
+
+            bounds0 = AABB(bounds0, box0);
+            bounds1 = AABB(bounds1, box1);
+            boundsMid = AABB(boundsMid, object.BoundingBoxAt(timeMid));
+            centroidBounds = AABB(centroidBounds, AABB(centroid, centroid));
+        }
+
+        nodes[nodeIdx].bounds0 = bounds0;
+        nodes[nodeIdx].bounds1 = bounds1;
+        nodes[nodeIdx].time0 = time0;
+        nodes[nodeIdx].invDuration = 1.0 / (time1 - time0);
+        nodes[nodeIdx].offset = 0;
+        nodes[nodeIdx].count = 0;
+        nodes[nodeIdx].axis = 0;
+        nodes[nodeIdx].timeSplit = 0;
+
+        const size_t count = end - start;
+        if (count <= 1)
+        {
+            MakeLeaf(nodeIdx, refs, start, end);
+            return;
+        }
+
+        const double interpolatedArea = AABB::Lerp(bounds0, bounds1, 0.5).SurfaceArea();
+        if (timeSplits < maxTimeSplits && interpolatedArea > timeSplitLooseness * boundsMid.SurfaceArea())
+        {
+            // Both halves reference the same objects, each over half of the time range.
+            std::vector<uint32_t> refsCopy(refs.begin() + start, refs.begin() + end);
+
+            nodes[nodeIdx].timeSplit = 1;
+            Build(refs, start, end, time0, timeMid, timeSplits + 1);
+            nodes[nodeIdx].offset = uint32_t(nodes.size());
+            Build(refsCopy, 0, refsCopy.size(), timeMid, time1, timeSplits + 1);
+            return;
+        }
+
+        int axis;
+        size_t mid;
+        if (!FindSpatialSplit(refs, start, end, time0, time1, centroidBounds, interpolatedArea, axis, mid))
+        {
+            if (count <= maxLeafSize)
+            {
+                MakeLeaf(nodeIdx, refs, start, end);
+                return;
+            }
+
+            // Too many objects for a leaf; fall back to a median split along the widest axis.
+            axis = centroidBounds.LongestAxis();
+            mid = start + count / 2;
+            std::nth_element(refs.begin() + start, refs.begin() + mid, refs.begin() + end,
+                [&](uint32_t a, uint32_t b)
+                {
+                    return Centroid(a, time0, time1)[axis] < Centroid(b, time0, time1)[axis];
+                });
+        }
+
+        nodes[nodeIdx].axis = uint8_t(axis);
+        Build(refs, start, mid, time0, time1, timeSplits);
+        nodes[nodeIdx].offset = uint32_t(nodes.size());
+        Build(refs, mid, end, time0, time1, timeSplits);
+    }
+
+    bool FindSpatialSplit(std::vector<uint32_t>& refs, size_t start, size_t end, double time0, double time1,
+        const AABB& centroidBounds, double nodeArea, int& bestAxis, size_t& mid) const
+    {
+        // Binned surface area heuristic over the mid-time centroids. The cost of each side uses the
+        // area of its interpolated bounds at the middle of the time range. Returns false if making
+        // a leaf is cheaper than any split.
+
+        struct Bin
+        {
+            AABB bounds0, bounds1;
+            size_t count = 0;
+        };
+
+        double bestCost = intersectionCost * double(end - start);
+        int bestBin = -1;
+        bestAxis = -1;
+
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const Interval& extent = centroidBounds.AxisInterval(axis);
+            if (extent.Size() <= 0)
+                continue;
+
+            Bin bins[binCount];
+            const double scale = binCount / extent.Size();
+
+            for (size_t i = start; i < end; i++)
+            {
+                const Hittable& object = *objects[refs[i]];
+                const AABB box0 = object.BoundingBoxAt(time0);
+                const AABB box1 = object.BoundingBoxAt(time1);
+                const double c = AABB::Lerp(box0, box1, 0.5).Center()[axis];
+
+                Bin& bin = bins[std::min(binCount - 1, int((c - extent.min) * scale))];
+                bin.bounds0 = AABB(bin.bounds0, box0);
+                bin.bounds1 = AABB(bin.bounds1, box1);
+                bin.count++;
+            }
+
+            // Sweep from the right to get the cost of every right side, then from the left.
+            double rightArea[binCount];
+            size_t rightCount[binCount];
+            AABB right0, right1;
+            size_t count = 0;
+            for (int b = binCount - 1; b > 0; b--)
+            {
+                right0 = AABB(right0, bins[b].bounds0);
+                right1 = AABB(right1, bins[b].bounds1);
+                count += bins[b].count;
+                rightArea[b] = AABB::Lerp(right0, right1, 0.5).SurfaceArea();
+                rightCount[b] = count;
+            }
+
+            AABB left0, left1;
+            count = 0;
+            for (int b = 0; b < binCount - 1; b++)
+            {
+                left0 = AABB(left0, bins[b].bounds0);
+                left1 = AABB(left1, bins[b].bounds1);
+                count += bins[b].count;
+
+                if (count == 0 || rightCount[b + 1] == 0)
+                    continue;
+
+                const double leftArea = AABB::Lerp(left0, left1, 0.5).SurfaceArea();
+                const double cost = traversalCost + intersectionCost *
+                    (leftArea * count + rightArea[b + 1] * rightCount[b + 1]) / nodeArea;
+
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = b;
+                }
+            }
+        }
+
+        if (bestAxis < 0)
+            return false;
+
+        const Interval& extent = centroidBounds.AxisInterval(bestAxis);
+        const double scale = binCount / extent.Size();
+
+        auto it = std::partition(refs.begin() + start, refs.begin() + end, [&](uint32_t ref)
+        {
+            const double c = Centroid(ref, time0, time1)[bestAxis];
+            return std::min(binCount - 1, int((c - extent.min) * scale)) <= bestBin;
+        });
+
+        mid = size_t(it - refs.begin());
+        return true;
+    }
+
+    Point3 Centroid(uint32_t ref, double time0, double time1) const
+    {
+        const Hittable& object = *objects[ref];
+        return AABB::Lerp(object.BoundingBoxAt(time0), object.BoundingBoxAt(time1), 0.5).Center();
+    }
+
+    void MakeLeaf(size_t nodeIdx, const std::vector<uint32_t>& refs, size_t start, size_t end)
+    {
+        nodes[nodeIdx].offset = uint32_t(leafRefs.size());
+        nodes[nodeIdx].count = uint16_t(end - start);
+        leafRefs.insert(leafRefs.end(), refs.begin() + start, refs.begin() + end);
+    }
+
+private:
+    std::vector<shared_ptr<Hittable>> objects;
+    std::vector<Node> nodes;
+    std::vector<uint32_t> leafRefs;
+    int maxTimeSplits;
+    AABB bbox;
+};
@@ -1,20 +1,46 @@
 #pragma once
 
+#include "simd.h"
+
 #include <algorithm>
+#include <cstdint>
+
+struct PerlinTables
+{
+    // Random gradients and permutations of a Perlin noise generator. Plain data, so they can be
+    // written to and used straight from a file. Permutations of 256 entries fit in bytes, which
+    // keeps all three in a dozen cache lines.
+
+    static const int pointCount = 256;
+    Vec3 randvec[pointCount];
+    uint8_t perm_x[pointCount];
+    uint8_t perm_y[pointCount];
+    uint8_t perm_z[pointCount];
+};
 
 class Perlin
 {
 public:
     Perlin()
+        : ownedTables(make_shared<PerlinTables>())
+        , tables(ownedTables.get())
     {
+        PerlinTables& t = *ownedTables;
+
         for (int i = 0; i < pointCount; i++)
         {
-            randvec[i] = UnitVector(Vec3::Random(-1, 1));
+            t.randvec[i] = UnitVector(Vec3::Random(-1, 1));
         }
 
-        PerlinGeneratePerm(perm_x);
-        PerlinGeneratePerm(perm_y);
-        PerlinGeneratePerm(perm_z);
+        PerlinGeneratePerm(t.perm_x);
+        PerlinGeneratePerm(t.perm_y);
+        PerlinGeneratePerm(t.perm_z);
+    }
+
+    Perlin(const PerlinTables* tables)
+        : tables(tables)
+    {
+        // Uses tables owned by someone else, who must keep them alive.
     }
 
     double Noise(const Point3& p) const
@@ -32,10 +58,10 @@ public:
             for (int dj = 0; dj < 2; dj++)
                 for (int dk = 0; dk < 2; dk++)
                 {
-                    c[di][dj][dk] = randvec[
-                        perm_x[(i + di) & 255] ^
-                            perm_y[(j + dj) & 255] ^
-                            perm_z[(k + dk) & 255]
+                    c[di][dj][dk] = tables->randvec[
+                        tables->perm_x[(i + di) & 255] ^
+                            tables->perm_y[(j + dj) & 255] ^
+                            tables->perm_z[(k + dk) & 255]
                     ];
                 }
 
@@ -44,36 +70,133 @@ public:
 
     double Turb(const Point3& p, int depth) const
     {
+        // Evaluates four octaves at once, one per SIMD lane. Only the gradient lookups are done
+        // lane by lane, and every lane adds up its terms in the same order as Noise, so the result
+        // is the same as summing Noise over the octaves.
+
         double accum = 0.0;
         Point3 temp_p = p;
         double weight = 1.0;
 
-        for (int i = 0; i < depth; i++)
+        for (int first = 0; first < depth; first += 4)
         {
-            accum += weight * Noise(temp_p);
-            weight *= 0.5;
-            temp_p *= 2;
+            const int laneCount = std::min(4, depth - first);
+            OctaveLanes lanes;
+
+            // Lanes past the last octave are evaluated at the origin and ignored.
+            alignas(32) double x[4] = {}, y[4] = {}, z[4] = {};
+            for (int lane = 0; lane < laneCount; lane++)
+            {
+                x[lane] = temp_p.x();
+                y[lane] = temp_p.y();
+                z[lane] = temp_p.z();
+                temp_p *= 2;
+            }
+
+            lanes.Gather(*tables, x, y, z);
+
+            alignas(32) double noise[4];
+            lanes.Interpolate().Store(noise);
+
+            for (int lane = 0; lane < laneCount; lane++)
+            {
+                accum += weight * noise[lane];
+                weight *= 0.5;
+            }
         }
 
         return std::fabs(accum);
     }
 
+    const PerlinTables& Tables() const { return *tables; }
+
 private:
-    static const int pointCount = 256;
-    Vec3 randvec[pointCount];
-    int perm_x[pointCount];
-    int perm_y[pointCount];
-    int perm_z[pointCount];
+    static const int pointCount = PerlinTables::pointCount;
+    shared_ptr<PerlinTables> ownedTables;
+    const PerlinTables* tables;
+
+    struct OctaveLanes
+    {
+        // Fractional positions and the gradients at the eight surrounding lattice points of one
+        // noise lookup per lane, with corners numbered 4 * di + 2 * dj + dk.
+
+        alignas(32) double u[4], v[4], w[4];
+        alignas(32) double gx[8][4], gy[8][4], gz[8][4];
+
+        void Gather(const PerlinTables& t, const double* x, const double* y, const double* z)
+        {
+            alignas(32) double fx[4], fy[4], fz[4];
+            const Double4 px = Double4::Load(x), py = Double4::Load(y), pz = Double4::Load(z);
+            const Double4 floorX = Floor(px), floorY = Floor(py), floorZ = Floor(pz);
+            floorX.Store(fx);
+            floorY.Store(fy);
+            floorZ.Store(fz);
+            (px - floorX).Store(u);
+            (py - floorY).Store(v);
+            (pz - floorZ).Store(w);
+
+            for (int lane = 0; lane < 4; lane++)
+            {
+                const int i = int(fx[lane]);
+                const int j = int(fy[lane]);
+                const int k = int(fz[lane]);
+
+                // The x and y permutations are shared by the two corners along z.
+                const int pz0 = t.perm_z[k & 255];
+                const int pz1 = t.perm_z[(k + 1) & 255];
+
+                for (int corner = 0; corner < 8; corner += 2)
+                {
+                    const int pxy = t.perm_x[(i + (corner >> 2)) & 255] ^ t.perm_y[(j + ((corner >> 1) & 1)) & 255];
+                    const Vec3& g0 = t.randvec[pxy ^ pz0];
+                    const Vec3& g1 = t.randvec[pxy ^ pz1];
+
+                    gx[corner][lane] = g0.x();
+                    gy[corner][lane] = g0.y();
+                    gz[corner][lane] = g0.z();
+                    gx[corner + 1][lane] = g1.x();
+                    gy[corner + 1][lane] = g1.y();
+                    gz[corner + 1][lane] = g1.z();
+                }
+            }
+        }
+
+        Double4 Interpolate() const
+        {
+            // PerlinInterp on every lane.
+
+            const Double4 one(1.0), three(3.0), two(2.0);
+            const Double4 fu = Double4::Load(u), fv = Double4::Load(v), fw = Double4::Load(w);
+            const Double4 uu = fu * fu * (three - two * fu);
+            const Double4 vv = fv * fv * (three - two * fv);
+            const Double4 ww = fw * fw * (three - two * fw);
+
+            Double4 accum(0.0);
+            for (int corner = 0; corner < 8; corner++)
+            {
+                const bool i = corner >> 2, j = (corner >> 1) & 1, k = corner & 1;
+
+                const Double4 weight = (i ? uu : one - uu) * (j ? vv : one - vv) * (k ? ww : one - ww);
+                const Double4 dot = Double4::Load(gx[corner]) * (i ? fu - one : fu)
+                    + Double4::Load(gy[corner]) * (j ? fv - one : fv)
+                    + Double4::Load(gz[corner]) * (k ? fw - one : fw);
+
+                accum = accum + weight * dot;
+            }
+
+            return accum;
+        }
+    };
 
-    static void PerlinGeneratePerm(int* p)
+    static void PerlinGeneratePerm(uint8_t* p)
     {
         for (int i = 0; i < pointCount; i++)
-            p[i] = i;
+            p[i] = uint8_t(i);
 
         Permute(p, pointCount);
     }
 
-    static void Permute(int* p, int n)
+    static void Permute(uint8_t* p, int n)
     {
         for (int i = n - 1; i > 0; i--)
         {
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+class PreviewBuffer
+{
+public:
+    // Named shared memory holding two 8-bit RGB frames, written by a renderer and read by any
+    // number of viewers in other processes. The renderer writes the frame viewers aren't
+    // reading, then bumps the sequence number, whose lowest bit says which frame is current.
+    // Viewers copy the current frame and keep the copy if the sequence didn't change while
+    // they read, so they never hold up the renderer.
+
+    PreviewBuffer() {}
+    PreviewBuffer(const PreviewBuffer&) = delete;
+    PreviewBuffer& operator=(const PreviewBuffer&) = delete;
+
+    ~PreviewBuffer() { Close(); }
+
+    bool Create(const std::string& name, int width, int height)
+    {
+        // Creates the shared memory, or takes over one left with the same name.
+
+        Close();
+
+        const size_t size = sizeof(Header) + 2 * FrameBytes(width, height);
+        if (!Map(name, size, true))
+            return false;
+
+        Header& header = *reinterpret_cast<Header*>(data);
+        header.width = uint32_t(width);
+        header.height = uint32_t(height);
+        header.samples = 0;
+        header.sequence.store(0, std::memory_order_relaxed);
+        std::memset(data + sizeof(Header), 0, 2 * FrameBytes(width, height));
+
+        // Viewers check the magic last, so they don't see a half written header.
+        std::memcpy(header.magic, previewMagic, sizeof(header.magic));
+        std::atomic_thread_fence(std::memory_order_release);
+        header.formatVersion = formatVersion;
+        owner = true;
+        this->name = name;
+        return true;
+    }
+
+    bool Attach(const std::string& name)
+    {
+        // Opens the shared memory of a running or finished renderer for reading.
+
+        Close();
+
+        if (!Map(name, sizeof(Header), false))
+            return false;
+
+        const Header& header = *reinterpret_cast<const Header*>(data);
+        if (std::memcmp(header.magic, previewMagic, sizeof(header.magic)) != 0 || header.formatVersion != formatVersion)
+        {
+            Close();
+            return false;
+        }
+
+        // Map again now that the size is known.
+        const size_t size = sizeof(Header) + 2 * FrameBytes(header.width, header.height);
+        Unmap();
+        return Map(name, size, false);
+    }
+
+    void Publish(const unsigned char* pixels, int samples)
+    {
+        // Copies rows of RGB bytes into the frame viewers aren't reading, then makes it current.
+
+        Header& header = *reinterpret_cast<Header*>(data);
+        const uint64_t sequence = header.sequence.load(std::memory_order_relaxed);
+        std::memcpy(Frame((sequence + 1) & 1), pixels, FrameBytes(header.width, header.height));
+        header.samples = uint32_t(samples);
+        header.sequence.store(sequence + 1, std::memory_order_release);
+    }
+
+    bool Read(std::vector<unsigned char>& pixels, int& samples, uint64_t& sequence) const
+    {
+        // Copies the current frame. Returns false if the renderer published a frame while it
+        // was being copied, in which case reading again gets the newer one.
+
+        const Header& header = *reinterpret_cast<const Header*>(data);
+        sequence = header.sequence.load(std::memory_order_acquire);
+        samples = int(header.samples);
+        pixels.resize(FrameBytes(header.width, header.height));
+        std::memcpy(pixels.data(), Frame(sequence & 1), pixels.size());
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return header.sequence.load(std::memory_order_relaxed) == sequence;
+    }
+
+    void Close()
+    {
+        Unmap();
+
+#ifndef _WIN32
+        if (owner)
+            shm_unlink(SharedName(name).c_str());
+#endif
+        owner = false;
+    }
+
+    bool IsOpen() const { return data != nullptr; }
+    int Width() const { return int(reinterpret_cast<const Header*>(data)->width); }
+    int Height() const { return int(reinterpret_cast<const Header*>(data)->height); }
+
+private:
+    static constexpr char previewMagic[8] = { 'R', 'T', 'P', 'R', 'E', 'V', 0, 0 };
+    static constexpr uint32_t formatVersion = 1;
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t formatVersion;
+        uint32_t width;
+        uint32_t height;
+        uint32_t samples;                 // Per pixel, in the current frame
+        std::atomic<uint64_t> sequence;   // Frames published, its lowest bit is the current frame
+    };
+
+    unsigned char* data = nullptr;
+    size_t size = 0;
+    bool owner = false;  // Removes the name when closed
+    std::string name;
+
+#ifdef _WIN32
+    HANDLE mapping = nullptr;
+#endif
+
+    static size_t FrameBytes(size_t width, size_t height) { return width * height * 3; }
+
+    unsigned char* Frame(uint64_t index) const
+    {
+        const Header& header = *reinterpret_cast<const Header*>(data);
+        return data + sizeof(Header) + index * FrameBytes(header.width, header.height);
+    }
+
+    static std::string SharedName(const std::string& name)
+    {
+        // POSIX names start with a slash, Windows ones live in the session namespace.
+#ifdef _WIN32
+        return "Local\\" + name;
+#else
+        return "/" + name;
+#endif
+    }
+
+    bool Map(const std::string& name, size_t mapSize, bool create)
+    {
+#ifdef _WIN32
+        mapping = create
+            ? CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, DWORD(uint64_t(mapSize) >> 32), DWORD(mapSize), SharedName(name).c_str())
+            : OpenFileMappingA(FILE_MAP_READ, FALSE, SharedName(name).c_str());
+        if (mapping == nullptr)
+            return false;
+
+        data = static_cast<unsigned char*>(MapViewOfFile(mapping, create ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, mapSize));
+#else
+        const int fd = shm_open(SharedName(name).c_str(), create ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+        if (fd < 0)
+            return false;
+
+        struct stat sharedStat;
+        const bool sized = create ? ftruncate(fd, off_t(mapSize)) == 0 : fstat(fd, &sharedStat) == 0 && size_t(sharedStat.st_size) >= mapSize;
+        void* mapped = sized ? mmap(nullptr, mapSize, create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close(fd);
+
+        data = (mapped == MAP_FAILED) ? nullptr : static_cast<unsigned char*>(mapped);
+#endif
+
+        size = mapSize;
+        if (data == nullptr)
+        {
+            Unmap();
+            return false;
+        }
+
+        return true;
+    }
+
+    void Unmap()
+    {
+#ifdef _WIN32
+        if (data != nullptr) UnmapViewOfFile(data);
+        if (mapping != nullptr) CloseHandle(mapping);
+        mapping = nullptr;
+#else
+        if (data != nullptr) munmap(data, size);
+#endif
+        data = nullptr;
+        size = 0;
+    }
+};
@@ -0,0 +1,554 @@
+#pragma once
+
+#include "hittable.h"
+#include "quad.h"
+#include "simd.h"
+#include "sphere.h"
+#include "triangleMesh.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <typeinfo>
+#include <unordered_map>
+#include <vector>
+
+class PrimitiveBatch final : public Hittable
+{
+public:
+    // Spheres and quads stored as structures of arrays, four to a block, under a BVH whose leaves
+    // reference runs of blocks. Every block is intersected at once with SIMD, and only the
+    // nearest hit gets a hit record. Sphere and Quad stay the way to build scenes, the scene
+    // compiler moves them into batches.
+
+    static constexpr int laneCount = 4;
+
+    struct alignas(32) SphereBlock
+    {
+        double centerX[laneCount], centerY[laneCount], centerZ[laneCount];  // Center at time zero
+        double motionX[laneCount], motionY[laneCount], motionZ[laneCount];  // Center movement over the shutter
+        double radius[laneCount];
+    };
+
+    struct alignas(32) QuadBlock
+    {
+        double cornerX[laneCount], cornerY[laneCount], cornerZ[laneCount];
+        double edgeUX[laneCount], edgeUY[laneCount], edgeUZ[laneCount];
+        double edgeVX[laneCount], edgeVY[laneCount], edgeVZ[laneCount];
+        double planeWX[laneCount], planeWY[laneCount], planeWZ[laneCount];
+        double normalX[laneCount], normalY[laneCount], normalZ[laneCount];
+        double planeD[laneCount];
+    };
+
+    struct Node
+    {
+        double min[3];
+        double max[3];
+        uint32_t offset;        // Leaf: first sphere block. Interior: index of the first child, the second follows it
+        uint32_t quadOffset;    // Leaf: first quad block
+        uint16_t sphereBlocks;  // Blocks in a leaf, both zero for interior nodes
+        uint16_t quadBlocks;
+    };
+
+    static bool CanBatch(const Hittable& object)
+    {
+        // Only plain spheres and quads, since derived classes may change how they are hit. Moving
+        // spheres are left to the motion BVH, whose bounds follow them through the shutter
+        // interval, since the batch hierarchy would have to use their swept boxes.
+        if (typeid(object) == typeid(Quad))
+            return true;
+
+        return typeid(object) == typeid(Sphere) && static_cast<const Sphere&>(object).Center().direction().LengthSquared() == 0;
+    }
+
+    PrimitiveBatch(const std::vector<shared_ptr<Hittable>>& objects)
+        : Hittable(HittableKind::PrimitiveBatch)
+    {
+        // Objects that can't be batched are left out, see CanBatch.
+
+        std::vector<BuildPrimitive> primitives;
+        for (const shared_ptr<Hittable>& object : objects)
+        {
+            if (!CanBatch(*object))
+                continue;
+
+            BuildPrimitive primitive;
+            primitive.object = object.get();
+            primitive.isQuad = typeid(*object) == typeid(Quad);
+            primitive.bbox = object->BoundingBox();
+            primitive.centroid = primitive.bbox.Center();
+            primitives.push_back(primitive);
+        }
+
+        if (primitives.empty())
+            return;
+
+        primitiveCount = primitives.size();
+        nodes.reserve(2 * primitives.size());
+        nodes.emplace_back();
+        Build(primitives, 0, 0, uint32_t(primitives.size()));
+
+        materialIds.clear();
+
+        const Node& root = nodes[0];
+        bbox = AABB(Point3(root.min[0], root.min[1], root.min[2]), Point3(root.max[0], root.max[1], root.max[2]));
+    }
+
+    bool Intersect(const Ray& r, const Interval& ray_t, Intersection& hit) const override
+    {
+        if (nodes.empty())
+            return false;
+
+        const TriangleMesh::RayData ray(r);
+        const RayLanes lanes(r);
+
+        double closest = ray_t.max;
+        uint32_t hitBlock = 0;
+        int hitLane = -1;
+        bool hitQuad = false;
+
+        // Nodes still to visit, with the distance where the ray enters them.
+        struct StackEntry
+        {
+            uint32_t node;
+            double tEnter;
+        } stack[64];
+
+        int stackSize = 0;
+        uint32_t nodeIdx = 0;
+
+        while (true)
+        {
+            const Node& node = nodes[nodeIdx];
+
+            if (node.sphereBlocks + node.quadBlocks > 0)
+            {
+                for (uint32_t i = node.offset; i < node.offset + node.sphereBlocks; i++)
+                {
+                    const int lane = IntersectSpheres(sphereBlocks[i], lanes, ray_t.min, closest);
+                    if (lane >= 0)
+                    {
+                        hitBlock = i;
+                        hitLane = lane;
+                        hitQuad = false;
+                    }
+                }
+
+                for (uint32_t i = node.quadOffset; i < node.quadOffset + node.quadBlocks; i++)
+                {
+                    const int lane = IntersectQuads(quadBlocks[i], lanes, ray_t.min, closest);
+                    if (lane >= 0)
+                    {
+                        hitBlock = i;
+                        hitLane = lane;
+                        hitQuad = true;
+                    }
+                }
+            }
+            else
+            {
+                // Visit the nearest child first, and skip the children the ray misses.
+                double tLeft = TriangleMesh::SlabEntry(ray, nodes[node.offset].min, nodes[node.offset].max, ray_t.min, closest);
+                double tRight = TriangleMesh::SlabEntry(ray, nodes[node.offset + 1].min, nodes[node.offset + 1].max, ray_t.min, closest);
+                uint32_t first = node.offset;
+                uint32_t second = node.offset + 1;
+
+                if (tRight < tLeft)
+                {
+                    std::swap(tLeft, tRight);
+                    std::swap(first, second);
+                }
+
+                if (tLeft < infinity)
+                {
+                    if (tRight < infinity)
+                        stack[stackSize++] = { second, tRight };
+                    nodeIdx = first;
+                    continue;
+                }
+            }
+
+            // Skip the nodes that start beyond the closest hit found since they were pushed.
+            while (stackSize > 0 && stack[stackSize - 1].tEnter > closest)
+                stackSize--;
+
+            if (stackSize == 0)
+                break;
+            nodeIdx = stack[--stackSize].node;
+        }
+
+        if (hitLane < 0)
+            return false;
+
+        hit.Set(closest, this, (hitQuad ? quadFlag : 0) | (hitBlock * laneCount + hitLane));
+        return true;
+    }
+
+    void ComputeSurface(const Ray& r, const Intersection& hit, int depth, HitRecord& rec) const override
+    {
+        const uint32_t lane = hit.primitive & ~quadFlag;
+
+        if (hit.primitive & quadFlag)
+        {
+            FillQuadRecord(r, quadBlocks[lane / laneCount], lane % laneCount, hit.t, rec);
+            rec.mat = materials[quadMaterials[lane]].get();
+        }
+        else
+        {
+            const SphereBlock& block = sphereBlocks[lane / laneCount];
+            const int i = lane % laneCount;
+            const Ray center(Point3(block.centerX[i], block.centerY[i], block.centerZ[i]),
+                Vec3(block.motionX[i], block.motionY[i], block.motionZ[i]));
+            Sphere::SphereSurface(center, block.radius[i], r, hit.t, rec);
+            rec.mat = materials[sphereMaterials[lane]].get();
+        }
+    }
+
+    AABB BoundingBox() const override { return bbox; }
+
+    size_t PrimitiveCount() const { return primitiveCount; }
+
+private:
+    static constexpr uint32_t quadFlag = 0x80000000;  // Set in the primitive of quad hits
+
+    std::vector<Node> nodes;
+    std::vector<SphereBlock> sphereBlocks;
+    std::vector<QuadBlock> quadBlocks;
+    std::vector<shared_ptr<Material>> materials;     // Every material of the batch, once
+    std::vector<uint32_t> sphereMaterials;            // Index in materials of every lane
+    std::vector<uint32_t> quadMaterials;
+    std::unordered_map<const Material*, uint32_t> materialIds;  // Only used while building
+    size_t primitiveCount = 0;
+    AABB bbox;
+
+    struct RayLanes
+    {
+        // The ray broadcast to every lane.
+
+        Double4 originX, originY, originZ;
+        Double4 directionX, directionY, directionZ;
+        Double4 time;
+        Double4 lengthSquared;
+
+        RayLanes(const Ray& r)
+            : originX(r.origin().x()), originY(r.origin().y()), originZ(r.origin().z())
+            , directionX(r.direction().x()), directionY(r.direction().y()), directionZ(r.direction().z())
+            , time(r.time())
+            , lengthSquared(r.direction().LengthSquared())
+        {}
+    };
+
+    static int NearestLane(Double4 t, double& closest)
+    {
+        // Returns the lane with the smallest t, if it is below closest, and updates closest.
+
+        if (MoveMask(t < Double4(closest)) == 0)
+            return -1;
+
+        alignas(32) double values[laneCount];
+        t.Store(values);
+
+        int nearest = -1;
+        for (int lane = 0; lane < laneCount; lane++)
+        {
+            if (values[lane] < closest)
+            {
+                closest = values[lane];
+                nearest = lane;
+            }
+        }
+        return nearest;
+    }
+
+    static int IntersectSpheres(const SphereBlock& block, const RayLanes& ray, double tMin, double& closest)
+    {
+        // Same arithmetic as Sphere::IntersectSphere, on four spheres at once.
+
+        const Double4 centerX = Double4::Load(block.centerX) + ray.time * Double4::Load(block.motionX);
+        const Double4 centerY = Double4::Load(block.centerY) + ray.time * Double4::Load(block.motionY);
+        const Double4 centerZ = Double4::Load(block.centerZ) + ray.time * Double4::Load(block.motionZ);
+        const Double4 radius = Double4::Load(block.radius);
+
+        const Double4 ocX = centerX - ray.originX;
+        const Double4 ocY = centerY - ray.originY;
+        const Double4 ocZ = centerZ - ray.originZ;
+
+        const Double4 h = ray.directionX * ocX + ray.directionY * ocY + ray.directionZ * ocZ;
+        const Double4 c = ocX * ocX + ocY * ocY + ocZ * ocZ - radius * radius;
+        const Double4 discriminant = h * h - ray.lengthSquared * c;
+        const Double4 sqrtd = Sqrt(Max(discriminant, Double4(0)));
+
+        const Double4 lower(tMin);
+        const Double4 upper(closest);
+        const Double4 nearRoot = (h - sqrtd) / ray.lengthSquared;
+        const Double4 farRoot = (h + sqrtd) / ray.lengthSquared;
+        const Double4 nearValid = (nearRoot > lower) & (nearRoot < upper);
+        const Double4 farValid = (farRoot > lower) & (farRoot < upper);
+
+        const Double4 miss(infinity);
+        Double4 t = Select(farValid, farRoot, miss);
+        t = Select(nearValid, nearRoot, t);
+        t = Select(discriminant >= Double4(0), t, miss);
+
+        return NearestLane(t, closest);
+    }
+
+    static int IntersectQuads(const QuadBlock& block, const RayLanes& ray, double tMin, double& closest)
+    {
+        // Same arithmetic as Quad::HitPlane and Quad::IsInterior, on four quads at once.
+
+        const Double4 normalX = Double4::Load(block.normalX);
+        const Double4 normalY = Double4::Load(block.normalY);
+        const Double4 normalZ = Double4::Load(block.normalZ);
+
+        const Double4 denom = normalX * ray.directionX + normalY * ray.directionY + normalZ * ray.directionZ;
+        const Double4 t = (Double4::Load(block.planeD) - (normalX * ray.originX + normalY * ray.originY + normalZ * ray.originZ)) / denom;
+
+        Double4 valid = (Abs(denom) >= Double4(1e-8)) & (t >= Double4(tMin)) & (t <= Double4(closest));
+        if (MoveMask(valid) == 0)
+            return -1;
+
+        const Double4 pX = ray.originX + t * ray.directionX - Double4::Load(block.cornerX);
+        const Double4 pY = ray.originY + t * ray.directionY - Double4::Load(block.cornerY);
+        const Double4 pZ = ray.originZ + t * ray.directionZ - Double4::Load(block.cornerZ);
+
+        const Double4 uX = Double4::Load(block.edgeUX), uY = Double4::Load(block.edgeUY), uZ = Double4::Load(block.edgeUZ);
+        const Double4 vX = Double4::Load(block.edgeVX), vY = Double4::Load(block.edgeVY), vZ = Double4::Load(block.edgeVZ);
+        const Double4 wX = Double4::Load(block.planeWX), wY = Double4::Load(block.planeWY), wZ = Double4::Load(block.planeWZ);
+
+        // alpha = w . (p x v), beta = w . (u x p)
+        const Double4 alpha = wX * (pY * vZ - pZ * vY) + wY * (pZ * vX - pX * vZ) + wZ * (pX * vY - pY * vX);
+        const Double4 beta = wX * (uY * pZ - uZ * pY) + wY * (uZ * pX - uX * pZ) + wZ * (uX * pY - uY * pX);
+
+        const Double4 zero(0), one(1);
+        valid = valid & (alpha >= zero) & (alpha <= one) & (beta >= zero) & (beta <= one);
+
+        return NearestLane(Select(valid, t, Double4(infinity)), closest);
+    }
+
+    static void FillQuadRecord(const Ray& r, const QuadBlock& block, int lane, double t, HitRecord& rec)
+    {
+        const Point3 Q(block.cornerX[lane], block.cornerY[lane], block.cornerZ[lane]);
+        const Vec3 u(block.edgeUX[lane], block.edgeUY[lane], block.edgeUZ[lane]);
+        const Vec3 v(block.edgeVX[lane], block.edgeVY[lane], block.edgeVZ[lane]);
+        const Vec3 w(block.planeWX[lane], block.planeWY[lane], block.planeWZ[lane]);
+
+        rec.t = t;
+        rec.p = r.at(t);
+
+        const Vec3 planarHitptVector = rec.p - Q;
+        rec.u = Dot(w, Cross(planarHitptVector, v));
+        rec.v = Dot(w, Cross(u, planarHitptVector));
+        rec.dpdu = u;
+        rec.dpdv = v;
+        rec.SetFaceNormal(r, Vec3(block.normalX[lane], block.normalY[lane], block.normalZ[lane]));
+    }
+
+    // BVH construction
+
+    static constexpr int binCount = 16;
+    static constexpr uint32_t maxLeafSize = 8;
+
+    struct BuildPrimitive
+    {
+        const Hittable* object;
+        bool isQuad;
+        AABB bbox;
+        Point3 centroid;
+    };
+
+    void Build(std::vector<BuildPrimitive>& primitives, uint32_t nodeIdx, uint32_t begin, uint32_t end)
+    {
+        AABB bounds = AABB::empty;
+        for (uint32_t i = begin; i < end; i++)
+            bounds = AABB(bounds, primitives[i].bbox);
+
+        for (int axis = 0; axis < 3; axis++)
+        {
+            nodes[nodeIdx].min[axis] = bounds.AxisInterval(axis).min;
+            nodes[nodeIdx].max[axis] = bounds.AxisInterval(axis).max;
+        }
+
+        const uint32_t count = end - begin;
+        const uint32_t mid = count <= maxLeafSize ? end : FindSplit(primitives, begin, end);
+
+        if (mid == end)
+        {
+            MakeLeaf(primitives, nodeIdx, begin, end);
+            return;
+        }
+
+        const uint32_t left = uint32_t(nodes.size());
+        nodes.emplace_back();
+        nodes.emplace_back();
+
+        nodes[nodeIdx].offset = left;
+        nodes[nodeIdx].quadOffset = 0;
+        nodes[nodeIdx].sphereBlocks = 0;
+        nodes[nodeIdx].quadBlocks = 0;
+
+        Build(primitives, left, begin, mid);
+        Build(primitives, left + 1, mid, end);
+    }
+
+    uint32_t FindSplit(std::vector<BuildPrimitive>& primitives, uint32_t begin, uint32_t end) const
+    {
+        // Partitions the range by the cheapest binned SAH split, and returns where the second
+        // half starts. Ranges whose centroids all coincide are split in the middle.
+
+        AABB centroidBounds = AABB::empty;
+        for (uint32_t i = begin; i < end; i++)
+            centroidBounds = AABB(centroidBounds, AABB(primitives[i].centroid, primitives[i].centroid));
+
+        double bestCost = infinity;
+        int bestAxis = -1;
+        int bestBin = 0;
+
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const Interval& extent = centroidBounds.AxisInterval(axis);
+            if (extent.Size() <= 0)
+                continue;
+
+            AABB binBounds[binCount];
+            uint32_t binCounts[binCount] = {};
+            for (int b = 0; b < binCount; b++)
+                binBounds[b] = AABB::empty;
+
+            const double scale = binCount / extent.Size();
+            for (uint32_t i = begin; i < end; i++)
+            {
+                const int b = BinIndex(primitives[i].centroid[axis], extent.min, scale);
+                binBounds[b] = AABB(binBounds[b], primitives[i].bbox);
+                binCounts[b]++;
+            }
+
+            // Sweep from the right to get the area and count right of every split plane.
+            double rightArea[binCount];
+            uint32_t rightCount[binCount];
+            AABB accumulated = AABB::empty;
+            uint32_t accumulatedCount = 0;
+            for (int b = binCount - 1; b > 0; b--)
+            {
+                accumulated = AABB(accumulated, binBounds[b]);
+                accumulatedCount += binCounts[b];
+                rightArea[b] = accumulated.SurfaceArea();
+                rightCount[b] = accumulatedCount;
+            }
+
+            accumulated = AABB::empty;
+            accumulatedCount = 0;
+            for (int b = 0; b < binCount - 1; b++)
+            {
+                accumulated = AABB(accumulated, binBounds[b]);
+                accumulatedCount += binCounts[b];
+                if (accumulatedCount == 0 || rightCount[b + 1] == 0)
+                    continue;
+
+                const double cost = accumulatedCount * accumulated.SurfaceArea() + rightCount[b + 1] * rightArea[b + 1];
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = b;
+                }
+            }
+        }
+
+        auto first = primitives.begin() + begin;
+        auto last = primitives.begin() + end;
+
+        if (bestAxis < 0)
+            return begin + (end - begin) / 2;
+
+        const Interval& extent = centroidBounds.AxisInterval(bestAxis);
+        const double scale = binCount / extent.Size();
+        auto split = std::partition(first, last, [&](const BuildPrimitive& p)
+        {
+            return BinIndex(p.centroid[bestAxis], extent.min, scale) <= bestBin;
+        });
+        return uint32_t(split - primitives.begin());
+    }
+
+    static int BinIndex(double value, double min, double scale)
+    {
+        return std::min(binCount - 1, int((value - min) * scale));
+    }
+
+    void MakeLeaf(std::vector<BuildPrimitive>& primitives, uint32_t nodeIdx, uint32_t begin, uint32_t end)
+    {
+        // Packs the spheres and the quads of the leaf into their own blocks. Unused lanes are
+        // NaN, which fails every comparison, so they are never hit.
+
+        const double nan = std::numeric_limits<double>::quiet_NaN();
+
+        Node& node = nodes[nodeIdx];
+        node.offset = uint32_t(sphereBlocks.size());
+        node.quadOffset = uint32_t(quadBlocks.size());
+        node.sphereBlocks = 0;
+        node.quadBlocks = 0;
+
+        int sphereLane = laneCount, quadLane = laneCount;
+        for (uint32_t i = begin; i < end; i++)
+        {
+            if (primitives[i].isQuad)
+            {
+                if (quadLane == laneCount)
+                {
+                    QuadBlock block;
+                    std::fill_n(reinterpret_cast<double*>(&block), sizeof(QuadBlock) / sizeof(double), nan);
+                    quadBlocks.push_back(block);
+                    quadMaterials.resize(quadMaterials.size() + laneCount);
+                    node.quadBlocks++;
+                    quadLane = 0;
+                }
+
+                const Quad& quad = static_cast<const Quad&>(*primitives[i].object);
+                QuadBlock& block = quadBlocks.back();
+                SetLane(block.cornerX, block.cornerY, block.cornerZ, quadLane, quad.Corner());
+                SetLane(block.edgeUX, block.edgeUY, block.edgeUZ, quadLane, quad.EdgeU());
+                SetLane(block.edgeVX, block.edgeVY, block.edgeVZ, quadLane, quad.EdgeV());
+                SetLane(block.planeWX, block.planeWY, block.planeWZ, quadLane, quad.PlaneW());
+                SetLane(block.normalX, block.normalY, block.normalZ, quadLane, quad.Normal());
+                block.planeD[quadLane] = quad.PlaneD();
+                quadMaterials[(quadBlocks.size() - 1) * laneCount + quadLane] = MaterialId(quad.GetMaterial());
+                quadLane++;
+            }
+            else
+            {
+                if (sphereLane == laneCount)
+                {
+                    SphereBlock block;
+                    std::fill_n(reinterpret_cast<double*>(&block), sizeof(SphereBlock) / sizeof(double), nan);
+                    sphereBlocks.push_back(block);
+                    sphereMaterials.resize(sphereMaterials.size() + laneCount);
+                    node.sphereBlocks++;
+                    sphereLane = 0;
+                }
+
+                const Sphere& sphere = static_cast<const Sphere&>(*primitives[i].object);
+                SphereBlock& block = sphereBlocks.back();
+                SetLane(block.centerX, block.centerY, block.centerZ, sphereLane, sphere.Center().origin());
+                SetLane(block.motionX, block.motionY, block.motionZ, sphereLane, sphere.Center().direction());
+                block.radius[sphereLane] = sphere.Radius();
+                sphereMaterials[(sphereBlocks.size() - 1) * laneCount + sphereLane] = MaterialId(sphere.GetMaterial());
+                sphereLane++;
+            }
+        }
+    }
+
+    uint32_t MaterialId(const shared_ptr<Material>& mat)
+    {
+        auto found = materialIds.emplace(mat.get(), uint32_t(materials.size()));
+        if (found.second)
+            materials.push_back(mat);
+        return found.first->second;
+    }
+
+    static void SetLane(double* x, double* y, double* z, int lane, const Vec3& value)
+    {
+        x[lane] = value.x();
+        y[lane] = value.y();
+        z[lane] = value.z();
+    }
+};
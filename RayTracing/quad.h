@@ -1,13 +1,13 @@
 #pragma once
 
 #include "hittable.h"
-#include "hittableList.h"
 
-class Quad : public Hittable
+class Quad final : public Hittable
 {
 public:
     Quad(const Point3& Q, const Vec3& u, const Vec3& v, shared_ptr<Material> mat)
-        : Q(Q)
+        : Hittable(HittableKind::Quad)
+        , Q(Q)
         , u(u)
         , v(v)
         , mat(mat)
@@ -20,7 +20,7 @@ public:
         SetBoundingBox();
     }
 
-    virtual void SetBoundingBox()
+    void SetBoundingBox()
     {
         // Compute the bounding box of all four vertices.
         const AABB bboxDiagonal1 = AABB(Q, Q + u + v);
@@ -30,8 +30,71 @@ public:
 
     AABB BoundingBox() const override { return bbox; }
 
-    bool Hit(const Ray& r, const Interval& ray_t, HitRecord& rec) const override
+    AABB ClippedBoundingBox(const AABB& clip) const override
     {
+        // Clip the quad polygon against the six planes of the clip box and bound what's left.
+
+        Point3 polygon[10] = { Q, Q + u, Q + u + v, Q + v };
+        int vertexCount = 4;
+
+        for (int axis = 0; axis < 3 && vertexCount > 0; axis++)
+        {
+            const Interval& slab = clip.AxisInterval(axis);
+            vertexCount = ClipPolygon(polygon, vertexCount, axis, slab.min, +1.0);
+            vertexCount = ClipPolygon(polygon, vertexCount, axis, slab.max, -1.0);
+        }
+
+        AABB box;
+        for (int i = 0; i < vertexCount; i++)
+            box = AABB(box, AABB(polygon[i], polygon[i]));
+
+        return AABB::Overlap(box, clip);
+    }
+
+    bool Intersect(const Ray& r, const Interval& ray_t, Intersection& hit) const override
+    {
+        double t, alpha, beta;
+        if (!HitPlane(Q, u, v, w, normal, D, r, ray_t, t, alpha, beta))
+            return false;
+
+        // Determine if the hit point lies within the planar shape using its plane coordinates.
+        if (!IsInterior(alpha, beta))
+            return false;
+
+        hit.Set(t, this, 0, alpha, beta);
+        return true;
+    }
+
+    void ComputeSurface(const Ray& r, const Intersection& hit, int depth, HitRecord& rec) const override
+    {
+        // The plane coordinates of the hit are the UV coordinates.
+        rec.t = hit.t;
+        rec.p = r.at(hit.t);
+        rec.u = hit.b1;
+        rec.v = hit.b2;
+        rec.dpdu = u;
+        rec.dpdv = v;
+        rec.mat = mat.get();
+        rec.SetFaceNormal(r, normal);
+    }
+
+    bool Span(const Ray& r, Interval& span) const override
+    {
+        // A flat quad is crossed once, which lists of quads merge into the span of a closed shape.
+        Intersection hit;
+        if (!Intersect(r, Interval::universe, hit))
+            return false;
+
+        span = Interval(hit.t, hit.t);
+        return true;
+    }
+
+    static bool HitPlane(const Point3& Q, const Vec3& u, const Vec3& v, const Vec3& w, const Vec3& normal, double D,
+        const Ray& r, const Interval& ray_t, double& t, double& alpha, double& beta)
+    {
+        // Intersects the plane of a quad, returning the ray parameter and the plane coordinates
+        // of the hit point along u and v.
+
         const double denom = Dot(normal, r.direction());
 
         // No hit if the ray is parallel to the plane.
@@ -39,40 +102,65 @@ public:
             return false;
 
         // Return false if the hit point parameter t is outside the ray interval.
-        const double t = (D - Dot(normal, r.origin())) / denom;
+        t = (D - Dot(normal, r.origin())) / denom;
         if (!ray_t.Contains(t))
             return false;
 
-        // Determine if the hit point lies within the planar shape using its plane coordinates.
-        const Point3 intersection = r.at(t);
-        const Vec3 planarHitptVector = intersection - Q;
-        const double alpha = Dot(w, Cross(planarHitptVector, v));
-        const double beta = Dot(w, Cross(u, planarHitptVector));
-
-        if (!IsInterior(alpha, beta, rec))
-            return false;
-
-        // Ray hits the 2D shape; set the rest of the hit record and return true.
-        rec.t = t;
-        rec.p = intersection;
-        rec.mat = mat;
-        rec.SetFaceNormal(r, normal);
-
+        const Vec3 planarHitptVector = r.at(t) - Q;
+        alpha = Dot(w, Cross(planarHitptVector, v));
+        beta = Dot(w, Cross(u, planarHitptVector));
         return true;
     }
 
-    virtual bool IsInterior(double a, double b, HitRecord& rec) const
+    const Point3& Corner() const { return Q; }
+    const Vec3& EdgeU() const { return u; }
+    const Vec3& EdgeV() const { return v; }
+    const Vec3& PlaneW() const { return w; }
+    const Vec3& Normal() const { return normal; }
+    double PlaneD() const { return D; }
+    const shared_ptr<Material>& GetMaterial() const { return mat; }
+
+    bool IsInterior(double a, double b) const
     {
         const Interval unitInterval = Interval(0, 1);
         // Given the hit point in plane coordinates, return false if it is outside the
-        // primitive, otherwise set the hit record UV coordinates and return true.
+        // primitive. The plane coordinates become the UV coordinates of the hit.
 
-        if (!unitInterval.Contains(a) || !unitInterval.Contains(b))
-            return false;
+        return unitInterval.Contains(a) && unitInterval.Contains(b);
+    }
 
-        rec.u = a;
-        rec.v = b;
-        return true;
+private:
+
+    static int ClipPolygon(Point3* polygon, int vertexCount, int axis, double plane, double side)
+    {
+        // Sutherland-Hodgman clipping of a convex polygon against an axis aligned plane, keeping
+        // the half space where side * (p[axis] - plane) >= 0. Returns the new vertex count.
+
+        Point3 clipped[10];
+        int clippedCount = 0;
+
+        for (int i = 0; i < vertexCount; i++)
+        {
+            const Point3& a = polygon[i];
+            const Point3& b = polygon[(i + 1) % vertexCount];
+            const double da = side * (a[axis] - plane);
+            const double db = side * (b[axis] - plane);
+
+            if (da >= 0)
+                clipped[clippedCount++] = a;
+
+            if ((da < 0 && db > 0) || (da > 0 && db < 0))
+            {
+                Point3 p = a + (da / (da - db)) * (b - a);
+                p[axis] = plane;
+                clipped[clippedCount++] = p;
+            }
+        }
+
+        for (int i = 0; i < clippedCount; i++)
+            polygon[i] = clipped[i];
+
+        return clippedCount;
     }
 
 private:
@@ -83,28 +171,4 @@ private:
     AABB bbox;
     Vec3 normal;
     double D;
-};
-
-inline shared_ptr<HittableList> Box(const Point3& a, const Point3& b, shared_ptr<Material> mat)
-{
-    // Returns the 3D box (six sides) that contains the two opposite vertices a & b.
-
-    auto sides = make_shared<HittableList>();
-
-    // Construct the two opposite vertices with the minimum and maximum coordinates.
-    const Point3 min = Point3(std::fmin(a.x(), b.x()), std::fmin(a.y(), b.y()), std::fmin(a.z(), b.z()));
-    const Point3 max = Point3(std::fmax(a.x(), b.x()), std::fmax(a.y(), b.y()), std::fmax(a.z(), b.z()));
-
-    const Vec3 dx = Vec3(max.x() - min.x(), 0, 0);
-    const Vec3 dy = Vec3(0, max.y() - min.y(), 0);
-    const Vec3 dz = Vec3(0, 0, max.z() - min.z());
-
-    sides->Add(make_shared<Quad>(Point3(min.x(), min.y(), max.z()), dx, dy, mat)); // front
-    sides->Add(make_shared<Quad>(Point3(max.x(), min.y(), max.z()),-dz, dy, mat)); // right
-    sides->Add(make_shared<Quad>(Point3(max.x(), min.y(), min.z()),-dx, dy, mat)); // back
-    sides->Add(make_shared<Quad>(Point3(min.x(), min.y(), min.z()), dz, dy, mat)); // left
-    sides->Add(make_shared<Quad>(Point3(min.x(), max.y(), max.z()), dx,-dz, mat)); // top
-    sides->Add(make_shared<Quad>(Point3(min.x(), min.y(), min.z()), dx, dz, mat)); // bottom
-
-    return sides;
-}
\ No newline at end of file
+};
\ No newline at end of file
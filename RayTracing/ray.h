@@ -2,35 +2,46 @@
 
 #include "vec3.h"
 
-class Ray
+template<typename T>
+class RayT
 {
 public:
-    Ray() {}
+    RayT() {}
 
-    Ray(const Point3& origin, const Vec3& direction, double time)
+    RayT(const Vec3T<T>& origin, const Vec3T<T>& direction, T time)
         : orig(origin)
         , dir(direction)
         , tm(time)
     {}
 
-    Ray(const Point3& origin, const Vec3& direction)
+    RayT(const Vec3T<T>& origin, const Vec3T<T>& direction)
         : orig(origin)
         , dir(direction)
         , tm(0)
     {}
 
-    const Point3& origin() const { return orig; }
-    const Vec3& direction() const { return dir; }
+    const Vec3T<T>& origin() const { return orig; }
+    const Vec3T<T>& direction() const { return dir; }
 
-    double time() const { return tm; }
+    T time() const { return tm; }
 
-    Point3 at(double t) const
+    Vec3T<T> at(T t) const
     {
         return orig + t * dir;
     }
 
 private:
-    Point3 orig;
-    Vec3 dir;
-    double tm;
-};
\ No newline at end of file
+    Vec3T<T> orig;
+    Vec3T<T> dir;
+    T tm;
+};
+
+using Ray = RayT<Real>;
+
+struct RayDifferential
+{
+    // Change of a camera ray's direction to the rays of the neighbouring samples across and down
+    // the image, which share its origin.
+    Vec3 dDdx;
+    Vec3 dDdy;
+};
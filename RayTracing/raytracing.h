@@ -12,6 +12,25 @@
 using std::make_shared;
 using std::shared_ptr;
 
+// Scalar type of the math core. Build with RT_FLOAT_PRECISION defined for the float variant,
+// which halves the size of vectors, rays and boxes, see the precision notes in the README.
+
+#ifdef RT_FLOAT_PRECISION
+using Real = float;
+#else
+using Real = double;
+#endif
+
+// Whether built-in objects, materials and textures are called directly, through a switch on
+// their kind, instead of through their virtual functions. Build with RT_VIRTUAL_DISPATCH defined
+// to turn it off, which is only done to measure the gain with --dispatch-bench.
+
+#ifdef RT_VIRTUAL_DISPATCH
+constexpr bool closedDispatch = false;
+#else
+constexpr bool closedDispatch = true;
+#endif
+
 // Constants
 
 constexpr double infinity = std::numeric_limits<double>::infinity();
@@ -51,4 +70,5 @@ namespace Random
 #include "color.h"
 #include "interval.h"
 #include "ray.h"
+#include "sceneArena.h"
 #include "vec3.h"
\ No newline at end of file
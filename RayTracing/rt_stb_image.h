@@ -10,6 +10,7 @@
 #include "external/stb_image.h"
 
 #include <cstdlib>
+#include <fstream>
 #include <iostream>
 
 class rtw_image {
@@ -17,12 +18,21 @@ public:
     rtw_image() {}
 
     rtw_image(const char* image_filename) {
-        // Loads image data from the specified file. If the RTW_IMAGES environment variable is
-        // defined, looks only in that directory for the image file. If the image was not found,
-        // searches for the specified image file first from the current directory, then in the
-        // images/ subdirectory, then the _parent's_ images/ subdirectory, and then _that_
-        // parent, on so on, for six levels up. If the image was not loaded successfully,
-        // width() and height() will return 0.
+        // Loads image data from the specified file, found as described in find(). If the image
+        // was not loaded successfully, width() and height() will return 0.
+
+        const std::string path = find(image_filename);
+        if (!path.empty() && load(path)) return;
+
+        std::cerr << "ERROR: Could not load image file '" << image_filename << "'.\n";
+    }
+
+    static std::string find(const char* image_filename) {
+        // Returns the path of the image file, or an empty string if it was not found. If the
+        // RTW_IMAGES environment variable is defined, looks first in that directory for the image
+        // file. If the image was not found, searches for the specified image file first from the
+        // current directory, then in the images/ subdirectory, then the _parent's_ images/
+        // subdirectory, and then _that_ parent, on so on, for six levels up.
 
         auto filename = std::string(image_filename);
         
@@ -37,23 +47,33 @@ public:
         std::string path = imagedir ? imagedir : "";
 #endif
 
+        if (!path.empty() && exists(path + "/" + filename)) return path + "/" + filename;
 
         // Hunt for the image file in some likely locations.
-        if (!path.empty() && load(path + "/" + image_filename)) return;
-        if (load(filename)) return;
-        if (load("images/" + filename)) return;
-        if (load("../images/" + filename)) return;
-        if (load("../../images/" + filename)) return;
-        if (load("../../../images/" + filename)) return;
-        if (load("../../../../images/" + filename)) return;
-        if (load("../../../../../images/" + filename)) return;
-        if (load("../../../../../../images/" + filename)) return;
+        const char* directories[] = { "", "images/", "../images/", "../../images/", "../../../images/",
+            "../../../../images/", "../../../../../images/", "../../../../../../images/" };
+        for (const char* directory : directories)
+            if (exists(directory + filename)) return directory + filename;
 
-        std::cerr << "ERROR: Could not load image file '" << image_filename << "'.\n";
+        return "";
+    }
+
+    rtw_image(const unsigned char* pixels, int width, int height)
+        : bdata(pixels)
+        , image_width(width)
+        , image_height(height)
+        , bytes_per_scanline(width * bytes_per_pixel)
+        , owns_data(false)
+    {
+        // Wraps existing 8-bit RGB pixel data without copying it. The caller keeps the pixels
+        // alive for the lifetime of the image.
     }
 
+    rtw_image(const rtw_image&) = delete;
+    rtw_image& operator=(const rtw_image&) = delete;
+
     ~rtw_image() {
-        delete[] bdata;
+        if (owns_data) delete[] bdata;
         STBI_FREE(fdata);
     }
 
@@ -70,11 +90,18 @@ public:
 
         bytes_per_scanline = image_width * bytes_per_pixel;
         convert_to_bytes();
+
+        // Only the bytes are used, so don't keep the floats around.
+        STBI_FREE(fdata);
+        fdata = nullptr;
         return true;
     }
 
-    int width()  const { return (fdata == nullptr) ? 0 : image_width; }
-    int height() const { return (fdata == nullptr) ? 0 : image_height; }
+    int width()  const { return (bdata == nullptr) ? 0 : image_width; }
+    int height() const { return (bdata == nullptr) ? 0 : image_height; }
+
+    // Returns the 8-bit RGB pixel data, or null if there is no image data.
+    const unsigned char* data() const { return bdata; }
 
     const unsigned char* pixel_data(int x, int y) const {
         // Return the address of the three RGB bytes of the pixel at x,y. If there is no image
@@ -91,10 +118,15 @@ public:
 private:
     const int      bytes_per_pixel = 3;
     float* fdata = nullptr;         // Linear floating point pixel data
-    unsigned char* bdata = nullptr;         // Linear 8-bit pixel data
+    const unsigned char* bdata = nullptr;   // Linear 8-bit pixel data
     int            image_width = 0;         // Loaded image width
     int            image_height = 0;        // Loaded image height
     int            bytes_per_scanline = 0;
+    bool           owns_data = true;        // Whether bdata was allocated by this image
+
+    static bool exists(const std::string& filename) {
+        return std::ifstream(filename).good();
+    }
 
     static int clamp(int x, int low, int high) {
         // Return the value clamped to the range [low, high).
@@ -116,12 +148,13 @@ private:
         // data in the `bdata` member.
 
         int total_bytes = image_width * image_height * bytes_per_pixel;
-        bdata = new unsigned char[total_bytes];
+        auto* bytes = new unsigned char[total_bytes];
+        bdata = bytes;
 
         // Iterate through all pixel components, converting from [0.0, 1.0] float values to
         // unsigned [0, 255] byte values.
 
-        auto* bptr = bdata;
+        auto* bptr = bytes;
         auto* fptr = fdata;
         for (auto i = 0; i < total_bytes; i++, fptr++, bptr++)
             *bptr = float_to_byte(*fptr);
@@ -0,0 +1,627 @@
+#pragma once
+
+#include "aabb.h"
+#include "hittable.h"
+#include "hittableList.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+class SBVH : public Hittable
+{
+public:
+    // Flattened bounding volume hierarchy built with the surface area heuristic. With the spatial
+    // builder, nodes may also be split by a plane that cuts through objects, which then get
+    // referenced from both sides (Stich et al., "Spatial Splits in Bounding Volume Hierarchies").
+    // This keeps huge objects, like the Cornell box walls or the ground sphere, from inflating the
+    // bounds of every node they overlap.
+
+    enum class Builder
+    {
+        Object,   // Only partition objects (regular SAH BVH)
+        Spatial,  // Also consider spatial splits with reference duplication
+    };
+
+    struct Stats
+    {
+        size_t objectCount = 0;
+        size_t referenceCount = 0;
+        size_t nodeCount = 0;
+        size_t leafCount = 0;
+        double cost = 0;  // Expected traversal cost according to the surface area heuristic
+    };
+
+    // Flattened layout, which scene snapshots store as is.
+
+    struct Node
+    {
+        AABB bounds;
+        uint32_t offset;  // Leaf: first entry in leafRefs. Interior: index of the second child
+        uint16_t count;   // Number of references in a leaf, zero for interior nodes
+        uint8_t axis;     // Split axis, used to visit the nearest child first
+    };
+
+    struct LeafRef
+    {
+        uint32_t object;
+        uint32_t clipBox; // Index into clipBoxes for duplicated objects, noClipBox otherwise
+    };
+
+    static constexpr uint32_t noClipBox = 0xffffffff;
+
+    SBVH(const HittableList& list, Builder builder = Builder::Spatial, double duplicationBudget = 0.5)
+        : objects(list.objects)
+        , builder(builder)
+    {
+        // The duplication budget caps the number of references at (1 + budget) times the object
+        // count, limiting how much memory spatial splits can use.
+
+        std::vector<Reference> refs;
+        refs.reserve(objects.size());
+        for (size_t i = 0; i < objects.size(); i++)
+        {
+            const AABB box = objects[i]->BoundingBox();
+            rootBounds = AABB(rootBounds, box);
+            refs.push_back({ box, uint32_t(i) });
+        }
+
+        bbox = rootBounds;
+        referenceCount = refs.size();
+        maxReferences = size_t(objects.size() * (1.0 + duplicationBudget));
+
+        if (!refs.empty())
+            Build(refs, rootBounds);
+
+        MarkDuplicates();
+    }
+
+    bool Intersect(const Ray& r, const Interval& ray_t, Intersection& hit) const override
+    {
+        if (nodes.empty())
+            return false;
+
+        return Traverse(nodes.data(), leafRefs.data(), clipBoxes.data(), r, ray_t, hit,
+            [this](uint32_t object, const Ray& r, const Interval& ray_t, Intersection& hit)
+            {
+                return IntersectObject(*objects[object], r, ray_t, hit);
+            });
+    }
+
+    template<typename HitObject>
+    static bool Traverse(const Node* nodes, const LeafRef* leafRefs, const AABB* clipBoxes,
+        const Ray& r, const Interval& ray_t, Intersection& hit, const HitObject& hitObject)
+    {
+        // Closest hit traversal of a flattened hierarchy, calling hitObject for the objects in
+        // every leaf the ray reaches. Works on any storage of the flattened layout.
+
+        const bool dirIsNeg[3] = { r.direction().x() < 0, r.direction().y() < 0, r.direction().z() < 0 };
+
+        uint32_t stack[64];
+        int stackSize = 0;
+        uint32_t nodeIdx = 0;
+
+        bool hitAnything = false;
+        double closestSoFar = ray_t.max;
+
+        while (true)
+        {
+            const Node& node = nodes[nodeIdx];
+
+            if (node.bounds.Hit(r, Interval(ray_t.min, closestSoFar)))
+            {
+                if (node.count > 0)
+                {
+                    for (uint32_t i = node.offset; i < node.offset + node.count; i++)
+                    {
+                        const LeafRef& ref = leafRefs[i];
+                        Interval refInterval(ray_t.min, closestSoFar);
+
+                        // An object referenced from several leaves only counts the hits inside
+                        // the box of each reference. The reference boxes of an object don't
+                        // overlap, so every hit is found once, even for random media.
+                        if (ref.clipBox != noClipBox && !clipBoxes[ref.clipBox].Clip(r, refInterval))
+                            continue;
+
+                        if (hitObject(ref.object, r, refInterval, hit))
+                        {
+                            hitAnything = true;
+                            closestSoFar = hit.t;
+                        }
+                    }
+                }
+                else
+                {
+                    // Visit the child nearest to the ray origin first.
+                    if (dirIsNeg[node.axis])
+                    {
+                        stack[stackSize++] = nodeIdx + 1;
+                        nodeIdx = node.offset;
+                    }
+                    else
+                    {
+                        stack[stackSize++] = node.offset;
+                        nodeIdx = nodeIdx + 1;
+                    }
+                    continue;
+                }
+            }
+
+            if (stackSize == 0)
+                break;
+
+            nodeIdx = stack[--stackSize];
+        }
+
+        return hitAnything;
+    }
+
+    AABB BoundingBox() const override { return bbox; }
+
+    Stats GetStats() const
+    {
+        Stats stats;
+        stats.objectCount = objects.size();
+        stats.referenceCount = leafRefs.size();
+        stats.nodeCount = nodes.size();
+
+        const double rootArea = rootBounds.SurfaceArea();
+        for (const Node& node : nodes)
+        {
+            const double relativeArea = rootArea > 0 ? node.bounds.SurfaceArea() / rootArea : 1.0;
+            if (node.count > 0)
+            {
+                stats.leafCount++;
+                stats.cost += relativeArea * intersectionCost * node.count;
+            }
+            else
+            {
+                stats.cost += relativeArea * traversalCost;
+            }
+        }
+
+        return stats;
+    }
+
+    const std::vector<shared_ptr<Hittable>>& Objects() const { return objects; }
+    const std::vector<Node>& GetNodes() const { return nodes; }
+    const std::vector<LeafRef>& GetLeafRefs() const { return leafRefs; }
+    const std::vector<AABB>& GetClipBoxes() const { return clipBoxes; }
+
+    void LogStats(std::ostream& out) const
+    {
+        const Stats stats = GetStats();
+        out << (builder == Builder::Spatial ? "SBVH" : "BVH") << ": "
+            << stats.objectCount << " objects, "
+            << stats.referenceCount << " references, "
+            << stats.nodeCount << " nodes, "
+            << stats.leafCount << " leaves, SAH cost " << stats.cost << '\n';
+    }
+
+private:
+
+    struct Reference
+    {
+        AABB bounds;      // Bounds of the part of the object this reference covers
+        uint32_t object;
+    };
+
+    struct Split
+    {
+        double cost = infinity;
+        int axis = -1;
+        int bin = -1;
+        AABB left, right;
+        bool spatial = false;
+    };
+
+    static constexpr int binCount = 16;
+    static constexpr int spatialBinCount = 32;
+    static constexpr size_t maxLeafSize = 4;
+    static constexpr double traversalCost = 1.0;
+    static constexpr double intersectionCost = 1.0;
+
+    // Spatial splits are only searched for when the children of the best object split overlap
+    // by more than this fraction of the root surface area.
+    static constexpr double overlapThreshold = 1e-5;
+
+    void Build(std::vector<Reference>& refs, const AABB& bounds)
+    {
+        const size_t nodeIdx = nodes.size();
+        nodes.push_back({ bounds, 0, 0, 0 });
+
+        const size_t count = refs.size();
+        if (count <= 1)
+        {
+            MakeLeaf(nodeIdx, refs);
+            return;
+        }
+
+        AABB centroidBounds;
+        for (const Reference& ref : refs)
+        {
+            const Point3 c = ref.bounds.Center();
+            centroidBounds = AABB(centroidBounds, AABB(c, c));
+        }
+
+        const double nodeArea = bounds.SurfaceArea();
+        Split best = FindObjectSplit(refs, centroidBounds, nodeArea);
+
+        if (builder == Builder::Spatial && referenceCount < maxReferences && best.axis >= 0)
+        {
+            const double overlap = AABB::Overlap(best.left, best.right).SurfaceArea();
+            if (overlap > overlapThreshold * rootBounds.SurfaceArea())
+            {
+                const Split spatial = FindSpatialSplit(refs, bounds, nodeArea);
+                if (spatial.cost < best.cost)
+                    best = spatial;
+            }
+        }
+
+        const double leafCost = intersectionCost * double(count);
+        if (best.axis < 0 || (best.cost >= leafCost && count <= maxLeafSize))
+        {
+            if (count <= maxLeafSize)
+            {
+                MakeLeaf(nodeIdx, refs);
+                return;
+            }
+
+            // No useful split, but too many references for a leaf: split at the median instead.
+            best.axis = centroidBounds.LongestAxis();
+            best.spatial = false;
+            best.bin = -1;
+        }
+
+        std::vector<Reference> left, right;
+        if (best.spatial)
+            PartitionSpatial(refs, bounds, best, left, right);
+        else
+            PartitionObjects(refs, centroidBounds, best, left, right);
+
+        // Release the parent references before going deeper.
+        std::vector<Reference>().swap(refs);
+
+        AABB leftBounds, rightBounds;
+        for (const Reference& ref : left)
+            leftBounds = AABB(leftBounds, ref.bounds);
+        for (const Reference& ref : right)
+            rightBounds = AABB(rightBounds, ref.bounds);
+
+        nodes[nodeIdx].axis = uint8_t(best.axis);
+        Build(left, leftBounds);
+        nodes[nodeIdx].offset = uint32_t(nodes.size());
+        Build(right, rightBounds);
+    }
+
+    Split FindObjectSplit(const std::vector<Reference>& refs, const AABB& centroidBounds, double nodeArea) const
+    {
+        // Binned surface area heuristic over the reference centroids.
+
+        struct Bin
+        {
+            AABB bounds;
+            size_t count = 0;
+        };
+
+        Split best;
+
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const Interval& extent = centroidBounds.AxisInterval(axis);
+            if (extent.Size() <= 0)
+                continue;
+
+            Bin bins[binCount];
+            const double scale = binCount / extent.Size();
+
+            for (const Reference& ref : refs)
+            {
+                const double c = ref.bounds.Center()[axis];
+                Bin& bin = bins[std::min(binCount - 1, int((c - extent.min) * scale))];
+                bin.bounds = AABB(bin.bounds, ref.bounds);
+                bin.count++;
+            }
+
+            AABB rightBounds[binCount];
+            size_t rightCount[binCount];
+            AABB accum;
+            size_t count = 0;
+            for (int b = binCount - 1; b > 0; b--)
+            {
+                accum = AABB(accum, bins[b].bounds);
+                count += bins[b].count;
+                rightBounds[b] = accum;
+                rightCount[b] = count;
+            }
+
+            accum = AABB();
+            count = 0;
+            for (int b = 0; b < binCount - 1; b++)
+            {
+                accum = AABB(accum, bins[b].bounds);
+                count += bins[b].count;
+
+                if (count == 0 || rightCount[b + 1] == 0)
+                    continue;
+
+                const double cost = traversalCost + intersectionCost *
+                    (accum.SurfaceArea() * count + rightBounds[b + 1].SurfaceArea() * rightCount[b + 1]) / nodeArea;
+
+                if (cost < best.cost)
+                {
+                    best.cost = cost;
+                    best.axis = axis;
+                    best.bin = b;
+                    best.left = accum;
+                    best.right = rightBounds[b + 1];
+                }
+            }
+        }
+
+        return best;
+    }
+
+    Split FindSpatialSplit(const std::vector<Reference>& refs, const AABB& bounds, double nodeArea) const
+    {
+        // Bins the node bounds uniformly and chops every reference into the bins it overlaps.
+        // References entering and exiting each bin give the counts on each side of every plane.
+
+        struct Bin
+        {
+            AABB bounds;
+            size_t entries = 0;
+            size_t exits = 0;
+        };
+
+        Split best;
+
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const Interval& extent = bounds.AxisInterval(axis);
+            if (extent.Size() <= 0)
+                continue;
+
+            Bin bins[spatialBinCount];
+            const double binSize = extent.Size() / spatialBinCount;
+
+            for (const Reference& ref : refs)
+            {
+                const int firstBin = SpatialBin(ref.bounds.AxisInterval(axis).min, extent, binSize);
+                const int lastBin = std::max(firstBin, SpatialBin(ref.bounds.AxisInterval(axis).max, extent, binSize));
+
+                for (int b = firstBin; b <= lastBin; b++)
+                {
+                    const double slabMin = (b == firstBin) ? -infinity : extent.min + b * binSize;
+                    const double slabMax = (b == lastBin) ? infinity : extent.min + (b + 1) * binSize;
+                    bins[b].bounds = AABB(bins[b].bounds, ClipReference(ref, axis, slabMin, slabMax));
+                }
+
+                bins[firstBin].entries++;
+                bins[lastBin].exits++;
+            }
+
+            AABB rightBounds[spatialBinCount];
+            size_t rightCount[spatialBinCount];
+            AABB accum;
+            size_t count = 0;
+            for (int b = spatialBinCount - 1; b > 0; b--)
+            {
+                accum = AABB(accum, bins[b].bounds);
+                count += bins[b].exits;
+                rightBounds[b] = accum;
+                rightCount[b] = count;
+            }
+
+            accum = AABB();
+            count = 0;
+            for (int b = 0; b < spatialBinCount - 1; b++)
+            {
+                accum = AABB(accum, bins[b].bounds);
+                count += bins[b].entries;
+
+                if (count == 0 || rightCount[b + 1] == 0)
+                    continue;
+
+                const double cost = traversalCost + intersectionCost *
+                    (accum.SurfaceArea() * count + rightBounds[b + 1].SurfaceArea() * rightCount[b + 1]) / nodeArea;
+
+                if (cost < best.cost)
+                {
+                    best.cost = cost;
+                    best.axis = axis;
+                    best.bin = b;
+                    best.left = accum;
+                    best.right = rightBounds[b + 1];
+                    best.spatial = true;
+                }
+            }
+        }
+
+        return best;
+    }
+
+    void PartitionObjects(const std::vector<Reference>& refs, const AABB& centroidBounds, const Split& split,
+        std::vector<Reference>& left, std::vector<Reference>& right) const
+    {
+        const int axis = split.axis;
+        const Interval& extent = centroidBounds.AxisInterval(axis);
+
+        if (split.bin >= 0)
+        {
+            const double scale = binCount / extent.Size();
+            for (const Reference& ref : refs)
+            {
+                const double c = ref.bounds.Center()[axis];
+                const int bin = std::min(binCount - 1, int((c - extent.min) * scale));
+                (bin <= split.bin ? left : right).push_back(ref);
+            }
+            return;
+        }
+
+        std::vector<Reference> sorted = refs;
+        const size_t mid = sorted.size() / 2;
+        std::nth_element(sorted.begin(), sorted.begin() + mid, sorted.end(), [axis](const Reference& a, const Reference& b)
+        {
+            return a.bounds.Center()[axis] < b.bounds.Center()[axis];
+        });
+
+        left.assign(sorted.begin(), sorted.begin() + mid);
+        right.assign(sorted.begin() + mid, sorted.end());
+    }
+
+    void PartitionSpatial(const std::vector<Reference>& refs, const AABB& bounds, const Split& split,
+        std::vector<Reference>& left, std::vector<Reference>& right)
+    {
+        const int axis = split.axis;
+        const Interval& extent = bounds.AxisInterval(axis);
+        const double plane = extent.min + (split.bin + 1) * (extent.Size() / spatialBinCount);
+
+        std::vector<const Reference*> straddling;
+        AABB leftBounds, rightBounds;
+
+        for (const Reference& ref : refs)
+        {
+            const Interval& refExtent = ref.bounds.AxisInterval(axis);
+            if (refExtent.max <= plane)
+            {
+                left.push_back(ref);
+                leftBounds = AABB(leftBounds, ref.bounds);
+            }
+            else if (refExtent.min >= plane)
+            {
+                right.push_back(ref);
+                rightBounds = AABB(rightBounds, ref.bounds);
+            }
+            else
+            {
+                straddling.push_back(&ref);
+            }
+        }
+
+        for (const Reference* ref : straddling)
+        {
+            // Reference unsplitting: keep the whole reference on one side when that is cheaper than
+            // duplicating it, or when the duplication budget has run out.
+
+            const Reference leftPart = { ClipReference(*ref, axis, -infinity, plane), ref->object };
+            const Reference rightPart = { ClipReference(*ref, axis, plane, infinity), ref->object };
+
+            if (leftPart.bounds.IsEmpty() || rightPart.bounds.IsEmpty())
+            {
+                const Reference& part = leftPart.bounds.IsEmpty() ? rightPart : leftPart;
+                std::vector<Reference>& side = leftPart.bounds.IsEmpty() ? right : left;
+                AABB& sideBounds = leftPart.bounds.IsEmpty() ? rightBounds : leftBounds;
+                side.push_back(part);
+                sideBounds = AABB(sideBounds, part.bounds);
+                continue;
+            }
+
+            const double leftCount = double(left.size() + 1);
+            const double rightCount = double(right.size() + 1);
+            const double splitCost = AABB(leftBounds, leftPart.bounds).SurfaceArea() * leftCount
+                + AABB(rightBounds, rightPart.bounds).SurfaceArea() * rightCount;
+            const double leftOnlyCost = AABB(leftBounds, ref->bounds).SurfaceArea() * leftCount
+                + rightBounds.SurfaceArea() * (rightCount - 1);
+            const double rightOnlyCost = leftBounds.SurfaceArea() * (leftCount - 1)
+                + AABB(rightBounds, ref->bounds).SurfaceArea() * rightCount;
+
+            const bool canDuplicate = referenceCount < maxReferences;
+
+            if (canDuplicate && splitCost < leftOnlyCost && splitCost < rightOnlyCost)
+            {
+                left.push_back(leftPart);
+                right.push_back(rightPart);
+                leftBounds = AABB(leftBounds, leftPart.bounds);
+                rightBounds = AABB(rightBounds, rightPart.bounds);
+                referenceCount++;
+            }
+            else if (leftOnlyCost <= rightOnlyCost)
+            {
+                left.push_back(*ref);
+                leftBounds = AABB(leftBounds, ref->bounds);
+            }
+            else
+            {
+                right.push_back(*ref);
+                rightBounds = AABB(rightBounds, ref->bounds);
+            }
+        }
+
+        if (left.empty() || right.empty())
+        {
+            // Degenerate split; halve the references instead so the recursion always progresses.
+            std::vector<Reference>& all = left.empty() ? right : left;
+            const size_t mid = all.size() / 2;
+            std::vector<Reference> other(all.begin() + mid, all.end());
+            all.resize(mid);
+            (left.empty() ? left : right) = std::move(other);
+        }
+    }
+
+    AABB ClipReference(const Reference& ref, int axis, double slabMin, double slabMax) const
+    {
+        // Returns the bounds of the part of the referenced object that lies inside both the
+        // reference bounds and the given slab.
+
+        AABB clip = ref.bounds;
+        Interval& slab = (axis == 0) ? clip.x : (axis == 1) ? clip.y : clip.z;
+        slab = Interval(std::fmax(slab.min, slabMin), std::fmin(slab.max, slabMax));
+
+        if (clip.IsEmpty())
+            return AABB::empty;
+
+        return objects[ref.object]->ClippedBoundingBox(clip);
+    }
+
+    static int SpatialBin(double x, const Interval& extent, double binSize)
+    {
+        const int bin = int((x - extent.min) / binSize);
+        return std::clamp(bin, 0, spatialBinCount - 1);
+    }
+
+    void MakeLeaf(size_t nodeIdx, const std::vector<Reference>& refs)
+    {
+        nodes[nodeIdx].offset = uint32_t(leafRefs.size());
+        nodes[nodeIdx].count = uint16_t(refs.size());
+
+        for (const Reference& ref : refs)
+        {
+            leafRefs.push_back({ ref.object, noClipBox });
+            leafBounds.push_back(ref.bounds);
+        }
+    }
+
+    void MarkDuplicates()
+    {
+        // Objects referenced from more than one leaf keep the bounds of each of their references,
+        // so that traversal can tell which reference owns each hit.
+
+        std::vector<uint32_t> referenceCounts(objects.size(), 0);
+        for (const LeafRef& ref : leafRefs)
+            referenceCounts[ref.object]++;
+
+        for (size_t i = 0; i < leafRefs.size(); i++)
+        {
+            if (referenceCounts[leafRefs[i].object] > 1)
+            {
+                leafRefs[i].clipBox = uint32_t(clipBoxes.size());
+                clipBoxes.push_back(leafBounds[i]);
+            }
+        }
+
+        std::vector<AABB>().swap(leafBounds);
+    }
+
+private:
+    std::vector<shared_ptr<Hittable>> objects;
+    std::vector<Node> nodes;
+    std::vector<LeafRef> leafRefs;
+    std::vector<AABB> clipBoxes;
+    std::vector<AABB> leafBounds;  // Reference bounds, only kept while building
+    Builder builder;
+    AABB rootBounds;
+    AABB bbox;
+    size_t referenceCount = 0;
+    size_t maxReferences = 0;
+};
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+template<typename T>
+struct Handle
+{
+    // Index of an object in the arena pool of its type.
+
+    static constexpr uint32_t invalid = 0xffffffff;
+
+    uint32_t index = invalid;
+
+    bool IsValid() const { return index != invalid; }
+};
+
+class SceneArena
+{
+public:
+    // Owns the objects of a scene in one pool per type, so objects of a type sit next to each
+    // other in memory and the whole scene is freed at once. Objects are referred to by 32-bit
+    // handles, or by shared pointers that don't own them: copying those touches no reference
+    // count, and they stay valid until the arena is cleared or destroyed.
+
+    SceneArena() {}
+    SceneArena(const SceneArena&) = delete;
+    SceneArena& operator=(const SceneArena&) = delete;
+
+    ~SceneArena() { Clear(); }
+
+    template<typename T, typename... Args>
+    Handle<T> Create(Args&&... args)
+    {
+        Handle<T> handle;
+        handle.index = GetPool<T>().Emplace(std::forward<Args>(args)...);
+        return handle;
+    }
+
+    template<typename T>
+    T& Get(Handle<T> handle) { return GetPool<T>().Get(handle.index); }
+
+    template<typename T, typename... Args>
+    shared_ptr<T> Make(Args&&... args)
+    {
+        T* object = &Get(Create<T>(std::forward<Args>(args)...));
+
+        // Aliasing an empty pointer gives a pointer with no control block, which owns nothing.
+        return shared_ptr<T>(shared_ptr<void>(), object);
+    }
+
+    void Clear()
+    {
+        // Destroys every object, newest pool first, and frees the pool memory.
+        for (auto it = poolOrder.rbegin(); it != poolOrder.rend(); ++it)
+            pools[*it].reset();
+
+        poolOrder.clear();
+    }
+
+    size_t ObjectCount() const
+    {
+        size_t count = 0;
+        for (const std::unique_ptr<PoolBase>& pool : pools)
+            count += pool ? pool->Count() : 0;
+        return count;
+    }
+
+    size_t BytesReserved() const
+    {
+        size_t bytes = 0;
+        for (const std::unique_ptr<PoolBase>& pool : pools)
+            bytes += pool ? pool->BytesReserved() : 0;
+        return bytes;
+    }
+
+    class Scope
+    {
+    public:
+        // Makes MakeObject allocate from the arena on this thread, while the scope lasts.
+
+        Scope(SceneArena& arena) : previous(active) { active = &arena; }
+        ~Scope() { active = previous; }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        SceneArena* previous;
+    };
+
+    static SceneArena* Active() { return active; }
+
+private:
+    static inline thread_local SceneArena* active = nullptr;
+
+    struct PoolBase
+    {
+        virtual ~PoolBase() = default;
+        virtual size_t Count() const = 0;
+        virtual size_t BytesReserved() const = 0;
+    };
+
+    template<typename T>
+    class Pool : public PoolBase
+    {
+    public:
+        // Objects are bump allocated in chunks that never move, so they keep their address as
+        // the pool grows.
+
+        ~Pool() override
+        {
+            for (uint32_t i = count; i-- > 0;)
+                Get(i).~T();
+        }
+
+        template<typename... Args>
+        uint32_t Emplace(Args&&... args)
+        {
+            if (count % chunkObjects == 0)
+                chunks.push_back(std::unique_ptr<Chunk>(new Chunk));  // Left uninitialized
+
+            // Take the slot first, since the constructor may create objects of the same type.
+            const uint32_t index = count++;
+            new (Slot(index)) T(std::forward<Args>(args)...);
+            return index;
+        }
+
+        T& Get(uint32_t index) { return *std::launder(reinterpret_cast<T*>(Slot(index))); }
+
+        size_t Count() const override { return count; }
+        size_t BytesReserved() const override { return chunks.size() * sizeof(Chunk); }
+
+    private:
+        static constexpr size_t chunkObjects = sizeof(T) < 1024 ? 16384 / sizeof(T) : 16;
+
+        struct Chunk
+        {
+            alignas(T) unsigned char bytes[chunkObjects * sizeof(T)];
+        };
+
+        std::vector<std::unique_ptr<Chunk>> chunks;
+        uint32_t count = 0;
+
+        void* Slot(uint32_t index) { return chunks[index / chunkObjects]->bytes + (index % chunkObjects) * sizeof(T); }
+    };
+
+    std::vector<std::unique_ptr<PoolBase>> pools;  // Indexed by type id
+    std::vector<size_t> poolOrder;                 // Type ids in the order their pools were made
+
+    static size_t NextTypeId()
+    {
+        static size_t nextId = 0;
+        return nextId++;
+    }
+
+    template<typename T>
+    static size_t TypeId()
+    {
+        static const size_t id = NextTypeId();
+        return id;
+    }
+
+    template<typename T>
+    Pool<T>& GetPool()
+    {
+        const size_t id = TypeId<T>();
+        if (id >= pools.size())
+            pools.resize(id + 1);
+
+        if (!pools[id])
+        {
+            pools[id] = std::make_unique<Pool<T>>();
+            poolOrder.push_back(id);
+        }
+
+        return static_cast<Pool<T>&>(*pools[id]);
+    }
+};
+
+template<typename T, typename... Args>
+shared_ptr<T> MakeObject(Args&&... args)
+{
+    // Creates a scene object in the active arena of this thread, or on the heap if there is none.
+
+    if (SceneArena* arena = SceneArena::Active())
+        return arena->Make<T>(std::forward<Args>(args)...);
+
+    return make_shared<T>(std::forward<Args>(args)...);
+}
@@ -0,0 +1,313 @@
+#pragma once
+
+#include "box.h"
+#include "bvh.h"
+#include "compressedMesh.h"
+#include "constantMedium.h"
+#include "heterogeneousMedium.h"
+#include "hittable.h"
+#include "hittableList.h"
+#include "instance.h"
+#include "material.h"
+#include "matrix.h"
+#include "motionBvh.h"
+#include "primitiveBatch.h"
+#include "quad.h"
+#include "sbvh.h"
+#include "sphere.h"
+#include "triangleMesh.h"
+
+#include <ostream>
+#include <typeinfo>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+class SceneCompiler
+{
+public:
+    // Rewrites a scene graph into a form that is fast to trace. Nested lists and hierarchies are
+    // flattened, transforms are baked into quads and translated spheres or otherwise turned into
+    // instances, lists above the acceleration threshold get a BVH or a primitive batch, and
+    // materials fold constant textures. The source graph is left untouched, apart from the folded materials.
+
+    struct Stats
+    {
+        size_t objectCount = 0;     // Objects in the top level of the compiled scene
+        size_t bakedCount = 0;      // Objects with a transform baked in
+        size_t instanceCount = 0;   // Transformed objects kept as instances
+        size_t hierarchyCount = 0;  // Acceleration structures built
+        size_t foldedMaterials = 0; // Materials with a constant texture
+        size_t batchedCount = 0;    // Spheres and quads moved into primitive batches
+    };
+
+    size_t accelerationThreshold = 8;  // Lists with more objects than this get a BVH
+    bool batchPrimitives = true;       // Store spheres and quads of large lists in SIMD batches
+
+    shared_ptr<Hittable> Compile(const Hittable& world)
+    {
+        // Returns the compiled scene, or nullptr when the world is best traced as it is. Only
+        // lists can be taken apart, since the compiled scene has to share their children.
+
+        stats = Stats();
+        sharedObjects.clear();
+        foldedMaterials.clear();
+
+        auto list = dynamic_cast<const HittableList*>(&world);
+        if (list == nullptr)
+            return nullptr;
+
+        std::vector<shared_ptr<Hittable>> objects;
+        for (const shared_ptr<Hittable>& child : list->objects)
+            Flatten(child, Matrix34(), objects);
+
+        stats.objectCount = objects.size();
+        return Build(objects);
+    }
+
+    const Stats& GetStats() const { return stats; }
+
+    void LogStats(std::ostream& out) const
+    {
+        out << "Scene: "
+            << stats.objectCount << " objects, "
+            << stats.bakedCount << " baked transforms, "
+            << stats.instanceCount << " instances, "
+            << stats.hierarchyCount << " hierarchies, "
+            << stats.foldedMaterials << " constant materials, "
+            << stats.batchedCount << " batched primitives\n";
+    }
+
+private:
+    Stats stats;
+
+    // Compiled version of every object placed through an instance, so all instances of an
+    // object keep sharing it.
+    std::unordered_map<const Hittable*, shared_ptr<Hittable>> sharedObjects;
+
+    std::unordered_set<const Material*> foldedMaterials;
+
+    void Flatten(const shared_ptr<Hittable>& object, const Matrix34& xf, std::vector<shared_ptr<Hittable>>& out)
+    {
+        // Appends the object to out, transformed to world space by xf.
+
+        if (auto list = dynamic_cast<const HittableList*>(object.get()))
+        {
+            for (const shared_ptr<Hittable>& child : list->objects)
+                Flatten(child, xf, out);
+            return;
+        }
+
+        if (auto translate = dynamic_cast<const Translate*>(object.get()))
+        {
+            Flatten(translate->GetObject(), xf * Matrix34::Translation(translate->Offset()), out);
+            return;
+        }
+
+        if (auto rotate = dynamic_cast<const Rotate_Y*>(object.get()))
+        {
+            Flatten(rotate->GetObject(), xf * Matrix34::RotationY(rotate->SinTheta(), rotate->CosTheta()), out);
+            return;
+        }
+
+        if (auto instance = dynamic_cast<const Instance*>(object.get()))
+        {
+            Flatten(instance->GetObject(), xf * instance->ObjectToWorld(), out);
+            return;
+        }
+
+        if (auto medium = dynamic_cast<const ConstantMedium*>(object.get()))
+        {
+            // The boundary is compiled on its own, since the medium needs it as a single object.
+            std::vector<shared_ptr<Hittable>> boundary;
+            Flatten(medium->Boundary(), xf, boundary);
+
+            FoldMaterial(medium->PhaseFunction());
+            out.push_back(make_shared<ConstantMedium>(Build(boundary), medium->Density(), medium->PhaseFunction()));
+            return;
+        }
+
+        auto gridMedium = dynamic_cast<const HeterogeneousMedium*>(object.get());
+        if (gridMedium && xf.IsIdentity())
+        {
+            // The density grid lives in the space of the medium, so transformed ones go through
+            // an instance, which compiles them here with an identity transform.
+            std::vector<shared_ptr<Hittable>> boundary;
+            Flatten(gridMedium->Boundary(), xf, boundary);
+
+            FoldMaterial(gridMedium->PhaseFunction());
+            out.push_back(make_shared<HeterogeneousMedium>(Build(boundary), gridMedium->Grid(), gridMedium->DensityScale(),
+                gridMedium->PhaseFunction()));
+            return;
+        }
+
+        if (xf.IsIdentity())
+        {
+            // Hierarchies built by hand are merged into the one built for the whole list.
+
+            if (auto node = dynamic_cast<const BVH_Node*>(object.get()))
+            {
+                Flatten(node->Left(), xf, out);
+                if (node->Right() != node->Left())
+                    Flatten(node->Right(), xf, out);
+                return;
+            }
+
+            if (auto bvh = dynamic_cast<const SBVH*>(object.get()))
+            {
+                for (const shared_ptr<Hittable>& child : bvh->Objects())
+                    Flatten(child, xf, out);
+                return;
+            }
+
+            if (auto bvh = dynamic_cast<const MotionBVH*>(object.get()))
+            {
+                for (const shared_ptr<Hittable>& child : bvh->Objects())
+                    Flatten(child, xf, out);
+                return;
+            }
+
+            FoldMaterials(*object);
+            out.push_back(object);
+            return;
+        }
+
+        if (typeid(*object) == typeid(Quad))
+        {
+            const Quad& quad = static_cast<const Quad&>(*object);
+            FoldMaterial(quad.GetMaterial());
+            out.push_back(make_shared<Quad>(xf.TransformPoint(quad.Corner()), xf.TransformVector(quad.EdgeU()),
+                xf.TransformVector(quad.EdgeV()), quad.GetMaterial()));
+            stats.bakedCount++;
+            return;
+        }
+
+        if (typeid(*object) == typeid(Sphere) && xf.IsTranslation())
+        {
+            // Only translations can be baked: rotations would change the UVs, and scaling would
+            // make it an ellipsoid.
+            const Sphere& sphere = static_cast<const Sphere&>(*object);
+            const Ray& center = sphere.Center();
+            FoldMaterial(sphere.GetMaterial());
+            out.push_back(make_shared<Sphere>(xf.TransformPoint(center.origin()),
+                xf.TransformPoint(center.origin() + center.direction()), sphere.Radius(), sphere.GetMaterial()));
+            stats.bakedCount++;
+            return;
+        }
+
+        if (typeid(*object) == typeid(Box) && xf.IsTranslation())
+        {
+            // Rotated boxes are no longer axis aligned, so they go through an instance.
+            const Box& box = static_cast<const Box&>(*object);
+            FoldMaterial(box.GetMaterial());
+            out.push_back(make_shared<Box>(xf.TransformPoint(box.Min()), xf.TransformPoint(box.Max()), box.GetMaterial()));
+            stats.bakedCount++;
+            return;
+        }
+
+        out.push_back(make_shared<Instance>(CompileShared(object), xf));
+        stats.instanceCount++;
+    }
+
+    shared_ptr<Hittable> CompileShared(const shared_ptr<Hittable>& object)
+    {
+        auto found = sharedObjects.find(object.get());
+        if (found != sharedObjects.end())
+            return found->second;
+
+        std::vector<shared_ptr<Hittable>> objects;
+        Flatten(object, Matrix34(), objects);
+
+        shared_ptr<Hittable> compiled = Build(objects);
+        sharedObjects[object.get()] = compiled;
+        return compiled;
+    }
+
+    shared_ptr<Hittable> Build(const std::vector<shared_ptr<Hittable>>& objects)
+    {
+        if (objects.size() == 1)
+            return objects[0];
+
+        HittableList list;
+        for (const shared_ptr<Hittable>& object : objects)
+            list.Add(object);
+
+        if (objects.size() <= accelerationThreshold)
+            return make_shared<HittableList>(list);
+
+        if (batchPrimitives)
+        {
+            // Spheres and quads go to a batch with its own hierarchy, traced next to the one
+            // built for the rest of the objects.
+
+            std::vector<shared_ptr<Hittable>> primitives, others;
+            for (const shared_ptr<Hittable>& object : objects)
+                (PrimitiveBatch::CanBatch(*object) ? primitives : others).push_back(object);
+
+            if (primitives.size() > accelerationThreshold)
+            {
+                auto batch = make_shared<PrimitiveBatch>(primitives);
+                stats.batchedCount += batch->PrimitiveCount();
+                stats.hierarchyCount++;
+
+                if (others.empty())
+                    return batch;
+
+                auto combined = make_shared<HittableList>();
+                combined->Add(batch);
+                combined->Add(Build(others));
+                return combined;
+            }
+        }
+
+        stats.hierarchyCount++;
+
+        // Moving objects need node bounds that follow them through the shutter interval.
+        if (HasMotion(objects))
+            return make_shared<MotionBVH>(list);
+
+        return make_shared<SBVH>(list);
+    }
+
+    static bool HasMotion(const std::vector<shared_ptr<Hittable>>& objects)
+    {
+        for (const shared_ptr<Hittable>& object : objects)
+        {
+            const AABB start = object->BoundingBoxAt(0);
+            const AABB end = object->BoundingBoxAt(1);
+
+            for (int axis = 0; axis < 3; axis++)
+            {
+                if (start.AxisInterval(axis).min != end.AxisInterval(axis).min
+                    || start.AxisInterval(axis).max != end.AxisInterval(axis).max)
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    void FoldMaterials(const Hittable& object)
+    {
+        if (auto sphere = dynamic_cast<const Sphere*>(&object))
+            FoldMaterial(sphere->GetMaterial());
+        else if (auto quad = dynamic_cast<const Quad*>(&object))
+            FoldMaterial(quad->GetMaterial());
+        else if (auto box = dynamic_cast<const Box*>(&object))
+            FoldMaterial(box->GetMaterial());
+        else if (auto mesh = dynamic_cast<const TriangleMesh*>(&object))
+            FoldMaterial(mesh->GetMaterial());
+        else if (auto mesh = dynamic_cast<const CompressedMesh<uint8_t>*>(&object))
+            FoldMaterial(mesh->GetMaterial());
+        else if (auto mesh = dynamic_cast<const CompressedMesh<uint16_t>*>(&object))
+            FoldMaterial(mesh->GetMaterial());
+    }
+
+    void FoldMaterial(const shared_ptr<Material>& mat)
+    {
+        if (mat == nullptr || !foldedMaterials.insert(mat.get()).second)
+            return;
+
+        if (mat->FoldConstants())
+            stats.foldedMaterials++;
+    }
+};
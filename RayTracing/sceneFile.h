@@ -0,0 +1,729 @@
+#pragma once
+
+#include "box.h"
+#include "camera.h"
+#include "constantMedium.h"
+#include "hittable.h"
+#include "hittableList.h"
+#include "mappedFile.h"
+#include "material.h"
+#include "quad.h"
+#include "sphere.h"
+#include "texture.h"
+
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+class SceneFile
+{
+public:
+    // Scene description, read from a text file or from its compact binary equivalent. Reading
+    // only fills flat arrays of records, one per kind of object, and building makes the objects
+    // from them in one go, so the two are timed apart. Values are kept as floats.
+    //
+    // Text files hold one statement per line, and # starts a comment. Names are defined before
+    // they are used, and wherever a texture is taken, a color written as three numbers will do.
+    //
+    //   camera key=value ...                   As in job files: width, spp, lookFrom=x,y,z...
+    //   texture NAME solid R G B
+    //   texture NAME checker SCALE EVEN ODD
+    //   texture NAME image FILE
+    //   texture NAME noise SCALE
+    //   material NAME lambertian TEXTURE
+    //   material NAME metal R G B FUZZ
+    //   material NAME dielectric INDEX
+    //   material NAME light TEXTURE
+    //   material NAME isotropic TEXTURE
+    //   sphere MATERIAL X Y Z RADIUS
+    //   movingSphere MATERIAL X1 Y1 Z1 X2 Y2 Z2 RADIUS
+    //   quad MATERIAL QX QY QZ UX UY UZ VX VY VZ
+    //   box MATERIAL AX AY AZ BX BY BZ
+    //
+    // Objects may be followed by modifiers, applied from left to right: rotateY DEGREES,
+    // translate X Y Z, and medium DENSITY TEXTURE, which fills the object with a constant
+    // medium. Objects only used as the boundary of a medium take - as their material.
+    //
+    // Binary files start with a header holding the offset and size of each array, which follow
+    // it as raw native little-endian records.
+
+    static constexpr uint32_t formatVersion = 1;
+
+    struct Timings
+    {
+        double parse = 0;  // Reading the file into records, in seconds
+        double build = 0;  // Making the objects
+        double bvh = 0;    // Compiling the scene, left to the caller
+
+        void Log(std::ostream& out) const
+        {
+            out << "Parse: " << parse << "s, build: " << build << "s, BVH: " << bvh << "s\n";
+        }
+    };
+
+    Timings timings;
+
+    bool Parse(const std::string& filename)
+    {
+        // Reads a text or binary scene file, told apart by the binary magic. Returns false, with
+        // the line of the first error for text files, if it can't be read.
+
+        const auto start = std::chrono::steady_clock::now();
+        Clear();
+
+        MappedFile file;
+        if (!file.Open(filename))
+        {
+            std::cerr << "ERROR: Could not open scene file '" << filename << "'.\n";
+            return false;
+        }
+
+        const char* data = reinterpret_cast<const char*>(file.Data());
+        const bool binary = file.Size() >= sizeof(fileMagic) && std::memcmp(data, fileMagic, sizeof(fileMagic)) == 0;
+        const bool parsed = binary ? ParseBinary(file.Data(), file.Size()) : ParseText(data, data + file.Size());
+        if (!parsed)
+        {
+            std::cerr << "ERROR: Could not read scene file '" << filename << "'";
+            if (!binary)
+                std::cerr << ", line " << errorLine << ": " << error;
+            std::cerr << ".\n";
+            Clear();
+            return false;
+        }
+
+        timings.parse = SecondsSince(start);
+        return true;
+    }
+
+    void Build(HittableList& world, Camera& cam)
+    {
+        // Makes the objects into the world and applies the camera settings over cam.
+
+        const auto start = std::chrono::steady_clock::now();
+
+        for (const auto& setting : cameraSettings)
+            cam.Set(setting.first, setting.second);
+
+        std::vector<shared_ptr<Texture>> textureObjects(textures.size());
+        for (size_t t = 0; t < textures.size(); t++)
+        {
+            const TextureRecord& record = textures[t];
+            switch (record.kind)
+            {
+                case SolidTexture:       textureObjects[t] = MakeObject<SolidColor>(ToColor(record.color)); break;
+                case CheckerTextureKind: textureObjects[t] = MakeObject<CheckerTexture>(record.scale, textureObjects[record.even], textureObjects[record.odd]); break;
+                case ImageTextureKind:   textureObjects[t] = MakeObject<ImageTexture>(&strings[record.filename]); break;
+                case NoiseTextureKind:   textureObjects[t] = MakeObject<NoiseTexture>(record.scale); break;
+            }
+        }
+
+        std::vector<shared_ptr<Material>> materialObjects(materials.size());
+        for (size_t m = 0; m < materials.size(); m++)
+        {
+            const MaterialRecord& record = materials[m];
+            switch (record.kind)
+            {
+                case LambertianMaterial: materialObjects[m] = MakeObject<Lambertian>(textureObjects[record.texture]); break;
+                case MetalMaterial:      materialObjects[m] = MakeObject<Metal>(ToColor(record.color), record.parameter); break;
+                case DielectricMaterial: materialObjects[m] = MakeObject<Dielectric>(record.parameter); break;
+                case LightMaterial:      materialObjects[m] = MakeObject<DiffuseLight>(textureObjects[record.texture]); break;
+                case IsotropicMaterial:  materialObjects[m] = MakeObject<Isotropic>(textureObjects[record.texture]); break;
+            }
+        }
+
+        world.objects.reserve(world.objects.size() + ObjectCount());
+
+        auto add = [&](const auto& record, shared_ptr<Hittable> object)
+        {
+            for (uint32_t k = record.firstModifier; k < record.firstModifier + record.modifierCount; k++)
+            {
+                const ModifierRecord& modifier = modifiers[k];
+                switch (modifier.kind)
+                {
+                    case RotateYModifier:   object = MakeObject<Rotate_Y>(object, modifier.values[0]); break;
+                    case TranslateModifier: object = MakeObject<Translate>(object, ToVec3(modifier.values)); break;
+                    case MediumModifier:    object = MakeObject<ConstantMedium>(object, modifier.values[0], textureObjects[modifier.texture]); break;
+                }
+            }
+
+            world.Add(object);
+        };
+
+        auto material = [&](uint32_t index) { return index == noId ? nullptr : materialObjects[index]; };
+
+        for (const SphereRecord& r : spheres)
+            add(r, MakeObject<Sphere>(ToVec3(r.values), r.values[3], material(r.material)));
+
+        for (const MovingSphereRecord& r : movingSpheres)
+            add(r, MakeObject<Sphere>(ToVec3(r.values), ToVec3(r.values + 3), r.values[6], material(r.material)));
+
+        for (const QuadRecord& r : quads)
+            add(r, MakeObject<Quad>(ToVec3(r.values), ToVec3(r.values + 3), ToVec3(r.values + 6), material(r.material)));
+
+        for (const BoxRecord& r : boxes)
+            add(r, MakeObject<Box>(ToVec3(r.values), ToVec3(r.values + 3), material(r.material)));
+
+        timings.build = SecondsSince(start);
+    }
+
+    bool WriteBinary(const std::string& filename) const
+    {
+        Header header = {};
+        std::memcpy(header.magic, fileMagic, sizeof(header.magic));
+        header.formatVersion = formatVersion;
+        header.byteOrder = byteOrderMark;
+        header.headerSize = sizeof(Header);
+
+        // Camera settings go in the string table as one line of key=value words.
+        std::vector<char> allStrings = strings;
+        header.cameraSettings = uint32_t(allStrings.size());
+        for (const auto& setting : cameraSettings)
+        {
+            const std::string word = setting.first + "=" + setting.second + " ";
+            allStrings.insert(allStrings.end(), word.begin(), word.end());
+        }
+        allStrings.push_back(0);
+
+        std::vector<unsigned char> payload;
+        AppendSection(header, payload, StringsSection, allStrings);
+        AppendSection(header, payload, TexturesSection, textures);
+        AppendSection(header, payload, MaterialsSection, materials);
+        AppendSection(header, payload, ModifiersSection, modifiers);
+        AppendSection(header, payload, SpheresSection, spheres);
+        AppendSection(header, payload, MovingSpheresSection, movingSpheres);
+        AppendSection(header, payload, QuadsSection, quads);
+        AppendSection(header, payload, BoxesSection, boxes);
+
+        // Write to a temporary file first, so a reader never maps a half written scene.
+        const std::string tempFilename = filename + ".tmp";
+        {
+            std::ofstream out(tempFilename, std::ios::binary | std::ios::trunc);
+            out.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+            out.write(reinterpret_cast<const char*>(payload.data()), std::streamsize(payload.size()));
+            if (!out)
+                return false;
+        }
+
+        std::remove(filename.c_str());
+        return std::rename(tempFilename.c_str(), filename.c_str()) == 0;
+    }
+
+    size_t ObjectCount() const { return spheres.size() + movingSpheres.size() + quads.size() + boxes.size(); }
+
+    static double SecondsSince(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+private:
+    enum TextureKind : uint32_t { SolidTexture, CheckerTextureKind, ImageTextureKind, NoiseTextureKind };
+    enum MaterialKind : uint32_t { LambertianMaterial, MetalMaterial, DielectricMaterial, LightMaterial, IsotropicMaterial };
+    enum ModifierKind : uint32_t { RotateYModifier, TranslateModifier, MediumModifier };
+
+    enum SectionId
+    {
+        StringsSection, TexturesSection, MaterialsSection, ModifiersSection, SpheresSection, MovingSpheresSection,
+        QuadsSection, BoxesSection, SectionCount
+    };
+
+    static constexpr uint32_t noId = 0xffffffff;
+    static constexpr uint32_t byteOrderMark = 0x01020304;
+    static constexpr size_t sectionAlignment = 16;
+    static constexpr char fileMagic[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0' };
+
+    struct TextureRecord
+    {
+        TextureKind kind;
+        uint32_t even, odd;   // Checker sides
+        uint32_t filename;    // Image file, in the string table
+        float scale;          // Checkers and noise
+        float color[3];       // Solid colors
+    };
+
+    struct MaterialRecord
+    {
+        MaterialKind kind;
+        uint32_t texture;     // Lambertians, lights and isotropics
+        float parameter;      // Fuzz for metals, refraction index for dielectrics
+        float color[3];       // Metals
+    };
+
+    struct ModifierRecord
+    {
+        ModifierKind kind;
+        uint32_t texture;     // Media
+        float values[3];      // Offset, angle in degrees, or density
+    };
+
+    template<int valueCount>
+    struct ObjectRecord
+    {
+        uint32_t material;    // noId for medium boundaries
+        uint32_t firstModifier;
+        uint32_t modifierCount;
+        float values[valueCount];
+    };
+
+    using SphereRecord = ObjectRecord<4>;        // Center and radius
+    using MovingSphereRecord = ObjectRecord<7>;  // Centers at times 0 and 1, and radius
+    using QuadRecord = ObjectRecord<9>;          // Corner and edges
+    using BoxRecord = ObjectRecord<6>;           // Opposite corners
+
+    struct SectionRecord
+    {
+        uint64_t offset;  // Byte offset from the start of the file
+        uint64_t size;    // Size in bytes
+    };
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t formatVersion;
+        uint32_t byteOrder;
+        uint32_t headerSize;
+        uint32_t cameraSettings;  // Offset of the camera settings in the string table
+        uint32_t padding[2];
+        SectionRecord sections[SectionCount];
+    };
+
+    static_assert(std::is_trivially_copyable<Header>::value, "The header is stored as raw bytes");
+    static_assert(sizeof(Header) % sectionAlignment == 0, "Sections following the header must be aligned");
+
+    std::vector<std::pair<std::string, std::string>> cameraSettings;
+    std::vector<char> strings;  // Nul terminated
+    std::vector<TextureRecord> textures;
+    std::vector<MaterialRecord> materials;
+    std::vector<ModifierRecord> modifiers;
+    std::vector<SphereRecord> spheres;
+    std::vector<MovingSphereRecord> movingSpheres;
+    std::vector<QuadRecord> quads;
+    std::vector<BoxRecord> boxes;
+
+    // Text parsing state.
+    std::unordered_map<std::string, uint32_t> textureNames, materialNames;
+    const char* cursor = nullptr;
+    const char* end = nullptr;
+    int errorLine = 0;
+    std::string error;
+
+    struct Token
+    {
+        const char* begin = nullptr;
+        size_t size = 0;
+
+        bool Is(const char* word) const { return std::strlen(word) == size && std::memcmp(begin, word, size) == 0; }
+        std::string String() const { return std::string(begin, size); }
+    };
+
+    void Clear()
+    {
+        cameraSettings.clear();
+        strings.clear();
+        textures.clear();
+        materials.clear();
+        modifiers.clear();
+        spheres.clear();
+        movingSpheres.clear();
+        quads.clear();
+        boxes.clear();
+        textureNames.clear();
+        materialNames.clear();
+        timings = Timings();
+    }
+
+    static Color ToColor(const float c[3]) { return Color(c[0], c[1], c[2]); }
+    static Vec3 ToVec3(const float v[3]) { return Vec3(v[0], v[1], v[2]); }
+
+    bool ParseText(const char* begin, const char* fileEnd)
+    {
+        cursor = begin;
+        end = fileEnd;
+
+        // The material of the last object is looked up again by name only when it changes.
+        Token lastMaterial;
+        uint32_t lastMaterialId = noId;
+
+        for (errorLine = 1; cursor < end; errorLine++)
+        {
+            Token keyword;
+            if (NextToken(keyword))
+            {
+                bool parsed;
+                if (keyword.Is("sphere"))
+                    parsed = ParseObject(spheres, lastMaterial, lastMaterialId);
+                else if (keyword.Is("quad"))
+                    parsed = ParseObject(quads, lastMaterial, lastMaterialId);
+                else if (keyword.Is("box"))
+                    parsed = ParseObject(boxes, lastMaterial, lastMaterialId);
+                else if (keyword.Is("movingSphere"))
+                    parsed = ParseObject(movingSpheres, lastMaterial, lastMaterialId);
+                else if (keyword.Is("material"))
+                    parsed = ParseMaterial();
+                else if (keyword.Is("texture"))
+                    parsed = ParseTexture();
+                else if (keyword.Is("camera"))
+                    parsed = ParseCamera();
+                else
+                    parsed = Fail("unknown statement '" + keyword.String() + "'");
+
+                if (!parsed)
+                    return false;
+
+                Token extra;
+                if (NextToken(extra))
+                    return Fail("unexpected '" + extra.String() + "'");
+            }
+
+            // Move past the end of the line, skipping any comment.
+            while (cursor < end && *cursor != '\n')
+                cursor++;
+            if (cursor < end)
+                cursor++;
+        }
+
+        return true;
+    }
+
+    bool NextToken(Token& token)
+    {
+        // Reads the next word of the line, or returns false at the end of the line or a comment.
+
+        while (cursor < end && (*cursor == ' ' || *cursor == '\t' || *cursor == '\r'))
+            cursor++;
+
+        if (cursor >= end || *cursor == '\n' || *cursor == '#')
+            return false;
+
+        token.begin = cursor;
+        while (cursor < end && *cursor != ' ' && *cursor != '\t' && *cursor != '\r' && *cursor != '\n' && *cursor != '#')
+            cursor++;
+
+        token.size = size_t(cursor - token.begin);
+        return true;
+    }
+
+    bool Fail(const std::string& message)
+    {
+        error = message;
+        return false;
+    }
+
+    bool ParseNumbers(float* values, int count)
+    {
+        for (int k = 0; k < count; k++)
+        {
+            Token token;
+            if (!NextToken(token))
+                return Fail("expected a number");
+
+            double value;
+            const auto result = std::from_chars(token.begin, token.begin + token.size, value);
+            if (result.ec != std::errc() || result.ptr != token.begin + token.size)
+                return Fail("expected a number, not '" + token.String() + "'");
+
+            values[k] = float(value);
+        }
+
+        return true;
+    }
+
+    bool ParseName(Token& name)
+    {
+        return NextToken(name) || Fail("expected a name");
+    }
+
+    bool DefineName(std::unordered_map<std::string, uint32_t>& names, const Token& name, uint32_t id)
+    {
+        return names.emplace(name.String(), id).second || Fail("'" + name.String() + "' is already defined");
+    }
+
+    bool ParseTextureRef(uint32_t& texture)
+    {
+        // A texture name, or a color that becomes a solid texture of its own.
+
+        const char* start = cursor;
+        Token token;
+        if (!NextToken(token))
+            return Fail("expected a texture or a color");
+
+        const char c = token.begin[0];
+        if ((c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.')
+        {
+            cursor = start;
+            TextureRecord record = {};
+            record.kind = SolidTexture;
+            if (!ParseNumbers(record.color, 3))
+                return false;
+
+            texture = uint32_t(textures.size());
+            textures.push_back(record);
+            return true;
+        }
+
+        auto found = textureNames.find(token.String());
+        if (found == textureNames.end())
+            return Fail("unknown texture '" + token.String() + "'");
+
+        texture = found->second;
+        return true;
+    }
+
+    bool ParseTexture()
+    {
+        Token name, kind;
+        if (!ParseName(name) || !ParseName(kind))
+            return false;
+
+        TextureRecord record = {};
+        if (kind.Is("solid"))
+        {
+            record.kind = SolidTexture;
+            if (!ParseNumbers(record.color, 3))
+                return false;
+        }
+        else if (kind.Is("checker"))
+        {
+            record.kind = CheckerTextureKind;
+            if (!ParseNumbers(&record.scale, 1) || !ParseTextureRef(record.even) || !ParseTextureRef(record.odd))
+                return false;
+        }
+        else if (kind.Is("image"))
+        {
+            Token file;
+            if (!NextToken(file))
+                return Fail("expected an image file");
+
+            record.kind = ImageTextureKind;
+            record.filename = uint32_t(strings.size());
+            strings.insert(strings.end(), file.begin, file.begin + file.size);
+            strings.push_back(0);
+        }
+        else if (kind.Is("noise"))
+        {
+            record.kind = NoiseTextureKind;
+            if (!ParseNumbers(&record.scale, 1))
+                return false;
+        }
+        else
+            return Fail("unknown texture kind '" + kind.String() + "'");
+
+        const uint32_t id = uint32_t(textures.size());
+        textures.push_back(record);
+        return DefineName(textureNames, name, id);
+    }
+
+    bool ParseMaterial()
+    {
+        Token name, kind;
+        if (!ParseName(name) || !ParseName(kind))
+            return false;
+
+        MaterialRecord record = {};
+        record.texture = noId;
+        bool parsed;
+
+        if (kind.Is("lambertian"))      { record.kind = LambertianMaterial; parsed = ParseTextureRef(record.texture); }
+        else if (kind.Is("metal"))      { record.kind = MetalMaterial; parsed = ParseNumbers(record.color, 3) && ParseNumbers(&record.parameter, 1); }
+        else if (kind.Is("dielectric")) { record.kind = DielectricMaterial; parsed = ParseNumbers(&record.parameter, 1); }
+        else if (kind.Is("light"))      { record.kind = LightMaterial; parsed = ParseTextureRef(record.texture); }
+        else if (kind.Is("isotropic"))  { record.kind = IsotropicMaterial; parsed = ParseTextureRef(record.texture); }
+        else
+            return Fail("unknown material kind '" + kind.String() + "'");
+
+        if (!parsed)
+            return false;
+
+        const uint32_t id = uint32_t(materials.size());
+        materials.push_back(record);
+        return DefineName(materialNames, name, id);
+    }
+
+    bool ParseCamera()
+    {
+        Token word;
+        while (NextToken(word))
+        {
+            const std::string text = word.String();
+            const size_t equals = text.find('=');
+            const std::string key = text.substr(0, equals);
+            const std::string value = equals == std::string::npos ? "" : text.substr(equals + 1);
+
+            Camera check;
+            if (!check.Set(key, value))
+                return Fail("bad camera setting '" + text + "'");
+
+            cameraSettings.emplace_back(key, value);
+        }
+
+        return true;
+    }
+
+    template<int valueCount>
+    bool ParseObject(std::vector<ObjectRecord<valueCount>>& records, Token& lastMaterial, uint32_t& lastMaterialId)
+    {
+        ObjectRecord<valueCount> record;
+
+        Token material;
+        if (!ParseName(material))
+            return false;
+
+        if (material.size == lastMaterial.size && std::memcmp(material.begin, lastMaterial.begin, material.size) == 0)
+        {
+            record.material = lastMaterialId;
+        }
+        else if (material.Is("-"))
+        {
+            record.material = noId;
+        }
+        else
+        {
+            auto found = materialNames.find(material.String());
+            if (found == materialNames.end())
+                return Fail("unknown material '" + material.String() + "'");
+
+            record.material = found->second;
+        }
+
+        lastMaterial = material;
+        lastMaterialId = record.material;
+
+        if (!ParseNumbers(record.values, valueCount))
+            return false;
+
+        record.firstModifier = uint32_t(modifiers.size());
+        bool filled = false;
+
+        Token word;
+        while (NextToken(word))
+        {
+            ModifierRecord modifier = {};
+            bool parsed;
+
+            if (word.Is("rotateY"))        { modifier.kind = RotateYModifier; parsed = ParseNumbers(modifier.values, 1); }
+            else if (word.Is("translate")) { modifier.kind = TranslateModifier; parsed = ParseNumbers(modifier.values, 3); }
+            else if (word.Is("medium"))    { modifier.kind = MediumModifier; parsed = ParseNumbers(modifier.values, 1) && ParseTextureRef(modifier.texture); filled = true; }
+            else
+                return Fail("unknown modifier '" + word.String() + "'");
+
+            if (!parsed)
+                return false;
+
+            modifiers.push_back(modifier);
+        }
+
+        if (record.material == noId && !filled)
+            return Fail("objects without a material must be filled with a medium");
+
+        record.modifierCount = uint32_t(modifiers.size()) - record.firstModifier;
+        records.push_back(record);
+        return true;
+    }
+
+    bool ParseBinary(const unsigned char* data, size_t size)
+    {
+        if (size < sizeof(Header))
+            return false;
+
+        Header header;
+        std::memcpy(&header, data, sizeof(Header));
+        if (header.formatVersion != formatVersion || header.byteOrder != byteOrderMark || header.headerSize != sizeof(Header))
+            return false;
+
+        for (const SectionRecord& section : header.sections)
+            if (section.offset % sectionAlignment != 0 || section.offset > size || section.size > size - section.offset)
+                return false;
+
+        ReadSection(header, data, StringsSection, strings);
+        ReadSection(header, data, TexturesSection, textures);
+        ReadSection(header, data, MaterialsSection, materials);
+        ReadSection(header, data, ModifiersSection, modifiers);
+        ReadSection(header, data, SpheresSection, spheres);
+        ReadSection(header, data, MovingSpheresSection, movingSpheres);
+        ReadSection(header, data, QuadsSection, quads);
+        ReadSection(header, data, BoxesSection, boxes);
+
+        if (strings.empty() || strings.back() != 0 || header.cameraSettings >= strings.size())
+            return false;
+
+        // Camera settings are stored as a line of key=value words.
+        std::istringstream settings(&strings[header.cameraSettings]);
+        std::string word;
+        while (settings >> word)
+        {
+            const size_t equals = word.find('=');
+            cameraSettings.emplace_back(word.substr(0, equals), equals == std::string::npos ? "" : word.substr(equals + 1));
+        }
+
+        return RecordsAreValid();
+    }
+
+    bool RecordsAreValid() const
+    {
+        // Checks every reference of a binary file, so a damaged one can't make building crash.
+        // Textures and materials only refer to ones before them.
+
+        for (size_t t = 0; t < textures.size(); t++)
+        {
+            const TextureRecord& r = textures[t];
+            if (r.kind > NoiseTextureKind
+                || (r.kind == CheckerTextureKind && (r.even >= t || r.odd >= t))
+                || (r.kind == ImageTextureKind && r.filename >= strings.size()))
+                return false;
+        }
+
+        for (const MaterialRecord& r : materials)
+            if (r.kind > IsotropicMaterial || ((r.kind == LambertianMaterial || r.kind == LightMaterial || r.kind == IsotropicMaterial) && r.texture >= textures.size()))
+                return false;
+
+        for (const ModifierRecord& r : modifiers)
+            if (r.kind > MediumModifier || (r.kind == MediumModifier && r.texture >= textures.size()))
+                return false;
+
+        auto objectsAreValid = [this](const auto& records)
+        {
+            for (const auto& r : records)
+                if ((r.material != noId && r.material >= materials.size())
+                    || r.firstModifier > modifiers.size() || r.modifierCount > modifiers.size() - r.firstModifier)
+                    return false;
+
+            return true;
+        };
+
+        return objectsAreValid(spheres) && objectsAreValid(movingSpheres) && objectsAreValid(quads) && objectsAreValid(boxes);
+    }
+
+    template<typename T>
+    static void ReadSection(const Header& header, const unsigned char* data, SectionId id, std::vector<T>& items)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "Scene sections hold raw bytes");
+
+        items.resize(size_t(header.sections[id].size / sizeof(T)));
+        if (!items.empty())
+            std::memcpy(items.data(), data + header.sections[id].offset, items.size() * sizeof(T));
+    }
+
+    template<typename T>
+    static void AppendSection(Header& header, std::vector<unsigned char>& payload, SectionId id, const std::vector<T>& items)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "Scene sections hold raw bytes");
+
+        const size_t size = items.size() * sizeof(T);
+        header.sections[id].offset = sizeof(Header) + payload.size();
+        header.sections[id].size = size;
+
+        // Pad every section so the next one starts aligned.
+        const size_t paddedSize = (size + sectionAlignment - 1) / sectionAlignment * sectionAlignment;
+        const size_t start = payload.size();
+        payload.resize(start + paddedSize, 0);
+        if (size > 0)
+            std::memcpy(payload.data() + start, items.data(), size);
+    }
+};
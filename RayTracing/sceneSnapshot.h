@@ -0,0 +1,1072 @@
+#pragma once
+
+#include "box.h"
+#include "bvh.h"
+#include "camera.h"
+#include "constantMedium.h"
+#include "hittable.h"
+#include "hittableList.h"
+#include "instance.h"
+#include "mappedFile.h"
+#include "material.h"
+#include "matrix.h"
+#include "motionBvh.h"
+#include "quad.h"
+#include "sbvh.h"
+#include "sourceFiles.h"
+#include "sphere.h"
+#include "texture.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <type_traits>
+#include <typeinfo>
+#include <unordered_map>
+#include <vector>
+
+class SceneSnapshot : public Hittable
+{
+public:
+    // A compiled scene (flattened BVH, primitives, materials, textures and camera) stored in a
+    // versioned binary file. Loading maps the file into memory and uses its arrays in place, so
+    // startup skips building the scene, the BVH, the Perlin tables and decoding images. Only the
+    // handful of material and texture objects are recreated, pointing into the mapped data,
+    // except image textures: their decoded pixels are stored, and copied on load into a new
+    // pyramid in memory.
+    //
+    // The file is native little-endian data. Its header holds a hash of whatever the scene was
+    // built from: the caller's hash of the scene and renderer, combined with the size and
+    // modification time of every image, mesh and volume file the scene read, whose paths are
+    // stored in the snapshot. Snapshots whose hashes don't match are reported as stale, so the
+    // caller can rebuild them. The header also holds a hash of the payload, checked on load
+    // unless the caller trusts the file, since hashing reads the whole file.
+
+    static constexpr uint32_t formatVersion = 4;
+
+    SceneSnapshot() {}
+
+    bool Load(const std::string& filename, uint64_t sourceHash, bool verifyContent = true)
+    {
+        // Maps the snapshot and validates it against the expected source hash and the source
+        // files the scene was built from. Returns false if the file is missing, corrupt or
+        // stale. The recreated textures, materials and media are always checked. Without
+        // verifyContent the payload isn't hashed, and a corrupt primitive or BVH array is
+        // only caught if it breaks those.
+
+        Unload();
+
+        if (!file.Open(filename) || file.Size() < sizeof(Header))
+            return false;
+
+        const unsigned char* data = file.Data();
+        const Header& header = *reinterpret_cast<const Header*>(data);
+
+        const bool valid = std::memcmp(header.magic, magic, sizeof(header.magic)) == 0
+            && header.version == formatVersion
+            && header.headerSize == sizeof(Header)
+            && SectionsAreValid(header, file.Size())
+            && header.sourceHash == CombineHashes(sourceHash, SourceFiles::Hash(SourcePaths(header)))
+            && (!verifyContent || HashWords(data + sizeof(Header), file.Size() - sizeof(Header)) == header.contentHash);
+
+        if (!valid)
+        {
+            Unload();
+            return false;
+        }
+
+        camera = header.camera;
+        spheres = Section<SphereRecord>(header, SpheresSection);
+        quads = Section<QuadRecord>(header, QuadsSection);
+        boxes = Section<BoxRecord>(header, BoxesSection);
+        mediaRecords = Section<MediumRecord>(header, MediaSection);
+        boundaryRefs = Section<uint32_t>(header, BoundaryRefsSection);
+        nodes = Section<SBVH::Node>(header, NodesSection);
+        leafRefs = Section<SBVH::LeafRef>(header, LeafRefsSection);
+        clipBoxes = Section<AABB>(header, ClipBoxesSection);
+        nodeCount = header.sections[NodesSection].size / sizeof(SBVH::Node);
+
+        if (!CreateTextures(header) || !CreateMaterials(header) || !CreateMedia(header))
+        {
+            Unload();
+            return false;
+        }
+
+        return true;
+    }
+
+    void Unload()
+    {
+        media.clear();
+        materials.clear();
+        textures.clear();
+        nodeCount = 0;
+        file.Close();
+    }
+
+    static bool Write(const std::string& filename, const Hittable& world, const Camera& cam, uint64_t sourceHash, const SourceFiles& sources)
+    {
+        // Compiles the scene and writes it as a snapshot, along with the files it was built
+        // from. Returns false, writing nothing, if the scene holds objects the snapshot format
+        // doesn't support.
+
+        Compiler compiler;
+        if (!compiler.Flatten(world, Matrix34(), nullptr))
+            return false;
+
+        SBVH bvh(compiler.baked, SBVH::Builder::Spatial);
+
+        std::vector<SBVH::LeafRef> leafRefs = bvh.GetLeafRefs();
+        for (SBVH::LeafRef& ref : leafRefs)
+            ref.object = compiler.bakedRefs[ref.object];
+
+        Header header = {};
+        std::memcpy(header.magic, magic, sizeof(header.magic));
+        header.version = formatVersion;
+        header.headerSize = sizeof(Header);
+        header.sourceHash = CombineHashes(sourceHash, SourceFiles::Hash(sources.paths));
+        header.camera = CameraRecord(cam);
+
+        std::vector<unsigned char> payload;
+        AppendSection(header, payload, SpheresSection, compiler.spheres);
+        AppendSection(header, payload, QuadsSection, compiler.quads);
+        AppendSection(header, payload, BoxesSection, compiler.boxes);
+        AppendSection(header, payload, MediaSection, compiler.media);
+        AppendSection(header, payload, BoundaryRefsSection, compiler.boundaryRefs);
+        AppendSection(header, payload, NodesSection, bvh.GetNodes());
+        AppendSection(header, payload, LeafRefsSection, leafRefs);
+        AppendSection(header, payload, ClipBoxesSection, bvh.GetClipBoxes());
+        AppendSection(header, payload, MaterialsSection, compiler.materials);
+        AppendSection(header, payload, TexturesSection, compiler.textures);
+        AppendSection(header, payload, PerlinSection, compiler.perlinTables);
+        AppendSection(header, payload, PixelsSection, compiler.pixels);
+
+        // Source paths are stored one after another, each ending with a null.
+        std::vector<char> sourcePaths;
+        for (const std::string& path : sources.paths)
+            sourcePaths.insert(sourcePaths.end(), path.c_str(), path.c_str() + path.size() + 1);
+        AppendSection(header, payload, SourcesSection, sourcePaths);
+
+        header.contentHash = HashWords(payload.data(), payload.size());
+
+        // Write to a temporary file first, so a reader never maps a half written snapshot.
+        const std::string tempFilename = filename + ".tmp";
+        {
+            std::ofstream out(tempFilename, std::ios::binary | std::ios::trunc);
+            out.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+            out.write(reinterpret_cast<const char*>(payload.data()), std::streamsize(payload.size()));
+            if (!out)
+                return false;
+        }
+
+        std::remove(filename.c_str());
+        return std::rename(tempFilename.c_str(), filename.c_str()) == 0;
+    }
+
+    static std::string CacheDirectory()
+    {
+        // The directory named by RTW_SNAPSHOT_CACHE, or an empty string if it isn't set.
+
+#ifdef _MSC_VER
+        char* cachedir = nullptr;
+        size_t len = 0;
+        _dupenv_s(&cachedir, &len, "RTW_SNAPSHOT_CACHE");
+        const std::string directory = cachedir ? cachedir : "";
+        free(cachedir);
+#else
+        const char* cachedir = getenv("RTW_SNAPSHOT_CACHE");
+        const std::string directory = cachedir ? cachedir : "";
+#endif
+
+        return directory;
+    }
+
+    static uint64_t Hash(const std::string& text)
+    {
+        // 64-bit FNV-1a hash of a string, handy to build source hashes.
+
+        uint64_t hash = fnvOffset;
+        for (const char c : text)
+            hash = (hash ^ uint64_t(uint8_t(c))) * fnvPrime;
+
+        return hash;
+    }
+
+    Camera GetCamera() const
+    {
+        Camera cam;
+        cam.aspectRatio = camera.aspectRatio;
+        cam.imageWidth = camera.imageWidth;
+        cam.samplesPerPixel = camera.samplesPerPixel;
+        cam.maxDepth = camera.maxDepth;
+        cam.background = camera.background;
+        cam.vfov = camera.vfov;
+        cam.lookFrom = camera.lookFrom;
+        cam.lookAt = camera.lookAt;
+        cam.up = camera.up;
+        cam.defocusAngle = camera.defocusAngle;
+        cam.focusDist = camera.focusDist;
+        return cam;
+    }
+
+    bool Intersect(const Ray& r, const Interval& ray_t, Intersection& hit) const override
+    {
+        if (nodeCount == 0)
+            return false;
+
+        return SBVH::Traverse(nodes, leafRefs, clipBoxes, r, ray_t, hit,
+            [this](uint32_t object, const Ray& r, const Interval& ray_t, Intersection& hit)
+            {
+                return IntersectObject(object, r, ray_t, hit);
+            });
+    }
+
+    void ComputeSurface(const Ray& r, const Intersection& hit, int depth, HitRecord& rec) const override
+    {
+        // Media compute their own surface, so only spheres, quads and boxes get here.
+
+        const uint32_t index = hit.primitive & indexMask;
+
+        switch (hit.primitive >> kindShift)
+        {
+            case SphereObject:
+            {
+                const SphereRecord& sphere = spheres[index];
+                Sphere::SphereSurface(sphere.center, sphere.radius, r, hit.t, rec);
+                rec.mat = materials[sphere.material].get();
+                break;
+            }
+            case QuadObject:
+            {
+                const QuadRecord& quad = quads[index];
+                rec.t = hit.t;
+                rec.p = r.at(hit.t);
+                rec.u = hit.b1;
+                rec.v = hit.b2;
+                rec.dpdu = quad.u;
+                rec.dpdv = quad.v;
+                rec.mat = materials[quad.material].get();
+                rec.SetFaceNormal(r, quad.normal);
+                break;
+            }
+            case BoxObject:
+            {
+                // Affine transforms keep the face orientation found in box space, see Instance.
+                const BoxRecord& box = boxes[index];
+                Box::BoxSurface(box.min, box.max, BoxRay(box, r), hit.t, int(hit.b1), rec);
+                rec.mat = materials[box.material].get();
+                if (box.transformed)
+                {
+                    rec.p = r.at(hit.t);
+                    rec.normal = UnitVector(box.worldToBox.TransformTransposed(rec.normal));
+
+                    const Matrix34 boxToWorld = box.worldToBox.Inverse();
+                    rec.dpdu = boxToWorld.TransformVector(rec.dpdu);
+                    rec.dpdv = boxToWorld.TransformVector(rec.dpdv);
+                }
+                break;
+            }
+        }
+    }
+
+    AABB BoundingBox() const override { return nodeCount > 0 ? nodes[0].bounds : AABB::empty; }
+
+private:
+
+    // Objects are referenced by a 32-bit value holding their kind in the top two bits and their
+    // index in the array of that kind in the rest.
+    enum ObjectKind : uint32_t { SphereObject = 0, QuadObject = 1, MediumObject = 2, BoxObject = 3 };
+    static constexpr uint32_t kindShift = 30;
+    static constexpr uint32_t indexMask = (1u << kindShift) - 1;
+
+    enum MaterialKind : uint32_t { LambertianMaterial, MetalMaterial, DielectricMaterial, DiffuseLightMaterial, IsotropicMaterial };
+    enum TextureKind : uint32_t { SolidTexture, CheckerTextureKind, ImageTextureKind, NoiseTextureKind };
+
+    enum SectionId
+    {
+        SpheresSection, QuadsSection, BoxesSection, MediaSection, BoundaryRefsSection, NodesSection, LeafRefsSection,
+        ClipBoxesSection, MaterialsSection, TexturesSection, PerlinSection, PixelsSection, SourcesSection, SectionCount
+    };
+
+    static constexpr uint32_t noId = 0xffffffff;
+    static constexpr size_t sectionAlignment = 16;
+    static constexpr char magic[8] = { 'R', 'T', 'S', 'N', 'A', 'P', '\0', '\0' };
+    static constexpr uint64_t fnvOffset = 14695981039346656037ull;
+    static constexpr uint64_t fnvPrime = 1099511628211ull;
+
+    struct SphereRecord
+    {
+        Ray center;
+        double radius;
+        uint32_t material;
+        uint32_t padding;
+    };
+
+    struct QuadRecord
+    {
+        Point3 Q;
+        Vec3 u, v, w, normal;
+        double D;
+        uint32_t material;
+        uint32_t padding;
+    };
+
+    struct BoxRecord
+    {
+        Matrix34 worldToBox;  // Only used for transformed boxes
+        Point3 min, max;
+        uint32_t material;
+        uint32_t transformed;  // Zero for boxes baked in world space
+    };
+
+    struct MediumRecord
+    {
+        AABB bounds;
+        double density;
+        uint32_t firstBoundary;  // First entry in the boundary references
+        uint32_t boundaryCount;
+        uint32_t texture;
+        uint32_t padding;
+    };
+
+    struct MaterialRecord
+    {
+        MaterialKind kind;
+        uint32_t texture;
+        double parameter;  // Fuzz for metals, refraction index for dielectrics
+        Color albedo;
+    };
+
+    struct TextureRecord
+    {
+        TextureKind kind;
+        uint32_t even, odd;    // Checker children
+        uint32_t perlin;       // Noise tables index
+        int32_t width, height; // Image size
+        uint64_t pixels;       // Image offset in the pixel section
+        double scale;
+        Color color;
+    };
+
+    struct CameraRecord
+    {
+        CameraRecord() {}
+
+        CameraRecord(const Camera& cam)
+            : aspectRatio(cam.aspectRatio)
+            , imageWidth(cam.imageWidth)
+            , samplesPerPixel(cam.samplesPerPixel)
+            , maxDepth(cam.maxDepth)
+            , background(cam.background)
+            , vfov(cam.vfov)
+            , lookFrom(cam.lookFrom)
+            , lookAt(cam.lookAt)
+            , up(cam.up)
+            , defocusAngle(cam.defocusAngle)
+            , focusDist(cam.focusDist)
+        {}
+
+        double aspectRatio = 1;
+        int32_t imageWidth = 0;
+        int32_t samplesPerPixel = 0;
+        int32_t maxDepth = 0;
+        int32_t padding = 0;
+        Color background;
+        double vfov = 90;
+        Point3 lookFrom, lookAt;
+        Vec3 up;
+        double defocusAngle = 0;
+        double focusDist = 10;
+    };
+
+    struct SectionRecord
+    {
+        uint64_t offset;  // Byte offset from the start of the file
+        uint64_t size;    // Size in bytes
+    };
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t headerSize;
+        uint64_t sourceHash;
+        uint64_t contentHash;
+        CameraRecord camera;
+        SectionRecord sections[SectionCount];
+    };
+
+    static_assert(std::is_trivially_copyable<SBVH::Node>::value, "BVH nodes are stored as raw bytes");
+    static_assert(std::is_trivially_copyable<AABB>::value, "Bounding boxes are stored as raw bytes");
+    static_assert(std::is_trivially_copyable<PerlinTables>::value, "Perlin tables are stored as raw bytes");
+    static_assert(std::is_trivially_copyable<Header>::value, "The header is stored as raw bytes");
+    static_assert(sizeof(Header) % sectionAlignment == 0, "Sections following the header must be aligned");
+
+    class SnapshotBoundary : public Hittable
+    {
+    public:
+        // Boundary of a medium: a list of snapshot objects that are not part of the BVH.
+
+        SnapshotBoundary(const SceneSnapshot* snapshot, const MediumRecord& medium)
+            : snapshot(snapshot)
+            , medium(medium)
+        {}
+
+        bool Intersect(const Ray& r, const Interval& ray_t, Intersection& hit) const override
+        {
+            bool hitAnything = false;
+            double closestSoFar = ray_t.max;
+
+            for (uint32_t i = 0; i < medium.boundaryCount; i++)
+            {
+                const uint32_t object = snapshot->boundaryRefs[medium.firstBoundary + i];
+                if (snapshot->IntersectObject(object, r, Interval(ray_t.min, closestSoFar), hit))
+                {
+                    hitAnything = true;
+                    closestSoFar = hit.t;
+                }
+            }
+
+            return hitAnything;
+        }
+
+        bool Span(const Ray& r, Interval& span) const override
+        {
+            // Joins the spans of the boundary objects in one pass, like a list does.
+            bool hitAnything = false;
+            span = Interval::empty;
+
+            for (uint32_t i = 0; i < medium.boundaryCount; i++)
+            {
+                Interval objectSpan;
+                if (snapshot->ObjectSpan(snapshot->boundaryRefs[medium.firstBoundary + i], r, objectSpan))
+                {
+                    hitAnything = true;
+                    span = Interval(span, objectSpan);
+                }
+            }
+
+            return hitAnything;
+        }
+
+        AABB BoundingBox() const override { return medium.bounds; }
+
+    private:
+        const SceneSnapshot* snapshot;
+        const MediumRecord& medium;
+    };
+
+    struct Compiler
+    {
+        // Flattens a scene graph into the snapshot arrays. Transforms are baked into the objects,
+        // and every object of the BVH gets a baked copy, used only to build the hierarchy.
+
+        std::vector<SphereRecord> spheres;
+        std::vector<QuadRecord> quads;
+        std::vector<BoxRecord> boxes;
+        std::vector<MediumRecord> media;
+        std::vector<uint32_t> boundaryRefs;
+        std::vector<MaterialRecord> materials;
+        std::vector<TextureRecord> textures;
+        std::vector<PerlinTables> perlinTables;
+        std::vector<unsigned char> pixels;
+
+        HittableList baked;
+        std::vector<uint32_t> bakedRefs;
+        std::vector<shared_ptr<Hittable>> bakedBoundaryObjects;
+
+        std::unordered_map<const Material*, uint32_t> materialIds;
+        std::unordered_map<const Texture*, uint32_t> textureIds;
+        std::unordered_map<const PerlinTables*, uint32_t> perlinIds;
+
+        bool Flatten(const Hittable& object, const Matrix34& xf, std::vector<uint32_t>* boundary)
+        {
+            // Adds the object to the snapshot, either to the BVH or, for medium boundaries, to the
+            // given list. Returns false for objects that can't be stored.
+
+            if (auto list = dynamic_cast<const HittableList*>(&object))
+            {
+                for (const shared_ptr<Hittable>& child : list->objects)
+                    if (!Flatten(*child, xf, boundary))
+                        return false;
+                return true;
+            }
+
+            if (auto node = dynamic_cast<const BVH_Node*>(&object))
+            {
+                if (!Flatten(*node->Left(), xf, boundary))
+                    return false;
+                return node->Left() == node->Right() || Flatten(*node->Right(), xf, boundary);
+            }
+
+            if (auto bvh = dynamic_cast<const SBVH*>(&object))
+                return FlattenAll(bvh->Objects(), xf, boundary);
+
+            if (auto bvh = dynamic_cast<const MotionBVH*>(&object))
+                return FlattenAll(bvh->Objects(), xf, boundary);
+
+            if (auto translate = dynamic_cast<const Translate*>(&object))
+                return Flatten(*translate->GetObject(), xf * Matrix34::Translation(translate->Offset()), boundary);
+
+            if (auto rotate = dynamic_cast<const Rotate_Y*>(&object))
+                return Flatten(*rotate->GetObject(), xf * Matrix34::RotationY(rotate->SinTheta(), rotate->CosTheta()), boundary);
+
+            if (auto instance = dynamic_cast<const Instance*>(&object))
+                return Flatten(*instance->GetObject(), xf * instance->ObjectToWorld(), boundary);
+
+            if (typeid(object) == typeid(Sphere))
+            {
+                // Sphere UVs come from the object space normal, which baking a rotation would change,
+                // and a scaled sphere is no longer a sphere.
+                const Sphere& sphere = static_cast<const Sphere&>(object);
+                if (!xf.IsTranslation())
+                    return false;
+
+                SphereRecord record = {};
+                record.center = Ray(xf.TransformPoint(sphere.Center().origin()), xf.TransformVector(sphere.Center().direction()));
+                record.radius = sphere.Radius();
+                record.material = MaterialId(sphere.GetMaterial());
+                if (record.material == noId)
+                    return false;
+
+                spheres.push_back(record);
+                const Point3 center1 = record.center.origin() + record.center.direction();
+                AddObject(ObjectRef(SphereObject, spheres.size() - 1),
+                    make_shared<Sphere>(record.center.origin(), center1, record.radius, nullptr), boundary);
+                return true;
+            }
+
+            if (typeid(object) == typeid(Quad))
+            {
+                const Quad& quad = static_cast<const Quad&>(object);
+                auto bakedQuad = make_shared<Quad>(xf.TransformPoint(quad.Corner()), xf.TransformVector(quad.EdgeU()),
+                    xf.TransformVector(quad.EdgeV()), nullptr);
+
+                QuadRecord record = {};
+                record.Q = bakedQuad->Corner();
+                record.u = bakedQuad->EdgeU();
+                record.v = bakedQuad->EdgeV();
+                record.w = bakedQuad->PlaneW();
+                record.normal = bakedQuad->Normal();
+                record.D = bakedQuad->PlaneD();
+                record.material = MaterialId(quad.GetMaterial());
+                if (record.material == noId)
+                    return false;
+
+                quads.push_back(record);
+                AddObject(ObjectRef(QuadObject, quads.size() - 1), bakedQuad, boundary);
+                return true;
+            }
+
+            if (typeid(object) == typeid(Box))
+            {
+                // Translated boxes stay axis aligned and are baked, others keep their transform.
+                const Box& box = static_cast<const Box&>(object);
+
+                BoxRecord record = {};
+                record.transformed = !xf.IsTranslation();
+                record.worldToBox = record.transformed ? xf.Inverse() : Matrix34();
+                record.min = record.transformed ? box.Min() : xf.TransformPoint(box.Min());
+                record.max = record.transformed ? box.Max() : xf.TransformPoint(box.Max());
+                record.material = MaterialId(box.GetMaterial());
+                if (record.material == noId)
+                    return false;
+
+                boxes.push_back(record);
+                auto bakedBox = make_shared<Box>(record.min, record.max, nullptr);
+                AddObject(ObjectRef(BoxObject, boxes.size() - 1),
+                    record.transformed ? make_shared<Instance>(bakedBox, xf) : shared_ptr<Hittable>(bakedBox), boundary);
+                return true;
+            }
+
+            if (auto medium = dynamic_cast<const ConstantMedium*>(&object))
+            {
+                auto isotropic = dynamic_cast<const Isotropic*>(medium->PhaseFunction().get());
+                if (boundary != nullptr || isotropic == nullptr)
+                    return false;
+
+                MediumRecord record = {};
+                record.density = medium->Density();
+                record.texture = TextureId(isotropic->GetTexture());
+                if (record.texture == noId)
+                    return false;
+
+                // The boundary objects go into their own list, and a baked boundary provides the
+                // bounds of the medium for the BVH.
+                std::vector<uint32_t> refs;
+                if (!Flatten(*medium->Boundary(), xf, &refs))
+                    return false;
+
+                HittableList bakedBoundary;
+                for (const shared_ptr<Hittable>& bakedObject : bakedBoundaryObjects)
+                    bakedBoundary.Add(bakedObject);
+                bakedBoundaryObjects.clear();
+
+                record.bounds = bakedBoundary.BoundingBox();
+                record.firstBoundary = uint32_t(boundaryRefs.size());
+                record.boundaryCount = uint32_t(refs.size());
+                boundaryRefs.insert(boundaryRefs.end(), refs.begin(), refs.end());
+
+                media.push_back(record);
+                AddObject(ObjectRef(MediumObject, media.size() - 1),
+                    make_shared<ConstantMedium>(make_shared<HittableList>(bakedBoundary), record.density, Color(0, 0, 0)), nullptr);
+                return true;
+            }
+
+            return false;
+        }
+
+        bool FlattenAll(const std::vector<shared_ptr<Hittable>>& objects, const Matrix34& xf, std::vector<uint32_t>* boundary)
+        {
+            for (const shared_ptr<Hittable>& child : objects)
+                if (!Flatten(*child, xf, boundary))
+                    return false;
+            return true;
+        }
+
+        void AddObject(uint32_t ref, const shared_ptr<Hittable>& bakedObject, std::vector<uint32_t>* boundary)
+        {
+            if (boundary != nullptr)
+            {
+                boundary->push_back(ref);
+                bakedBoundaryObjects.push_back(bakedObject);
+                return;
+            }
+
+            baked.Add(bakedObject);
+            bakedRefs.push_back(ref);
+        }
+
+        uint32_t MaterialId(const shared_ptr<Material>& mat)
+        {
+            if (mat == nullptr)
+                return noId;
+
+            auto found = materialIds.find(mat.get());
+            if (found != materialIds.end())
+                return found->second;
+
+            MaterialRecord record = {};
+            record.texture = noId;
+
+            if (auto lambertian = dynamic_cast<const Lambertian*>(mat.get()))
+            {
+                record.kind = LambertianMaterial;
+                record.texture = TextureId(lambertian->GetTexture());
+            }
+            else if (auto metal = dynamic_cast<const Metal*>(mat.get()))
+            {
+                record.kind = MetalMaterial;
+                record.albedo = metal->Albedo();
+                record.parameter = metal->Fuzz();
+                record.texture = 0;
+            }
+            else if (auto dielectric = dynamic_cast<const Dielectric*>(mat.get()))
+            {
+                record.kind = DielectricMaterial;
+                record.parameter = dielectric->RefractionIndex();
+                record.texture = 0;
+            }
+            else if (auto light = dynamic_cast<const DiffuseLight*>(mat.get()))
+            {
+                record.kind = DiffuseLightMaterial;
+                record.texture = TextureId(light->GetTexture());
+            }
+            else if (auto isotropic = dynamic_cast<const Isotropic*>(mat.get()))
+            {
+                record.kind = IsotropicMaterial;
+                record.texture = TextureId(isotropic->GetTexture());
+            }
+
+            if (record.texture == noId)
+                return noId;
+
+            const uint32_t id = uint32_t(materials.size());
+            materials.push_back(record);
+            materialIds[mat.get()] = id;
+            return id;
+        }
+
+        uint32_t TextureId(const shared_ptr<Texture>& tex)
+        {
+            // Children are added before their parents, so loading can create textures in order.
+
+            if (tex == nullptr)
+                return noId;
+
+            auto found = textureIds.find(tex.get());
+            if (found != textureIds.end())
+                return found->second;
+
+            TextureRecord record = {};
+
+            if (auto solid = dynamic_cast<const SolidColor*>(tex.get()))
+            {
+                record.kind = SolidTexture;
+                record.color = solid->Albedo();
+            }
+            else if (auto checker = dynamic_cast<const CheckerTexture*>(tex.get()))
+            {
+                record.kind = CheckerTextureKind;
+                record.scale = checker->Scale();
+                record.even = TextureId(checker->Even());
+                record.odd = TextureId(checker->Odd());
+                if (record.even == noId || record.odd == noId)
+                    return noId;
+            }
+            else if (auto image = dynamic_cast<const ImageTexture*>(tex.get()))
+            {
+                const std::vector<unsigned char> imagePixels = image->Pixels();
+                record.kind = ImageTextureKind;
+                record.width = image->Width();
+                record.height = image->Height();
+                record.pixels = pixels.size();
+                pixels.insert(pixels.end(), imagePixels.begin(), imagePixels.end());
+            }
+            else if (auto noise = dynamic_cast<const NoiseTexture*>(tex.get()); noise && !noise->IsBaked())
+            {
+                const PerlinTables* tables = &noise->Noise().Tables();
+                auto foundTables = perlinIds.find(tables);
+                if (foundTables == perlinIds.end())
+                {
+                    foundTables = perlinIds.emplace(tables, uint32_t(perlinTables.size())).first;
+                    perlinTables.push_back(*tables);
+                }
+
+                record.kind = NoiseTextureKind;
+                record.scale = noise->Scale();
+                record.perlin = foundTables->second;
+            }
+            else
+            {
+                return noId;
+            }
+
+            const uint32_t id = uint32_t(textures.size());
+            textures.push_back(record);
+            textureIds[tex.get()] = id;
+            return id;
+        }
+    };
+
+    static uint32_t ObjectRef(ObjectKind kind, size_t index)
+    {
+        return (uint32_t(kind) << kindShift) | uint32_t(index);
+    }
+
+    static Ray BoxRay(const BoxRecord& box, const Ray& r)
+    {
+        // The ray in the space of the box, where it is axis aligned.
+        if (!box.transformed)
+            return r;
+
+        return Ray(box.worldToBox.TransformPoint(r.origin()), box.worldToBox.TransformVector(r.direction()), r.time());
+    }
+
+    bool IntersectObject(uint32_t object, const Ray& r, const Interval& ray_t, Intersection& hit) const
+    {
+        const uint32_t index = object & indexMask;
+
+        switch (object >> kindShift)
+        {
+            case SphereObject:
+            {
+                const SphereRecord& sphere = spheres[index];
+                double t;
+                if (!Sphere::IntersectSphere(sphere.center, sphere.radius, r, ray_t, t))
+                    return false;
+
+                hit.Set(t, this, object);
+                return true;
+            }
+            case QuadObject:
+            {
+                const QuadRecord& quad = quads[index];
+                double t, alpha, beta;
+                if (!Quad::HitPlane(quad.Q, quad.u, quad.v, quad.w, quad.normal, quad.D, r, ray_t, t, alpha, beta))
+                    return false;
+
+                const Interval unitInterval = Interval(0, 1);
+                if (!unitInterval.Contains(alpha) || !unitInterval.Contains(beta))
+                    return false;
+
+                hit.Set(t, this, object, alpha, beta);
+                return true;
+            }
+            case BoxObject:
+            {
+                const BoxRecord& box = boxes[index];
+                double t;
+                int face;
+                if (!Box::IntersectBox(box.min, box.max, BoxRay(box, r), ray_t, t, face))
+                    return false;
+
+                hit.Set(t, this, object, face);
+                return true;
+            }
+            case MediumObject:
+                return media[index]->Intersect(r, ray_t, hit);
+        }
+
+        return false;
+    }
+
+    bool ObjectSpan(uint32_t object, const Ray& r, Interval& span) const
+    {
+        const uint32_t index = object & indexMask;
+
+        switch (object >> kindShift)
+        {
+            case SphereObject:
+                return Sphere::SphereSpan(spheres[index].center, spheres[index].radius, r, span);
+            case QuadObject:
+            {
+                // Quads are crossed once.
+                Intersection hit;
+                if (!IntersectObject(object, r, Interval::universe, hit))
+                    return false;
+
+                span = Interval(hit.t, hit.t);
+                return true;
+            }
+            case BoxObject:
+            {
+                const BoxRecord& box = boxes[index];
+                int enterFace, exitFace;
+                return Box::Slabs(box.min, box.max, BoxRay(box, r), span, enterFace, exitFace);
+            }
+        }
+
+        return false;
+    }
+
+    template<typename T>
+    const T* Section(const Header& header, SectionId id) const
+    {
+        return reinterpret_cast<const T*>(file.Data() + header.sections[id].offset);
+    }
+
+    template<typename T>
+    size_t SectionCountOf(const Header& header, SectionId id) const
+    {
+        return size_t(header.sections[id].size / sizeof(T));
+    }
+
+    template<typename T>
+    static void AppendSection(Header& header, std::vector<unsigned char>& payload, SectionId id, const std::vector<T>& items)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "Snapshot sections hold raw bytes");
+
+        const size_t size = items.size() * sizeof(T);
+        header.sections[id].offset = sizeof(Header) + payload.size();
+        header.sections[id].size = size;
+
+        // Pad every section so the next one starts aligned.
+        const size_t paddedSize = (size + sectionAlignment - 1) / sectionAlignment * sectionAlignment;
+        const size_t start = payload.size();
+        payload.resize(start + paddedSize, 0);
+        if (size > 0)
+            std::memcpy(payload.data() + start, items.data(), size);
+    }
+
+    static bool SectionsAreValid(const Header& header, size_t fileSize)
+    {
+        for (const SectionRecord& section : header.sections)
+        {
+            if (section.offset % sectionAlignment != 0 || section.offset > fileSize || section.size > fileSize - section.offset)
+                return false;
+        }
+
+        return true;
+    }
+
+    std::vector<std::string> SourcePaths(const Header& header) const
+    {
+        // Reads the paths of the source files. A section not ending with a null can't be read,
+        // and is given a path no file has, so the snapshot is reported as stale.
+
+        const char* text = Section<char>(header, SourcesSection);
+        const size_t size = SectionCountOf<char>(header, SourcesSection);
+        if (size > 0 && text[size - 1] != '\0')
+            return { std::string() };
+
+        std::vector<std::string> paths;
+        for (size_t i = 0; i < size; i += paths.back().size() + 1)
+            paths.emplace_back(text + i);
+
+        return paths;
+    }
+
+    static uint64_t CombineHashes(uint64_t first, uint64_t second)
+    {
+        return (first ^ second) * fnvPrime;
+    }
+
+    static uint64_t HashWords(const unsigned char* data, size_t size)
+    {
+        // FNV-1a over 64-bit words, so validating large snapshots stays cheap. Sections are padded
+        // to a multiple of the word size.
+
+        uint64_t hash = fnvOffset;
+        for (size_t i = 0; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+        {
+            uint64_t word;
+            std::memcpy(&word, data + i, sizeof(word));
+            hash = (hash ^ word) * fnvPrime;
+        }
+
+        return hash;
+    }
+
+    // The Create functions below recreate the objects of the records in order, and return
+    // false on a record of an unknown kind or one referring to anything outside its section.
+    // Records only refer to textures recreated before them.
+
+    bool CreateTextures(const Header& header)
+    {
+        const TextureRecord* records = Section<TextureRecord>(header, TexturesSection);
+        const PerlinTables* perlinTables = Section<PerlinTables>(header, PerlinSection);
+        const unsigned char* pixels = Section<unsigned char>(header, PixelsSection);
+        const size_t perlinCount = SectionCountOf<PerlinTables>(header, PerlinSection);
+        const size_t pixelBytes = SectionCountOf<unsigned char>(header, PixelsSection);
+
+        const size_t count = SectionCountOf<TextureRecord>(header, TexturesSection);
+        textures.reserve(count);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            const TextureRecord& record = records[i];
+            switch (record.kind)
+            {
+                case SolidTexture:
+                    textures.push_back(make_shared<SolidColor>(record.color));
+                    break;
+                case CheckerTextureKind:
+                    if (record.even >= textures.size() || record.odd >= textures.size())
+                        return false;
+                    textures.push_back(make_shared<CheckerTexture>(record.scale, textures[record.even], textures[record.odd]));
+                    break;
+                case ImageTextureKind:
+                {
+                    // The pixels are copied into a pyramid. Images that failed to load are stored
+                    // without pixels.
+                    const bool hasPixels = record.width > 0 && record.height > 0;
+                    if (hasPixels && (record.pixels > pixelBytes
+                        || uint64_t(record.width) * uint64_t(record.height) * 3 > pixelBytes - record.pixels))
+                        return false;
+                    textures.push_back(make_shared<ImageTexture>(hasPixels ? pixels + record.pixels : nullptr, record.width, record.height));
+                    break;
+                }
+                case NoiseTextureKind:
+                    if (record.perlin >= perlinCount)
+                        return false;
+                    textures.push_back(make_shared<NoiseTexture>(record.scale, &perlinTables[record.perlin]));
+                    break;
+                default:
+                    return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool CreateMaterials(const Header& header)
+    {
+        const MaterialRecord* records = Section<MaterialRecord>(header, MaterialsSection);
+
+        const size_t count = SectionCountOf<MaterialRecord>(header, MaterialsSection);
+        materials.reserve(count);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            const MaterialRecord& record = records[i];
+            const bool usesTexture = record.kind == LambertianMaterial || record.kind == DiffuseLightMaterial || record.kind == IsotropicMaterial;
+            if (usesTexture && record.texture >= textures.size())
+                return false;
+
+            switch (record.kind)
+            {
+                case LambertianMaterial:
+                    materials.push_back(make_shared<Lambertian>(textures[record.texture]));
+                    break;
+                case MetalMaterial:
+                    materials.push_back(make_shared<Metal>(record.albedo, record.parameter));
+                    break;
+                case DielectricMaterial:
+                    materials.push_back(make_shared<Dielectric>(record.parameter));
+                    break;
+                case DiffuseLightMaterial:
+                    materials.push_back(make_shared<DiffuseLight>(textures[record.texture]));
+                    break;
+                case IsotropicMaterial:
+                    materials.push_back(make_shared<Isotropic>(textures[record.texture]));
+                    break;
+                default:
+                    return false;
+            }
+        }
+
+        for (const shared_ptr<Material>& material : materials)
+            material->FoldConstants();
+
+        return true;
+    }
+
+    bool CreateMedia(const Header& header)
+    {
+        const size_t count = SectionCountOf<MediumRecord>(header, MediaSection);
+        const size_t boundaryRefCount = SectionCountOf<uint32_t>(header, BoundaryRefsSection);
+        media.reserve(count);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            const MediumRecord& record = mediaRecords[i];
+            if (record.texture >= textures.size() || uint64_t(record.firstBoundary) + record.boundaryCount > boundaryRefCount)
+                return false;
+
+            // Boundaries are spheres, quads and boxes, never media.
+            for (uint32_t b = 0; b < record.boundaryCount; b++)
+            {
+                const uint32_t object = boundaryRefs[record.firstBoundary + b];
+                const uint32_t index = object & indexMask;
+                switch (object >> kindShift)
+                {
+                    case SphereObject: if (index >= SectionCountOf<SphereRecord>(header, SpheresSection)) return false; break;
+                    case QuadObject:   if (index >= SectionCountOf<QuadRecord>(header, QuadsSection)) return false; break;
+                    case BoxObject:    if (index >= SectionCountOf<BoxRecord>(header, BoxesSection)) return false; break;
+                    default:           return false;
+                }
+            }
+
+            auto boundary = make_shared<SnapshotBoundary>(this, record);
+            auto medium = make_shared<ConstantMedium>(boundary, record.density, textures[record.texture]);
+            medium->PhaseFunction()->FoldConstants();
+            media.push_back(medium);
+        }
+
+        return true;
+    }
+
+private:
+    MappedFile file;
+    CameraRecord camera;
+
+    // Arrays pointing into the mapped file
+    const SphereRecord* spheres = nullptr;
+    const QuadRecord* quads = nullptr;
+    const BoxRecord* boxes = nullptr;
+    const MediumRecord* mediaRecords = nullptr;
+    const uint32_t* boundaryRefs = nullptr;
+    const SBVH::Node* nodes = nullptr;
+    const SBVH::LeafRef* leafRefs = nullptr;
+    const AABB* clipBoxes = nullptr;
+    size_t nodeCount = 0;
+
+    // Objects recreated on load
+    std::vector<shared_ptr<Texture>> textures;
+    std::vector<shared_ptr<Material>> materials;
+    std::vector<shared_ptr<Hittable>> media;
+};
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+// Four double lanes, mapped to AVX when the compiler targets it, to two SSE2 registers on x64 (or
+// x86 built with SSE2), and to plain arrays elsewhere. Comparisons return masks with every bit
+// of a lane set, which Select and MoveMask consume.
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define SIMD_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SIMD_SSE2
+#endif
+
+struct alignas(32) Double4
+{
+#if defined(SIMD_AVX)
+    __m256d v;
+
+    Double4() {}
+    Double4(__m256d v) : v(v) {}
+    Double4(double x) : v(_mm256_set1_pd(x)) {}
+
+    static Double4 Load(const double* p) { return _mm256_load_pd(p); }
+    void Store(double* p) const { _mm256_store_pd(p, v); }
+
+    friend Double4 operator+(Double4 a, Double4 b) { return _mm256_add_pd(a.v, b.v); }
+    friend Double4 operator-(Double4 a, Double4 b) { return _mm256_sub_pd(a.v, b.v); }
+    friend Double4 operator*(Double4 a, Double4 b) { return _mm256_mul_pd(a.v, b.v); }
+    friend Double4 operator/(Double4 a, Double4 b) { return _mm256_div_pd(a.v, b.v); }
+    friend Double4 operator&(Double4 a, Double4 b) { return _mm256_and_pd(a.v, b.v); }
+    friend Double4 operator|(Double4 a, Double4 b) { return _mm256_or_pd(a.v, b.v); }
+
+    friend Double4 operator<(Double4 a, Double4 b) { return _mm256_cmp_pd(a.v, b.v, _CMP_LT_OQ); }
+    friend Double4 operator<=(Double4 a, Double4 b) { return _mm256_cmp_pd(a.v, b.v, _CMP_LE_OQ); }
+    friend Double4 operator>(Double4 a, Double4 b) { return _mm256_cmp_pd(a.v, b.v, _CMP_GT_OQ); }
+    friend Double4 operator>=(Double4 a, Double4 b) { return _mm256_cmp_pd(a.v, b.v, _CMP_GE_OQ); }
+
+    friend Double4 Sqrt(Double4 a) { return _mm256_sqrt_pd(a.v); }
+    friend Double4 Min(Double4 a, Double4 b) { return _mm256_min_pd(a.v, b.v); }
+    friend Double4 Max(Double4 a, Double4 b) { return _mm256_max_pd(a.v, b.v); }
+    friend Double4 Abs(Double4 a) { return _mm256_andnot_pd(_mm256_set1_pd(-0.0), a.v); }
+    friend Double4 Floor(Double4 a) { return _mm256_floor_pd(a.v); }
+
+    // Lanes of a where the mask is set, lanes of b elsewhere.
+    friend Double4 Select(Double4 mask, Double4 a, Double4 b) { return _mm256_blendv_pd(b.v, a.v, mask.v); }
+
+    // One bit per lane, set where the mask is.
+    friend int MoveMask(Double4 mask) { return _mm256_movemask_pd(mask.v); }
+
+#elif defined(SIMD_SSE2)
+    __m128d lo, hi;
+
+    Double4() {}
+    Double4(__m128d lo, __m128d hi) : lo(lo), hi(hi) {}
+    Double4(double x) : lo(_mm_set1_pd(x)), hi(_mm_set1_pd(x)) {}
+
+    static Double4 Load(const double* p) { return Double4(_mm_load_pd(p), _mm_load_pd(p + 2)); }
+    void Store(double* p) const { _mm_store_pd(p, lo); _mm_store_pd(p + 2, hi); }
+
+    friend Double4 operator+(Double4 a, Double4 b) { return Double4(_mm_add_pd(a.lo, b.lo), _mm_add_pd(a.hi, b.hi)); }
+    friend Double4 operator-(Double4 a, Double4 b) { return Double4(_mm_sub_pd(a.lo, b.lo), _mm_sub_pd(a.hi, b.hi)); }
+    friend Double4 operator*(Double4 a, Double4 b) { return Double4(_mm_mul_pd(a.lo, b.lo), _mm_mul_pd(a.hi, b.hi)); }
+    friend Double4 operator/(Double4 a, Double4 b) { return Double4(_mm_div_pd(a.lo, b.lo), _mm_div_pd(a.hi, b.hi)); }
+    friend Double4 operator&(Double4 a, Double4 b) { return Double4(_mm_and_pd(a.lo, b.lo), _mm_and_pd(a.hi, b.hi)); }
+    friend Double4 operator|(Double4 a, Double4 b) { return Double4(_mm_or_pd(a.lo, b.lo), _mm_or_pd(a.hi, b.hi)); }
+
+    friend Double4 operator<(Double4 a, Double4 b) { return Double4(_mm_cmplt_pd(a.lo, b.lo), _mm_cmplt_pd(a.hi, b.hi)); }
+    friend Double4 operator<=(Double4 a, Double4 b) { return Double4(_mm_cmple_pd(a.lo, b.lo), _mm_cmple_pd(a.hi, b.hi)); }
+    friend Double4 operator>(Double4 a, Double4 b) { return Double4(_mm_cmpgt_pd(a.lo, b.lo), _mm_cmpgt_pd(a.hi, b.hi)); }
+    friend Double4 operator>=(Double4 a, Double4 b) { return Double4(_mm_cmpge_pd(a.lo, b.lo), _mm_cmpge_pd(a.hi, b.hi)); }
+
+    friend Double4 Sqrt(Double4 a) { return Double4(_mm_sqrt_pd(a.lo), _mm_sqrt_pd(a.hi)); }
+    friend Double4 Min(Double4 a, Double4 b) { return Double4(_mm_min_pd(a.lo, b.lo), _mm_min_pd(a.hi, b.hi)); }
+    friend Double4 Max(Double4 a, Double4 b) { return Double4(_mm_max_pd(a.lo, b.lo), _mm_max_pd(a.hi, b.hi)); }
+    friend Double4 Abs(Double4 a)
+    {
+        const __m128d sign = _mm_set1_pd(-0.0);
+        return Double4(_mm_andnot_pd(sign, a.lo), _mm_andnot_pd(sign, a.hi));
+    }
+
+    friend Double4 Floor(Double4 a)
+    {
+        // Truncates through 32-bit integers, so only for lanes below 2^31 in magnitude, and steps
+        // down the lanes that were rounded up.
+        const __m128d one = _mm_set1_pd(1.0);
+        const __m128d lo = _mm_cvtepi32_pd(_mm_cvttpd_epi32(a.lo));
+        const __m128d hi = _mm_cvtepi32_pd(_mm_cvttpd_epi32(a.hi));
+        return Double4(_mm_sub_pd(lo, _mm_and_pd(_mm_cmpgt_pd(lo, a.lo), one)),
+            _mm_sub_pd(hi, _mm_and_pd(_mm_cmpgt_pd(hi, a.hi), one)));
+    }
+
+    friend Double4 Select(Double4 mask, Double4 a, Double4 b)
+    {
+        return Double4(
+            _mm_or_pd(_mm_and_pd(mask.lo, a.lo), _mm_andnot_pd(mask.lo, b.lo)),
+            _mm_or_pd(_mm_and_pd(mask.hi, a.hi), _mm_andnot_pd(mask.hi, b.hi)));
+    }
+
+    friend int MoveMask(Double4 mask) { return _mm_movemask_pd(mask.lo) | (_mm_movemask_pd(mask.hi) << 2); }
+
+#else
+    double v[4];
+
+    Double4() {}
+    Double4(double x) : v{ x, x, x, x } {}
+
+    static Double4 Load(const double* p) { Double4 r; std::memcpy(r.v, p, sizeof(r.v)); return r; }
+    void Store(double* p) const { std::memcpy(p, v, sizeof(v)); }
+
+    template<typename F>
+    static Double4 Map(Double4 a, Double4 b, F f)
+    {
+        Double4 r;
+        for (int i = 0; i < 4; i++)
+            r.v[i] = f(a.v[i], b.v[i]);
+        return r;
+    }
+
+    static double Bits(uint64_t bits) { double d; std::memcpy(&d, &bits, sizeof(d)); return d; }
+    static uint64_t Bits(double d) { uint64_t bits; std::memcpy(&bits, &d, sizeof(d)); return bits; }
+    static double Mask(bool set) { return Bits(set ? ~uint64_t(0) : uint64_t(0)); }
+
+    friend Double4 operator+(Double4 a, Double4 b) { return Map(a, b, [](double x, double y) { return x + y; }); }
+    friend Double4 operator-(Double4 a, Double4 b) { return Map(a, b, [](double x, double y) { return x - y; }); }
+    friend Double4 operator*(Double4 a, Double4 b) { return Map(a, b, [](double x, double y) { return x * y; }); }
+    friend Double4 operator/(Double4 a, Double4 b) { return Map(a, b, [](double x, double y) { return x / y; }); }
+    friend Double4 operator&(Double4 a, Double4 b) { return Map(a, b, [](double x, double y) { return Bits(Bits(x) & Bits(y)); }); }
+    friend Double4 operator|(Double4 a, Double4 b) { return Map(a, b, [](double x, double y) { return Bits(Bits(x) | Bits(y)); }); }
+
+    friend Double4 operator<(Double4 a, Double4 b) { return Map(a, b, [](double x, double y) { return Mask(x < y); }); }
+    friend Double4 operator<=(Double4 a, Double4 b) { return Map(a, b, [](double x, double y) { return Mask(x <= y); }); }
+    friend Double4 operator>(Double4 a, Double4 b) { return Map(a, b, [](double x, double y) { return Mask(x > y); }); }
+    friend Double4 operator>=(Double4 a, Double4 b) { return Map(a, b, [](double x, double y) { return Mask(x >= y); }); }
+
+    friend Double4 Sqrt(Double4 a) { return Map(a, a, [](double x, double) { return std::sqrt(x); }); }
+    friend Double4 Min(Double4 a, Double4 b) { return Map(a, b, [](double x, double y) { return x < y ? x : y; }); }
+    friend Double4 Max(Double4 a, Double4 b) { return Map(a, b, [](double x, double y) { return x > y ? x : y; }); }
+    friend Double4 Abs(Double4 a) { return Map(a, a, [](double x, double) { return std::fabs(x); }); }
+    friend Double4 Floor(Double4 a) { return Map(a, a, [](double x, double) { return std::floor(x); }); }
+
+    friend Double4 Select(Double4 mask, Double4 a, Double4 b)
+    {
+        Double4 r;
+        for (int i = 0; i < 4; i++)
+            r.v[i] = Bits(mask.v[i]) ? a.v[i] : b.v[i];
+        return r;
+    }
+
+    friend int MoveMask(Double4 mask)
+    {
+        int bits = 0;
+        for (int i = 0; i < 4; i++)
+            bits |= int(Bits(mask.v[i]) >> 63) << i;
+        return bits;
+    }
+#endif
+};
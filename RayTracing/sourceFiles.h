@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+class SourceFiles
+{
+public:
+    // The files a scene was built from: images, meshes and volumes. Loaders record the files
+    // they read in the list of the active scope, so caches of a built scene can store the list
+    // and tell when any of the files changed since.
+
+    std::vector<std::string> paths;
+
+    static void Record(const std::string& path)
+    {
+        if (active == nullptr)
+            return;
+
+        for (const std::string& known : active->paths)
+            if (known == path)
+                return;
+
+        active->paths.push_back(path);
+    }
+
+    static bool Stamp(const std::string& path, uint64_t& stamp)
+    {
+        // Any change to a file changes its size or its modification time.
+
+        std::error_code error;
+        const uint64_t size = uint64_t(std::filesystem::file_size(path, error));
+        if (error)
+            return false;
+
+        const uint64_t modified = uint64_t(std::filesystem::last_write_time(path, error).time_since_epoch().count());
+        stamp = size * 0x9e3779b97f4a7c15ull ^ modified;
+        return !error;
+    }
+
+    static uint64_t Hash(const std::vector<std::string>& paths)
+    {
+        // FNV-1a over the paths and the stamps of the files, with missing files hashed apart
+        // from every stamp, so files appearing or going also change the hash.
+
+        uint64_t hash = fnvOffset;
+        for (const std::string& path : paths)
+        {
+            for (const char c : path)
+                hash = (hash ^ uint64_t(uint8_t(c))) * fnvPrime;
+
+            uint64_t stamp;
+            hash = (hash ^ (Stamp(path, stamp) ? stamp : missingStamp)) * fnvPrime;
+        }
+
+        return hash;
+    }
+
+    class Scope
+    {
+    public:
+        // Makes loaders on this thread record their files in the list, while the scope lasts.
+
+        Scope(SourceFiles& files) : previous(active) { active = &files; }
+        ~Scope() { active = previous; }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        SourceFiles* previous;
+    };
+
+private:
+    static inline thread_local SourceFiles* active = nullptr;
+
+    static constexpr uint64_t fnvOffset = 14695981039346656037ull;
+    static constexpr uint64_t fnvPrime = 1099511628211ull;
+    static constexpr uint64_t missingStamp = 0xffffffffffffffffull;
+};
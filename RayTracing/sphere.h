@@ -2,12 +2,13 @@
 
 #include "hittable.h"
 
-class Sphere : public Hittable
+class Sphere final : public Hittable
 {
 public:
     // Stationary Sphere
     Sphere(const Point3& staticCenter, double radius, shared_ptr<Material> mat)
-        : center(staticCenter, Vec3(0, 0, 0))
+        : Hittable(HittableKind::Sphere)
+        , center(staticCenter, Vec3(0, 0, 0))
         , radius(std::fmax(0, radius))
         , mat(mat)
     {
@@ -17,7 +18,8 @@ public:
 
     // Moving Sphere
     Sphere(const Point3& center1, const Point3& center2, double radius, shared_ptr<Material> mat)
-        : center(center1, center2 - center1)
+        : Hittable(HittableKind::Sphere)
+        , center(center1, center2 - center1)
         , radius(std::fmax(0, radius))
         , mat(mat)
     {
@@ -27,8 +29,29 @@ public:
         bbox = AABB(box1, box2);
     }
 
-    bool Hit(const Ray& r, const Interval& ray_t, HitRecord& rec) const override
+    bool Intersect(const Ray& r, const Interval& ray_t, Intersection& hit) const override
     {
+        double t;
+        if (!IntersectSphere(center, radius, r, ray_t, t))
+            return false;
+
+        hit.Set(t, this);
+        return true;
+    }
+
+    void ComputeSurface(const Ray& r, const Intersection& hit, int depth, HitRecord& rec) const override
+    {
+        SphereSurface(center, radius, r, hit.t, rec);
+        rec.mat = mat.get();
+    }
+
+    bool Span(const Ray& r, Interval& span) const override { return SphereSpan(center, radius, r, span); }
+
+    static bool IntersectSphere(const Ray& center, double radius, const Ray& r, const Interval& ray_t, double& t)
+    {
+        // Intersects a sphere moving along the given center ray, returning the nearest root in
+        // the interval.
+
         const Point3 currentCenter = center.at(r.time());
         const Vec3 oc = currentCenter - r.origin();
         const double a = r.direction().LengthSquared();
@@ -50,19 +73,62 @@ public:
                 return false;
         }
 
-        rec.t = root;
+        t = root;
+        return true;
+    }
+
+    static bool SphereSpan(const Ray& center, double radius, const Ray& r, Interval& span)
+    {
+        // Both roots at once, for the part of the ray line inside the sphere.
+
+        const Vec3 oc = center.at(r.time()) - r.origin();
+        const double a = r.direction().LengthSquared();
+        const double h = Dot(r.direction(), oc);
+        const double c = oc.LengthSquared() - radius * radius;
+
+        const double discriminant = h * h - a * c;
+        if (discriminant < 0)
+            return false;
+
+        const double sqrtd = std::sqrt(discriminant);
+        span = Interval((h - sqrtd) / a, (h + sqrtd) / a);
+        return true;
+    }
+
+    static void SphereSurface(const Ray& center, double radius, const Ray& r, double t, HitRecord& rec)
+    {
+        // Fills everything in the hit record but the material, for a hit at t.
+
+        const Point3 currentCenter = center.at(r.time());
+
+        rec.t = t;
         rec.p = r.at(rec.t);
         Vec3 outwardNormal = (rec.p - currentCenter) / radius;
         rec.SetFaceNormal(r, outwardNormal);
         GetSphere_UV(outwardNormal, rec.u, rec.v);
-        rec.mat = mat;
 
-        return true;
+        // Derivatives of the point along the angles of GetSphere_UV, which the poles don't have.
+        const double x = outwardNormal.x(), y = outwardNormal.y(), z = outwardNormal.z();
+        const double rho = std::sqrt(x * x + z * z);
+        if (rho > 0)
+        {
+            rec.dpdu = 2 * pi * radius * Vec3(z, 0, -x);
+            rec.dpdv = pi * radius * Vec3(-x * y / rho, rho, -y * z / rho);
+        }
     }
 
     virtual AABB BoundingBox() const { return bbox; }
 
-private:
+    const Ray& Center() const { return center; }
+    double Radius() const { return radius; }
+    const shared_ptr<Material>& GetMaterial() const { return mat; }
+
+    AABB BoundingBoxAt(double time) const override
+    {
+        const Point3 currentCenter = center.at(time);
+        const Vec3 rvec = Vec3(radius, radius, radius);
+        return AABB(currentCenter - rvec, currentCenter + rvec);
+    }
 
     static void GetSphere_UV(const Point3& p, double& u, double& v)
     {
@@ -1,106 +1,327 @@
 #pragma once
 
+#include "densityGrid.h"
 #include "perlin.h"
-#include "rt_stb_image.h"
+#include "textureLibrary.h"
+
+enum class TextureKind : uint8_t
+{
+    // Built-in textures, which TextureValue calls directly. Any other texture is Custom.
+    Custom, Solid, Checker, Image, Noise
+};
 
 class Texture
 {
 public:
     virtual ~Texture() = default;
 
-    virtual Color Value(double u, double v, const Point3& p) const = 0;
+    // footprint is the width of the area around u, v seen by the ray, in UV units, which
+    // textures may average over. Zero asks for the value at the point.
+    virtual Color Value(double u, double v, const Point3& p, double footprint) const = 0;
+
+    // Whether the texture has the same value everywhere, which is then written to value.
+    virtual bool IsConstant(Color& value) const { return false; }
+
+    TextureKind Kind() const { return kind; }
+
+protected:
+    Texture() {}
+    explicit Texture(TextureKind kind) : kind(kind) {}
+
+private:
+    TextureKind kind = TextureKind::Custom;
 };
 
-class SolidColor : public Texture
+inline Color TextureValue(const Texture& tex, double u, double v, const Point3& p, double footprint);
+
+class SolidColor final : public Texture
 {
 public:
-    SolidColor(const Color& albedo) : albedo(albedo)
+    SolidColor(const Color& albedo)
+        : Texture(TextureKind::Solid)
+        , albedo(albedo)
     {}
 
     SolidColor(double red, double green, double blue)
         : SolidColor(Color(red, green, blue))
     {}
 
-    Color Value(double u, double v, const Point3& p) const override
+    Color Value(double u, double v, const Point3& p, double footprint) const override
     {
         return albedo;
     }
 
+    bool IsConstant(Color& value) const override
+    {
+        value = albedo;
+        return true;
+    }
+
+    const Color& Albedo() const { return albedo; }
+
 private:
     Color albedo;
 };
 
-class CheckerTexture : public Texture
+class CheckerTexture final : public Texture
 {
 public:
     CheckerTexture(double scale, shared_ptr<Texture> even, shared_ptr<Texture> odd)
-        : invScale(1.0 / scale)
+        : Texture(TextureKind::Checker)
+        , invScale(1.0 / scale)
         , even(even)
         , odd(odd)
     {}
 
     CheckerTexture(double scale, const Color& c1, const Color& c2)
-        : CheckerTexture(scale, make_shared<SolidColor>(c1), make_shared<SolidColor>(c2))
+        : CheckerTexture(scale, MakeObject<SolidColor>(c1), MakeObject<SolidColor>(c2))
     {}
 
-    Color Value(double u, double v, const Point3& p) const override
+    Color Value(double u, double v, const Point3& p, double footprint) const override
+    {
+        return TextureValue(IsEven(p) ? *even : *odd, u, v, p, footprint);
+    }
+
+    bool IsEven(const Point3& p) const
     {
         const int xInteger = int(std::floor(invScale * p.x()));
         const int yInteger = int(std::floor(invScale * p.y()));
         const int zInteger = int(std::floor(invScale * p.z()));
 
-        const bool isEven = (xInteger + yInteger + zInteger) % 2 == 0;
-
-        return isEven ? even->Value(u, v, p) : odd->Value(u, v, p);
+        return (xInteger + yInteger + zInteger) % 2 == 0;
     }
 
+    double Scale() const { return 1.0 / invScale; }
+    const shared_ptr<Texture>& Even() const { return even; }
+    const shared_ptr<Texture>& Odd() const { return odd; }
+
 private:
     double invScale;
     shared_ptr<Texture> even;
     shared_ptr<Texture> odd;
 };
 
-class ImageTexture : public Texture
+class ImageTexture final : public Texture
 {
 public:
+    // Image filtered through its MIP pyramid, blending the two levels whose texels are closest
+    // to the size of the footprint. Images from files are loaded in the background by the
+    // texture library, and read a tile at a time through the texture cache, so only the tiles
+    // in use take memory.
+
     ImageTexture(const char* filename)
-        : image(filename) 
+        : Texture(TextureKind::Image)
+        , pending(TextureLibrary::Global().Request(filename))
     {}
 
-    Color Value(double u, double v, const Point3& p) const override
+    ImageTexture(const unsigned char* pixels, int width, int height)
+        : Texture(TextureKind::Image)
+    {
+        // Builds the pyramid in memory from rows of 8-bit RGB pixels.
+
+        shared_ptr<const TiledImage> tiles;
+        if (pixels != nullptr && width > 0 && height > 0)
+            tiles = make_shared<TiledImage>(pixels, width, height);
+
+        std::promise<shared_ptr<const TextureLibrary::Image>> ready;
+        ready.set_value(std::make_shared<const TextureLibrary::Image>(tiles));
+        pending = ready.get_future().share();
+    }
+
+    Color Value(double u, double v, const Point3& p, double footprint) const override
     {
         // If we have no texture data, then return solid cyan as a debugging aid.
-        if (image.height() <= 0) return Color(0, 1, 1);
+        const TextureLibrary::Image& image = GetImage();
+        if (!image.tiles) return Color(0, 1, 1);
 
         // Clamp input texture coordinates to [0,1] x [1,0]
         u = Interval(0, 1).Clamp(u);
         v = 1.0 - Interval(0, 1).Clamp(v);  // Flip V to image coordinates
 
-        const int i = int(u * image.width());
-        const int j = int(v * image.height());
-        const unsigned char* pixel = image.pixel_data(i, j);
+        const TiledImage& tiles = *image.tiles;
+        const int lastLevel = tiles.LevelCount() - 1;
+        const double texels = footprint * std::max(tiles.Width(), tiles.Height());
+        const double level = texels > 1 ? std::fmin(std::log2(texels), lastLevel) : 0;
 
-        const double colorScale = 1.0 / 255.0;
-        return Color(colorScale * pixel[0], colorScale * pixel[1], colorScale * pixel[2]);
+        const int fineLevel = int(level);
+        const double blend = level - fineLevel;
+        const Color fine = Bilinear(image, fineLevel, u, v);
+        if (blend <= 0 || fineLevel == lastLevel)
+            return fine;
+
+        return (1 - blend) * fine + blend * Bilinear(image, fineLevel + 1, u, v);
+    }
+
+    int Width() const { return GetImage().tiles ? GetImage().tiles->Width() : 0; }
+    int Height() const { return GetImage().tiles ? GetImage().tiles->Height() : 0; }
+
+    std::vector<unsigned char> Pixels() const
+    {
+        // Rows of 8-bit RGB pixels of the full size image.
+
+        std::vector<unsigned char> pixels(size_t(Width()) * Height() * 3);
+        for (int y = 0; y < Height(); y++)
+            for (int x = 0; x < Width(); x++)
+                Texel(GetImage(), 0, x, y, &pixels[(size_t(y) * Width() + x) * 3]);
+
+        return pixels;
     }
 
 private:
-    rtw_image image;
+    TextureLibrary::Future pending;
+    mutable std::atomic<const TextureLibrary::Image*> loaded{ nullptr };  // Once pending is ready
+
+    const TextureLibrary::Image& GetImage() const
+    {
+        // Waits for the image on the first lookup, later ones only check it's there.
+
+        const TextureLibrary::Image* image = loaded.load(std::memory_order_acquire);
+        if (image == nullptr)
+        {
+            image = pending.get().get();
+            loaded.store(image, std::memory_order_release);
+        }
+
+        return *image;
+    }
+
+    static void Texel(const TextureLibrary::Image& image, int level, int x, int y, unsigned char texel[3])
+    {
+        const TiledImage::Level& info = image.tiles->GetLevel(level);
+        const int tileSize = TiledImage::tileSize;
+        const size_t tile = info.firstTile + size_t(y / tileSize) * info.tilesX + size_t(x / tileSize);
+        const size_t offset = (size_t(y % tileSize) * tileSize + size_t(x % tileSize)) * 3;
+
+        if (image.cacheEntry != nullptr)
+            TextureCache::Global().Texel(*image.cacheEntry, tile, offset, texel);
+        else
+            std::memcpy(texel, image.tiles->ResidentTile(tile) + offset, 3);
+    }
+
+    static Color Bilinear(const TextureLibrary::Image& image, int level, double u, double v)
+    {
+        // Interpolates between the centers of the four nearest texels, repeating the edges.
+
+        const TiledImage::Level& info = image.tiles->GetLevel(level);
+        const double x = u * info.width - 0.5;
+        const double y = v * info.height - 0.5;
+        const int x0 = int(std::floor(x));
+        const int y0 = int(std::floor(y));
+        const double fx = x - x0;
+        const double fy = y - y0;
+
+        const int maxX = int(info.width) - 1;
+        const int maxY = int(info.height) - 1;
+        const int xs[2] = { std::clamp(x0, 0, maxX), std::clamp(x0 + 1, 0, maxX) };
+        const int ys[2] = { std::clamp(y0, 0, maxY), std::clamp(y0 + 1, 0, maxY) };
+
+        double rgb[3] = { 0, 0, 0 };
+        for (int corner = 0; corner < 4; corner++)
+        {
+            const int dx = corner & 1, dy = corner >> 1;
+            const double weight = (dx ? fx : 1 - fx) * (dy ? fy : 1 - fy);
+
+            unsigned char texel[3];
+            Texel(image, level, xs[dx], ys[dy], texel);
+            for (int c = 0; c < 3; c++)
+                rgb[c] += weight * texel[c];
+        }
+
+        const double colorScale = 1.0 / 255.0;
+        return Color(colorScale * rgb[0], colorScale * rgb[1], colorScale * rgb[2]);
+    }
 };
 
-class NoiseTexture : public Texture
+class NoiseTexture final : public Texture
 {
 public:
     NoiseTexture(double scale)
-        : scale(scale)
+        : Texture(TextureKind::Noise)
+        , scale(scale)
     {}
 
-    Color Value(double u, double v, const Point3& p) const override
+    NoiseTexture(double scale, const PerlinTables* tables)
+        : Texture(TextureKind::Noise)
+        , noise(tables)
+        , scale(scale)
+    {}
+
+    Color Value(double u, double v, const Point3& p, double footprint) const override
+    {
+        return Color(.5, .5, .5) * (1 + std::sin(scale * p.z() + 10 * Turbulence(p)));
+    }
+
+    double Turbulence(const Point3& p) const
     {
-        return Color(.5, .5, .5) * (1 + std::sin(scale * p.z() + 10 * noise.Turb(p, 7)));
+        // The baked turbulence inside the baked bounds, the exact one elsewhere.
+        if (baked && baked->Contains(p))
+            return baked->Density(p);
+
+        return noise.Turb(p, octaves);
+    }
+
+    struct BakeStats
+    {
+        size_t bytes = 0;
+        double rmsError = 0;  // Of the turbulence, against the exact one
+        double maxError = 0;
+    };
+
+    BakeStats Bake(const AABB& bounds, int resolution, int errorSamples = 100000)
+    {
+        // Precomputes the turbulence over the bounds into a grid with resolution voxels along
+        // its longest axis, sampled with trilinear filtering. Octaves finer than the voxels are
+        // smoothed out, so the error is measured at random points in the bounds.
+
+        const int longest = bounds.LongestAxis();
+        int counts[3];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const double ratio = bounds.AxisInterval(axis).Size() / bounds.AxisInterval(longest).Size();
+            counts[axis] = std::max(2, int(std::ceil(resolution * ratio)));
+        }
+
+        baked = DensityGrid::Sample(bounds, counts[0], counts[1], counts[2],
+            [this](const Point3& p) { return noise.Turb(p, octaves); });
+
+        BakeStats stats;
+        stats.bytes = baked->BytesUsed();
+
+        double squaredSum = 0;
+        for (int i = 0; i < errorSamples; i++)
+        {
+            const Point3 p(Random::Double(bounds.x.min, bounds.x.max), Random::Double(bounds.y.min, bounds.y.max),
+                Random::Double(bounds.z.min, bounds.z.max));
+            const double error = std::fabs(baked->Density(p) - noise.Turb(p, octaves));
+            squaredSum += error * error;
+            stats.maxError = std::fmax(stats.maxError, error);
+        }
+
+        stats.rmsError = errorSamples > 0 ? std::sqrt(squaredSum / errorSamples) : 0;
+        return stats;
     }
 
+    bool IsBaked() const { return baked != nullptr; }
+    double Scale() const { return scale; }
+    const Perlin& Noise() const { return noise; }
+
 private:
+    static constexpr int octaves = 7;
+
     Perlin noise;
     double scale;
-};
\ No newline at end of file
+    shared_ptr<const DensityGrid> baked;
+};
+
+inline Color TextureValue(const Texture& tex, double u, double v, const Point3& p, double footprint)
+{
+    // Built-in textures are final, so the casts call them directly.
+    switch (closedDispatch ? tex.Kind() : TextureKind::Custom)
+    {
+        case TextureKind::Solid:   return static_cast<const SolidColor&>(tex).Value(u, v, p, footprint);
+        case TextureKind::Checker: return static_cast<const CheckerTexture&>(tex).Value(u, v, p, footprint);
+        case TextureKind::Image:   return static_cast<const ImageTexture&>(tex).Value(u, v, p, footprint);
+        case TextureKind::Noise:   return static_cast<const NoiseTexture&>(tex).Value(u, v, p, footprint);
+        default:                   return tex.Value(u, v, p, footprint);
+    }
+}
\ No newline at end of file
@@ -0,0 +1,183 @@
+#pragma once
+
+#include "tiledImage.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class TextureCache
+{
+public:
+    // Holds the tiles of tiled images kept in files, in a fixed number of slots that together
+    // take the memory budget. Tiles are loaded on the first lookup that needs them, replacing the
+    // least recently used tile with the clock algorithm: lookups mark the slot they read, and the
+    // eviction hand unmarks marked slots and takes the first unmarked one.
+    //
+    // Lookups take no lock. Each slot has a version, odd while its tile is being replaced, and a
+    // lookup that sees the version change while it read a texel reads it again.
+
+    struct Entry
+    {
+        // An image registered with the cache, with the slot of every tile plus one, or zero for
+        // tiles that aren't loaded.
+
+        shared_ptr<const TiledImage> image;
+        std::unique_ptr<std::atomic<uint32_t>[]> slotOfTile;
+        uint32_t id;
+    };
+
+    static TextureCache& Global()
+    {
+        static TextureCache cache;
+        return cache;
+    }
+
+    void SetBudget(size_t bytes)
+    {
+        // Takes effect when the first tile is loaded.
+        const std::lock_guard<std::mutex> lock(mutex);
+        if (slotCount == 0)
+            budget = bytes;
+    }
+
+    Entry* Register(shared_ptr<const TiledImage> image)
+    {
+        auto entry = std::make_unique<Entry>();
+        entry->image = image;
+        entry->slotOfTile = std::make_unique<std::atomic<uint32_t>[]>(image->TileCount());
+        for (size_t tile = 0; tile < image->TileCount(); tile++)
+            entry->slotOfTile[tile].store(0, std::memory_order_relaxed);
+
+        const std::lock_guard<std::mutex> lock(mutex);
+        entry->id = uint32_t(entries.size());
+        entries.push_back(std::move(entry));
+        return entries.back().get();
+    }
+
+    void Unregister(Entry* entry)
+    {
+        // Frees the slots of the image. No lookups of it may be running.
+
+        const std::lock_guard<std::mutex> lock(mutex);
+        for (uint32_t slot = 0; slot < slotCount; slot++)
+            if (slots[slot].key.load(std::memory_order_relaxed) >> tileBits == entry->id)
+                slots[slot].key.store(noKey, std::memory_order_relaxed);
+
+        entries[entry->id].reset();
+    }
+
+    void Texel(const Entry& entry, size_t tile, size_t offset, unsigned char texel[3])
+    {
+        // Copies the three bytes at offset in the tile, loading the tile if needed.
+
+        const uint64_t key = Key(entry.id, tile);
+
+        while (true)
+        {
+            const uint32_t slotPlusOne = entry.slotOfTile[tile].load(std::memory_order_acquire);
+            if (slotPlusOne == 0)
+            {
+                Load(entry, tile);
+                continue;
+            }
+
+            Slot& slot = slots[slotPlusOne - 1];
+            const uint32_t version = slot.version.load(std::memory_order_acquire);
+            if (version % 2 == 1 || slot.key.load(std::memory_order_relaxed) != key)
+                continue;  // Being replaced, or already replaced
+
+            std::memcpy(texel, data.get() + size_t(slotPlusOne - 1) * TiledImage::tileBytes + offset, 3);
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.version.load(std::memory_order_relaxed) == version)
+            {
+                if (!slot.referenced.load(std::memory_order_relaxed))
+                    slot.referenced.store(true, std::memory_order_relaxed);
+                return;
+            }
+        }
+    }
+
+    size_t TileLoads() const { return tileLoads.load(std::memory_order_relaxed); }
+    size_t SlotCount() const { return slotCount; }
+
+private:
+    static constexpr int tileBits = 40;
+    static constexpr uint64_t noKey = ~uint64_t(0);
+    static constexpr uint32_t minSlots = 64;
+
+    struct Slot
+    {
+        std::atomic<uint64_t> key{ noKey };  // Image id and tile held by the slot
+        std::atomic<uint32_t> version{ 0 };
+        std::atomic<bool> referenced{ false };
+    };
+
+    std::mutex mutex;  // Taken to load tiles and to change the registered images
+    size_t budget = size_t(256) << 20;
+    std::vector<std::unique_ptr<Entry>> entries;  // Indexed by id, null once unregistered
+
+    std::unique_ptr<Slot[]> slots;
+    std::unique_ptr<unsigned char[]> data;
+    uint32_t slotCount = 0;
+    uint32_t hand = 0;
+    std::atomic<size_t> tileLoads{ 0 };
+
+    TextureCache() {}
+
+    static uint64_t Key(uint32_t id, size_t tile) { return (uint64_t(id) << tileBits) | uint64_t(tile); }
+
+    void Load(const Entry& entry, size_t tile)
+    {
+        const std::lock_guard<std::mutex> lock(mutex);
+
+        // Another thread may have loaded it while this one waited.
+        if (entry.slotOfTile[tile].load(std::memory_order_relaxed) != 0)
+            return;
+
+        if (slotCount == 0)
+        {
+            slotCount = std::max(minSlots, uint32_t(std::min<size_t>(budget / TiledImage::tileBytes, 0xffffffe)));
+            slots = std::make_unique<Slot[]>(slotCount);
+            // Left uninitialized, so the system only backs the slots that get used.
+            data.reset(new unsigned char[size_t(slotCount) * TiledImage::tileBytes]);
+        }
+
+        // Sweep past recently used slots, giving them another round.
+        while (slots[hand].referenced.load(std::memory_order_relaxed))
+        {
+            slots[hand].referenced.store(false, std::memory_order_relaxed);
+            hand = (hand + 1) % slotCount;
+        }
+
+        const uint32_t victim = hand;
+        hand = (hand + 1) % slotCount;
+        Slot& slot = slots[victim];
+
+        const uint64_t oldKey = slot.key.load(std::memory_order_relaxed);
+        if (oldKey != noKey)
+        {
+            const std::unique_ptr<Entry>& owner = entries[oldKey >> tileBits];
+            if (owner)
+                owner->slotOfTile[oldKey & ((uint64_t(1) << tileBits) - 1)].store(0, std::memory_order_relaxed);
+        }
+
+        // Odd version while the slot changes, so lookups reading it try again.
+        const uint32_t version = slot.version.load(std::memory_order_relaxed);
+        slot.version.store(version + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        slot.key.store(Key(entry.id, tile), std::memory_order_relaxed);
+        unsigned char* texels = data.get() + size_t(victim) * TiledImage::tileBytes;
+        if (!entry.image->ReadTile(tile, texels))
+            std::memset(texels, 0, TiledImage::tileBytes);
+
+        slot.version.store(version + 2, std::memory_order_release);
+        entry.slotOfTile[tile].store(victim + 1, std::memory_order_release);
+        tileLoads.fetch_add(1, std::memory_order_relaxed);
+    }
+};
@@ -0,0 +1,150 @@
+#pragma once
+
+#include "sourceFiles.h"
+#include "textureCache.h"
+#include "tiledImage.h"
+
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class TextureLibrary
+{
+public:
+    // Loads the images of image textures on a pool of threads, so a scene with many textures
+    // decodes or maps them all at once while it is being built. Images are shared by the
+    // canonical path of their file, so textures naming the same file, even by different paths,
+    // load it once. Loaded images are kept for the rest of the run.
+
+    struct Image
+    {
+        // A loaded image, registered with the texture cache when its tiles are in a file.
+
+        shared_ptr<const TiledImage> tiles;
+        TextureCache::Entry* cacheEntry = nullptr;
+
+        Image(shared_ptr<const TiledImage> tiles)
+            : tiles(tiles)
+        {
+            if (tiles && tiles->ResidentTile(0) == nullptr)
+                cacheEntry = TextureCache::Global().Register(tiles);
+        }
+
+        Image(const Image&) = delete;
+        Image& operator=(const Image&) = delete;
+
+        ~Image()
+        {
+            if (cacheEntry != nullptr)
+                TextureCache::Global().Unregister(cacheEntry);
+        }
+    };
+
+    using Future = std::shared_future<shared_ptr<const Image>>;
+
+    static TextureLibrary& Global()
+    {
+        static TextureLibrary library;
+        return library;
+    }
+
+    ~TextureLibrary()
+    {
+        {
+            const std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+
+        jobReady.notify_all();
+        for (std::thread& worker : workers)
+            worker.join();
+    }
+
+    Future Request(const char* filename)
+    {
+        // Starts loading the image unless it was already requested. The image is null if the
+        // file can't be found or loaded.
+
+        const std::string path = rtw_image::find(filename);
+        SourceFiles::Record(path.empty() ? filename : path);
+
+        std::error_code error;
+        const std::string key = path.empty() ? filename : std::filesystem::weakly_canonical(path, error).string();
+
+        const std::lock_guard<std::mutex> lock(mutex);
+
+        auto found = images.find(key);
+        if (found != images.end())
+            return found->second;
+
+        auto job = std::make_shared<std::packaged_task<shared_ptr<const Image>()>>([name = std::string(filename)]()
+        {
+            return std::make_shared<const Image>(TiledImage::Load(name.c_str()));
+        });
+
+        const Future future = job->get_future().share();
+        images.emplace(key, future);
+        jobs.push_back([job]() { (*job)(); });
+
+        if (workers.empty())
+            StartWorkers();
+
+        jobReady.notify_one();
+        return future;
+    }
+
+    size_t ImageCount() const
+    {
+        const std::lock_guard<std::mutex> lock(mutex);
+        return images.size();
+    }
+
+private:
+    mutable std::mutex mutex;  // Guards everything below
+    std::condition_variable jobReady;
+    std::deque<std::function<void()>> jobs;
+    std::vector<std::thread> workers;
+    bool stopping = false;
+    std::map<std::string, Future> images;  // By canonical path
+
+    TextureLibrary()
+    {
+        // Images unregister from the cache when the library goes, so it must go after.
+        TextureCache::Global();
+    }
+
+    void StartWorkers()
+    {
+        workers.resize(std::max(1u, std::thread::hardware_concurrency()));
+
+        for (std::thread& worker : workers)
+        {
+            worker = std::thread([this]()
+            {
+                while (true)
+                {
+                    std::function<void()> job;
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        jobReady.wait(lock, [this]() { return stopping || !jobs.empty(); });
+                        if (jobs.empty())
+                            return;
+
+                        job = std::move(jobs.front());
+                        jobs.pop_front();
+                    }
+
+                    job();
+                }
+            });
+        }
+    }
+};
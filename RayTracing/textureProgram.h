@@ -0,0 +1,179 @@
+#pragma once
+
+#include "texture.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+class TextureProgram
+{
+public:
+    // A texture graph compiled to a flat list of instructions. Checkers are the only textures
+    // with children, and they pick one of them, so a lookup is a line of checker tests, each
+    // falling through to its even child or jumping to its odd one, ending in a single leaf:
+    // a constant, an image or noise lookup, or a call to a custom texture. Checkers whose two
+    // sides are the same, or the same constant, fold into that side, and a program left with
+    // a single constant is constant.
+
+    TextureProgram() {}
+
+    explicit TextureProgram(const Texture& root)
+        : root(&root)
+        , code(Compile(root))
+    {}
+
+    Color Evaluate(double u, double v, const Point3& p, double footprint) const
+    {
+        // The plain graph is called through its virtual functions when closed dispatch is off.
+        if (!closedDispatch)
+            return root->Value(u, v, p, footprint);
+
+        const Instruction* op = code.data();
+        while (true)
+        {
+            switch (op->op)
+            {
+                case Op::Checker:  op = static_cast<const CheckerTexture*>(op->texture)->IsEven(p) ? op + 1 : op + op->oddOffset; break;
+                case Op::Constant: return op->color;
+                case Op::Image:    return static_cast<const ImageTexture*>(op->texture)->Value(u, v, p, footprint);
+                case Op::Noise:    return static_cast<const NoiseTexture*>(op->texture)->Value(u, v, p, footprint);
+                default:           return op->texture->Value(u, v, p, footprint);
+            }
+        }
+    }
+
+    void Evaluate(size_t count, const double* u, const double* v, const Point3* p, const double* footprint, Color* values) const
+    {
+        // Looks up many points at once. The checker tests run first for every point, writing
+        // constants right away, and the other points are then grouped by leaf, so each leaf is
+        // dispatched once and runs over its points in a loop.
+
+        if (!closedDispatch)
+        {
+            for (size_t i = 0; i < count; i++)
+                values[i] = root->Value(u[i], v[i], p[i], footprint[i]);
+            return;
+        }
+
+        std::vector<std::pair<uint32_t, uint32_t>> lookups;  // Leaf and point
+        for (size_t i = 0; i < count; i++)
+        {
+            const Instruction* op = code.data();
+            while (op->op == Op::Checker)
+                op = static_cast<const CheckerTexture*>(op->texture)->IsEven(p[i]) ? op + 1 : op + op->oddOffset;
+
+            if (op->op == Op::Constant)
+                values[i] = op->color;
+            else
+                lookups.emplace_back(uint32_t(op - code.data()), uint32_t(i));
+        }
+
+        std::sort(lookups.begin(), lookups.end());
+
+        for (size_t first = 0, last = 0; first < lookups.size(); first = last)
+        {
+            const Instruction& op = code[lookups[first].first];
+            for (last = first; last < lookups.size() && lookups[last].first == lookups[first].first; last++) {}
+
+            switch (op.op)
+            {
+                case Op::Image:
+                {
+                    const auto& image = *static_cast<const ImageTexture*>(op.texture);
+                    for (size_t k = first; k < last; k++)
+                    {
+                        const uint32_t i = lookups[k].second;
+                        values[i] = image.Value(u[i], v[i], p[i], footprint[i]);
+                    }
+                    break;
+                }
+                case Op::Noise:
+                {
+                    const auto& noise = *static_cast<const NoiseTexture*>(op.texture);
+                    for (size_t k = first; k < last; k++)
+                    {
+                        const uint32_t i = lookups[k].second;
+                        values[i] = noise.Value(u[i], v[i], p[i], footprint[i]);
+                    }
+                    break;
+                }
+                default:
+                {
+                    for (size_t k = first; k < last; k++)
+                    {
+                        const uint32_t i = lookups[k].second;
+                        values[i] = op.texture->Value(u[i], v[i], p[i], footprint[i]);
+                    }
+                    break;
+                }
+            }
+        }
+    }
+
+    bool IsConstant(Color& value) const
+    {
+        if (code.size() != 1 || code[0].op != Op::Constant)
+            return false;
+
+        value = code[0].color;
+        return true;
+    }
+
+    size_t InstructionCount() const { return code.size(); }
+
+private:
+    enum class Op : uint8_t { Checker, Constant, Image, Noise, Call };
+
+    struct Instruction
+    {
+        Op op;
+        uint32_t oddOffset = 0;            // Checkers: from the checker to its odd side
+        Color color;                       // Constants
+        const Texture* texture = nullptr;  // Everything else, owned by the graph
+    };
+
+    const Texture* root = nullptr;
+    std::vector<Instruction> code;
+
+    static std::vector<Instruction> Compile(const Texture& tex)
+    {
+        Instruction leaf;
+        leaf.texture = &tex;
+
+        if (tex.IsConstant(leaf.color))
+        {
+            leaf.op = Op::Constant;
+            return { leaf };
+        }
+
+        switch (tex.Kind())
+        {
+            case TextureKind::Image: leaf.op = Op::Image; return { leaf };
+            case TextureKind::Noise: leaf.op = Op::Noise; return { leaf };
+            case TextureKind::Checker: break;
+            default: leaf.op = Op::Call; return { leaf };
+        }
+
+        const auto& checker = static_cast<const CheckerTexture&>(tex);
+        std::vector<Instruction> even = Compile(*checker.Even());
+        if (checker.Even() == checker.Odd())
+            return even;
+
+        std::vector<Instruction> odd = Compile(*checker.Odd());
+        if (even.size() == 1 && odd.size() == 1 && even[0].op == Op::Constant && odd[0].op == Op::Constant
+            && even[0].color.x() == odd[0].color.x() && even[0].color.y() == odd[0].color.y() && even[0].color.z() == odd[0].color.z())
+            return even;
+
+        // Offsets are relative, so the two sides are copied in unchanged.
+        Instruction test;
+        test.op = Op::Checker;
+        test.oddOffset = uint32_t(1 + even.size());
+        test.texture = &tex;
+
+        std::vector<Instruction> code = { test };
+        code.insert(code.end(), even.begin(), even.end());
+        code.insert(code.end(), odd.begin(), odd.end());
+        return code;
+    }
+};
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+    // Worker threads started once and kept waiting between jobs, so work split over them costs
+    // a wake up instead of creating threads. The thread calling ParallelFor works too, so a
+    // pool of n threads starts n - 1 workers.
+
+    explicit ThreadPool(unsigned threadCount = 0)
+    {
+        if (threadCount == 0)
+            threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+        workers.resize(threadCount - 1);
+        for (std::thread& worker : workers)
+            worker = std::thread([this]() { WorkerLoop(); });
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool()
+    {
+        {
+            const std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+
+        wake.notify_all();
+        for (std::thread& worker : workers)
+            worker.join();
+    }
+
+    template<typename F>
+    void ParallelFor(int count, F fn)
+    {
+        // Runs fn for every index below count, and returns once all are done. Indices are
+        // handed out one at a time, so uneven ones balance out.
+
+        const std::function<void(int)> task = fn;
+        {
+            const std::lock_guard<std::mutex> lock(mutex);
+            job = &task;
+            jobCount = count;
+            nextIndex.store(0, std::memory_order_relaxed);
+            busyWorkers = workers.size();
+            generation++;
+        }
+
+        wake.notify_all();
+        RunIndices(task, count);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this]() { return busyWorkers == 0; });
+        job = nullptr;
+    }
+
+    size_t ThreadCount() const { return workers.size() + 1; }
+
+private:
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;  // Guards the job and the counters but nextIndex
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void(int)>* job = nullptr;
+    int jobCount = 0;
+    std::atomic<int> nextIndex{ 0 };
+    size_t busyWorkers = 0;     // Workers yet to finish the current job
+    uint64_t generation = 0;    // Jobs started, so workers tell a new job from the last one
+    bool stopping = false;
+
+    void RunIndices(const std::function<void(int)>& task, int count)
+    {
+        for (int i = nextIndex++; i < count; i = nextIndex++)
+            task(i);
+    }
+
+    void WorkerLoop()
+    {
+        uint64_t seenGeneration = 0;
+
+        while (true)
+        {
+            const std::function<void(int)>* task;
+            int count;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&]() { return stopping || generation != seenGeneration; });
+                if (stopping)
+                    return;
+
+                seenGeneration = generation;
+                task = job;
+                count = jobCount;
+            }
+
+            RunIndices(*task, count);
+
+            const std::lock_guard<std::mutex> lock(mutex);
+            if (--busyWorkers == 0)
+                done.notify_all();
+        }
+    }
+};
@@ -0,0 +1,321 @@
+#pragma once
+
+#include "mappedFile.h"
+#include "rt_stb_image.h"
+#include "sourceFiles.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+class TiledImage
+{
+public:
+    // An 8-bit RGB image stored as a MIP pyramid cut into square tiles, so a lookup touches one
+    // small block of memory and only the tiles that are looked up need to be loaded. Each level
+    // halves the size of the one above, down to a single texel. Tiles on the right and bottom
+    // edges repeat the last texels of the level. The pyramid is either held in memory, or in a
+    // memory mapped tile file read one tile at a time, usually through the texture cache.
+    //
+    // Tile files are little-endian, with the tiles page aligned so they map straight into
+    // memory. They are made ahead of time with --convert-texture, and then named in place of
+    // the image. If the RTW_TEXTURE_CACHE environment variable names a directory, tile files
+    // are also made there when an image is first used, and reused while the image is unchanged.
+
+    static constexpr int tileSize = 64;
+    static constexpr size_t tileBytes = size_t(tileSize) * tileSize * 3;
+
+    struct Level
+    {
+        uint32_t width;
+        uint32_t height;
+        uint32_t tilesX;
+        uint32_t tilesY;
+        uint64_t firstTile;  // Index of the first tile of the level, in row order
+    };
+
+    TiledImage(const unsigned char* pixels, int width, int height)
+    {
+        // Builds the pyramid in memory from rows of RGB pixels, each level filtered down from
+        // the one above with a box filter.
+
+        std::vector<unsigned char> level(pixels, pixels + size_t(width) * height * 3);
+        int levelWidth = width;
+        int levelHeight = height;
+
+        while (true)
+        {
+            AddLevel(level.data(), levelWidth, levelHeight);
+            if (levelWidth == 1 && levelHeight == 1)
+                break;
+
+            const int nextWidth = std::max(1, levelWidth / 2);
+            const int nextHeight = std::max(1, levelHeight / 2);
+            std::vector<unsigned char> next(size_t(nextWidth) * nextHeight * 3);
+
+            for (int y = 0; y < nextHeight; y++)
+                for (int x = 0; x < nextWidth; x++)
+                    for (int c = 0; c < 3; c++)
+                    {
+                        // Odd sizes drop their last row or column, and sides of one texel are
+                        // averaged with themselves.
+                        const int x0 = std::min(2 * x, levelWidth - 1), x1 = std::min(2 * x + 1, levelWidth - 1);
+                        const int y0 = std::min(2 * y, levelHeight - 1), y1 = std::min(2 * y + 1, levelHeight - 1);
+                        const int sum = level[(size_t(y0) * levelWidth + x0) * 3 + c] + level[(size_t(y0) * levelWidth + x1) * 3 + c]
+                            + level[(size_t(y1) * levelWidth + x0) * 3 + c] + level[(size_t(y1) * levelWidth + x1) * 3 + c];
+                        next[(size_t(y) * nextWidth + x) * 3 + c] = (unsigned char)((sum + 2) / 4);
+                    }
+
+            level.swap(next);
+            levelWidth = nextWidth;
+            levelHeight = nextHeight;
+        }
+    }
+
+    static shared_ptr<TiledImage> Load(const char* imageFilename)
+    {
+        // Returns the pyramid of an image file, from its tile file in the cache directory when
+        // that was made from the current version of the image. Otherwise the image is decoded,
+        // and its pyramid written to the cache directory for the next time, or kept in memory
+        // without a cache directory or if writing fails. Names ending in .rttex are opened as
+        // tile files, whatever image they were made from. Returns nullptr if the image can't be
+        // found or decoded.
+
+        const std::string path = rtw_image::find(imageFilename);
+        if (IsTileFilename(path))
+        {
+            auto image = Open(path, anySourceStamp);
+            if (!image)
+                std::cerr << "ERROR: Could not open tile file '" << path << "'.\n";
+            return image;
+        }
+
+        uint64_t sourceStamp;
+        if (path.empty() || !SourceStamp(path, sourceStamp))
+        {
+            std::cerr << "ERROR: Could not load image file '" << imageFilename << "'.\n";
+            return nullptr;
+        }
+
+        const std::string cacheDirectory = CacheDirectory();
+        if (cacheDirectory.empty())
+            return Decode(path);
+
+        std::string tileFilename = imageFilename;
+        std::replace(tileFilename.begin(), tileFilename.end(), '/', '_');
+        std::replace(tileFilename.begin(), tileFilename.end(), '\\', '_');
+        tileFilename = cacheDirectory + "/" + tileFilename + ".rttex";
+
+        if (auto image = Open(tileFilename, sourceStamp))
+            return image;
+
+        auto image = Decode(path);
+        if (!image)
+            return nullptr;
+
+        if (image->Write(tileFilename, sourceStamp))
+            if (auto fileImage = Open(tileFilename, sourceStamp))
+                return fileImage;
+
+        return image;
+    }
+
+    static shared_ptr<TiledImage> Decode(const std::string& path)
+    {
+        // Builds the pyramid of an image file in memory.
+
+        rtw_image decoded;
+        if (!decoded.load(path))
+        {
+            std::cerr << "ERROR: Could not decode image file '" << path << "'.\n";
+            return nullptr;
+        }
+
+        return make_shared<TiledImage>(decoded.data(), decoded.width(), decoded.height());
+    }
+
+    static bool SourceStamp(const std::string& path, uint64_t& sourceStamp)
+    {
+        return SourceFiles::Stamp(path, sourceStamp);
+    }
+
+    static std::string CacheDirectory()
+    {
+        // The directory named by RTW_TEXTURE_CACHE, or an empty string if it isn't set.
+
+#ifdef _MSC_VER
+        char* cachedir = nullptr;
+        size_t len = 0;
+        _dupenv_s(&cachedir, &len, "RTW_TEXTURE_CACHE");
+        const std::string directory = cachedir ? cachedir : "";
+        free(cachedir);
+#else
+        const char* cachedir = getenv("RTW_TEXTURE_CACHE");
+        const std::string directory = cachedir ? cachedir : "";
+#endif
+
+        return directory;
+    }
+
+    static bool IsTileFilename(const std::string& filename)
+    {
+        return filename.size() > 6 && filename.compare(filename.size() - 6, 6, ".rttex") == 0;
+    }
+
+    static constexpr uint64_t anySourceStamp = 0;  // Opens tile files made from any image
+
+    static shared_ptr<TiledImage> Open(const std::string& filename, uint64_t sourceStamp)
+    {
+        // Maps a tile file for reading tiles on demand. Returns nullptr if the file is missing,
+        // invalid, or made from another version of the source image.
+
+        auto image = shared_ptr<TiledImage>(new TiledImage());
+        MappedFile& file = image->file;
+        if (!file.Open(filename) || file.Size() < sizeof(Header))
+            return nullptr;
+
+        Header header;
+        std::memcpy(&header, file.Data(), sizeof(Header));
+        if (std::memcmp(header.magic, fileMagic, sizeof(header.magic)) != 0
+            || header.formatVersion != formatVersion
+            || header.byteOrder != byteOrderMark
+            || header.tileSize != tileSize
+            || (sourceStamp != anySourceStamp && header.sourceStamp != sourceStamp)
+            || header.levelCount == 0 || header.levelCount > 32
+            || file.Size() < sizeof(Header) + header.levelCount * sizeof(Level))
+            return nullptr;
+
+        image->levels.resize(header.levelCount);
+        std::memcpy(image->levels.data(), file.Data() + sizeof(Header), header.levelCount * sizeof(Level));
+
+        // The file must hold every tile the levels refer to.
+        const Level& last = image->levels.back();
+        image->tileCount = size_t(last.firstTile) + size_t(last.tilesX) * last.tilesY;
+        if (file.Size() < header.dataOffset + image->tileCount * tileBytes)
+            return nullptr;
+
+        image->fileTiles = file.Data() + header.dataOffset;
+
+        return image;
+    }
+
+    bool Write(const std::string& filename, uint64_t sourceStamp) const
+    {
+        // Writes a pyramid held in memory to a tile file. Tiles start page aligned, and every
+        // tile is a whole number of pages.
+
+        if (tiles.empty())
+            return false;
+
+        Header header = {};
+        std::memcpy(header.magic, fileMagic, sizeof(header.magic));
+        header.formatVersion = formatVersion;
+        header.byteOrder = byteOrderMark;
+        header.tileSize = tileSize;
+        header.levelCount = uint32_t(levels.size());
+        header.sourceStamp = sourceStamp;
+
+        const size_t tableEnd = sizeof(Header) + levels.size() * sizeof(Level);
+        header.dataOffset = (tableEnd + pageSize - 1) / pageSize * pageSize;
+
+        // Replace the file instead of rewriting it, since other processes may be reading it.
+        const std::string tempFilename = filename + ".tmp";
+        {
+            std::ofstream out(tempFilename, std::ios::binary | std::ios::trunc);
+            const std::vector<char> padding(header.dataOffset - tableEnd, 0);
+            out.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+            out.write(reinterpret_cast<const char*>(levels.data()), std::streamsize(levels.size() * sizeof(Level)));
+            out.write(padding.data(), std::streamsize(padding.size()));
+            out.write(reinterpret_cast<const char*>(tiles.data()), std::streamsize(tiles.size()));
+            if (!out)
+                return false;
+        }
+
+        std::remove(filename.c_str());
+        return std::rename(tempFilename.c_str(), filename.c_str()) == 0;
+    }
+
+    int Width() const { return int(levels[0].width); }
+    int Height() const { return int(levels[0].height); }
+    int LevelCount() const { return int(levels.size()); }
+    const Level& GetLevel(int level) const { return levels[level]; }
+    size_t TileCount() const { return tileCount; }
+
+    // Tiles held in memory, or nullptr for a tile file.
+    const unsigned char* ResidentTile(size_t tile) const { return tiles.empty() ? nullptr : tiles.data() + tile * tileBytes; }
+
+    bool ReadTile(size_t tile, unsigned char* texels) const
+    {
+        // Copies a tile out of the mapped tile file, or out of memory.
+
+        if (const unsigned char* resident = ResidentTile(tile))
+        {
+            std::memcpy(texels, resident, tileBytes);
+            return true;
+        }
+
+        if (tile >= tileCount)
+            return false;
+
+        std::memcpy(texels, fileTiles + tile * tileBytes, tileBytes);
+        return true;
+    }
+
+private:
+    static constexpr char fileMagic[8] = { 'R', 'T', 'T', 'E', 'X', 0, 0, 0 };
+    static constexpr uint32_t formatVersion = 1;
+    static constexpr uint32_t byteOrderMark = 0x01020304;  // Reads differently on the other byte order
+    static constexpr size_t pageSize = 4096;
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t formatVersion;
+        uint32_t byteOrder;
+        uint32_t tileSize;
+        uint32_t levelCount;
+        uint64_t sourceStamp;  // Identifies the version of the image the file was made from
+        uint64_t dataOffset;   // Of the first tile, from the start of the file
+    };
+
+    std::vector<Level> levels;
+    std::vector<unsigned char> tiles;  // Empty for a tile file
+    size_t tileCount = 0;
+
+    MappedFile file;
+    const unsigned char* fileTiles = nullptr;  // First tile in the mapped file
+
+    TiledImage() {}
+
+    void AddLevel(const unsigned char* pixels, int width, int height)
+    {
+        Level level;
+        level.width = uint32_t(width);
+        level.height = uint32_t(height);
+        level.tilesX = uint32_t((width + tileSize - 1) / tileSize);
+        level.tilesY = uint32_t((height + tileSize - 1) / tileSize);
+        level.firstTile = tileCount;
+        levels.push_back(level);
+
+        tileCount += size_t(level.tilesX) * level.tilesY;
+        tiles.resize(tileCount * tileBytes);
+
+        for (uint32_t ty = 0; ty < level.tilesY; ty++)
+            for (uint32_t tx = 0; tx < level.tilesX; tx++)
+            {
+                unsigned char* tile = tiles.data() + (level.firstTile + size_t(ty) * level.tilesX + tx) * tileBytes;
+                for (int y = 0; y < tileSize; y++)
+                    for (int x = 0; x < tileSize; x++)
+                    {
+                        const int sx = std::min(int(tx) * tileSize + x, width - 1);
+                        const int sy = std::min(int(ty) * tileSize + y, height - 1);
+                        std::memcpy(tile + (size_t(y) * tileSize + x) * 3, pixels + (size_t(sy) * width + sx) * 3, 3);
+                    }
+            }
+    }
+};
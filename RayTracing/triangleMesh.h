@@ -0,0 +1,621 @@
+#pragma once
+
+#include "aabb.h"
+#include "hittable.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+struct MeshData
+{
+    // Indexed triangle mesh with every vertex attribute in its own array, so loaders and the BVH
+    // builder stream through exactly the data they need.
+
+    std::vector<float> x, y, z;     // Positions
+    std::vector<float> nx, ny, nz;  // Vertex normals, empty if the mesh has none
+    std::vector<float> u, v;        // Texture coordinates, empty if the mesh has none
+    std::vector<uint32_t> indices;  // Three vertex indices per triangle
+
+    size_t VertexCount() const { return x.size(); }
+    size_t TriangleCount() const { return indices.size() / 3; }
+    bool HasNormals() const { return !nx.empty(); }
+    bool HasUVs() const { return !u.empty(); }
+};
+
+struct MeshView
+{
+    // The arrays of a mesh, wherever they are stored: in a MeshData, or in a mapped mesh file.
+
+    const float* x = nullptr;
+    const float* y = nullptr;
+    const float* z = nullptr;
+    const float* nx = nullptr;
+    const float* ny = nullptr;
+    const float* nz = nullptr;
+    const float* u = nullptr;
+    const float* v = nullptr;
+    const uint32_t* indices = nullptr;
+    size_t vertexCount = 0;
+    size_t triangleCount = 0;
+
+    MeshView() {}
+
+    MeshView(const MeshData& data)
+        : x(data.x.data()), y(data.y.data()), z(data.z.data())
+        , nx(data.HasNormals() ? data.nx.data() : nullptr)
+        , ny(data.HasNormals() ? data.ny.data() : nullptr)
+        , nz(data.HasNormals() ? data.nz.data() : nullptr)
+        , u(data.HasUVs() ? data.u.data() : nullptr)
+        , v(data.HasUVs() ? data.v.data() : nullptr)
+        , indices(data.indices.data())
+        , vertexCount(data.VertexCount())
+        , triangleCount(data.TriangleCount())
+    {}
+
+    bool HasNormals() const { return nx != nullptr; }
+    bool HasUVs() const { return u != nullptr; }
+};
+
+class TriangleMesh final : public Hittable
+{
+public:
+    // Triangle mesh with its own BVH over the triangles. Triangles are reordered so every leaf
+    // references a contiguous range of them, and rays are tested with the watertight algorithm
+    // (Woop et al., "Watertight Ray/Triangle Intersection"), so rays never slip through shared
+    // edges.
+
+    struct Node
+    {
+        float min[3];
+        float max[3];
+        uint32_t offset;  // Leaf: first triangle. Interior: index of the first child, the second follows it
+        uint32_t count;   // Number of triangles in a leaf, zero for interior nodes
+    };
+
+    TriangleMesh(MeshData&& meshData, shared_ptr<Material> mat)
+        : Hittable(HittableKind::TriangleMesh)
+        , data(std::move(meshData))
+        , mesh(data)
+        , mat(mat)
+    {
+        BuildBVH();
+    }
+
+    TriangleMesh(const MeshView& view, const Node* prebuiltNodes, size_t prebuiltNodeCount, shared_ptr<const void> storage,
+        shared_ptr<Material> mat)
+        : Hittable(HittableKind::TriangleMesh)
+        , mesh(view)
+        , nodes(prebuiltNodes)
+        , nodeCount(prebuiltNodeCount)
+        , storage(storage)
+        , mat(mat)
+    {
+        // Uses arrays stored elsewhere, kept alive by storage, without copying them. Without
+        // prebuilt nodes the BVH is built here, on a copy of the indices it can reorder.
+
+        if (nodes == nullptr)
+        {
+            data.indices.assign(view.indices, view.indices + 3 * view.triangleCount);
+            mesh.indices = data.indices.data();
+            BuildBVH();
+        }
+        else if (nodeCount > 0)
+        {
+            SetBoundingBox();
+        }
+    }
+
+    // The view and the nodes may point into the mesh's own arrays, which a copy wouldn't follow.
+    TriangleMesh(const TriangleMesh&) = delete;
+    TriangleMesh& operator=(const TriangleMesh&) = delete;
+
+    bool Intersect(const Ray& r, const Interval& ray_t, Intersection& hit) const override
+    {
+        if (nodeCount == 0)
+            return false;
+
+        const RayData ray(r);
+
+        double closest = ray_t.max;
+        uint32_t hitTriangle = noTriangle;
+        double hitB1 = 0, hitB2 = 0;
+
+        // Nodes still to visit, with the distance where the ray enters them.
+        struct StackEntry
+        {
+            uint32_t node;
+            double tEnter;
+        } stack[64];
+
+        int stackSize = 0;
+        uint32_t nodeIdx = 0;
+
+        while (true)
+        {
+            const Node& node = nodes[nodeIdx];
+
+            if (node.count > 0)
+            {
+                for (uint32_t i = node.offset; i < node.offset + node.count; i++)
+                {
+                    double t, b1, b2;
+                    if (IntersectTriangle(ray, i, ray_t.min, closest, t, b1, b2))
+                    {
+                        closest = t;
+                        hitTriangle = i;
+                        hitB1 = b1;
+                        hitB2 = b2;
+                    }
+                }
+            }
+            else
+            {
+                // Visit the nearest child first, and skip the children the ray misses.
+                double tLeft = SlabEntry(ray, nodes[node.offset].min, nodes[node.offset].max, ray_t.min, closest);
+                double tRight = SlabEntry(ray, nodes[node.offset + 1].min, nodes[node.offset + 1].max, ray_t.min, closest);
+                uint32_t first = node.offset;
+                uint32_t second = node.offset + 1;
+
+                if (tRight < tLeft)
+                {
+                    std::swap(tLeft, tRight);
+                    std::swap(first, second);
+                }
+
+                if (tLeft < infinity)
+                {
+                    if (tRight < infinity)
+                        stack[stackSize++] = { second, tRight };
+                    nodeIdx = first;
+                    continue;
+                }
+            }
+
+            // Skip the nodes that start beyond the closest hit found since they were pushed.
+            while (stackSize > 0 && stack[stackSize - 1].tEnter > closest)
+                stackSize--;
+
+            if (stackSize == 0)
+                break;
+            nodeIdx = stack[--stackSize].node;
+        }
+
+        if (hitTriangle == noTriangle)
+            return false;
+
+        hit.Set(closest, this, hitTriangle, hitB1, hitB2);
+        return true;
+    }
+
+    void ComputeSurface(const Ray& r, const Intersection& hit, int depth, HitRecord& rec) const override
+    {
+        FillHitRecord(r, hit.primitive, hit.t, hit.b1, hit.b2, rec);
+    }
+
+    AABB BoundingBox() const override { return bbox; }
+
+    const MeshView& View() const { return mesh; }
+    const Node* GetNodes() const { return nodes; }
+    size_t NodeCount() const { return nodeCount; }
+    const shared_ptr<Material>& GetMaterial() const { return mat; }
+
+    // Ray tests, also used by the compressed meshes and the primitive batches.
+
+    struct RayData
+    {
+        // Per ray values shared by every node and triangle test.
+
+        Point3 origin;
+        Vec3 invDirection;
+        int kx, ky, kz;    // Axes permuted so the direction is largest along kz
+        double sx, sy, sz; // Shear that maps the ray direction to +z
+
+        RayData(const Ray& r)
+            : origin(r.origin())
+        {
+            const Vec3& d = r.direction();
+            invDirection = Vec3(1.0 / d.x(), 1.0 / d.y(), 1.0 / d.z());
+
+            kz = 0;
+            if (std::fabs(d[1]) > std::fabs(d[kz])) kz = 1;
+            if (std::fabs(d[2]) > std::fabs(d[kz])) kz = 2;
+            kx = (kz + 1) % 3;
+            ky = (kx + 1) % 3;
+
+            // Keep the winding of the triangles.
+            if (d[kz] < 0)
+                std::swap(kx, ky);
+
+            sx = d[kx] / d[kz];
+            sy = d[ky] / d[kz];
+            sz = 1.0 / d[kz];
+        }
+    };
+
+    static bool IntersectTriangle(const RayData& ray, const Point3& p0, const Point3& p1, const Point3& p2, double tMin, double tMax,
+        double& t, double& b1, double& b2)
+    {
+        // Triangle vertices relative to the ray origin.
+        const Vec3 a = p0 - ray.origin;
+        const Vec3 b = p1 - ray.origin;
+        const Vec3 c = p2 - ray.origin;
+
+        // Shear and scale the vertices, so the ray goes along +z from the origin.
+        const double ax = a[ray.kx] - ray.sx * a[ray.kz];
+        const double ay = a[ray.ky] - ray.sy * a[ray.kz];
+        const double bx = b[ray.kx] - ray.sx * b[ray.kz];
+        const double by = b[ray.ky] - ray.sy * b[ray.kz];
+        const double cx = c[ray.kx] - ray.sx * c[ray.kz];
+        const double cy = c[ray.ky] - ray.sy * c[ray.kz];
+
+        // Scaled barycentric coordinates, as edge functions of the 2D triangle at the origin.
+        const double u = cx * by - cy * bx;
+        const double v = ax * cy - ay * cx;
+        const double w = bx * ay - by * ax;
+
+        if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+            return false;
+
+        const double det = u + v + w;
+        if (det == 0)
+            return false;
+
+        const double invDet = 1.0 / det;
+        t = (u * ray.sz * a[ray.kz] + v * ray.sz * b[ray.kz] + w * ray.sz * c[ray.kz]) * invDet;
+        if (t <= tMin || t >= tMax)
+            return false;
+
+        b1 = v * invDet;
+        b2 = w * invDet;
+        return true;
+    }
+
+    template<typename T>
+    static double SlabEntry(const RayData& ray, const T* min, const T* max, double tMin, double tMax)
+    {
+        // Returns the distance where the ray enters the box, or infinity if it misses it.
+
+        for (int axis = 0; axis < 3; axis++)
+        {
+            double t0 = (min[axis] - ray.origin[axis]) * ray.invDirection[axis];
+            double t1 = (max[axis] - ray.origin[axis]) * ray.invDirection[axis];
+            if (t0 > t1)
+                std::swap(t0, t1);
+
+            // Widen the exit distance by the rounding error of the computation, so rays through
+            // edges shared by two boxes, or hitting flat boxes, aren't lost.
+            t1 *= slabErrorScale;
+
+            tMin = t0 > tMin ? t0 : tMin;
+            tMax = t1 < tMax ? t1 : tMax;
+        }
+
+        return tMin <= tMax ? tMin : infinity;
+    }
+
+    static constexpr double slabErrorScale = 1 + 4 * std::numeric_limits<double>::epsilon();
+
+private:
+    static constexpr uint32_t noTriangle = 0xffffffff;
+
+    MeshData data;                  // Arrays owned by the mesh, if any
+    MeshView mesh;                  // Arrays used for tracing
+    std::vector<Node> ownedNodes;
+    const Node* nodes = nullptr;
+    size_t nodeCount = 0;
+    shared_ptr<const void> storage; // Keeps external arrays alive
+    shared_ptr<Material> mat;
+    AABB bbox;
+
+    void SetBoundingBox()
+    {
+        const Node& root = nodes[0];
+        bbox = AABB(Point3(root.min[0], root.min[1], root.min[2]), Point3(root.max[0], root.max[1], root.max[2]));
+    }
+
+    Point3 Position(uint32_t vertex) const
+    {
+        return Point3(mesh.x[vertex], mesh.y[vertex], mesh.z[vertex]);
+    }
+
+    bool IntersectTriangle(const RayData& ray, uint32_t triangle, double tMin, double tMax, double& t, double& b1, double& b2) const
+    {
+        const uint32_t* tri = &mesh.indices[3 * triangle];
+        return IntersectTriangle(ray, Position(tri[0]), Position(tri[1]), Position(tri[2]), tMin, tMax, t, b1, b2);
+    }
+
+    void FillHitRecord(const Ray& r, uint32_t triangle, double t, double b1, double b2, HitRecord& rec) const
+    {
+        const uint32_t* tri = &mesh.indices[3 * triangle];
+        const double b0 = 1 - b1 - b2;
+
+        const Point3 p0 = Position(tri[0]);
+        const Vec3 geometricNormal = UnitVector(Cross(Position(tri[1]) - p0, Position(tri[2]) - p0));
+
+        rec.t = t;
+        rec.p = r.at(t);
+        rec.mat = mat.get();
+
+        if (mesh.HasNormals())
+        {
+            // Faces are decided by the geometric normal, the vertex normals only shade.
+            const Vec3 shadingNormal = UnitVector(
+                b0 * Vec3(mesh.nx[tri[0]], mesh.ny[tri[0]], mesh.nz[tri[0]]) +
+                b1 * Vec3(mesh.nx[tri[1]], mesh.ny[tri[1]], mesh.nz[tri[1]]) +
+                b2 * Vec3(mesh.nx[tri[2]], mesh.ny[tri[2]], mesh.nz[tri[2]]));
+
+            rec.frontFace = Dot(r.direction(), geometricNormal) < 0;
+            rec.normal = rec.frontFace ? shadingNormal : -shadingNormal;
+        }
+        else
+        {
+            rec.SetFaceNormal(r, geometricNormal);
+        }
+
+        if (mesh.HasUVs())
+        {
+            rec.u = b0 * mesh.u[tri[0]] + b1 * mesh.u[tri[1]] + b2 * mesh.u[tri[2]];
+            rec.v = b0 * mesh.v[tri[0]] + b1 * mesh.v[tri[1]] + b2 * mesh.v[tri[2]];
+            rec.SetTriangleDerivatives({ p0, Position(tri[1]), Position(tri[2]) },
+                { mesh.u[tri[0]], mesh.u[tri[1]], mesh.u[tri[2]] }, { mesh.v[tri[0]], mesh.v[tri[1]], mesh.v[tri[2]] });
+        }
+        else
+        {
+            rec.u = b1;
+            rec.v = b2;
+            rec.dpdu = Position(tri[1]) - p0;
+            rec.dpdv = Position(tri[2]) - p0;
+        }
+    }
+
+    // BVH construction
+
+    static constexpr int binCount = 16;
+    static constexpr uint32_t maxLeafSize = 8;
+    static constexpr uint32_t parallelBuildSize = 1 << 16;  // Smallest subtree built on its own thread
+
+    struct BuildState
+    {
+        std::vector<float> centroids[3];
+        std::vector<float> boundsMin[3];
+        std::vector<float> boundsMax[3];
+        std::vector<uint32_t> order;       // Triangle indices, partitioned during the build
+        std::atomic<uint32_t> nodeCount{ 1 };
+        int parallelDepth = 0;
+    };
+
+    void BuildBVH()
+    {
+        const uint32_t triangleCount = uint32_t(mesh.triangleCount);
+        if (triangleCount == 0)
+            return;
+
+        BuildState state;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            state.centroids[axis].resize(triangleCount);
+            state.boundsMin[axis].resize(triangleCount);
+            state.boundsMax[axis].resize(triangleCount);
+        }
+        state.order.resize(triangleCount);
+
+        for (uint32_t i = 0; i < triangleCount; i++)
+        {
+            const uint32_t* tri = &mesh.indices[3 * i];
+            const float* positions[3] = { mesh.x, mesh.y, mesh.z };
+
+            for (int axis = 0; axis < 3; axis++)
+            {
+                const float* p = positions[axis];
+                const float lo = std::min(p[tri[0]], std::min(p[tri[1]], p[tri[2]]));
+                const float hi = std::max(p[tri[0]], std::max(p[tri[1]], p[tri[2]]));
+                state.boundsMin[axis][i] = lo;
+                state.boundsMax[axis][i] = hi;
+                state.centroids[axis][i] = 0.5f * (lo + hi);
+            }
+            state.order[i] = i;
+        }
+
+        // Subtrees are built in parallel near the root, up to about two tasks per thread.
+        const unsigned threadCount = std::max(1u, std::thread::hardware_concurrency());
+        while ((1u << state.parallelDepth) < 2 * threadCount)
+            state.parallelDepth++;
+
+        ownedNodes.resize(2 * size_t(triangleCount) - 1);
+        Build(state, 0, 0, triangleCount, 0);
+        ownedNodes.resize(state.nodeCount);
+        nodes = ownedNodes.data();
+        nodeCount = ownedNodes.size();
+
+        // Store the triangles in leaf order, so leaves reference contiguous ranges.
+        std::vector<uint32_t> sorted(data.indices.size());
+        for (uint32_t i = 0; i < triangleCount; i++)
+            std::copy_n(&data.indices[3 * state.order[i]], 3, &sorted[3 * i]);
+        data.indices.swap(sorted);
+        mesh.indices = data.indices.data();
+
+        SetBoundingBox();
+    }
+
+    void SetNodeBounds(BuildState& state, Node& node, uint32_t begin, uint32_t end) const
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            node.min[axis] = infinity;
+            node.max[axis] = -infinity;
+        }
+
+        for (uint32_t i = begin; i < end; i++)
+        {
+            const uint32_t triangle = state.order[i];
+            for (int axis = 0; axis < 3; axis++)
+            {
+                node.min[axis] = std::min(node.min[axis], state.boundsMin[axis][triangle]);
+                node.max[axis] = std::max(node.max[axis], state.boundsMax[axis][triangle]);
+            }
+        }
+    }
+
+    static float HalfArea(const float* min, const float* max)
+    {
+        const float dx = max[0] - min[0];
+        const float dy = max[1] - min[1];
+        const float dz = max[2] - min[2];
+        return dx * dy + dy * dz + dz * dx;
+    }
+
+    void Build(BuildState& state, uint32_t nodeIdx, uint32_t begin, uint32_t end, int depth)
+    {
+        Node& node = ownedNodes[nodeIdx];
+        SetNodeBounds(state, node, begin, end);
+
+        const uint32_t count = end - begin;
+        if (count <= 2)
+        {
+            node.offset = begin;
+            node.count = count;
+            return;
+        }
+
+        // Bin the triangle centroids along every axis and pick the cheapest split by the surface
+        // area heuristic.
+
+        float centroidMin[3], centroidMax[3];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            centroidMin[axis] = infinity;
+            centroidMax[axis] = -infinity;
+        }
+        for (uint32_t i = begin; i < end; i++)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                const float c = state.centroids[axis][state.order[i]];
+                centroidMin[axis] = std::min(centroidMin[axis], c);
+                centroidMax[axis] = std::max(centroidMax[axis], c);
+            }
+        }
+
+        float bestCost = infinity;
+        int bestAxis = -1;
+        int bestBin = 0;
+
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const float extent = centroidMax[axis] - centroidMin[axis];
+            if (extent <= 0)
+                continue;
+
+            struct Bin
+            {
+                float min[3] = { float(infinity), float(infinity), float(infinity) };
+                float max[3] = { float(-infinity), float(-infinity), float(-infinity) };
+                uint32_t count = 0;
+            } bins[binCount];
+
+            const float scale = binCount / extent;
+            for (uint32_t i = begin; i < end; i++)
+            {
+                const uint32_t triangle = state.order[i];
+                const int b = std::min(binCount - 1, int((state.centroids[axis][triangle] - centroidMin[axis]) * scale));
+                Bin& bin = bins[b];
+                bin.count++;
+                for (int k = 0; k < 3; k++)
+                {
+                    bin.min[k] = std::min(bin.min[k], state.boundsMin[k][triangle]);
+                    bin.max[k] = std::max(bin.max[k], state.boundsMax[k][triangle]);
+                }
+            }
+
+            // Sweep from the right to get the area and count right of every split plane.
+            float rightArea[binCount];
+            uint32_t rightCount[binCount];
+            Bin right;
+            for (int b = binCount - 1; b > 0; b--)
+            {
+                right.count += bins[b].count;
+                for (int k = 0; k < 3; k++)
+                {
+                    right.min[k] = std::min(right.min[k], bins[b].min[k]);
+                    right.max[k] = std::max(right.max[k], bins[b].max[k]);
+                }
+                rightArea[b] = right.count > 0 ? HalfArea(right.min, right.max) : 0;
+                rightCount[b] = right.count;
+            }
+
+            Bin left;
+            for (int b = 0; b < binCount - 1; b++)
+            {
+                left.count += bins[b].count;
+                for (int k = 0; k < 3; k++)
+                {
+                    left.min[k] = std::min(left.min[k], bins[b].min[k]);
+                    left.max[k] = std::max(left.max[k], bins[b].max[k]);
+                }
+
+                if (left.count == 0 || rightCount[b + 1] == 0)
+                    continue;
+
+                const float cost = HalfArea(left.min, left.max) * left.count + rightArea[b + 1] * rightCount[b + 1];
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = b;
+                }
+            }
+        }
+
+        // Make a leaf when splitting doesn't pay off, comparing both costs relative to the node
+        // area with traversal and intersection costs of one. Without any split, all centroids
+        // coincide and large nodes are split in the middle.
+        const bool makeLeaf = bestAxis < 0
+            ? count <= maxLeafSize
+            : count <= maxLeafSize && count <= 1 + bestCost / HalfArea(node.min, node.max);
+
+        if (makeLeaf)
+        {
+            node.offset = begin;
+            node.count = count;
+            return;
+        }
+
+        uint32_t mid;
+        if (bestAxis >= 0)
+        {
+            const float extent = centroidMax[bestAxis] - centroidMin[bestAxis];
+            const float scale = binCount / extent;
+            const float* centroids = state.centroids[bestAxis].data();
+            const float axisMin = centroidMin[bestAxis];
+
+            mid = uint32_t(std::partition(state.order.begin() + begin, state.order.begin() + end,
+                [=](uint32_t triangle)
+                {
+                    return std::min(binCount - 1, int((centroids[triangle] - axisMin) * scale)) <= bestBin;
+                }) - state.order.begin());
+        }
+        else
+        {
+            mid = begin + count / 2;
+        }
+
+        const uint32_t children = state.nodeCount.fetch_add(2);
+        node.offset = children;
+        node.count = 0;
+
+        if (depth < state.parallelDepth && count >= parallelBuildSize)
+        {
+            std::thread leftThread([&, children, begin, mid, depth]() { Build(state, children, begin, mid, depth + 1); });
+            Build(state, children + 1, mid, end, depth + 1);
+            leftThread.join();
+        }
+        else
+        {
+            Build(state, children, begin, mid, depth + 1);
+            Build(state, children + 1, mid, end, depth + 1);
+        }
+    }
+};
@@ -1,22 +1,29 @@
 #pragma once
 
-class Vec3
+template<typename T>
+class alignas(sizeof(T) == sizeof(float) ? 16 : alignof(T)) Vec3T
 {
 public:
-    double e[3];
+    // Three coordinates of scalar type T. Float vectors are padded to 16 bytes, so they load as
+    // one SSE register and never straddle a cache line.
 
-    Vec3() : e{ 0,0,0 } {}
-    Vec3(double e0, double e1, double e2) : e{ e0, e1, e2 } {}
+    T e[3];
 
-    double x() const { return e[0]; }
-    double y() const { return e[1]; }
-    double z() const { return e[2]; }
+    Vec3T() : e{ 0,0,0 } {}
+    Vec3T(T e0, T e1, T e2) : e{ e0, e1, e2 } {}
 
-    Vec3 operator-() const { return Vec3(-e[0], -e[1], -e[2]); }
-    double operator[](int i) const { return e[i]; }
-    double& operator[](int i) { return e[i]; }
+    template<typename U>
+    explicit Vec3T(const Vec3T<U>& v) : e{ T(v.e[0]), T(v.e[1]), T(v.e[2]) } {}
 
-    Vec3& operator+=(const Vec3& v)
+    T x() const { return e[0]; }
+    T y() const { return e[1]; }
+    T z() const { return e[2]; }
+
+    Vec3T operator-() const { return Vec3T(-e[0], -e[1], -e[2]); }
+    T operator[](int i) const { return e[i]; }
+    T& operator[](int i) { return e[i]; }
+
+    Vec3T& operator+=(const Vec3T& v)
     {
         e[0] += v.e[0];
         e[1] += v.e[1];
@@ -24,7 +31,7 @@ public:
         return *this;
     }
 
-    Vec3& operator*=(double t)
+    Vec3T& operator*=(T t)
     {
         e[0] *= t;
         e[1] *= t;
@@ -32,17 +39,17 @@ public:
         return *this;
     }
 
-    Vec3& operator/=(double t)
+    Vec3T& operator/=(T t)
     {
         return *this *= 1 / t;
     }
 
-    double Length() const
+    T Length() const
     {
         return std::sqrt(LengthSquared());
     }
 
-    double LengthSquared() const
+    T LengthSquared() const
     {
         return e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
     }
@@ -50,79 +57,83 @@ public:
     bool isNearZero() const
     {
         // Return true if the vector is close to zero in all dimensions.
-        constexpr double epsilon = 1e-8;
+        constexpr T epsilon = T(1e-8);
         return (std::fabs(e[0]) < epsilon) && (std::fabs(e[1]) < epsilon) && (std::fabs(e[2]) < epsilon);
     }
 
-    static Vec3 Random()
+    static Vec3T Random()
     {
-        return Vec3(Random::Double(), Random::Double(), Random::Double());
+        return Vec3T(T(Random::Double()), T(Random::Double()), T(Random::Double()));
     }
 
-    static Vec3 Random(double min, double max)
+    static Vec3T Random(double min, double max)
     {
-        return Vec3(Random::Double(min, max), Random::Double(min, max), Random::Double(min, max));
+        return Vec3T(T(Random::Double(min, max)), T(Random::Double(min, max)), T(Random::Double(min, max)));
     }
-};
 
-// Point3 is just an alias for Vec3, but useful for geometric clarity in the code.
-using Point3 = Vec3;
+    // Vector Utility Functions. They are found through the vector arguments, which lets scalars of
+    // the other precision convert to T.
+    friend std::ostream& operator<<(std::ostream& out, const Vec3T& v)
+    {
+        return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
+    }
 
+    friend Vec3T operator+(const Vec3T& u, const Vec3T& v)
+    {
+        return Vec3T(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
+    }
 
-// Vector Utility Functions
-inline std::ostream& operator<<(std::ostream& out, const Vec3& v)
-{
-    return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
-}
+    friend Vec3T operator-(const Vec3T& u, const Vec3T& v)
+    {
+        return Vec3T(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
+    }
 
-inline Vec3 operator+(const Vec3& u, const Vec3& v)
-{
-    return Vec3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
-}
+    friend Vec3T operator*(const Vec3T& u, const Vec3T& v)
+    {
+        return Vec3T(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
+    }
 
-inline Vec3 operator-(const Vec3& u, const Vec3& v)
-{
-    return Vec3(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
-}
+    friend Vec3T operator*(T t, const Vec3T& v)
+    {
+        return Vec3T(t * v.e[0], t * v.e[1], t * v.e[2]);
+    }
 
-inline Vec3 operator*(const Vec3& u, const Vec3& v)
-{
-    return Vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
-}
+    friend Vec3T operator*(const Vec3T& v, T t)
+    {
+        return t * v;
+    }
 
-inline Vec3 operator*(double t, const Vec3& v)
-{
-    return Vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
-}
+    friend Vec3T operator/(const Vec3T& v, T t)
+    {
+        return (1 / t) * v;
+    }
 
-inline Vec3 operator*(const Vec3& v, double t)
-{
-    return t * v;
-}
+    friend T Dot(const Vec3T& u, const Vec3T& v)
+    {
+        return u.e[0] * v.e[0]
+            + u.e[1] * v.e[1]
+            + u.e[2] * v.e[2];
+    }
 
-inline Vec3 operator/(const Vec3& v, double t)
-{
-    return (1 / t) * v;
-}
+    friend Vec3T Cross(const Vec3T& u, const Vec3T& v)
+    {
+        return Vec3T(u.e[1] * v.e[2] - u.e[2] * v.e[1],
+            u.e[2] * v.e[0] - u.e[0] * v.e[2],
+            u.e[0] * v.e[1] - u.e[1] * v.e[0]);
+    }
 
-inline double Dot(const Vec3& u, const Vec3& v)
-{
-    return u.e[0] * v.e[0]
-        + u.e[1] * v.e[1]
-        + u.e[2] * v.e[2];
-}
+    friend Vec3T UnitVector(const Vec3T& v)
+    {
+        return v / v.Length();
+    }
+};
 
-inline Vec3 Cross(const Vec3& u, const Vec3& v)
-{
-    return Vec3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
-        u.e[2] * v.e[0] - u.e[0] * v.e[2],
-        u.e[0] * v.e[1] - u.e[1] * v.e[0]);
-}
+static_assert(sizeof(Vec3T<float>) == 16, "Float vectors are padded to 16 bytes");
 
-inline Vec3 UnitVector(const Vec3& v)
-{
-    return v / v.Length();
-}
+using Vec3 = Vec3T<Real>;
+
+// Point3 is just an alias for Vec3, but useful for geometric clarity in the code.
+using Point3 = Vec3;
 
 namespace Random
 {
@@ -131,9 +142,9 @@ namespace Random
         while (true)
         {
             const Vec3 p = Vec3::Random(-1, 1);
-            const double lensq = p.LengthSquared();
-            if (1e-160 < lensq && lensq <= 1)
-                return p / sqrt(lensq);
+            const Real lensq = p.LengthSquared();
+            if (std::numeric_limits<Real>::min() < lensq && lensq <= 1)
+                return p / std::sqrt(lensq);
         }
     }
 